@@ -0,0 +1,126 @@
+#include "analysis.h"
+
+AnalysisManager* create_analysis_manager(IRProgram* program) {
+    AnalysisManager* manager = calloc(1, sizeof(AnalysisManager));
+    manager->program = program;
+    return manager;
+}
+
+static void drop_analyses(FunctionAnalyses* entry, unsigned preserved) {
+    if (!(preserved & ANALYSIS_CFG)) preserved = ANALYSIS_NONE;
+    if (entry->loops && !(preserved & ANALYSIS_LOOPS)) {
+        // Blocks point back into the forest
+        for (int i = 0; entry->cfg && i < entry->cfg->block_count; i++) {
+            entry->cfg->blocks[i]->loop = NULL;
+        }
+        free_loop_forest(entry->loops);
+        entry->loops = NULL;
+    }
+    if (entry->liveness && !(preserved & ANALYSIS_LIVENESS)) {
+        free_liveness(entry->liveness);
+        entry->liveness = NULL;
+    }
+    if (entry->cfg && !(preserved & ANALYSIS_CFG)) {
+        free_cfg(entry->cfg);
+        entry->cfg = NULL;
+    }
+}
+
+void free_analysis_manager(AnalysisManager* manager) {
+    invalidate_analyses(manager, ANALYSIS_NONE);
+    free(manager->functions);
+    free(manager);
+}
+
+// Moves cached block boundaries along when instructions were inserted
+// or removed in front of the function
+static void rebase_cfg(CFG* cfg, int start) {
+    int delta = start - cfg->start;
+    if (delta == 0) return;
+    cfg->start += delta;
+    cfg->end += delta;
+    for (int i = 0; i < cfg->block_count; i++) {
+        cfg->blocks[i]->start += delta;
+        cfg->blocks[i]->end += delta;
+    }
+}
+
+static FunctionAnalyses* find_entry(AnalysisManager* manager, int function_start) {
+    IRInstr* label = manager->program->instructions[function_start];
+    if (!is_function_label(label)) {
+        fprintf(stderr, "Analysis requested for non-function at %d\n", function_start);
+        exit(1);
+    }
+    for (int i = 0; i < manager->count; i++) {
+        FunctionAnalyses* entry = &manager->functions[i];
+        if (entry->label == label) {
+            if (entry->cfg) rebase_cfg(entry->cfg, function_start);
+            entry->start = function_start;
+            return entry;
+        }
+    }
+
+    if (manager->count == manager->capacity) {
+        manager->capacity = manager->capacity ? manager->capacity * 2 : 8;
+        manager->functions = realloc(manager->functions,
+                                     sizeof(FunctionAnalyses) * manager->capacity);
+    }
+    FunctionAnalyses* entry = &manager->functions[manager->count++];
+    memset(entry, 0, sizeof(FunctionAnalyses));
+    entry->label = label;
+    entry->start = function_start;
+    return entry;
+}
+
+static CFG* ensure_cfg(AnalysisManager* manager, FunctionAnalyses* entry) {
+    if (!entry->cfg) {
+        entry->cfg = build_cfg(manager->program, entry->start);
+        manager->computed++;
+    }
+    return entry->cfg;
+}
+
+CFG* get_cfg(AnalysisManager* manager, int function_start) {
+    FunctionAnalyses* entry = find_entry(manager, function_start);
+    if (entry->cfg) manager->reused++;
+    return ensure_cfg(manager, entry);
+}
+
+LoopForest* get_loops(AnalysisManager* manager, int function_start) {
+    FunctionAnalyses* entry = find_entry(manager, function_start);
+    if (entry->loops) {
+        manager->reused++;
+    } else {
+        entry->loops = find_loops(ensure_cfg(manager, entry));
+        manager->computed++;
+    }
+    return entry->loops;
+}
+
+Liveness* get_liveness(AnalysisManager* manager, int function_start) {
+    FunctionAnalyses* entry = find_entry(manager, function_start);
+    if (entry->liveness) {
+        manager->reused++;
+    } else {
+        entry->liveness = compute_liveness(manager->program, ensure_cfg(manager, entry));
+        manager->computed++;
+    }
+    return entry->liveness;
+}
+
+void invalidate_function(AnalysisManager* manager, int function_start, unsigned preserved) {
+    IRInstr* label = manager->program->instructions[function_start];
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->functions[i].label == label) {
+            drop_analyses(&manager->functions[i], preserved);
+        }
+    }
+}
+
+void invalidate_analyses(AnalysisManager* manager, unsigned preserved) {
+    for (int i = 0; i < manager->count; i++) {
+        drop_analyses(&manager->functions[i], preserved);
+    }
+    // Entries with nothing left may belong to deleted functions
+    if (preserved == ANALYSIS_NONE) manager->count = 0;
+}
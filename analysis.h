@@ -0,0 +1,51 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "cfg.h"
+#include "dataflow.h"
+#include <stdbool.h>
+
+// Analyses a pass may use and declare as preserved.  Loops and
+// liveness are built on the CFG and are dropped whenever it is.
+typedef enum {
+    ANALYSIS_NONE = 0,
+    ANALYSIS_CFG = 1 << 0,      // Blocks, reverse postorder and dominators
+    ANALYSIS_LOOPS = 1 << 1,
+    ANALYSIS_LIVENESS = 1 << 2,
+    ANALYSIS_ALL = ANALYSIS_CFG | ANALYSIS_LOOPS | ANALYSIS_LIVENESS
+} AnalysisKind;
+
+// Cached results for one function.  Block boundaries are instruction
+// indices, so results survive edits elsewhere in the program by being
+// shifted along with the function.
+typedef struct {
+    IRInstr* label;             // Function label the results belong to
+    int start;                  // Its index when they were last used
+    CFG* cfg;
+    LoopForest* loops;
+    Liveness* liveness;
+} FunctionAnalyses;
+
+typedef struct {
+    IRProgram* program;
+    FunctionAnalyses* functions;
+    int count;
+    int capacity;
+    int computed;               // Analyses built from scratch
+    int reused;                 // Requests answered from the cache
+} AnalysisManager;
+
+AnalysisManager* create_analysis_manager(IRProgram* program);
+void free_analysis_manager(AnalysisManager* manager);
+
+// Each getter takes the index of the function label and computes the
+// result on first use
+CFG* get_cfg(AnalysisManager* manager, int function_start);
+LoopForest* get_loops(AnalysisManager* manager, int function_start);
+Liveness* get_liveness(AnalysisManager* manager, int function_start);
+
+// Drops everything not in preserved, for one function or all of them
+void invalidate_function(AnalysisManager* manager, int function_start, unsigned preserved);
+void invalidate_analyses(AnalysisManager* manager, unsigned preserved);
+
+#endif
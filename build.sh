@@ -10,8 +10,8 @@ echo -e "${GREEN}Building C Compiler...${NC}"
 # Create build directory if it doesn't exist
 mkdir -p build
 
-# Compilation flags
-CFLAGS="-Wall -Wextra"
+# Compilation flags; generated sources go in build
+CFLAGS="-Wall -Wextra -Ibuild"
 
 # Function to compile a source file
 compile() {
@@ -23,12 +23,34 @@ compile() {
     fi
 }
 
+# Generate the IR rewrite matcher from its rules
+echo -e "Generating ${GREEN}build/ir_rules.inc${NC}..."
+gcc -Wall -Wextra rulegen.c -o build/rulegen && ./build/rulegen ir.rules build/ir_rules.inc
+if [ $? -ne 0 ]; then
+    echo -e "${RED}Failed to generate build/ir_rules.inc${NC}"
+    exit 1
+fi
+
 # Compile files in order of dependency
 compile lexer.c
 compile parser.c
 compile debug.c
 compile semantic.c
 compile ir.c
+compile cfg.c
+compile dataflow.c
+compile analysis.c
+compile frame.c
+compile regalloc.c
+compile coloring.c
+compile emitbuf.c
+compile mir.c
+compile isel.c
+compile peephole.c
+compile encoder.c
+compile elfobj.c
+compile jit.c
+compile superopt.c
 compile ir_optimizer.c
 compile optimizer.c
 compile codegen.c
@@ -36,7 +58,7 @@ compile main.c
 
 # Link all object files
 echo -e "${GREEN}Linking...${NC}"
-gcc build/*.o -o compiler
+gcc build/*.o -o compiler -ldl
 
 if [ $? -eq 0 ]; then
     echo -e "${GREEN}Build successful! Executable created: compiler${NC}"
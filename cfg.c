@@ -0,0 +1,378 @@
+#include "cfg.h"
+
+static bool ends_block(IRInstr* instr) {
+    return is_branch(instr) || is_exit(instr);
+}
+
+static void add_edge(BasicBlock* from, BasicBlock* to) {
+    for (int i = 0; i < from->successor_count; i++) {
+        if (from->successors[i] == to) return;
+    }
+    from->successors[from->successor_count++] = to;
+    to->predecessor_count++;
+}
+
+static void compute_rpo(CFG* cfg) {
+    // Iterative depth-first search; next_succ tracks how far each block got
+    int* next_succ = calloc(cfg->block_count, sizeof(int));
+    bool* visited = calloc(cfg->block_count, sizeof(bool));
+    BasicBlock** stack = malloc(sizeof(BasicBlock*) * cfg->block_count);
+    BasicBlock** postorder = malloc(sizeof(BasicBlock*) * cfg->block_count);
+    int sp = 0, post_count = 0;
+
+    stack[sp++] = cfg->blocks[0];
+    visited[0] = true;
+    while (sp > 0) {
+        BasicBlock* block = stack[sp - 1];
+        if (next_succ[block->index] < block->successor_count) {
+            BasicBlock* succ = block->successors[next_succ[block->index]++];
+            if (!visited[succ->index]) {
+                visited[succ->index] = true;
+                stack[sp++] = succ;
+            }
+        } else {
+            postorder[post_count++] = block;
+            sp--;
+        }
+    }
+
+    cfg->rpo = malloc(sizeof(BasicBlock*) * (post_count > 0 ? post_count : 1));
+    cfg->rpo_count = post_count;
+    for (int i = 0; i < post_count; i++) {
+        BasicBlock* block = postorder[post_count - 1 - i];
+        block->rpo_number = i;
+        block->is_reachable = true;
+        cfg->rpo[i] = block;
+    }
+
+    free(next_succ);
+    free(visited);
+    free(stack);
+    free(postorder);
+}
+
+static BasicBlock* intersect(BasicBlock* a, BasicBlock* b) {
+    while (a != b) {
+        while (a->rpo_number > b->rpo_number) a = a->idom;
+        while (b->rpo_number > a->rpo_number) b = b->idom;
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy's iterative dominator algorithm
+static void compute_dominators(CFG* cfg) {
+    BasicBlock* entry = cfg->rpo[0];
+    entry->idom = entry;
+
+    bool changed;
+    do {
+        changed = false;
+        for (int i = 1; i < cfg->rpo_count; i++) {
+            BasicBlock* block = cfg->rpo[i];
+            BasicBlock* new_idom = NULL;
+            for (int j = 0; j < block->predecessor_count; j++) {
+                BasicBlock* pred = block->predecessors[j];
+                if (!pred->idom) continue;
+                new_idom = new_idom ? intersect(pred, new_idom) : pred;
+            }
+            if (new_idom != block->idom) {
+                block->idom = new_idom;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    // Number the dominator tree so dominance queries are O(1)
+    int n = cfg->block_count;
+    int* first_child = malloc(sizeof(int) * n);
+    int* next_sibling = malloc(sizeof(int) * n);
+    for (int i = 0; i < n; i++) {
+        first_child[i] = -1;
+        next_sibling[i] = -1;
+    }
+    for (int i = cfg->rpo_count - 1; i >= 1; i--) {
+        BasicBlock* block = cfg->rpo[i];
+        int parent = block->idom->index;
+        next_sibling[block->index] = first_child[parent];
+        first_child[parent] = block->index;
+    }
+
+    cfg->dom_pre = malloc(sizeof(int) * n);
+    cfg->dom_post = malloc(sizeof(int) * n);
+    for (int i = 0; i < n; i++) {
+        cfg->dom_pre[i] = -1;
+        cfg->dom_post[i] = -1;
+    }
+    int* stack = malloc(sizeof(int) * n);
+    int* cursor = malloc(sizeof(int) * n);
+    int sp = 0, clock = 0;
+    stack[sp++] = entry->index;
+    cursor[entry->index] = first_child[entry->index];
+    cfg->dom_pre[entry->index] = clock++;
+    while (sp > 0) {
+        int top = stack[sp - 1];
+        int child = cursor[top];
+        if (child >= 0) {
+            cursor[top] = next_sibling[child];
+            cfg->dom_pre[child] = clock++;
+            cursor[child] = first_child[child];
+            stack[sp++] = child;
+        } else {
+            cfg->dom_post[top] = clock++;
+            sp--;
+        }
+    }
+
+    entry->idom = NULL;
+    free(first_child);
+    free(next_sibling);
+    free(stack);
+    free(cursor);
+}
+
+CFG* build_cfg(IRProgram* program, int function_start) {
+    CFG* cfg = malloc(sizeof(CFG));
+    cfg->start = function_start;
+    cfg->end = find_function_end(program, function_start);
+
+    // First pass: count leaders
+    int block_count = 0;
+    for (int i = cfg->start; i < cfg->end; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (i == cfg->start || instr->op == IR_LABEL ||
+            ends_block(program->instructions[i - 1])) {
+            block_count++;
+        }
+    }
+
+    cfg->blocks = malloc(sizeof(BasicBlock*) * block_count);
+    cfg->block_count = 0;
+    cfg->label_blocks = create_name_map(block_count);
+
+    // Second pass: create blocks
+    for (int i = cfg->start; i < cfg->end; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (i == cfg->start || instr->op == IR_LABEL ||
+            ends_block(program->instructions[i - 1])) {
+            BasicBlock* block = calloc(1, sizeof(BasicBlock));
+            block->start = i;
+            block->index = cfg->block_count;
+            block->successors = malloc(sizeof(BasicBlock*) * 2);  // Max 2 successors
+            block->rpo_number = -1;
+            if (cfg->block_count > 0) {
+                cfg->blocks[cfg->block_count - 1]->end = i - 1;
+            }
+            cfg->blocks[cfg->block_count++] = block;
+        }
+        if (instr->op == IR_LABEL) {
+            name_map_put(cfg->label_blocks, instr->label->name, cfg->block_count - 1);
+        }
+    }
+    cfg->blocks[cfg->block_count - 1]->end = cfg->end - 1;
+
+    // Connect successors; jumps to labels outside the function have no edge
+    for (int i = 0; i < cfg->block_count; i++) {
+        BasicBlock* block = cfg->blocks[i];
+        IRInstr* last = program->instructions[block->end];
+        if (is_branch(last)) {
+            BasicBlock* target = find_block_by_label(cfg, last->label->name);
+            if (target) add_edge(block, target);
+        }
+        if (last->op != IR_JUMP && !is_exit(last) && i + 1 < cfg->block_count) {
+            add_edge(block, cfg->blocks[i + 1]);
+        }
+    }
+
+    for (int i = 0; i < cfg->block_count; i++) {
+        BasicBlock* block = cfg->blocks[i];
+        block->predecessors = malloc(sizeof(BasicBlock*) * (block->predecessor_count + 1));
+        block->predecessor_count = 0;
+    }
+    for (int i = 0; i < cfg->block_count; i++) {
+        BasicBlock* block = cfg->blocks[i];
+        for (int j = 0; j < block->successor_count; j++) {
+            BasicBlock* succ = block->successors[j];
+            succ->predecessors[succ->predecessor_count++] = block;
+        }
+    }
+
+    compute_rpo(cfg);
+
+    // Unreachable blocks take no part in dominance; drop their edges
+    // so every predecessor seen by later passes is reachable
+    for (int i = 0; i < cfg->block_count; i++) {
+        BasicBlock* block = cfg->blocks[i];
+        int write = 0;
+        for (int j = 0; j < block->predecessor_count; j++) {
+            if (block->predecessors[j]->is_reachable) {
+                block->predecessors[write++] = block->predecessors[j];
+            }
+        }
+        block->predecessor_count = write;
+    }
+
+    compute_dominators(cfg);
+    return cfg;
+}
+
+BasicBlock* find_block_by_label(CFG* cfg, const char* name) {
+    int index = name_map_get(cfg->label_blocks, name);
+    return index >= 0 ? cfg->blocks[index] : NULL;
+}
+
+// Block whose instruction range covers index, found by binary search
+BasicBlock* find_block_containing(CFG* cfg, int index) {
+    int low = 0, high = cfg->block_count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (cfg->blocks[mid]->start <= index) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return cfg->blocks[low];
+}
+
+// True if every path from the entry to b passes through a
+bool dominates(CFG* cfg, BasicBlock* a, BasicBlock* b) {
+    if (!a->is_reachable || !b->is_reachable) return false;
+    return cfg->dom_pre[a->index] <= cfg->dom_pre[b->index] &&
+           cfg->dom_post[b->index] <= cfg->dom_post[a->index];
+}
+
+// Deletes the instructions of blocks the entry cannot reach and returns
+// how many were removed.  The CFG no longer matches the program after.
+int remove_unreachable_blocks(IRProgram* program, CFG* cfg) {
+    int removed = 0;
+    for (int i = cfg->block_count - 1; i > 0; i--) {
+        BasicBlock* block = cfg->blocks[i];
+        if (block->is_reachable) continue;
+        remove_instructions(program, block->start, block->end - block->start + 1);
+        removed += block->end - block->start + 1;
+    }
+    return removed;
+}
+
+void free_cfg(CFG* cfg) {
+    for (int i = 0; i < cfg->block_count; i++) {
+        free(cfg->blocks[i]->successors);
+        free(cfg->blocks[i]->predecessors);
+        free(cfg->blocks[i]);
+    }
+    free(cfg->blocks);
+    free(cfg->rpo);
+    free(cfg->dom_pre);
+    free(cfg->dom_post);
+    free_name_map(cfg->label_blocks);
+    free(cfg);
+}
+
+static Loop* find_or_create_loop(LoopForest* forest, CFG* cfg, BasicBlock* header) {
+    for (int i = 0; i < forest->loop_count; i++) {
+        if (forest->loops[i]->header == header) return forest->loops[i];
+    }
+    Loop* loop = calloc(1, sizeof(Loop));
+    loop->header = header;
+    loop->contains = calloc(cfg->block_count, sizeof(bool));
+    loop->blocks = malloc(sizeof(BasicBlock*) * cfg->block_count);
+    loop->latches = malloc(sizeof(BasicBlock*) * header->predecessor_count);
+    loop->contains[header->index] = true;
+    loop->blocks[loop->block_count++] = header;
+    forest->loops[forest->loop_count++] = loop;
+    return loop;
+}
+
+// Walk predecessors backwards from a latch, stopping at the header
+static void add_loop_body(Loop* loop, BasicBlock* latch, BasicBlock** worklist) {
+    int top = 0;
+    if (!loop->contains[latch->index]) {
+        loop->contains[latch->index] = true;
+        loop->blocks[loop->block_count++] = latch;
+        worklist[top++] = latch;
+    }
+    while (top > 0) {
+        BasicBlock* block = worklist[--top];
+        for (int i = 0; i < block->predecessor_count; i++) {
+            BasicBlock* pred = block->predecessors[i];
+            if (!loop->contains[pred->index]) {
+                loop->contains[pred->index] = true;
+                loop->blocks[loop->block_count++] = pred;
+                worklist[top++] = pred;
+            }
+        }
+    }
+}
+
+static int compare_loop_size(const void* a, const void* b) {
+    const Loop* la = *(const Loop* const*)a;
+    const Loop* lb = *(const Loop* const*)b;
+    if (la->block_count != lb->block_count) return la->block_count - lb->block_count;
+    return la->header->index - lb->header->index;
+}
+
+LoopForest* find_loops(CFG* cfg) {
+    LoopForest* forest = malloc(sizeof(LoopForest));
+    forest->loops = malloc(sizeof(Loop*) * (cfg->block_count + 1));
+    forest->loop_count = 0;
+    BasicBlock** worklist = malloc(sizeof(BasicBlock*) * cfg->block_count);
+
+    // A back edge is an edge whose target dominates its source
+    for (int i = 0; i < cfg->rpo_count; i++) {
+        BasicBlock* block = cfg->rpo[i];
+        for (int j = 0; j < block->successor_count; j++) {
+            BasicBlock* header = block->successors[j];
+            if (!dominates(cfg, header, block)) continue;
+            Loop* loop = find_or_create_loop(forest, cfg, header);
+            loop->latches[loop->latch_count++] = block;
+            add_loop_body(loop, block, worklist);
+        }
+    }
+    free(worklist);
+
+    // Smaller loops first: the parent of a loop is the smallest other
+    // loop that contains its header
+    qsort(forest->loops, forest->loop_count, sizeof(Loop*), compare_loop_size);
+    forest->roots = malloc(sizeof(Loop*) * (forest->loop_count + 1));
+    forest->root_count = 0;
+    for (int i = 0; i < forest->loop_count; i++) {
+        Loop* loop = forest->loops[i];
+        loop->children = malloc(sizeof(Loop*) * (forest->loop_count + 1));
+        for (int j = i + 1; j < forest->loop_count; j++) {
+            if (forest->loops[j]->contains[loop->header->index]) {
+                loop->parent = forest->loops[j];
+                break;
+            }
+        }
+    }
+    for (int i = forest->loop_count - 1; i >= 0; i--) {
+        Loop* loop = forest->loops[i];
+        if (loop->parent) {
+            loop->parent->children[loop->parent->child_count++] = loop;
+            loop->depth = loop->parent->depth + 1;
+        } else {
+            forest->roots[forest->root_count++] = loop;
+            loop->depth = 1;
+        }
+        // Outer loops are visited first, so inner ones overwrite them
+        for (int j = 0; j < loop->block_count; j++) {
+            loop->blocks[j]->loop = loop;
+        }
+    }
+
+    return forest;
+}
+
+void free_loop_forest(LoopForest* forest) {
+    for (int i = 0; i < forest->loop_count; i++) {
+        Loop* loop = forest->loops[i];
+        free(loop->blocks);
+        free(loop->contains);
+        free(loop->latches);
+        free(loop->children);
+        free(loop);
+    }
+    free(forest->loops);
+    free(forest->roots);
+    free(forest);
+}
@@ -0,0 +1,53 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "ir.h"
+#include <stdbool.h>
+
+// Control flow graph of a single function
+typedef struct {
+    int start;              // Index of the function label
+    int end;                // One past the last instruction
+    BasicBlock** blocks;    // Blocks in instruction order, blocks[0] is the entry
+    int block_count;
+    BasicBlock** rpo;       // Reachable blocks in reverse postorder
+    int rpo_count;
+    NameMap* label_blocks;  // Label name -> block index
+    int* dom_pre;           // Dominator tree preorder/postorder numbers,
+    int* dom_post;          // indexed by block index
+} CFG;
+
+// Natural loop: a header plus every block that reaches a latch
+// without passing through the header
+typedef struct Loop {
+    BasicBlock* header;
+    BasicBlock** blocks;
+    int block_count;
+    bool* contains;         // Indexed by block index
+    BasicBlock** latches;   // Sources of back edges into the header
+    int latch_count;
+    struct Loop* parent;    // Enclosing loop, NULL if outermost
+    struct Loop** children;
+    int child_count;
+    int depth;              // 1 for outermost loops
+} Loop;
+
+// Loop nesting forest of a function
+typedef struct {
+    Loop** loops;           // All loops, innermost first
+    int loop_count;
+    Loop** roots;           // Outermost loops
+    int root_count;
+} LoopForest;
+
+CFG* build_cfg(IRProgram* program, int function_start);
+void free_cfg(CFG* cfg);
+int remove_unreachable_blocks(IRProgram* program, CFG* cfg);
+BasicBlock* find_block_by_label(CFG* cfg, const char* name);
+BasicBlock* find_block_containing(CFG* cfg, int index);
+bool dominates(CFG* cfg, BasicBlock* a, BasicBlock* b);
+
+LoopForest* find_loops(CFG* cfg);
+void free_loop_forest(LoopForest* forest);
+
+#endif
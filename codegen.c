@@ -1,91 +1,322 @@
 #include "codegen.h"
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "ir.h"
+#include "regalloc.h"
+#include "isel.h"
+#include "peephole.h"
+#include "frame.h"
+#include "elfobj.h"
 
 
 static void emit(CodeGenerator* gen, const char* fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    vfprintf(gen->output, fmt, args);
+    emit_vformat(gen->buffer, fmt, args);
     va_end(args);
 }
 
-static IRLabel* new_label(IRProgram* program) {
-    (void)program; // Prevent unused parameter warning
-    // Function implementation...
-    return NULL; // Ensure to return an appropriate value
+static void flush_output(CodeGenerator* gen) {
+    if (gen->output < 0) return;
+    if (!flush_emit_buffer(gen->buffer, gen->output)) {
+        perror("Code generation error: writing output");
+        exit(1);
+    }
+}
+
+// Output names ending in ".o" get an object file from the integrated
+// assembler
+static bool wants_object_file(const char* output_filename) {
+    size_t length = strlen(output_filename);
+    return length > 2 && strcmp(output_filename + length - 2, ".o") == 0;
+}
+
+static int new_label_number(CodeGenerator* gen) {
+    return gen->label_count++;
 }
 
+static void generate_expression(CodeGenerator* gen, ASTNode* node);
+
 static int get_variable_offset(CodeGenerator* gen, const char* name) {
-    for (int i = 0; i < gen->variables.count; i++) {
-        if (strcmp(gen->variables.names[i], name) == 0) {
-            return gen->variables.offsets[i];
+    int index = name_map_get(gen->variables.names, name);
+    if (index < 0) {
+        fprintf(stderr, "Code generation error: no stack slot for '%s'\n", name);
+        exit(1);
+    }
+    return gen->variables.offsets[index];
+}
+
+static void add_variable(CodeGenerator* gen, const char* name, int offset) {
+    gen->variables.offsets = realloc(gen->variables.offsets,
+                                     sizeof(int) * (gen->variables.count + 1));
+    gen->variables.offsets[gen->variables.count] = offset;
+    name_map_put(gen->variables.names, name, gen->variables.count++);
+}
+
+// Where each local of a function is live, numbering its mentions in
+// the order code is generated for them
+typedef struct {
+    NameMap* names;             // Name -> index into objects
+    StackObject* objects;       // One range each
+    int count;
+    int capacity;
+    int position;
+    NameMap* fixed;             // Names that already have a home
+} FrameLifetimes;
+
+static void mention_variable(FrameLifetimes* lifetimes, const char* name) {
+    if (name_map_get(lifetimes->fixed, name) >= 0) return;
+    int position = lifetimes->position++;
+    int index = name_map_get(lifetimes->names, name);
+    if (index >= 0) {
+        LiveRange* range = &lifetimes->objects[index].ranges[0];
+        if (range->to < position + 1) range->to = position + 1;
+        return;
+    }
+    if (lifetimes->count == lifetimes->capacity) {
+        lifetimes->capacity = lifetimes->capacity * 2 + 8;
+        lifetimes->objects = realloc(lifetimes->objects,
+                                     sizeof(StackObject) * lifetimes->capacity);
+    }
+    StackObject* object = &lifetimes->objects[lifetimes->count];
+    memset(object, 0, sizeof(StackObject));
+    add_live_range(object, position, position + 1);
+    name_map_put(lifetimes->names, name, lifetimes->count++);
+}
+
+static void collect_lifetimes(FrameLifetimes* lifetimes, ASTNode* node) {
+    if (!node) return;
+    switch (node->type) {
+        case NODE_IDENTIFIER:
+            mention_variable(lifetimes, node->data.string_value);
+            break;
+
+        case NODE_BINARY_OP:
+        case NODE_COMPARISON:
+            collect_lifetimes(lifetimes, node->data.binary.right);
+            collect_lifetimes(lifetimes, node->data.binary.left);
+            break;
+
+        case NODE_FUNCTION_CALL:
+            for (int i = node->data.function.parameter_count - 1; i >= 0; i--) {
+                collect_lifetimes(lifetimes, node->data.function.parameters[i]);
+            }
+            break;
+
+        case NODE_RETURN:
+            collect_lifetimes(lifetimes, node->data.binary.left);
+            break;
+
+        case NODE_IF:
+            collect_lifetimes(lifetimes, node->data.if_statement.condition);
+            collect_lifetimes(lifetimes, node->data.if_statement.if_body);
+            collect_lifetimes(lifetimes, node->data.if_statement.else_body);
+            break;
+
+        case NODE_WHILE: {
+            int start = lifetimes->position;
+            collect_lifetimes(lifetimes, node->data.while_statement.condition);
+            collect_lifetimes(lifetimes, node->data.while_statement.body);
+            // Anything the loop mentions may carry its value from one
+            // iteration to the next, so it is live for the whole loop
+            for (int i = 0; i < lifetimes->count; i++) {
+                LiveRange* range = &lifetimes->objects[i].ranges[0];
+                if (range->to <= start) continue;
+                if (range->from > start) range->from = start;
+                range->to = lifetimes->position;
+            }
+            break;
         }
+
+        case NODE_COMPOUND_STATEMENT:
+            for (int i = 0; i < node->data.block.statement_count; i++) {
+                collect_lifetimes(lifetimes, node->data.block.statements[i]);
+            }
+            break;
+
+        case NODE_VARIABLE_DECLARATION:
+            collect_lifetimes(lifetimes, node->data.variable.initializer);
+            mention_variable(lifetimes, node->data.variable.name);
+            break;
+
+        case NODE_ASSIGNMENT:
+            collect_lifetimes(lifetimes, node->data.binary.right);
+            mention_variable(lifetimes, node->data.binary.left->data.string_value);
+            break;
+
+        default:
+            break;
     }
-    // Add new variable
-    gen->variables.names[gen->variables.count] = strdup(name);
-    gen->stack_offset += 8;  // Assuming 64-bit integers
-    gen->variables.offsets[gen->variables.count] = -gen->stack_offset;
-    return -gen->stack_offset;
 }
 
-CodeGenerator* create_generator(const char* output_filename) {
+// Gives each local of func an offset from %rbp before its code is
+// generated.  Parameters passed on the stack stay where they are; the
+// rest share slots when their lifetimes do not overlap.
+static void layout_frame(CodeGenerator* gen, ASTNode* func) {
+    free_name_map(gen->variables.names);
+    gen->variables.names = create_name_map(16);
+    gen->variables.count = 0;
+
+    int parameter_count = func->data.function.parameter_count;
+    for (int p = MAX_REGISTER_ARGS; p < parameter_count; p++) {
+        add_variable(gen, func->data.function.parameters[p]->data.variable.name,
+                     16 + 8 * (p - MAX_REGISTER_ARGS));
+    }
+
+    FrameLifetimes lifetimes = {0};
+    lifetimes.names = create_name_map(16);
+    lifetimes.fixed = gen->variables.names;
+    for (int p = 0; p < parameter_count && p < MAX_REGISTER_ARGS; p++) {
+        mention_variable(&lifetimes, func->data.function.parameters[p]->data.variable.name);
+    }
+    collect_lifetimes(&lifetimes, func->data.function.body);
+
+    int slot_count = assign_stack_slots(lifetimes.objects, lifetimes.count);
+    for (int n = 0; n < lifetimes.names->capacity; n++) {
+        if (!lifetimes.names->keys[n]) continue;
+        StackObject* object = &lifetimes.objects[lifetimes.names->values[n]];
+        add_variable(gen, lifetimes.names->keys[n], -8 * (object->slot + 1));
+    }
+    gen->frame_size = frame_size(slot_count, 0);
+    free_stack_objects(lifetimes.objects, lifetimes.count);
+    free_name_map(lifetimes.names);
+}
+
+static CodeGenerator* new_generator(int output, ObjectCode* object) {
     CodeGenerator* gen = malloc(sizeof(CodeGenerator));
-    gen->output = fopen(output_filename, "w");
+    gen->output = output;
+    gen->buffer = create_emit_buffer();
+    gen->object = object;
+    gen->allocator = REGALLOC_LINEAR_SCAN;
     gen->label_count = 0;
-    gen->stack_offset = 0;
-    gen->variables.names = malloc(sizeof(char*) * 100);  // Max 100 variables
-    gen->variables.offsets = malloc(sizeof(int) * 100);
+    gen->frame_size = 0;
+    gen->stack_depth = 0;
+    gen->variables.names = create_name_map(16);
+    gen->variables.offsets = NULL;
     gen->variables.count = 0;
     return gen;
 }
 
-static void generate_function_call(CodeGenerator* gen, ASTNode* node) {
-    // Save registers that might be modified by the function call
+CodeGenerator* create_generator(const char* output_filename) {
+    int output = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) {
+        fprintf(stderr, "Could not open file: %s\n", output_filename);
+        exit(1);
+    }
+    return new_generator(output, wants_object_file(output_filename) ? create_object_code() : NULL);
+}
+
+CodeGenerator* create_jit_generator(void) {
+    return new_generator(-1, create_object_code());
+}
+
+// Expression temporaries live on the stack.  Their count is kept so
+// that calls can realign %rsp.
+static void push_temporary(CodeGenerator* gen) {
     emit(gen, "    pushq %%rax\n");
-    emit(gen, "    pushq %%rcx\n");
-    emit(gen, "    pushq %%rdx\n");
-    emit(gen, "    pushq %%rsi\n");
-    emit(gen, "    pushq %%rdi\n");
-    emit(gen, "    pushq %%r8\n");
-    emit(gen, "    pushq %%r9\n");
-    
-    // Generate code for arguments in reverse order
-    for (int i = node->data.function.parameter_count - 1; i >= 0; i--) {
-        generate_expression(gen, node->data.function.parameters[i]);
-        emit(gen, "    pushq %%rax\n");
+    gen->stack_depth++;
+}
+
+static void pop_temporary(CodeGenerator* gen, const char* reg) {
+    emit(gen, "    popq %s\n", reg);
+    gen->stack_depth--;
+}
+
+// Constants and variables can be loaded straight into an argument
+// register at the last moment, since nothing can clobber them
+static bool is_simple_argument(ASTNode* node) {
+    return node->type == NODE_NUMBER || node->type == NODE_IDENTIFIER;
+}
+
+// Arguments past the sixth are pushed right to left, after padding that
+// keeps %rsp 16-byte aligned at the call.  Register arguments that need
+// code of their own are evaluated next, each parked on the stack except
+// the last, which stays in %rax; simple ones are loaded last.  Every
+// source is then a temporary, %rax, a slot or an immediate, never an
+// argument register, so the moves into %rdi..%r9 need no ordering.
+// No value lives in a register across a call, so nothing is saved.
+static void generate_function_call(CodeGenerator* gen, ASTNode* node) {
+    ASTNode** args = node->data.function.parameters;
+    int argc = node->data.function.parameter_count;
+    int register_args = argc < MAX_REGISTER_ARGS ? argc : MAX_REGISTER_ARGS;
+    int stack_args = argc - register_args;
+
+    int padding = (gen->stack_depth + stack_args) % 2;
+    if (padding) emit(gen, "    subq $8, %%rsp\n");
+    gen->stack_depth += padding;
+    for (int i = argc - 1; i >= register_args; i--) {
+        generate_expression(gen, args[i]);
+        push_temporary(gen);
     }
-    
-    // Pop arguments into the appropriate registers according to System V AMD64 ABI
-    const char* arg_regs[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-    int reg_count = sizeof(arg_regs) / sizeof(arg_regs[0]);
-    
-    for (int i = 0; i < node->data.function.parameter_count && i < reg_count; i++) {
-        emit(gen, "    popq %s\n", arg_regs[i]);
+
+    int last_computed = -1;
+    for (int i = 0; i < register_args; i++) {
+        if (is_simple_argument(args[i])) continue;
+        if (last_computed >= 0) push_temporary(gen);
+        generate_expression(gen, args[i]);
+        last_computed = i;
     }
-    
-    // Call the function
+    if (last_computed >= 0) {
+        emit(gen, "    movq %%rax, %s\n", register_names[argument_registers[last_computed]]);
+    }
+    for (int i = last_computed - 1; i >= 0; i--) {
+        if (!is_simple_argument(args[i])) {
+            pop_temporary(gen, register_names[argument_registers[i]]);
+        }
+    }
+    for (int i = 0; i < register_args; i++) {
+        const char* reg = register_names[argument_registers[i]];
+        if (args[i]->type == NODE_NUMBER) {
+            emit(gen, "    movq $%d, %s\n", args[i]->data.number_value, reg);
+        } else if (args[i]->type == NODE_IDENTIFIER) {
+            emit(gen, "    movq %d(%%rbp), %s\n",
+                 get_variable_offset(gen, args[i]->data.string_value), reg);
+        }
+    }
+
     emit(gen, "    call %s\n", node->data.function.name);
-    
-    // Restore saved registers in reverse order
-    emit(gen, "    popq %%r9\n");
-    emit(gen, "    popq %%r8\n");
-    emit(gen, "    popq %%rdi\n");
-    emit(gen, "    popq %%rsi\n");
-    emit(gen, "    popq %%rdx\n");
-    emit(gen, "    popq %%rcx\n");
-    emit(gen, "    popq %%rbx\n");
+    if (stack_args + padding > 0) {
+        emit(gen, "    addq $%d, %%rsp\n", 8 * (stack_args + padding));
+        gen->stack_depth -= stack_args + padding;
+    }
 }
 
-static void generate_comparison(CodeGenerator* gen, ASTNode* node, const char* op) {
+// Condition-code suffix of a relation token, as in jl or setl
+static const char* condition_suffix(int relation) {
+    switch (relation) {
+        case TOKEN_EQUALS: return "e";
+        case TOKEN_NOT_EQUALS: return "ne";
+        case TOKEN_LESS: return "l";
+        case TOKEN_LESS_EQUALS: return "le";
+        case TOKEN_GREATER: return "g";
+        default: return "ge";
+    }
+}
+
+// Compares the operands of a comparison node, leaving only the flags
+static void generate_comparison(CodeGenerator* gen, ASTNode* node) {
     generate_expression(gen, node->data.binary.right);
-    emit(gen, "    pushq %%rax\n");
+    push_temporary(gen);
     generate_expression(gen, node->data.binary.left);
-    emit(gen, "    popq %%rbx\n");
-    emit(gen, "    cmpq %%rbx, %%rax\n");
-    emit(gen, "    %s %%al\n", op);
-    emit(gen, "    movzbq %%al, %%rax\n");
+    pop_temporary(gen, "%rcx");
+    emit(gen, "    cmpq %%rcx, %%rax\n");
+}
+
+// Jumps to label when condition is as wanted.  A comparison sets the
+// flags for the jump itself rather than producing a 0/1 value to test.
+static void generate_branch(CodeGenerator* gen, ASTNode* condition, bool wanted, int label) {
+    if (condition->type == NODE_COMPARISON) {
+        generate_comparison(gen, condition);
+        int relation = condition->data.binary.operator;
+        emit(gen, "    j%s .L%d\n",
+             condition_suffix(wanted ? relation : negate_relation(relation)), label);
+        return;
+    }
+    generate_expression(gen, condition);
+    emit(gen, "    cmp $0, %%rax\n");
+    emit(gen, "    j%s .L%d\n", wanted ? "ne" : "e", label);
 }
 
 static void generate_expression(CodeGenerator* gen, ASTNode* node) {
@@ -103,25 +334,26 @@ static void generate_expression(CodeGenerator* gen, ASTNode* node) {
             // Generate right operand first
             generate_expression(gen, node->data.binary.right);
             // Save right operand
-            emit(gen, "    pushq %%rax\n");
+            push_temporary(gen);
             // Generate left operand
             generate_expression(gen, node->data.binary.left);
-            // Restore right operand into rbx
-            emit(gen, "    popq %%rbx\n");
+            // Restore right operand into rcx, which unlike rbx the
+            // caller does not expect preserved
+            pop_temporary(gen, "%rcx");
             
             switch (node->data.binary.operator) {
                 case '+':
-                    emit(gen, "    addq %%rbx, %%rax\n");
+                    emit(gen, "    addq %%rcx, %%rax\n");
                     break;
                 case '-':
-                    emit(gen, "    subq %%rbx, %%rax\n");
+                    emit(gen, "    subq %%rcx, %%rax\n");
                     break;
                 case '*':
-                    emit(gen, "    imulq %%rbx, %%rax\n");
+                    emit(gen, "    imulq %%rcx, %%rax\n");
                     break;
                 case '/':
                     emit(gen, "    cqto\n");           // Sign extend rax into rdx
-                    emit(gen, "    idivq %%rbx\n");    // Divide rdx:rax by rbx
+                    emit(gen, "    idivq %%rcx\n");    // Divide rdx:rax by rcx
                     break;
             }
             break;
@@ -131,26 +363,9 @@ static void generate_expression(CodeGenerator* gen, ASTNode* node) {
             break;
             
         case NODE_COMPARISON:
-            switch (node->data.binary.operator) {
-                case TOKEN_EQUALS:
-                    generate_comparison(gen, node, "sete");
-                    break;
-                case TOKEN_NOT_EQUALS:
-                    generate_comparison(gen, node, "setne");
-                    break;
-                case TOKEN_LESS:
-                    generate_comparison(gen, node, "setl");
-                    break;
-                case TOKEN_LESS_EQUALS:
-                    generate_comparison(gen, node, "setle");
-                    break;
-                case TOKEN_GREATER:
-                    generate_comparison(gen, node, "setg");
-                    break;
-                case TOKEN_GREATER_EQUALS:
-                    generate_comparison(gen, node, "setge");
-                    break;
-            }
+            generate_comparison(gen, node);
+            emit(gen, "    set%s %%al\n", condition_suffix(node->data.binary.operator));
+            emit(gen, "    movzbq %%al, %%rax\n");
             break;
         case NODE_PROGRAM:
             // Handle NODE_PROGRAM
@@ -202,13 +417,10 @@ static void generate_statement(CodeGenerator* gen, ASTNode* node) {
             break;
             
         case NODE_IF: {
-            int else_label = new_label(gen);
-            int end_label = new_label(gen);
+            int else_label = new_label_number(gen);
+            int end_label = new_label_number(gen);
             
-            // Generate condition
-            generate_expression(gen, node->data.if_statement.condition);
-            emit(gen, "    cmp $0, %%rax\n");
-            emit(gen, "    je .L%d\n", else_label);
+            generate_branch(gen, node->data.if_statement.condition, false, else_label);
             
             // Generate if body
             generate_statement(gen, node->data.if_statement.if_body);
@@ -225,16 +437,15 @@ static void generate_statement(CodeGenerator* gen, ASTNode* node) {
         }
             
         case NODE_WHILE: {
-            int start_label = new_label(gen);
-            int end_label = new_label(gen);
-            
-            emit(gen, ".L%d:\n", start_label);
-            generate_expression(gen, node->data.while_statement.condition);
-            emit(gen, "    cmp $0, %%rax\n");
-            emit(gen, "    je .L%d\n", end_label);
-            
+            // Rotated into a guarded do-while, so each iteration ends in
+            // one conditional branch rather than a test and a jump back
+            int body_label = new_label_number(gen);
+            int end_label = new_label_number(gen);
+
+            generate_branch(gen, node->data.while_statement.condition, false, end_label);
+            emit(gen, ".L%d:\n", body_label);
             generate_statement(gen, node->data.while_statement.body);
-            emit(gen, "    jmp .L%d\n", start_label);
+            generate_branch(gen, node->data.while_statement.condition, true, body_label);
             emit(gen, ".L%d:\n", end_label);
             break;
         }
@@ -263,6 +474,11 @@ static void generate_statement(CodeGenerator* gen, ASTNode* node) {
 }
 
 void generate_code(CodeGenerator* gen, ASTNode* node) {
+    if (gen->object) {
+        fprintf(stderr, "Code generation error: object files need the IR code generator\n");
+        exit(1);
+    }
+
     // Generate assembly header
     emit(gen, "    .global main\n");
     emit(gen, "    .text\n");
@@ -271,117 +487,156 @@ void generate_code(CodeGenerator* gen, ASTNode* node) {
     for (int i = 0; i < node->data.block.statement_count; i++) {
         ASTNode* func = node->data.block.statements[i];
         if (func->type == NODE_FUNCTION_DECLARATION) {
+            layout_frame(gen, func);
             emit(gen, "%s:\n", func->data.function.name);
-            
-            // Function prologue
+
+            // Function prologue: the frame is reserved before any local
+            // is written, and register parameters go to their slots
             emit(gen, "    pushq %%rbp\n");
             emit(gen, "    movq %%rsp, %%rbp\n");
-            
-            // Reserve stack space for local variables
-            gen->stack_offset = 0;
-            generate_statement(gen, func->data.function.body);
-            
-            if (gen->stack_offset > 0) {
-                emit(gen, "    subq $%d, %%rsp\n", gen->stack_offset);
+            if (gen->frame_size > 0) {
+                emit(gen, "    subq $%d, %%rsp\n", gen->frame_size);
+            }
+            for (int p = 0; p < func->data.function.parameter_count && p < MAX_REGISTER_ARGS;
+                 p++) {
+                emit(gen, "    movq %s, %d(%%rbp)\n", register_names[argument_registers[p]],
+                     get_variable_offset(gen,
+                                         func->data.function.parameters[p]->data.variable.name));
             }
+
+            generate_statement(gen, func->data.function.body);
+
+            // Falling off the end returns rather than running into the
+            // next function
+            emit(gen, "    movq %%rbp, %%rsp\n");
+            emit(gen, "    popq %%rbp\n");
+            emit(gen, "    ret\n");
         }
     }
+    flush_output(gen);
 }
 
 void free_generator(CodeGenerator* gen) {
-    for (int i = 0; i < gen->variables.count; i++) {
-        free(gen->variables.names[i]);
-    }
-    free(gen->variables.names);
+    free_name_map(gen->variables.names);
     free(gen->variables.offsets);
-    fclose(gen->output);
+    flush_output(gen);
+    if (gen->output >= 0) close(gen->output);
+    free_emit_buffer(gen->buffer);
+    if (gen->object) free_object_code(gen->object);
     free(gen);
 }
 
+// Arguments are read when their call is made, so one whose operand is
+// overwritten before then gets a copy of its own
+static void isolate_call_arguments(IRProgram* program, int start) {
+    int end = find_function_end(program, start);
+    for (int i = start + 1; i < end; i++) {
+        IRInstr* arg = program->instructions[i];
+        if (arg->op != IR_ARG || is_immediate_operand(arg->src1)) continue;
+        // Look as far as the call, skipping calls whose arguments were
+        // pushed after this one
+        bool overwritten = false;
+        int later_args = 0;
+        for (int k = i + 1; k < end && !overwritten; k++) {
+            IRInstr* instr = program->instructions[k];
+            if (instr->op == IR_LABEL) break;
+            if (instr->op == IR_ARG) later_args++;
+            if (instr->op == IR_CALL || instr->op == IR_TAIL_CALL) {
+                if (instr->value > later_args) break;
+                later_args -= instr->value;
+            }
+            overwritten = writes_dest(instr) && strcmp(instr->dest, arg->src1) == 0;
+        }
+        if (!overwritten) continue;
+        char* temp = new_temp(program);
+        IRInstr* copy = create_instr(IR_ASSIGN, temp, arg->src1, NULL);
+        free(arg->src1);
+        arg->src1 = temp;
+        insert_instructions(program, i, &copy, 1);
+        i++;
+        end++;
+    }
+}
+
+// A comparison read only by the conditional jump after it becomes one
+// compare-and-branch, so no 0/1 value is materialised for the jump
+static void fuse_compare_branches(IRProgram* program, int start) {
+    int end = find_function_end(program, start);
+    NameMap* uses = create_name_map(64);
+    for (int i = start + 1; i < end; i++) {
+        const char* names[3];
+        int count = read_operands(program->instructions[i], names);
+        for (int j = 0; j < count; j++) {
+            int seen = name_map_get(uses, names[j]);
+            name_map_put(uses, names[j], seen < 0 ? 1 : seen + 1);
+        }
+    }
+    for (int i = start + 1; i + 1 < end; i++) {
+        IRInstr* compare = program->instructions[i];
+        IRInstr* jump = program->instructions[i + 1];
+        if (compare->op != IR_COMPARE || !compare->dest ||
+            (jump->op != IR_JUMPZ && jump->op != IR_JUMPNZ) ||
+            strcmp(jump->src1, compare->dest) != 0 || name_map_get(uses, compare->dest) != 1) {
+            continue;
+        }
+        jump->value = jump->op == IR_JUMPZ ? negate_relation(compare->value) : compare->value;
+        jump->op = IR_JUMP_COMPARE;
+        free(jump->src1);
+        jump->src1 = compare->src1;
+        jump->src2 = compare->src2;
+        compare->src1 = NULL;
+        compare->src2 = NULL;
+        free_instruction(detach_instruction(program, i));
+        end--;
+    }
+    free_name_map(uses);
+}
+
+// Allocates registers for each function in turn, selects its machine
+// instructions and prints them, writing each function out as it is done.
+// Object code is encoded function by function and, for an object file,
+// written at the end once calls between its functions are resolved.
 void generate_code_from_ir(CodeGenerator* gen, IRProgram* program) {
     // Generate assembly header
-    emit(gen, "    .global main\n");
-    emit(gen, "    .text\n");
-    
-    // Generate code for each instruction
-    for (int i = 0; i < program->count; i++) {
-        IRInstr* instr = program->instructions[i];
-        
-        switch (instr->op) {
-            case IR_LABEL:
-                emit(gen, "%s:\n", instr->label->name);
-                if (instr->label->number == -1) {  // Function label
-                    // Function prologue
-                    emit(gen, "    pushq %%rbp\n");
-                    emit(gen, "    movq %%rsp, %%rbp\n");
-                }
-                break;
-                
-            case IR_ADD:
-                emit(gen, "    movq %s, %%rax\n", instr->src1);
-                emit(gen, "    addq %s, %%rax\n", instr->src2);
-                emit(gen, "    movq %%rax, %s\n", instr->dest);
-                break;
-                
-            case IR_SUB:
-                emit(gen, "    movq %s, %%rax\n", instr->src1);
-                emit(gen, "    subq %s, %%rax\n", instr->src2);
-                emit(gen, "    movq %%rax, %s\n", instr->dest);
-                break;
-                
-            case IR_MUL:
-                emit(gen, "    movq %s, %%rax\n", instr->src1);
-                emit(gen, "    imulq %s, %%rax\n", instr->src2);
-                emit(gen, "    movq %%rax, %s\n", instr->dest);
-                break;
-                
-            case IR_DIV:
-                emit(gen, "    movq %s, %%rax\n", instr->src1);
-                emit(gen, "    cqto\n");
-                emit(gen, "    idivq %s\n", instr->src2);
-                emit(gen, "    movq %%rax, %s\n", instr->dest);
-                break;
-                
-            case IR_ASSIGN:
-                if (instr->src1) {
-                    emit(gen, "    movq %s, %%rax\n", instr->src1);
-                } else {
-                    emit(gen, "    movq $%d, %%rax\n", instr->value);
-                }
-                emit(gen, "    movq %%rax, %s\n", instr->dest);
-                break;
-                
-            case IR_JUMP:
-                emit(gen, "    jmp %s\n", instr->label->name);
-                break;
-                
-            case IR_JUMPZ:
-                emit(gen, "    cmpq $0, %s\n", instr->src1);
-                emit(gen, "    je %s\n", instr->label->name);
-                break;
-                
-            case IR_JUMPNZ:
-                emit(gen, "    cmpq $0, %s\n", instr->src1);
-                emit(gen, "    jne %s\n", instr->label->name);
-                break;
-                
-            case IR_CALL:
-                // Handle function calls similar to before...
-                break;
-                
-            case IR_RETURN:
-                if (instr->src1) {
-                    emit(gen, "    movq %s, %%rax\n", instr->src1);
-                }
-                emit(gen, "    movq %%rbp, %%rsp\n");
-                emit(gen, "    popq %%rbp\n");
-                emit(gen, "    ret\n");
-                break;
+    if (gen->object) {
+        declare_global_symbol(gen->object, "main");
+    } else {
+        emit(gen, "    .global main\n");
+        emit(gen, "    .text\n");
+    }
+
+    AnalysisManager* analyses = create_analysis_manager(program);
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+        isolate_call_arguments(program, start);
+        fuse_compare_branches(program, start);
+        CFG* cfg = get_cfg(analyses, start);
+        get_loops(analyses, start);
+        Liveness* liveness = get_liveness(analyses, start);
+        RegAllocation* alloc = gen->allocator == REGALLOC_GRAPH_COLORING
+                               ? allocate_registers_graph_coloring(program, cfg, liveness)
+                               : allocate_registers_linear_scan(program, cfg, liveness);
+        MachineFunction* function = select_instructions(program, cfg, alloc, &gen->label_count);
+        peephole_optimize(function);
+        if (gen->object) {
+            encode_machine_function(gen->object, function);
+        } else {
+            print_machine_function(gen->buffer, function);
+            flush_output(gen);
         }
+        free_machine_function(function);
+        free_reg_allocation(alloc);
+        start = cfg->end;
     }
+    free_analysis_manager(analyses);
+    if (gen->object) {
+        finish_object_code(gen->object);
+        if (gen->output >= 0) write_elf_object(gen->object, gen->buffer);
+    }
+    flush_output(gen);
 }
-
-void peephole_optimize(char* assembly) {
-    (void)assembly; // Prevent unused parameter warning
-    // Function implementation...
-} 
\ No newline at end of file
+ 
\ No newline at end of file
@@ -2,21 +2,36 @@
 #define CODEGEN_H
 
 #include "compiler.h"
+#include "ir.h"
+#include "emitbuf.h"
+#include "encoder.h"
+
+typedef enum {
+    REGALLOC_LINEAR_SCAN,
+    REGALLOC_GRAPH_COLORING     // Slower to run, for -O3
+} RegisterAllocator;
 
 typedef struct {
-    FILE* output;
+    int output;                 // File descriptor the buffer is flushed to, or -1
+    EmitBuffer* buffer;         // Everything emitted so far
+    ObjectCode* object;         // Set when writing an object file instead of assembly
+    RegisterAllocator allocator;
     int label_count;
-    int stack_offset;
-    // Symbol table for variable tracking
+    int frame_size;             // Bytes of locals below %rbp in the current function
+    int stack_depth;            // Expression temporaries pushed, in 8-byte words
+    // Locals of the current function: name -> index into offsets
     struct {
-        char** names;
-        int* offsets;
+        NameMap* names;
+        int* offsets;           // From %rbp
         int count;
     } variables;
 } CodeGenerator;
 
 CodeGenerator* create_generator(const char* output_filename);
+// Encodes into gen->object without writing a file, for the JIT
+CodeGenerator* create_jit_generator(void);
 void generate_code(CodeGenerator* gen, ASTNode* node);
+void generate_code_from_ir(CodeGenerator* gen, IRProgram* program);
 void free_generator(CodeGenerator* gen);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,640 @@
+#include "regalloc.h"
+#include <limits.h>
+
+// Iterated register coalescing, after George and Appel.  Nodes
+// 0 .. ALLOCATABLE_COUNT - 1 stand for the registers themselves; the
+// rest are the function's values.  A value that cannot be coloured
+// stays in its spill slot for its whole life, read and written there
+// directly, so the graph never has to be rebuilt.
+
+#define K ALLOCATABLE_COUNT
+
+typedef enum {
+    NODE_PRECOLORED,
+    NODE_INITIAL,
+    NODE_SIMPLIFY,              // Low degree, not move related
+    NODE_FREEZE,                // Low degree, move related
+    NODE_SPILL,                 // High degree
+    NODE_SELECT,                // Removed from the graph, on the select stack
+    NODE_COALESCED,
+    NODE_COLORED,
+    NODE_SPILLED
+} NodeState;
+
+typedef enum {
+    MOVE_WORKLIST,              // May be coalesced
+    MOVE_ACTIVE,                // Not ready to be coalesced yet
+    MOVE_COALESCED,
+    MOVE_CONSTRAINED,           // Source and destination interfere
+    MOVE_FROZEN                 // Given up on
+} MoveState;
+
+typedef struct {
+    int* items;
+    int count;
+    int capacity;
+} IntList;
+
+typedef struct {
+    int src;
+    int dst;
+    MoveState state;
+} GraphMove;
+
+typedef struct {
+    IRProgram* program;
+    CFG* cfg;
+    RegAllocation* alloc;
+    int node_count;
+    uint64_t* adjacency;        // Bit matrix, node_count rows
+    int words;                  // Per row
+    IntList* adj_list;          // Neighbours of uncoloured nodes
+    int* degree;
+    IntList* move_list;         // Moves each node takes part in
+    GraphMove* moves;
+    int move_count;
+    int move_capacity;
+    NodeState* state;
+    int* alias;
+    int* color;
+    double* cost;
+    int* remat;                 // Instruction of a single constant definition, or -1
+    IntList simplify_worklist;  // Entries are checked against state when taken,
+    IntList freeze_worklist;    // so a node may be left behind on a list
+    IntList spill_worklist;     // it has moved off
+    IntList move_worklist;
+    IntList select_stack;
+    int* marks;                 // Scratch for the conservative test
+    int mark;
+} Graph;
+
+static void push_int(IntList* list, int value) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity * 2 + 8;
+        list->items = realloc(list->items, sizeof(int) * list->capacity);
+    }
+    list->items[list->count++] = value;
+}
+
+static bool is_precolored(int node) {
+    return node < K;
+}
+
+static bool adjacent(Graph* graph, int u, int v) {
+    return bitset_test(graph->adjacency + (size_t)u * graph->words, v);
+}
+
+static void add_edge(Graph* graph, int u, int v) {
+    if (u == v || adjacent(graph, u, v)) return;
+    bitset_set(graph->adjacency + (size_t)u * graph->words, v);
+    bitset_set(graph->adjacency + (size_t)v * graph->words, u);
+    if (!is_precolored(u)) {
+        push_int(&graph->adj_list[u], v);
+        graph->degree[u]++;
+    }
+    if (!is_precolored(v)) {
+        push_int(&graph->adj_list[v], u);
+        graph->degree[v]++;
+    }
+}
+
+static int add_graph_move(Graph* graph, int src, int dst) {
+    if (graph->move_count == graph->move_capacity) {
+        graph->move_capacity = graph->move_capacity * 2 + 16;
+        graph->moves = realloc(graph->moves, sizeof(GraphMove) * graph->move_capacity);
+    }
+    int index = graph->move_count++;
+    graph->moves[index].src = src;
+    graph->moves[index].dst = dst;
+    graph->moves[index].state = MOVE_WORKLIST;
+    push_int(&graph->move_list[src], index);
+    push_int(&graph->move_list[dst], index);
+    push_int(&graph->move_worklist, index);
+    return index;
+}
+
+static int value_node(Graph* graph, const char* name) {
+    return K + name_map_get(graph->alloc->names, name);
+}
+
+// Every value gets a node before the graph is sized
+static void collect_values(Graph* graph) {
+    IRProgram* program = graph->program;
+    for (int i = graph->cfg->start + 1; i < graph->cfg->end; i++) {
+        IRInstr* instr = program->instructions[i];
+        const char* names[4];
+        int count = read_operands(instr, names);
+        for (int j = 0; j < count; j++) {
+            add_allocated_value(graph->alloc, names[j]);
+        }
+        if (writes_dest(instr)) add_allocated_value(graph->alloc, instr->dest);
+    }
+}
+
+static void init_graph(Graph* graph) {
+    int n = K + graph->alloc->value_count;
+    graph->node_count = n;
+    graph->words = (n + 63) / 64;
+    graph->adjacency = calloc((size_t)n * graph->words, sizeof(uint64_t));
+    graph->adj_list = calloc(n, sizeof(IntList));
+    graph->move_list = calloc(n, sizeof(IntList));
+    graph->degree = calloc(n, sizeof(int));
+    graph->state = malloc(sizeof(NodeState) * n);
+    graph->alias = malloc(sizeof(int) * n);
+    graph->color = malloc(sizeof(int) * n);
+    graph->cost = calloc(n, sizeof(double));
+    graph->remat = malloc(sizeof(int) * n);
+    graph->marks = calloc(n, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        graph->state[i] = is_precolored(i) ? NODE_PRECOLORED : NODE_INITIAL;
+        graph->alias[i] = i;
+        graph->color[i] = is_precolored(i) ? i : -1;
+        graph->remat[i] = -1;
+        // Registers never leave the graph
+        if (is_precolored(i)) graph->degree[i] = INT_MAX / 2;
+    }
+}
+
+// Makes every node in the live set interfere with node
+static void interfere_with_live(Graph* graph, uint64_t* live, int node) {
+    for (int v = 0; v < graph->alloc->value_count; v++) {
+        if (bitset_test(live, v)) add_edge(graph, node, K + v);
+    }
+}
+
+static void set_live(uint64_t* live, int node, bool on) {
+    if (node < K) return;
+    if (on) {
+        bitset_set(live, node - K);
+    } else {
+        bitset_clear(live, node - K);
+    }
+}
+
+// Parameters are all written at once on entry, so they interfere with
+// each other and would like to stay in the registers they arrive in
+static void build_parameters(Graph* graph, uint64_t* live, int first, int last) {
+    IRProgram* program = graph->program;
+    for (int i = first; i <= last; i++) {
+        set_live(live, value_node(graph, program->instructions[i]->dest), true);
+    }
+    for (int i = first; i <= last; i++) {
+        int node = value_node(graph, program->instructions[i]->dest);
+        interfere_with_live(graph, live, node);
+        int p = i - first;
+        for (int r = 0; r < K && p < MAX_REGISTER_ARGS; r++) {
+            if (allocatable_registers[r] == argument_registers[p]) add_graph_move(graph, r, node);
+        }
+    }
+    for (int i = first; i <= last; i++) {
+        set_live(live, value_node(graph, program->instructions[i]->dest), false);
+    }
+}
+
+// Walks each block backwards from its live-out set, making every
+// definition interfere with whatever is live across it.  Calls clobber
+// the caller-saved registers, which therefore interfere with the values
+// live across the call.  Copies are recorded as moves instead of
+// interfering with their source.
+static void build_graph(Graph* graph, Liveness* liveness) {
+    IRProgram* program = graph->program;
+    CFG* cfg = graph->cfg;
+    int start = cfg->start;
+    int* calls = match_call_arguments(program, cfg);
+    int words = (graph->alloc->value_count + 63) / 64;
+    uint64_t* live = malloc(sizeof(uint64_t) * (words + 1));
+    NameMap* live_names = liveness->names;
+    int* def_counts = calloc(graph->node_count, sizeof(int));
+
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        int weight = block_use_weight(block);
+        memset(live, 0, sizeof(uint64_t) * (words + 1));
+        uint64_t* out = dataflow_set(liveness->problem, liveness->problem->out, block);
+        for (int s = 0; s < live_names->capacity; s++) {
+            if (live_names->keys[s] && bitset_test(out, live_names->values[s])) {
+                set_live(live, value_node(graph, live_names->keys[s]), true);
+            }
+        }
+
+        for (int i = block->end; i >= block->start; i--) {
+            IRInstr* instr = program->instructions[i];
+            if (instr->op == IR_PARAM) {
+                int first = i;
+                while (program->instructions[first - 1]->op == IR_PARAM) first--;
+                // Parameters are definitions too, so one assigned a
+                // constant later is not rematerialisable
+                for (int p = first; p <= i; p++) {
+                    int param = value_node(graph, program->instructions[p]->dest);
+                    graph->cost[param] += weight;
+                    def_counts[param]++;
+                }
+                build_parameters(graph, live, first, i);
+                i = first;
+                continue;
+            }
+
+            int dest = writes_dest(instr) ? value_node(graph, instr->dest) : -1;
+            bool copy = instr->op == IR_ASSIGN && instr->src1 &&
+                        !is_immediate_operand(instr->src1);
+            if (copy) {
+                int src = value_node(graph, instr->src1);
+                set_live(live, src, false);
+                if (src != dest) add_graph_move(graph, src, dest);
+            }
+            if (instr->op == IR_CALL) {
+                for (int r = 0; r < K; r++) {
+                    if (is_callee_saved(allocatable_registers[r])) continue;
+                    for (int v = 0; v < graph->alloc->value_count; v++) {
+                        if (bitset_test(live, v) && K + v != dest) add_edge(graph, r, K + v);
+                    }
+                }
+            }
+            if (dest >= 0) {
+                set_live(live, dest, true);
+                interfere_with_live(graph, live, dest);
+                set_live(live, dest, false);
+                graph->cost[dest] += weight;
+                def_counts[dest]++;
+                if (instr->op == IR_ASSIGN && !instr->src1) graph->remat[dest] = i;
+            }
+
+            // Arguments are read by their call rather than where they are
+            // pushed, as long as both are in the same block
+            int k = i - start;
+            if (instr->op == IR_ARG && calls[k] >= 0 && calls[k] + start <= block->end) continue;
+            const char* names[4];
+            int count = read_operands(instr, names);
+            for (int j = 0; j < count; j++) {
+                set_live(live, value_node(graph, names[j]), true);
+                graph->cost[value_node(graph, names[j])] += weight;
+            }
+            if (instr->op == IR_CALL || instr->op == IR_TAIL_CALL) {
+                for (int a = block->start; a < i; a++) {
+                    if (calls[a - start] != k || program->instructions[a]->op != IR_ARG) continue;
+                    const char* operand = program->instructions[a]->src1;
+                    if (!is_immediate_operand(operand)) {
+                        set_live(live, value_node(graph, operand), true);
+                        graph->cost[value_node(graph, operand)] += weight;
+                    }
+                }
+            }
+        }
+    }
+
+    for (int n = K; n < graph->node_count; n++) {
+        if (def_counts[n] != 1) graph->remat[n] = -1;
+        // Constants are cheaper to spill, since they are never stored
+        if (graph->remat[n] >= 0) graph->cost[n] /= 2;
+    }
+    free(def_counts);
+    free(live);
+    free(calls);
+}
+
+static bool move_is_pending(Graph* graph, int move) {
+    MoveState state = graph->moves[move].state;
+    return state == MOVE_ACTIVE || state == MOVE_WORKLIST;
+}
+
+static bool is_move_related(Graph* graph, int node) {
+    IntList* moves = &graph->move_list[node];
+    for (int i = 0; i < moves->count; i++) {
+        if (move_is_pending(graph, moves->items[i])) return true;
+    }
+    return false;
+}
+
+// Neighbours still in the graph
+static bool in_graph(Graph* graph, int node) {
+    return graph->state[node] != NODE_SELECT && graph->state[node] != NODE_COALESCED;
+}
+
+static void set_state(Graph* graph, int node, NodeState state) {
+    graph->state[node] = state;
+    switch (state) {
+        case NODE_SIMPLIFY: push_int(&graph->simplify_worklist, node); break;
+        case NODE_FREEZE: push_int(&graph->freeze_worklist, node); break;
+        case NODE_SPILL: push_int(&graph->spill_worklist, node); break;
+        case NODE_SELECT: push_int(&graph->select_stack, node); break;
+        default: break;
+    }
+}
+
+static void make_worklists(Graph* graph) {
+    for (int n = K; n < graph->node_count; n++) {
+        if (graph->degree[n] >= K) {
+            set_state(graph, n, NODE_SPILL);
+        } else if (is_move_related(graph, n)) {
+            set_state(graph, n, NODE_FREEZE);
+        } else {
+            set_state(graph, n, NODE_SIMPLIFY);
+        }
+    }
+}
+
+static void enable_moves(Graph* graph, int node) {
+    IntList* moves = &graph->move_list[node];
+    for (int i = 0; i < moves->count; i++) {
+        int move = moves->items[i];
+        if (graph->moves[move].state == MOVE_ACTIVE) {
+            graph->moves[move].state = MOVE_WORKLIST;
+            push_int(&graph->move_worklist, move);
+        }
+    }
+}
+
+static void decrement_degree(Graph* graph, int node) {
+    if (is_precolored(node)) return;
+    int degree = graph->degree[node]--;
+    if (degree != K) return;
+    enable_moves(graph, node);
+    IntList* neighbours = &graph->adj_list[node];
+    for (int i = 0; i < neighbours->count; i++) {
+        if (in_graph(graph, neighbours->items[i])) enable_moves(graph, neighbours->items[i]);
+    }
+    if (graph->state[node] == NODE_SPILL) {
+        set_state(graph, node, is_move_related(graph, node) ? NODE_FREEZE : NODE_SIMPLIFY);
+    }
+}
+
+static void simplify(Graph* graph, int node) {
+    set_state(graph, node, NODE_SELECT);
+    IntList* neighbours = &graph->adj_list[node];
+    for (int i = 0; i < neighbours->count; i++) {
+        if (in_graph(graph, neighbours->items[i])) decrement_degree(graph, neighbours->items[i]);
+    }
+}
+
+static int get_alias(Graph* graph, int node) {
+    while (graph->state[node] == NODE_COALESCED) {
+        node = graph->alias[node];
+    }
+    return node;
+}
+
+static void add_worklist(Graph* graph, int node) {
+    if (!is_precolored(node) && graph->state[node] == NODE_FREEZE &&
+        !is_move_related(graph, node) && graph->degree[node] < K) {
+        set_state(graph, node, NODE_SIMPLIFY);
+    }
+}
+
+// George's test for coalescing v into register u: every neighbour of v
+// is harmless or already interferes with u
+static bool george_ok(Graph* graph, int u, int v) {
+    IntList* neighbours = &graph->adj_list[v];
+    for (int i = 0; i < neighbours->count; i++) {
+        int t = neighbours->items[i];
+        if (!in_graph(graph, t)) continue;
+        if (graph->degree[t] >= K && !is_precolored(t) && !adjacent(graph, t, u)) return false;
+    }
+    return true;
+}
+
+// Briggs's test: the combined node has fewer than K neighbours of
+// significant degree
+static bool briggs_ok(Graph* graph, int u, int v) {
+    graph->mark++;
+    int significant = 0;
+    int nodes[2] = { u, v };
+    for (int n = 0; n < 2; n++) {
+        IntList* neighbours = &graph->adj_list[nodes[n]];
+        for (int i = 0; i < neighbours->count; i++) {
+            int t = neighbours->items[i];
+            if (!in_graph(graph, t) || graph->marks[t] == graph->mark) continue;
+            graph->marks[t] = graph->mark;
+            if (graph->degree[t] >= K) significant++;
+        }
+    }
+    return significant < K;
+}
+
+static void combine(Graph* graph, int u, int v) {
+    graph->state[v] = NODE_COALESCED;
+    graph->alias[v] = u;
+    IntList* moves = &graph->move_list[v];
+    for (int i = 0; i < moves->count; i++) {
+        push_int(&graph->move_list[u], moves->items[i]);
+    }
+    enable_moves(graph, v);
+    IntList* neighbours = &graph->adj_list[v];
+    for (int i = 0; i < neighbours->count; i++) {
+        int t = neighbours->items[i];
+        if (!in_graph(graph, t)) continue;
+        add_edge(graph, t, u);
+        decrement_degree(graph, t);
+    }
+    graph->cost[u] += graph->cost[v];
+    if (graph->degree[u] >= K && graph->state[u] == NODE_FREEZE) {
+        set_state(graph, u, NODE_SPILL);
+    }
+}
+
+static void coalesce(Graph* graph, int move) {
+    int x = get_alias(graph, graph->moves[move].src);
+    int y = get_alias(graph, graph->moves[move].dst);
+    int u = is_precolored(y) ? y : x;
+    int v = is_precolored(y) ? x : y;
+
+    if (u == v) {
+        graph->moves[move].state = MOVE_COALESCED;
+        add_worklist(graph, u);
+    } else if (is_precolored(v) || adjacent(graph, u, v)) {
+        graph->moves[move].state = MOVE_CONSTRAINED;
+        add_worklist(graph, u);
+        add_worklist(graph, v);
+    } else if (is_precolored(u) ? george_ok(graph, u, v) : briggs_ok(graph, u, v)) {
+        graph->moves[move].state = MOVE_COALESCED;
+        combine(graph, u, v);
+        add_worklist(graph, u);
+    } else {
+        graph->moves[move].state = MOVE_ACTIVE;
+    }
+}
+
+static void freeze_moves(Graph* graph, int node) {
+    IntList* moves = &graph->move_list[node];
+    for (int i = 0; i < moves->count; i++) {
+        int move = moves->items[i];
+        if (!move_is_pending(graph, move)) continue;
+        int x = get_alias(graph, graph->moves[move].src);
+        int y = get_alias(graph, graph->moves[move].dst);
+        int other = y == get_alias(graph, node) ? x : y;
+        graph->moves[move].state = MOVE_FROZEN;
+        if (!is_precolored(other) && graph->state[other] == NODE_FREEZE &&
+            !is_move_related(graph, other) && graph->degree[other] < K) {
+            set_state(graph, other, NODE_SIMPLIFY);
+        }
+    }
+}
+
+// Takes the first live entry of a worklist, dropping stale ones
+static int take_node(Graph* graph, IntList* list, NodeState state) {
+    while (list->count > 0) {
+        int node = list->items[--list->count];
+        if (graph->state[node] == state) return node;
+    }
+    return -1;
+}
+
+// The high-degree node that is cheapest to spill per neighbour freed
+static int choose_spill(Graph* graph) {
+    int best = -1;
+    double best_cost = 0;
+    IntList* list = &graph->spill_worklist;
+    int kept = 0;
+    for (int i = 0; i < list->count; i++) {
+        int node = list->items[i];
+        if (graph->state[node] != NODE_SPILL) continue;
+        list->items[kept++] = node;
+        double cost = graph->cost[node] / graph->degree[node];
+        if (best < 0 || cost < best_cost) {
+            best = node;
+            best_cost = cost;
+        }
+    }
+    list->count = kept;
+    return best;
+}
+
+static void assign_colors(Graph* graph) {
+    while (graph->select_stack.count > 0) {
+        int node = graph->select_stack.items[--graph->select_stack.count];
+        bool taken[K] = {false};
+        IntList* neighbours = &graph->adj_list[node];
+        for (int i = 0; i < neighbours->count; i++) {
+            int w = get_alias(graph, neighbours->items[i]);
+            if (graph->state[w] == NODE_COLORED || is_precolored(w)) taken[graph->color[w]] = true;
+        }
+        graph->state[node] = NODE_SPILLED;
+        for (int c = 0; c < K; c++) {
+            if (!taken[c]) {
+                graph->state[node] = NODE_COLORED;
+                graph->color[node] = c;
+                break;
+            }
+        }
+    }
+}
+
+static void color_graph(Graph* graph) {
+    make_worklists(graph);
+    while (true) {
+        int node;
+        if ((node = take_node(graph, &graph->simplify_worklist, NODE_SIMPLIFY)) >= 0) {
+            simplify(graph, node);
+        } else if (graph->move_worklist.count > 0) {
+            int move = graph->move_worklist.items[--graph->move_worklist.count];
+            if (graph->moves[move].state == MOVE_WORKLIST) coalesce(graph, move);
+        } else if ((node = take_node(graph, &graph->freeze_worklist, NODE_FREEZE)) >= 0) {
+            set_state(graph, node, NODE_SIMPLIFY);
+            freeze_moves(graph, node);
+        } else if ((node = choose_spill(graph)) >= 0) {
+            set_state(graph, node, NODE_SIMPLIFY);
+            freeze_moves(graph, node);
+        } else {
+            break;
+        }
+    }
+    assign_colors(graph);
+}
+
+// Lowest slot no spilled group interfering with root's group has taken.
+// Interference is read through aliases, as in assign_colors.
+static int choose_spill_slot(Graph* graph, int* slots, int root) {
+    RegAllocation* alloc = graph->alloc;
+    bool* taken = calloc(alloc->slot_count + 1, sizeof(bool));
+    for (int n = K; n < graph->node_count; n++) {
+        if (get_alias(graph, n) != root) continue;
+        IntList* neighbours = &graph->adj_list[n];
+        for (int i = 0; i < neighbours->count; i++) {
+            int other = get_alias(graph, neighbours->items[i]);
+            if (!is_precolored(other) && slots[other] >= 0) taken[slots[other]] = true;
+        }
+    }
+    int slot = 0;
+    while (taken[slot]) slot++;
+    free(taken);
+    if (slot == alloc->slot_count) alloc->slot_count++;
+    return slot;
+}
+
+// Every value has one location for the whole function.  Values
+// coalesced together share it, including a spill slot; a constant on
+// its own is rematerialised instead.  Spilled groups that never
+// interfere share a slot.
+static void record_colors(Graph* graph) {
+    RegAllocation* alloc = graph->alloc;
+    int* group_sizes = calloc(graph->node_count, sizeof(int));
+    int* slots = malloc(sizeof(int) * graph->node_count);
+    for (int n = K; n < graph->node_count; n++) {
+        group_sizes[get_alias(graph, n)]++;
+        slots[n] = -1;
+    }
+
+    for (int n = K; n < graph->node_count; n++) {
+        int root = get_alias(graph, n);
+        Location location = { LOC_REG, -1, -1, 0 };
+        if (is_precolored(root) || graph->state[root] == NODE_COLORED) {
+            location.reg = allocatable_registers[graph->color[root]];
+            alloc->used[location.reg] = true;
+        } else if (graph->remat[n] >= 0 && group_sizes[root] == 1) {
+            location.kind = LOC_IMM;
+            location.imm = graph->program->instructions[graph->remat[n]]->value;
+        } else {
+            if (slots[root] < 0) slots[root] = choose_spill_slot(graph, slots, root);
+            location.kind = LOC_STACK;
+            location.slot = slots[root];
+        }
+        ValueAllocation* value = &alloc->values[n - K];
+        value->ranges = malloc(sizeof(AllocRange));
+        value->range_count = 1;
+        value->ranges[0].from = 0;
+        value->ranges[0].to = USE_POSITION(alloc->instr_count);
+        value->ranges[0].location = location;
+    }
+    free(group_sizes);
+    free(slots);
+}
+
+static void free_graph(Graph* graph) {
+    for (int n = 0; n < graph->node_count; n++) {
+        free(graph->adj_list[n].items);
+        free(graph->move_list[n].items);
+    }
+    free(graph->adjacency);
+    free(graph->adj_list);
+    free(graph->move_list);
+    free(graph->degree);
+    free(graph->moves);
+    free(graph->state);
+    free(graph->alias);
+    free(graph->color);
+    free(graph->cost);
+    free(graph->remat);
+    free(graph->marks);
+    free(graph->simplify_worklist.items);
+    free(graph->freeze_worklist.items);
+    free(graph->spill_worklist.items);
+    free(graph->move_worklist.items);
+    free(graph->select_stack.items);
+}
+
+// Slower than linear scan, with a graph quadratic in the number of
+// values, but it coalesces copies away and spills by cost over the
+// whole function rather than interval by interval
+RegAllocation* allocate_registers_graph_coloring(IRProgram* program, CFG* cfg,
+                                                 Liveness* liveness) {
+    Graph graph = {0};
+    graph.program = program;
+    graph.cfg = cfg;
+    graph.alloc = create_reg_allocation(cfg);
+    collect_values(&graph);
+    init_graph(&graph);
+    build_graph(&graph, liveness);
+    color_graph(&graph);
+    record_colors(&graph);
+    free_graph(&graph);
+    return graph.alloc;
+}
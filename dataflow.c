@@ -0,0 +1,528 @@
+#include "dataflow.h"
+
+DataflowProblem* create_dataflow_problem(CFG* cfg, DataflowDirection direction,
+                                         DataflowMeet meet, int bit_count) {
+    DataflowProblem* problem = malloc(sizeof(DataflowProblem));
+    problem->direction = direction;
+    problem->meet = meet;
+    problem->bit_count = bit_count;
+    problem->words = bit_count > 0 ? (bit_count + 63) / 64 : 1;
+    problem->block_count = cfg->block_count;
+    size_t size = (size_t)cfg->block_count * problem->words;
+    problem->gen = calloc(size, sizeof(uint64_t));
+    problem->kill = calloc(size, sizeof(uint64_t));
+    problem->in = calloc(size, sizeof(uint64_t));
+    problem->out = calloc(size, sizeof(uint64_t));
+    return problem;
+}
+
+uint64_t* dataflow_set(DataflowProblem* problem, uint64_t* sets, BasicBlock* block) {
+    return &sets[(size_t)block->index * problem->words];
+}
+
+// Iterates to the fixed point.  Blocks are swept in reverse postorder
+// (postorder going backward) and only those whose inputs changed since
+// their last visit are recomputed, so acyclic regions converge in one
+// sweep and loops in one more per nesting level.
+void solve_dataflow(DataflowProblem* problem, CFG* cfg) {
+    int words = problem->words;
+    bool forward = problem->direction == DATAFLOW_FORWARD;
+    bool intersect = problem->meet == DATAFLOW_INTERSECTION;
+    uint64_t* meet = malloc(sizeof(uint64_t) * words);
+    bool* pending = calloc(cfg->block_count, sizeof(bool));
+
+    // Must problems start from everything and shrink
+    for (int i = 0; i < cfg->rpo_count; i++) {
+        BasicBlock* block = cfg->rpo[i];
+        uint64_t* result = dataflow_set(problem, forward ? problem->out : problem->in, block);
+        memset(result, intersect ? 0xff : 0, sizeof(uint64_t) * words);
+        pending[block->index] = true;
+    }
+
+    bool visited = true;
+    while (visited) {
+        visited = false;
+        for (int i = 0; i < cfg->rpo_count; i++) {
+            BasicBlock* block = cfg->rpo[forward ? i : cfg->rpo_count - 1 - i];
+            if (!pending[block->index]) continue;
+            pending[block->index] = false;
+            visited = true;
+
+            // Meet over predecessors going forward, successors going
+            // backward; the entry and the exits see the empty boundary
+            BasicBlock** edges = forward ? block->predecessors : block->successors;
+            int edge_count = forward ? block->predecessor_count : block->successor_count;
+            bool boundary = forward ? block == cfg->blocks[0] : edge_count == 0;
+            memset(meet, intersect && !boundary ? 0xff : 0, sizeof(uint64_t) * words);
+            for (int e = 0; e < edge_count; e++) {
+                uint64_t* value = dataflow_set(problem, forward ? problem->out : problem->in,
+                                               edges[e]);
+                for (int w = 0; w < words; w++) {
+                    meet[w] = intersect ? (meet[w] & value[w]) : (meet[w] | value[w]);
+                }
+            }
+            memcpy(dataflow_set(problem, forward ? problem->in : problem->out, block),
+                   meet, sizeof(uint64_t) * words);
+
+            uint64_t* gen = dataflow_set(problem, problem->gen, block);
+            uint64_t* kill = dataflow_set(problem, problem->kill, block);
+            uint64_t* result = dataflow_set(problem, forward ? problem->out : problem->in, block);
+            bool changed = false;
+            for (int w = 0; w < words; w++) {
+                uint64_t value = gen[w] | (meet[w] & ~kill[w]);
+                if (value != result[w]) {
+                    result[w] = value;
+                    changed = true;
+                }
+            }
+            if (!changed) continue;
+            BasicBlock** dependents = forward ? block->successors : block->predecessors;
+            int dependent_count = forward ? block->successor_count : block->predecessor_count;
+            for (int d = 0; d < dependent_count; d++) {
+                pending[dependents[d]->index] = true;
+            }
+        }
+    }
+    free(meet);
+    free(pending);
+}
+
+void free_dataflow_problem(DataflowProblem* problem) {
+    free(problem->gen);
+    free(problem->kill);
+    free(problem->in);
+    free(problem->out);
+    free(problem);
+}
+
+// Names read by the instruction, at most 3; the target of a call is a function
+int read_operands(IRInstr* instr, const char** names) {
+    int count = 0;
+    if (instr->src1 && instr->op != IR_CALL && instr->op != IR_TAIL_CALL &&
+        !is_immediate_operand(instr->src1)) {
+        names[count++] = instr->src1;
+    }
+    if (instr->src2 && !is_immediate_operand(instr->src2)) names[count++] = instr->src2;
+    if ((instr->op == IR_STORE || instr->op == IR_CMOVZ || instr->op == IR_CMOVNZ) &&
+        instr->dest) {
+        names[count++] = instr->dest;
+    }
+    return count;
+}
+
+// Builds the lists from id to the bits that mention it, given one
+// (id, bit) pair per mention
+static void build_index_lists(int id_count, int* ids, int* bits, int pair_count,
+                              int** starts_out, int** lists_out) {
+    int* starts = calloc(id_count + 1, sizeof(int));
+    int* lists = malloc(sizeof(int) * (pair_count + 1));
+    for (int i = 0; i < pair_count; i++) {
+        starts[ids[i] + 1]++;
+    }
+    for (int i = 0; i < id_count; i++) {
+        starts[i + 1] += starts[i];
+    }
+    int* fill = malloc(sizeof(int) * (id_count + 1));
+    memcpy(fill, starts, sizeof(int) * (id_count + 1));
+    for (int i = 0; i < pair_count; i++) {
+        lists[fill[ids[i]]++] = bits[i];
+    }
+    free(fill);
+    *starts_out = starts;
+    *lists_out = lists;
+}
+
+// Names read before being written in some block, numbered from 0.  No
+// other name is live across a block boundary, and no definition of one
+// is read outside its own block.
+static NameMap* find_upward_exposed_names(IRProgram* program, CFG* cfg, int* count) {
+    NameMap* ids = create_name_map(64);
+    int id_count = 0;
+    int capacity = 64;
+    int* written_in = malloc(sizeof(int) * capacity);
+    NameMap* exposed = create_name_map(64);
+    *count = 0;
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        for (int i = block->start; i <= block->end; i++) {
+            IRInstr* instr = program->instructions[i];
+            const char* names[4];
+            int read_count = read_operands(instr, names);
+            for (int j = 0; j < read_count; j++) {
+                int id = name_map_get(ids, names[j]);
+                if ((id < 0 || written_in[id] != b) && name_map_get(exposed, names[j]) < 0) {
+                    name_map_put(exposed, names[j], (*count)++);
+                }
+            }
+            if (!writes_dest(instr)) continue;
+            int id = name_map_get(ids, instr->dest);
+            if (id < 0) {
+                if (id_count == capacity) {
+                    capacity *= 2;
+                    written_in = realloc(written_in, sizeof(int) * capacity);
+                }
+                id = id_count++;
+                name_map_put(ids, instr->dest, id);
+            }
+            written_in[id] = b;
+        }
+    }
+    free_name_map(ids);
+    free(written_in);
+    return exposed;
+}
+
+// Copies the solved entry set of block into set, a set of words words
+// also covering bits the problem leaves out, which start clear
+static void copy_entry_set(DataflowProblem* problem, BasicBlock* block, uint64_t* set,
+                           int words) {
+    memcpy(set, dataflow_set(problem, problem->in, block), sizeof(uint64_t) * problem->words);
+    memset(set + problem->words, 0, sizeof(uint64_t) * (words - problem->words));
+    // Must problems leave the unused top of the last word set
+    for (int bit = problem->bit_count; bit < problem->words * 64; bit++) {
+        bitset_clear(set, bit);
+    }
+}
+
+// Liveness
+
+Liveness* compute_liveness(IRProgram* program, CFG* cfg) {
+    // A name read before any write in its block is live on entry to it
+    Liveness* liveness = malloc(sizeof(Liveness));
+    int bit_count;
+    liveness->names = find_upward_exposed_names(program, cfg, &bit_count);
+
+    DataflowProblem* problem = create_dataflow_problem(cfg, DATAFLOW_BACKWARD,
+                                                       DATAFLOW_UNION, bit_count);
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        uint64_t* use = dataflow_set(problem, problem->gen, block);
+        uint64_t* def = dataflow_set(problem, problem->kill, block);
+        for (int i = block->start; i <= block->end; i++) {
+            IRInstr* instr = program->instructions[i];
+            const char* names[4];
+            int count = read_operands(instr, names);
+            for (int j = 0; j < count; j++) {
+                int bit = name_map_get(liveness->names, names[j]);
+                if (bit >= 0 && !bitset_test(def, bit)) bitset_set(use, bit);
+            }
+            if (!writes_dest(instr)) continue;
+            int bit = name_map_get(liveness->names, instr->dest);
+            if (bit >= 0) bitset_set(def, bit);
+        }
+    }
+    solve_dataflow(problem, cfg);
+    liveness->problem = problem;
+    return liveness;
+}
+
+bool is_live_in_block(Liveness* liveness, BasicBlock* block, const char* name) {
+    int bit = name_map_get(liveness->names, name);
+    return bit >= 0 &&
+           bitset_test(dataflow_set(liveness->problem, liveness->problem->in, block), bit);
+}
+
+bool is_live_out_block(Liveness* liveness, BasicBlock* block, const char* name) {
+    int bit = name_map_get(liveness->names, name);
+    return bit >= 0 &&
+           bitset_test(dataflow_set(liveness->problem, liveness->problem->out, block), bit);
+}
+
+void free_liveness(Liveness* liveness) {
+    free_name_map(liveness->names);
+    free_dataflow_problem(liveness->problem);
+    free(liveness);
+}
+
+// Reaching definitions
+
+ReachingDefs* compute_reaching_defs(IRProgram* program, CFG* cfg) {
+    ReachingDefs* defs = malloc(sizeof(ReachingDefs));
+    int length = cfg->end - cfg->start;
+    defs->start = cfg->start;
+    defs->instr_defs = malloc(sizeof(int) * (length + 1));
+    defs->def_instrs = malloc(sizeof(int) * (length + 1));
+    defs->def_names = malloc(sizeof(int) * (length + 1));
+    defs->names = create_name_map(64);
+    int name_count = 0;
+    for (int i = cfg->start; i < cfg->end; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (writes_dest(instr) && name_map_get(defs->names, instr->dest) < 0) {
+            name_map_put(defs->names, instr->dest, name_count++);
+        }
+    }
+
+    // Only the last definition of a name in its block reaches the block's
+    // end, and only one of a name some block reads before writing can be
+    // read there.  Those get the low bits, the ones the per-block sets
+    // hold; the rest are found by the scan within their block.
+    int exposed_count;
+    NameMap* exposed = find_upward_exposed_names(program, cfg, &exposed_count);
+    int* last_block = malloc(sizeof(int) * (name_count + 1));
+    for (int n = 0; n < name_count; n++) {
+        last_block[n] = -1;
+    }
+    bool* global = calloc(length + 1, sizeof(bool));
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        for (int i = block->end; i >= block->start; i--) {
+            IRInstr* instr = program->instructions[i];
+            if (!writes_dest(instr)) continue;
+            int id = name_map_get(defs->names, instr->dest);
+            if (last_block[id] == b) continue;
+            last_block[id] = b;
+            global[i - cfg->start] = name_map_get(exposed, instr->dest) >= 0;
+        }
+    }
+    free(last_block);
+    free_name_map(exposed);
+
+    defs->def_count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) defs->global_count = defs->def_count;
+        for (int i = cfg->start; i < cfg->end; i++) {
+            IRInstr* instr = program->instructions[i];
+            if (pass == 0) defs->instr_defs[i - cfg->start] = -1;
+            if (!writes_dest(instr) || global[i - cfg->start] != (pass == 0)) continue;
+            defs->def_names[defs->def_count] = name_map_get(defs->names, instr->dest);
+            defs->instr_defs[i - cfg->start] = defs->def_count;
+            defs->def_instrs[defs->def_count++] = i;
+        }
+    }
+    free(global);
+    defs->words = defs->def_count > 0 ? (defs->def_count + 63) / 64 : 1;
+    int* bits = malloc(sizeof(int) * (defs->def_count + 1));
+    for (int i = 0; i < defs->def_count; i++) {
+        bits[i] = i;
+    }
+    build_index_lists(name_count, defs->def_names, bits, defs->def_count,
+                      &defs->name_def_start, &defs->name_defs);
+    free(bits);
+
+    // A definition kills every other definition of its name.  Only the
+    // definitions with bits here can be last in their block.
+    DataflowProblem* problem = create_dataflow_problem(cfg, DATAFLOW_FORWARD,
+                                                       DATAFLOW_UNION, defs->global_count);
+    defs->problem = problem;
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        uint64_t* gen = dataflow_set(problem, problem->gen, block);
+        uint64_t* kill = dataflow_set(problem, problem->kill, block);
+        for (int i = block->start; i <= block->end; i++) {
+            int bit = defs->instr_defs[i - cfg->start];
+            if (bit < 0 || bit >= defs->global_count) continue;
+            int* others;
+            int count = find_name_defs(defs, program->instructions[i]->dest, &others);
+            for (int j = 0; j < count && others[j] < defs->global_count; j++) {
+                bitset_set(kill, others[j]);
+            }
+            bitset_set(gen, bit);
+        }
+    }
+    solve_dataflow(problem, cfg);
+    return defs;
+}
+
+// Sets set, of defs->words words, to the definitions reaching the start
+// of block
+void reaching_defs_at_entry(ReachingDefs* defs, BasicBlock* block, uint64_t* set) {
+    copy_entry_set(defs->problem, block, set, defs->words);
+}
+
+// Updates set, the definitions reaching instruction index, to those
+// reaching the instruction after it
+void apply_reaching_def(ReachingDefs* defs, uint64_t* set, int index) {
+    int bit = defs->instr_defs[index - defs->start];
+    if (bit < 0) return;
+    int id = defs->def_names[bit];
+    for (int j = defs->name_def_start[id]; j < defs->name_def_start[id + 1]; j++) {
+        bitset_clear(set, defs->name_defs[j]);
+    }
+    bitset_set(set, bit);
+}
+
+// Returns the number of definitions of name and points bits at them
+int find_name_defs(ReachingDefs* defs, const char* name, int** bits) {
+    int id = name_map_get(defs->names, name);
+    if (id < 0) {
+        *bits = NULL;
+        return 0;
+    }
+    *bits = &defs->name_defs[defs->name_def_start[id]];
+    return defs->name_def_start[id + 1] - defs->name_def_start[id];
+}
+
+void free_reaching_defs(ReachingDefs* defs) {
+    free(defs->instr_defs);
+    free(defs->def_instrs);
+    free(defs->def_names);
+    free_name_map(defs->names);
+    free(defs->name_def_start);
+    free(defs->name_defs);
+    free_dataflow_problem(defs->problem);
+    free(defs);
+}
+
+// Available expressions
+
+static bool is_available_candidate(IRInstr* instr) {
+    switch (instr->op) {
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV: case IR_SHR:
+        case IR_COMPARE:
+            // Division may trap, but only where it was evaluated before
+            return instr->dest && instr->src1 && instr->src2;
+        default:
+            return false;
+    }
+}
+
+// Key identifying an expression; operands of commutative operations
+// are put in a fixed order
+static char* expression_key(IRInstr* instr) {
+    const char* left = instr->src1;
+    const char* right = instr->src2;
+    if ((instr->op == IR_ADD || instr->op == IR_MUL) && strcmp(left, right) > 0) {
+        left = instr->src2;
+        right = instr->src1;
+    }
+    size_t size = strlen(left) + strlen(right) + 32;
+    char* key = malloc(size);
+    snprintf(key, size, "%d %d %s %s", instr->op, instr->value, left, right);
+    return key;
+}
+
+AvailableExprs* compute_available_exprs(IRProgram* program, CFG* cfg) {
+    AvailableExprs* exprs = malloc(sizeof(AvailableExprs));
+    int length = cfg->end - cfg->start;
+    exprs->start = cfg->start;
+    exprs->instr_exprs = malloc(sizeof(int) * (length + 1));
+    exprs->expr_count = 0;
+    exprs->names = create_name_map(64);
+    NameMap* keys = create_name_map(64);
+    int* operand_ids = malloc(sizeof(int) * (2 * length + 1));
+    int* operand_exprs = malloc(sizeof(int) * (2 * length + 1));
+    // Block an expression was first computed in, or -1 once it has
+    // been computed in a second
+    int* home_block = malloc(sizeof(int) * (length + 1));
+    int pair_count = 0;
+    int name_count = 0;
+    for (int i = 0; i < length; i++) exprs->instr_exprs[i] = -1;
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        for (int i = block->start; i <= block->end; i++) {
+            IRInstr* instr = program->instructions[i];
+            if (!is_available_candidate(instr)) continue;
+            char* key = expression_key(instr);
+            int expr = name_map_get(keys, key);
+            if (expr < 0) {
+                expr = exprs->expr_count++;
+                name_map_put(keys, key, expr);
+                home_block[expr] = b;
+                const char* operands[2] = { instr->src1, instr->src2 };
+                for (int j = 0; j < 2; j++) {
+                    if (is_immediate_operand(operands[j])) continue;
+                    if (j == 1 && strcmp(operands[0], operands[1]) == 0) continue;
+                    int id = name_map_get(exprs->names, operands[j]);
+                    if (id < 0) {
+                        id = name_count++;
+                        name_map_put(exprs->names, operands[j], id);
+                    }
+                    operand_ids[pair_count] = id;
+                    operand_exprs[pair_count++] = expr;
+                }
+            } else if (home_block[expr] != b) {
+                home_block[expr] = -1;
+            }
+            free(key);
+            exprs->instr_exprs[i - cfg->start] = expr;
+        }
+    }
+    free_name_map(keys);
+
+    // An expression computed in one block only is never available on
+    // entry to it, since the first pass through it has not computed it,
+    // and it is not worth knowing anywhere else.  Expressions computed in
+    // several blocks get the low bits, the ones the per-block sets hold;
+    // the rest are found by the scan within their block.
+    int* bit_of = malloc(sizeof(int) * (exprs->expr_count + 1));
+    int bit_count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) exprs->global_count = bit_count;
+        for (int e = 0; e < exprs->expr_count; e++) {
+            if ((home_block[e] == -1) == (pass == 0)) bit_of[e] = bit_count++;
+        }
+    }
+    free(home_block);
+    for (int i = 0; i < length; i++) {
+        if (exprs->instr_exprs[i] >= 0) exprs->instr_exprs[i] = bit_of[exprs->instr_exprs[i]];
+    }
+    for (int i = 0; i < pair_count; i++) {
+        operand_exprs[i] = bit_of[operand_exprs[i]];
+    }
+    free(bit_of);
+    exprs->words = exprs->expr_count > 0 ? (exprs->expr_count + 63) / 64 : 1;
+    build_index_lists(name_count, operand_ids, operand_exprs, pair_count,
+                      &exprs->name_expr_start, &exprs->name_exprs);
+    free(operand_ids);
+    free(operand_exprs);
+
+    // Evaluating an expression generates it; writing one of its
+    // operands kills it until it is evaluated again
+    DataflowProblem* problem = create_dataflow_problem(cfg, DATAFLOW_FORWARD,
+                                                       DATAFLOW_INTERSECTION,
+                                                       exprs->global_count);
+    exprs->problem = problem;
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        uint64_t* gen = dataflow_set(problem, problem->gen, block);
+        uint64_t* kill = dataflow_set(problem, problem->kill, block);
+        for (int i = block->start; i <= block->end; i++) {
+            IRInstr* instr = program->instructions[i];
+            int bit = exprs->instr_exprs[i - cfg->start];
+            if (bit >= 0 && bit < exprs->global_count) {
+                bitset_set(gen, bit);
+                bitset_clear(kill, bit);
+            }
+            if (!writes_dest(instr)) continue;
+            int id = name_map_get(exprs->names, instr->dest);
+            if (id < 0) continue;
+            for (int j = exprs->name_expr_start[id]; j < exprs->name_expr_start[id + 1]; j++) {
+                int killed = exprs->name_exprs[j];
+                if (killed >= exprs->global_count) continue;
+                bitset_clear(gen, killed);
+                bitset_set(kill, killed);
+            }
+        }
+    }
+    solve_dataflow(problem, cfg);
+    return exprs;
+}
+
+// Sets set, of exprs->words words, to the expressions available at the
+// start of block
+void available_exprs_at_entry(AvailableExprs* exprs, BasicBlock* block, uint64_t* set) {
+    copy_entry_set(exprs->problem, block, set, exprs->words);
+}
+
+// Updates set, the expressions available before instruction index, to
+// those available after it
+void apply_available_expr(AvailableExprs* exprs, uint64_t* set, IRProgram* program, int index) {
+    IRInstr* instr = program->instructions[index];
+    int bit = exprs->instr_exprs[index - exprs->start];
+    if (bit >= 0) bitset_set(set, bit);
+    if (!writes_dest(instr)) return;
+    int id = name_map_get(exprs->names, instr->dest);
+    if (id < 0) return;
+    for (int j = exprs->name_expr_start[id]; j < exprs->name_expr_start[id + 1]; j++) {
+        bitset_clear(set, exprs->name_exprs[j]);
+    }
+}
+
+void free_available_exprs(AvailableExprs* exprs) {
+    free(exprs->instr_exprs);
+    free_name_map(exprs->names);
+    free(exprs->name_expr_start);
+    free(exprs->name_exprs);
+    free_dataflow_problem(exprs->problem);
+    free(exprs);
+}
@@ -0,0 +1,111 @@
+#ifndef DATAFLOW_H
+#define DATAFLOW_H
+
+#include "cfg.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    DATAFLOW_FORWARD,
+    DATAFLOW_BACKWARD
+} DataflowDirection;
+
+typedef enum {
+    DATAFLOW_UNION,         // May problems: a fact holds on some path
+    DATAFLOW_INTERSECTION   // Must problems: a fact holds on every path
+} DataflowMeet;
+
+// Bit-vector problem over the blocks of one CFG.  Every block has a gen,
+// kill, in and out set of words 64-bit words, stored back to back and
+// indexed by block index.  The transfer function of a block is
+// gen | (x & ~kill), applied to in going forward or out going backward.
+typedef struct {
+    DataflowDirection direction;
+    DataflowMeet meet;
+    int bit_count;
+    int words;
+    int block_count;
+    uint64_t* gen;
+    uint64_t* kill;
+    uint64_t* in;
+    uint64_t* out;
+} DataflowProblem;
+
+static inline void bitset_set(uint64_t* set, int bit) {
+    set[bit >> 6] |= (uint64_t)1 << (bit & 63);
+}
+
+static inline void bitset_clear(uint64_t* set, int bit) {
+    set[bit >> 6] &= ~((uint64_t)1 << (bit & 63));
+}
+
+static inline bool bitset_test(const uint64_t* set, int bit) {
+    return (set[bit >> 6] >> (bit & 63)) & 1;
+}
+
+DataflowProblem* create_dataflow_problem(CFG* cfg, DataflowDirection direction,
+                                         DataflowMeet meet, int bit_count);
+uint64_t* dataflow_set(DataflowProblem* problem, uint64_t* sets, BasicBlock* block);
+void solve_dataflow(DataflowProblem* problem, CFG* cfg);
+void free_dataflow_problem(DataflowProblem* problem);
+int read_operands(IRInstr* instr, const char** names);
+
+// Variables live on entry to and exit from each block.  Only names
+// read before being written in some block get a bit; no other name can
+// be live across a block boundary.
+typedef struct {
+    NameMap* names;             // Variable name -> bit
+    DataflowProblem* problem;
+} Liveness;
+
+Liveness* compute_liveness(IRProgram* program, CFG* cfg);
+bool is_live_in_block(Liveness* liveness, BasicBlock* block, const char* name);
+bool is_live_out_block(Liveness* liveness, BasicBlock* block, const char* name);
+void free_liveness(Liveness* liveness);
+
+// Definitions reaching each block; one bit per defining instruction.
+// Only the last definition of an upward-exposed name in a block can
+// reach another block, so only those get bits in the per-block sets;
+// the rest are numbered after them and tracked by the scan in a block.
+typedef struct {
+    int start;                  // Function start the indices below are relative to
+    int* def_instrs;            // Bit -> instruction index
+    int* def_names;             // Bit -> id of the name it defines
+    int def_count;
+    int global_count;           // Bits below this are in the per-block sets
+    int words;                  // Words in a set covering every definition
+    int* instr_defs;            // Instruction offset from start -> bit, or -1
+    NameMap* names;             // Defined name -> id
+    int* name_def_start;        // Bits of name id n are name_defs[start[n] .. start[n + 1])
+    int* name_defs;
+    DataflowProblem* problem;
+} ReachingDefs;
+
+ReachingDefs* compute_reaching_defs(IRProgram* program, CFG* cfg);
+void reaching_defs_at_entry(ReachingDefs* defs, BasicBlock* block, uint64_t* set);
+void apply_reaching_def(ReachingDefs* defs, uint64_t* set, int index);
+int find_name_defs(ReachingDefs* defs, const char* name, int** bits);
+void free_reaching_defs(ReachingDefs* defs);
+
+// Pure expressions computed on every path to each block with no operand
+// redefined since; one bit per distinct operation and operand pair.
+// Only expressions computed in more than one block get bits in the
+// per-block sets; the rest are numbered after them.
+typedef struct {
+    int start;
+    int* instr_exprs;           // Instruction offset from start -> bit, or -1
+    int expr_count;
+    int global_count;           // Bits below this are in the per-block sets
+    int words;                  // Words in a set covering every expression
+    NameMap* names;             // Operand name -> id
+    int* name_expr_start;       // Expressions reading name id n
+    int* name_exprs;
+    DataflowProblem* problem;
+} AvailableExprs;
+
+AvailableExprs* compute_available_exprs(IRProgram* program, CFG* cfg);
+void available_exprs_at_entry(AvailableExprs* exprs, BasicBlock* block, uint64_t* set);
+void apply_available_expr(AvailableExprs* exprs, uint64_t* set, IRProgram* program, int index);
+void free_available_exprs(AvailableExprs* exprs);
+
+#endif
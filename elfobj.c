@@ -0,0 +1,145 @@
+#include "elfobj.h"
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Section header indices, in file order
+enum {
+    SECTION_NULL,
+    SECTION_TEXT,
+    SECTION_RELA_TEXT,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_SHSTRTAB,
+    SECTION_NOTE_GNU_STACK,
+    SECTION_COUNT
+};
+
+static const char* section_names[SECTION_COUNT] = {
+    "", ".text", ".rela.text", ".symtab", ".strtab", ".shstrtab", ".note.GNU-stack"
+};
+
+static void align_output(EmitBuffer* output, size_t alignment) {
+    while (output->length % alignment) emit_char(output, 0);
+}
+
+// Appends name with its terminator and returns where it starts
+static Elf64_Word add_string(EmitBuffer* table, const char* name) {
+    Elf64_Word offset = (Elf64_Word)table->length;
+    emit_bytes(table, name, strlen(name) + 1);
+    return offset;
+}
+
+static void add_symbol(EmitBuffer* symtab, EmitBuffer* strtab, ObjectSymbol* symbol) {
+    Elf64_Sym entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.st_name = add_string(strtab, symbol->name);
+    bool defined = symbol->offset != -1;
+    entry.st_info = ELF64_ST_INFO(symbol->global ? STB_GLOBAL : STB_LOCAL,
+                                  defined ? STT_FUNC : STT_NOTYPE);
+    entry.st_shndx = defined ? SECTION_TEXT : SHN_UNDEF;
+    entry.st_value = defined ? (Elf64_Addr)symbol->offset : 0;
+    entry.st_size = (Elf64_Xword)symbol->size;
+    emit_bytes(symtab, (const char*)&entry, sizeof(entry));
+}
+
+void write_elf_object(ObjectCode* object, EmitBuffer* output) {
+    // Symbol table: the null symbol, then locals, then globals, as the
+    // format requires.  map[i] is the table index of object symbol i.
+    EmitBuffer* symtab = create_emit_buffer();
+    EmitBuffer* strtab = create_emit_buffer();
+    int* map = malloc(sizeof(int) * (object->symbol_count > 0 ? object->symbol_count : 1));
+    Elf64_Sym null_symbol;
+    memset(&null_symbol, 0, sizeof(null_symbol));
+    emit_bytes(symtab, (const char*)&null_symbol, sizeof(null_symbol));
+    emit_char(strtab, 0);
+    int next = 1;
+    int first_global = 1;   // Recorded in the .symtab header
+    for (int pass = 0; pass < 2; pass++) {
+        bool global = pass == 1;
+        if (global) first_global = next;
+        for (int i = 0; i < object->symbol_count; i++) {
+            if (object->symbols[i].global != global) continue;
+            map[i] = next++;
+            add_symbol(symtab, strtab, &object->symbols[i]);
+        }
+    }
+
+    EmitBuffer* rela = create_emit_buffer();
+    for (int i = 0; i < object->relocation_count; i++) {
+        ObjectRelocation* relocation = &object->relocations[i];
+        Elf64_Rela entry;
+        entry.r_offset = (Elf64_Addr)relocation->offset;
+        entry.r_info = ELF64_R_INFO(map[relocation->symbol], R_X86_64_PLT32);
+        entry.r_addend = relocation->addend;
+        emit_bytes(rela, (const char*)&entry, sizeof(entry));
+    }
+
+    EmitBuffer* shstrtab = create_emit_buffer();
+    Elf64_Word name_offsets[SECTION_COUNT];
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        name_offsets[i] = add_string(shstrtab, section_names[i]);
+    }
+
+    // Layout: ELF header, section contents, section header table
+    Elf64_Shdr headers[SECTION_COUNT];
+    memset(headers, 0, sizeof(headers));
+    EmitBuffer* contents[SECTION_COUNT] = {
+        NULL, object->text, rela, symtab, strtab, shstrtab, NULL
+    };
+    size_t alignments[SECTION_COUNT] = { 0, 16, 8, 8, 1, 1, 1 };
+    size_t start = output->length;
+    Elf64_Ehdr header;
+    memset(&header, 0, sizeof(header));
+    emit_bytes(output, (const char*)&header, sizeof(header));
+    for (int i = 1; i < SECTION_COUNT; i++) {
+        align_output(output, alignments[i]);
+        headers[i].sh_name = name_offsets[i];
+        headers[i].sh_offset = output->length - start;
+        headers[i].sh_addralign = alignments[i];
+        if (contents[i]) {
+            headers[i].sh_size = contents[i]->length;
+            emit_bytes(output, contents[i]->data, contents[i]->length);
+        }
+    }
+    headers[SECTION_TEXT].sh_type = SHT_PROGBITS;
+    headers[SECTION_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    headers[SECTION_RELA_TEXT].sh_type = SHT_RELA;
+    headers[SECTION_RELA_TEXT].sh_flags = SHF_INFO_LINK;
+    headers[SECTION_RELA_TEXT].sh_link = SECTION_SYMTAB;
+    headers[SECTION_RELA_TEXT].sh_info = SECTION_TEXT;
+    headers[SECTION_RELA_TEXT].sh_entsize = sizeof(Elf64_Rela);
+    headers[SECTION_SYMTAB].sh_type = SHT_SYMTAB;
+    headers[SECTION_SYMTAB].sh_link = SECTION_STRTAB;
+    headers[SECTION_SYMTAB].sh_info = first_global;
+    headers[SECTION_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+    headers[SECTION_STRTAB].sh_type = SHT_STRTAB;
+    headers[SECTION_SHSTRTAB].sh_type = SHT_STRTAB;
+    // An empty .note.GNU-stack asks the linker for a non-executable stack
+    headers[SECTION_NOTE_GNU_STACK].sh_type = SHT_PROGBITS;
+
+    align_output(output, 8);
+    size_t section_header_offset = output->length - start;
+    emit_bytes(output, (const char*)headers, sizeof(headers));
+
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_REL;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_shoff = section_header_offset;
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_shentsize = sizeof(Elf64_Shdr);
+    header.e_shnum = SECTION_COUNT;
+    header.e_shstrndx = SECTION_SHSTRTAB;
+    memcpy(output->data + start, &header, sizeof(header));
+
+    free_emit_buffer(shstrtab);
+    free_emit_buffer(rela);
+    free_emit_buffer(strtab);
+    free_emit_buffer(symtab);
+    free(map);
+}
@@ -0,0 +1,10 @@
+#ifndef ELFOBJ_H
+#define ELFOBJ_H
+
+#include "encoder.h"
+
+// Serializes an encoded object as an ELF64 x86-64 relocatable file with
+// .text, its symbols and its relocations
+void write_elf_object(ObjectCode* object, EmitBuffer* output);
+
+#endif
@@ -0,0 +1,86 @@
+#include "emitbuf.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INITIAL_CAPACITY 4096
+
+EmitBuffer* create_emit_buffer(void) {
+    EmitBuffer* buffer = malloc(sizeof(EmitBuffer));
+    buffer->data = malloc(INITIAL_CAPACITY);
+    buffer->length = 0;
+    buffer->capacity = INITIAL_CAPACITY;
+    buffer->flushed = 0;
+    return buffer;
+}
+
+static void reserve(EmitBuffer* buffer, size_t count) {
+    if (buffer->length + count <= buffer->capacity) return;
+    while (buffer->length + count > buffer->capacity) {
+        buffer->capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, buffer->capacity);
+}
+
+void emit_bytes(EmitBuffer* buffer, const char* bytes, size_t count) {
+    reserve(buffer, count);
+    memcpy(buffer->data + buffer->length, bytes, count);
+    buffer->length += count;
+}
+
+void emit_string(EmitBuffer* buffer, const char* string) {
+    emit_bytes(buffer, string, strlen(string));
+}
+
+void emit_char(EmitBuffer* buffer, char c) {
+    reserve(buffer, 1);
+    buffer->data[buffer->length++] = c;
+}
+
+void emit_decimal(EmitBuffer* buffer, long value) {
+    // Digits are produced backwards; the magnitude is taken unsigned so
+    // LONG_MIN works
+    char digits[24];
+    int count = 0;
+    unsigned long magnitude = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    do {
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) digits[sizeof(digits) - 1 - count++] = '-';
+    emit_bytes(buffer, digits + sizeof(digits) - count, count);
+}
+
+void emit_vformat(EmitBuffer* buffer, const char* format, va_list args) {
+    // Formats into the spare capacity, growing and retrying if it is short
+    va_list retry;
+    va_copy(retry, args);
+    size_t spare = buffer->capacity - buffer->length;
+    int count = vsnprintf(buffer->data + buffer->length, spare, format, args);
+    if (count >= 0 && (size_t)count >= spare) {
+        reserve(buffer, count + 1);
+        vsnprintf(buffer->data + buffer->length, count + 1, format, retry);
+    }
+    va_end(retry);
+    if (count > 0) buffer->length += count;
+}
+
+bool flush_emit_buffer(EmitBuffer* buffer, int fd) {
+    while (buffer->flushed < buffer->length) {
+        ssize_t written = write(fd, buffer->data + buffer->flushed,
+                                buffer->length - buffer->flushed);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buffer->flushed += written;
+    }
+    return true;
+}
+
+void free_emit_buffer(EmitBuffer* buffer) {
+    free(buffer->data);
+    free(buffer);
+}
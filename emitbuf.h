@@ -0,0 +1,30 @@
+#ifndef EMITBUF_H
+#define EMITBUF_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Growable buffer the backend writes assembly into.  It keeps everything
+// emitted, so the driver can show it, and remembers how much has reached
+// the output file.
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    size_t flushed;     // Bytes of data already written out
+} EmitBuffer;
+
+EmitBuffer* create_emit_buffer(void);
+void emit_bytes(EmitBuffer* buffer, const char* bytes, size_t count);
+void emit_string(EmitBuffer* buffer, const char* string);
+void emit_char(EmitBuffer* buffer, char c);
+void emit_decimal(EmitBuffer* buffer, long value);
+// printf-style, for text that is not built from machine operands
+void emit_vformat(EmitBuffer* buffer, const char* format, va_list args);
+// Writes what has not been written yet to fd, in one write when the
+// kernel takes it all
+bool flush_emit_buffer(EmitBuffer* buffer, int fd);
+void free_emit_buffer(EmitBuffer* buffer);
+
+#endif
@@ -0,0 +1,467 @@
+#include "encoder.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_INSTR_LENGTH 16
+
+#define REX 0x40
+#define REX_W 0x08
+#define REX_R 0x04
+#define REX_X 0x02
+#define REX_B 0x01
+
+// Bytes of one instruction
+typedef struct {
+    uint8_t bytes[MAX_INSTR_LENGTH];
+    int length;
+} Encoding;
+
+static void encoding_error(const char* message) {
+    fprintf(stderr, "Code generation error: %s\n", message);
+    exit(1);
+}
+
+static bool fits_int8(long value) {
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static bool fits_int32(long value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static void put_byte(Encoding* e, uint8_t byte) {
+    e->bytes[e->length++] = byte;
+}
+
+static void put_int32(Encoding* e, long value) {
+    for (int i = 0; i < 4; i++) {
+        put_byte(e, (uint8_t)((unsigned long)value >> (8 * i)));
+    }
+}
+
+static void put_int64(Encoding* e, long value) {
+    for (int i = 0; i < 8; i++) {
+        put_byte(e, (uint8_t)((unsigned long)value >> (8 * i)));
+    }
+}
+
+static void put_immediate(Encoding* e, long value, bool byte) {
+    if (byte) {
+        put_byte(e, (uint8_t)value);
+    } else {
+        if (!fits_int32(value)) encoding_error("immediate does not fit in 32 bits");
+        put_int32(e, value);
+    }
+}
+
+// Emits [REX] opcode ModRM [SIB] [displacement] with reg in the ModRM reg
+// field and rm a register or memory operand.  reg is a register or an
+// opcode extension.
+static void put_modrm(Encoding* e, bool wide, const uint8_t* opcode, int opcode_length,
+                      int reg, MachineOperand rm) {
+    int rex = wide ? REX_W : 0;
+    if (reg >= 8) rex |= REX_R;
+    if (rm.kind == MOP_REG) {
+        if (rm.reg >= 8) rex |= REX_B;
+        // Without a REX prefix these encode %ah..%bh instead
+        bool byte_needs_rex = rm.byte && rm.reg >= REG_RSP && rm.reg <= REG_RDI;
+        if (rex || byte_needs_rex) put_byte(e, REX | rex);
+        for (int i = 0; i < opcode_length; i++) put_byte(e, opcode[i]);
+        put_byte(e, 0xc0 | (reg & 7) << 3 | (rm.reg & 7));
+        return;
+    }
+    if (rm.kind != MOP_MEM) encoding_error("operand is not a register or memory");
+
+    int base = rm.reg;
+    int index = rm.index;
+    long displacement = rm.value;
+    if (!fits_int32(displacement)) encoding_error("displacement does not fit in 32 bits");
+    if (index == REG_RSP) encoding_error("%rsp cannot be an index register");
+    if (base >= 8) rex |= REX_B;
+    if (index >= 8) rex |= REX_X;
+    if (rex) put_byte(e, REX | rex);
+    for (int i = 0; i < opcode_length; i++) put_byte(e, opcode[i]);
+
+    if (base == NO_REGISTER) {
+        // Absolute or index-only: SIB with no base and a 32-bit displacement
+        int scale_bits = index == NO_REGISTER ? 0 : __builtin_ctz(rm.scale);
+        int index_bits = index == NO_REGISTER ? 4 : index & 7;
+        put_byte(e, (reg & 7) << 3 | 4);
+        put_byte(e, scale_bits << 6 | index_bits << 3 | 5);
+        put_int32(e, displacement);
+        return;
+    }
+
+    // %rbp and %r13 as a base with mod 00 mean something else, so they
+    // always carry a displacement
+    int mod;
+    if (displacement == 0 && (base & 7) != REG_RBP) {
+        mod = 0;
+    } else if (fits_int8(displacement)) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+    // %rsp and %r12 as a base are only reachable through a SIB byte
+    if (index != NO_REGISTER || (base & 7) == REG_RSP) {
+        int scale_bits = index == NO_REGISTER ? 0 : __builtin_ctz(rm.scale);
+        int index_bits = index == NO_REGISTER ? 4 : index & 7;
+        put_byte(e, mod << 6 | (reg & 7) << 3 | 4);
+        put_byte(e, scale_bits << 6 | index_bits << 3 | (base & 7));
+    } else {
+        put_byte(e, mod << 6 | (reg & 7) << 3 | (base & 7));
+    }
+    if (mod == 1) put_byte(e, (uint8_t)displacement);
+    if (mod == 2) put_int32(e, displacement);
+}
+
+static void put_modrm1(Encoding* e, bool wide, uint8_t opcode, int reg, MachineOperand rm) {
+    put_modrm(e, wide, &opcode, 1, reg, rm);
+}
+
+static void put_modrm2(Encoding* e, bool wide, uint8_t opcode, int reg, MachineOperand rm) {
+    uint8_t bytes[2] = { 0x0f, opcode };
+    put_modrm(e, wide, bytes, 2, reg, rm);
+}
+
+// Opcodes and /digit extensions of the ALU instructions
+typedef struct {
+    uint8_t store;      // op reg, rm
+    uint8_t load;       // op rm, reg
+    int extension;      // op imm, rm
+} AluOpcode;
+
+static const AluOpcode add_opcode = { 0x01, 0x03, 0 };
+static const AluOpcode sub_opcode = { 0x29, 0x2b, 5 };
+static const AluOpcode cmp_opcode = { 0x39, 0x3b, 7 };
+
+static void encode_alu(Encoding* e, AluOpcode opcode, MachineOperand src, MachineOperand dest) {
+    if (src.kind == MOP_IMM) {
+        bool byte = fits_int8(src.value);
+        put_modrm1(e, true, byte ? 0x83 : 0x81, opcode.extension, dest);
+        put_immediate(e, src.value, byte);
+    } else if (src.kind == MOP_REG) {
+        put_modrm1(e, true, opcode.store, src.reg, dest);
+    } else if (dest.kind == MOP_REG) {
+        put_modrm1(e, true, opcode.load, dest.reg, src);
+    } else {
+        encoding_error("instruction has two memory operands");
+    }
+}
+
+static void encode_mov(Encoding* e, MachineOperand src, MachineOperand dest) {
+    if (src.kind == MOP_IMM) {
+        if (fits_int32(src.value)) {
+            put_modrm1(e, true, 0xc7, 0, dest);
+            put_int32(e, src.value);
+        } else if (dest.kind == MOP_REG) {
+            put_byte(e, REX | REX_W | (dest.reg >= 8 ? REX_B : 0));
+            put_byte(e, 0xb8 + (dest.reg & 7));
+            put_int64(e, src.value);
+        } else {
+            encoding_error("immediate does not fit in 32 bits");
+        }
+    } else {
+        encode_alu(e, (AluOpcode){ 0x89, 0x8b, -1 }, src, dest);
+    }
+}
+
+static void encode_push_pop(Encoding* e, uint8_t base_opcode, MachineOperand operand) {
+    if (operand.reg >= 8) put_byte(e, REX | REX_B);
+    put_byte(e, base_opcode + (operand.reg & 7));
+}
+
+// Encodes everything but jumps and calls, whose bytes depend on layout
+static void encode_instr(Encoding* e, const MachineInstr* instr) {
+    const MachineOperand* operands = instr->operands;
+    e->length = 0;
+    switch (instr->opcode) {
+        case MI_LABEL:
+            break;
+        case MI_MOV:
+            encode_mov(e, operands[0], operands[1]);
+            break;
+        case MI_MOVZB:
+            put_modrm2(e, true, 0xb6, operands[1].reg, operands[0]);
+            break;
+        case MI_LEA:
+            put_modrm1(e, true, 0x8d, operands[1].reg, operands[0]);
+            break;
+        case MI_ADD:
+            encode_alu(e, add_opcode, operands[0], operands[1]);
+            break;
+        case MI_SUB:
+            encode_alu(e, sub_opcode, operands[0], operands[1]);
+            break;
+        case MI_CMP:
+            encode_alu(e, cmp_opcode, operands[0], operands[1]);
+            break;
+        case MI_IMUL:
+            if (instr->operand_count == 3) {
+                bool byte = fits_int8(operands[0].value);
+                put_modrm1(e, true, byte ? 0x6b : 0x69, operands[2].reg, operands[1]);
+                put_immediate(e, operands[0].value, byte);
+            } else {
+                put_modrm2(e, true, 0xaf, operands[1].reg, operands[0]);
+            }
+            break;
+        case MI_IDIV:
+            put_modrm1(e, true, 0xf7, 7, operands[0]);
+            break;
+        case MI_CQTO:
+            put_byte(e, REX | REX_W);
+            put_byte(e, 0x99);
+            break;
+        case MI_SAR:
+            if (operands[0].kind == MOP_IMM && operands[0].value == 1) {
+                put_modrm1(e, true, 0xd1, 7, operands[1]);
+            } else if (operands[0].kind == MOP_IMM) {
+                put_modrm1(e, true, 0xc1, 7, operands[1]);
+                put_immediate(e, operands[0].value, true);
+            } else {
+                // Count in %cl
+                put_modrm1(e, true, 0xd3, 7, operands[1]);
+            }
+            break;
+        case MI_TEST:
+            if (operands[0].kind == MOP_IMM) {
+                put_modrm1(e, true, 0xf7, 0, operands[1]);
+                put_immediate(e, operands[0].value, false);
+            } else if (operands[0].kind == MOP_REG) {
+                put_modrm1(e, true, 0x85, operands[0].reg, operands[1]);
+            } else {
+                put_modrm1(e, true, 0x85, operands[1].reg, operands[0]);
+            }
+            break;
+        case MI_SETCC:
+            put_modrm2(e, false, 0x90 + instr->cond, 0, operands[0]);
+            break;
+        case MI_CMOV:
+            put_modrm2(e, true, 0x40 + instr->cond, operands[1].reg, operands[0]);
+            break;
+        case MI_PUSH:
+            if (operands[0].kind == MOP_REG) {
+                encode_push_pop(e, 0x50, operands[0]);
+            } else if (operands[0].kind == MOP_IMM) {
+                bool byte = fits_int8(operands[0].value);
+                put_byte(e, byte ? 0x6a : 0x68);
+                put_immediate(e, operands[0].value, byte);
+            } else {
+                put_modrm1(e, false, 0xff, 6, operands[0]);
+            }
+            break;
+        case MI_POP:
+            if (operands[0].kind == MOP_REG) {
+                encode_push_pop(e, 0x58, operands[0]);
+            } else {
+                put_modrm1(e, false, 0x8f, 0, operands[0]);
+            }
+            break;
+        case MI_RET:
+            put_byte(e, 0xc3);
+            break;
+        default:
+            encoding_error("instruction has no encoding");
+    }
+}
+
+ObjectCode* create_object_code(void) {
+    ObjectCode* object = malloc(sizeof(ObjectCode));
+    object->text = create_emit_buffer();
+    object->symbol_capacity = 16;
+    object->symbol_count = 0;
+    object->symbols = malloc(sizeof(ObjectSymbol) * object->symbol_capacity);
+    object->symbol_index = create_name_map(16);
+    object->fixup_capacity = 16;
+    object->fixup_count = 0;
+    object->fixups = malloc(sizeof(ObjectRelocation) * object->fixup_capacity);
+    object->relocation_capacity = 16;
+    object->relocation_count = 0;
+    object->relocations = malloc(sizeof(ObjectRelocation) * object->relocation_capacity);
+    return object;
+}
+
+static int get_symbol(ObjectCode* object, const char* name) {
+    int symbol = name_map_get(object->symbol_index, name);
+    if (symbol != -1) return symbol;
+    if (object->symbol_count == object->symbol_capacity) {
+        object->symbol_capacity *= 2;
+        object->symbols = realloc(object->symbols, sizeof(ObjectSymbol) * object->symbol_capacity);
+    }
+    symbol = object->symbol_count++;
+    object->symbols[symbol].name = strdup(name);
+    object->symbols[symbol].offset = -1;
+    object->symbols[symbol].size = 0;
+    object->symbols[symbol].global = false;
+    name_map_put(object->symbol_index, name, symbol);
+    return symbol;
+}
+
+void declare_global_symbol(ObjectCode* object, const char* name) {
+    object->symbols[get_symbol(object, name)].global = true;
+}
+
+static void add_relocation(ObjectRelocation** list, int* count, int* capacity,
+                           long offset, int symbol) {
+    if (*count == *capacity) {
+        *capacity *= 2;
+        *list = realloc(*list, sizeof(ObjectRelocation) * *capacity);
+    }
+    ObjectRelocation* relocation = &(*list)[(*count)++];
+    relocation->offset = offset;
+    relocation->symbol = symbol;
+    // The field is read relative to the end of the instruction
+    relocation->addend = -4;
+}
+
+// Jumps to local labels, which can take the short rel8 form
+static bool is_local_jump(const MachineInstr* instr) {
+    return (instr->opcode == MI_JMP || instr->opcode == MI_JCC) &&
+           instr->operands[0].kind == MOP_LABEL;
+}
+
+static int jump_length(const MachineInstr* instr, bool near) {
+    if (!near) return 2;
+    return instr->opcode == MI_JMP ? 5 : 6;
+}
+
+void encode_machine_function(ObjectCode* object, MachineFunction* function) {
+    int count = function->count;
+    Encoding* encodings = malloc(sizeof(Encoding) * (count > 0 ? count : 1));
+    long* offsets = malloc(sizeof(long) * (count + 1));
+    bool* near = calloc(count > 0 ? count : 1, sizeof(bool));
+    int* targets = malloc(sizeof(int) * (count > 0 ? count : 1));
+    NameMap* labels = create_name_map(16);
+
+    for (int i = 0; i < count; i++) {
+        MachineInstr* instr = &function->instrs[i];
+        if (instr->opcode == MI_LABEL && instr->operands[0].kind == MOP_LABEL) {
+            name_map_put(labels, instr->operands[0].name, i);
+        }
+        if (instr->opcode == MI_JMP || instr->opcode == MI_JCC || instr->opcode == MI_CALL) {
+            encodings[i].length = 0;
+        } else {
+            encode_instr(&encodings[i], instr);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        MachineInstr* instr = &function->instrs[i];
+        targets[i] = -1;
+        if (is_local_jump(instr)) {
+            targets[i] = name_map_get(labels, instr->operands[0].name);
+            if (targets[i] == -1) {
+                fprintf(stderr, "Code generation error: undefined label '.%s'\n",
+                        instr->operands[0].name);
+                exit(1);
+            }
+        } else if (instr->opcode == MI_JMP || instr->opcode == MI_JCC ||
+                   instr->opcode == MI_CALL) {
+            if (instr->opcode == MI_JCC) encoding_error("conditional jump to a function");
+            // rel32 to a symbol, filled in by finish_object_code
+            near[i] = true;
+            encodings[i].length = 5;
+        }
+    }
+
+    // Relaxation: every local jump starts short and grows to near once its
+    // target is out of rel8 reach.  Growing only moves targets further
+    // away, so the loop ends once no jump changes.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        offsets[0] = 0;
+        for (int i = 0; i < count; i++) {
+            int length = targets[i] != -1 ? jump_length(&function->instrs[i], near[i])
+                                          : encodings[i].length;
+            offsets[i + 1] = offsets[i] + length;
+        }
+        for (int i = 0; i < count; i++) {
+            if (targets[i] == -1 || near[i]) continue;
+            if (!fits_int8(offsets[targets[i]] - offsets[i + 1])) {
+                near[i] = true;
+                changed = true;
+            }
+        }
+    }
+
+    long base = (long)object->text->length;
+    int function_symbol = -1;
+    for (int i = 0; i < count; i++) {
+        MachineInstr* instr = &function->instrs[i];
+        Encoding* e = &encodings[i];
+        if (instr->opcode == MI_LABEL && instr->operands[0].kind == MOP_SYMBOL) {
+            int symbol = get_symbol(object, instr->operands[0].name);
+            if (object->symbols[symbol].offset != -1) {
+                fprintf(stderr, "Code generation error: function '%s' defined twice\n",
+                        instr->operands[0].name);
+                exit(1);
+            }
+            object->symbols[symbol].offset = base + offsets[i];
+            if (function_symbol == -1) function_symbol = symbol;
+        } else if (targets[i] != -1) {
+            long displacement = offsets[targets[i]] - offsets[i + 1];
+            e->length = 0;
+            if (!near[i]) {
+                put_byte(e, instr->opcode == MI_JMP ? 0xeb : 0x70 + instr->cond);
+                put_byte(e, (uint8_t)displacement);
+            } else {
+                if (instr->opcode == MI_JMP) {
+                    put_byte(e, 0xe9);
+                } else {
+                    put_byte(e, 0x0f);
+                    put_byte(e, 0x80 + instr->cond);
+                }
+                put_int32(e, displacement);
+            }
+        } else if (instr->opcode == MI_JMP || instr->opcode == MI_CALL) {
+            e->length = 0;
+            put_byte(e, instr->opcode == MI_JMP ? 0xe9 : 0xe8);
+            put_int32(e, 0);
+            add_relocation(&object->fixups, &object->fixup_count, &object->fixup_capacity,
+                           base + offsets[i] + 1,
+                           get_symbol(object, instr->operands[0].name));
+        }
+        emit_bytes(object->text, (const char*)e->bytes, e->length);
+    }
+    if (function_symbol != -1) {
+        ObjectSymbol* symbol = &object->symbols[function_symbol];
+        symbol->size = base + offsets[count] - symbol->offset;
+    }
+
+    free_name_map(labels);
+    free(targets);
+    free(near);
+    free(offsets);
+    free(encodings);
+}
+
+void finish_object_code(ObjectCode* object) {
+    for (int i = 0; i < object->fixup_count; i++) {
+        ObjectRelocation* fixup = &object->fixups[i];
+        ObjectSymbol* symbol = &object->symbols[fixup->symbol];
+        if (symbol->offset == -1) {
+            symbol->global = true;
+            add_relocation(&object->relocations, &object->relocation_count,
+                           &object->relocation_capacity, fixup->offset, fixup->symbol);
+            continue;
+        }
+        long displacement = symbol->offset + fixup->addend - fixup->offset;
+        for (int j = 0; j < 4; j++) {
+            object->text->data[fixup->offset + j] = (char)((unsigned long)displacement >> (8 * j));
+        }
+    }
+    object->fixup_count = 0;
+}
+
+void free_object_code(ObjectCode* object) {
+    for (int i = 0; i < object->symbol_count; i++) {
+        free(object->symbols[i].name);
+    }
+    free(object->symbols);
+    free_name_map(object->symbol_index);
+    free(object->fixups);
+    free(object->relocations);
+    free_emit_buffer(object->text);
+    free(object);
+}
@@ -0,0 +1,47 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "mir.h"
+#include "emitbuf.h"
+
+// Integrated assembler: encodes machine functions straight into x86-64
+// machine code for an object file, with no assembly text in between
+
+typedef struct {
+    char* name;
+    long offset;        // In .text, or -1 while undefined
+    long size;
+    bool global;
+} ObjectSymbol;
+
+// A 32-bit PC-relative field in .text the linker fills in
+typedef struct {
+    long offset;
+    int symbol;
+    long addend;
+} ObjectRelocation;
+
+typedef struct {
+    EmitBuffer* text;
+    ObjectSymbol* symbols;
+    int symbol_count;
+    int symbol_capacity;
+    NameMap* symbol_index;
+    // Calls and jumps to functions, resolved once every function is in
+    ObjectRelocation* fixups;
+    int fixup_count;
+    int fixup_capacity;
+    ObjectRelocation* relocations;
+    int relocation_count;
+    int relocation_capacity;
+} ObjectCode;
+
+ObjectCode* create_object_code(void);
+void declare_global_symbol(ObjectCode* object, const char* name);
+void encode_machine_function(ObjectCode* object, MachineFunction* function);
+// Resolves calls to functions defined in the object; the rest become
+// relocations
+void finish_object_code(ObjectCode* object);
+void free_object_code(ObjectCode* object);
+
+#endif
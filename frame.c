@@ -0,0 +1,156 @@
+#include "frame.h"
+#include <stdlib.h>
+
+void add_live_range(StackObject* object, int from, int to) {
+    if (object->range_count == object->capacity) {
+        object->capacity = object->capacity * 2 + 2;
+        object->ranges = realloc(object->ranges, sizeof(LiveRange) * object->capacity);
+    }
+    object->ranges[object->range_count].from = from;
+    object->ranges[object->range_count].to = to;
+    object->range_count++;
+}
+
+static bool objects_overlap(StackObject* a, StackObject* b) {
+    for (int i = 0; i < a->range_count; i++) {
+        for (int j = 0; j < b->range_count; j++) {
+            if (a->ranges[i].from < b->ranges[j].to && b->ranges[j].from < a->ranges[i].to) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int first_position(StackObject* object) {
+    int first = object->range_count > 0 ? object->ranges[0].from : 0;
+    for (int i = 1; i < object->range_count; i++) {
+        if (object->ranges[i].from < first) first = object->ranges[i].from;
+    }
+    return first;
+}
+
+// Colours the objects with slots, in order of where they start, giving
+// each the lowest slot whose other objects are never live alongside it.
+// Returns the number of slots used.
+int assign_stack_slots(StackObject* objects, int count) {
+    int* order = malloc(sizeof(int) * (count + 1));
+    int* firsts = malloc(sizeof(int) * (count + 1));
+    for (int i = 0; i < count; i++) {
+        firsts[i] = first_position(&objects[i]);
+        int j = i;
+        while (j > 0 && firsts[order[j - 1]] > firsts[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    // Objects given each slot so far
+    int** members = malloc(sizeof(int*) * (count + 1));
+    int* member_counts = calloc(count + 1, sizeof(int));
+    int slot_count = 0;
+    for (int i = 0; i < count; i++) {
+        StackObject* object = &objects[order[i]];
+        int slot = 0;
+        for (; slot < slot_count; slot++) {
+            bool clash = false;
+            for (int m = 0; m < member_counts[slot] && !clash; m++) {
+                clash = objects_overlap(object, &objects[members[slot][m]]);
+            }
+            if (!clash) break;
+        }
+        if (slot == slot_count) members[slot_count++] = malloc(sizeof(int) * count);
+        members[slot][member_counts[slot]++] = order[i];
+        object->slot = slot;
+    }
+
+    for (int s = 0; s < slot_count; s++) {
+        free(members[s]);
+    }
+    free(members);
+    free(member_counts);
+    free(order);
+    free(firsts);
+    return slot_count;
+}
+
+// Bytes to reserve below the saved registers for slot_count 8-byte
+// slots, so that %rsp stays 16-byte aligned after the prologue
+int frame_size(int slot_count, int saved_count) {
+    int size = 8 * slot_count;
+    if ((8 * saved_count + size) % 16 != 0) size += 8;
+    return size;
+}
+
+// Bytes a function that makes no calls must reserve for slot_count
+// slots.  The red zone holds the first sixteen, and nothing it calls
+// needs %rsp aligned.
+int leaf_frame_size(int slot_count) {
+    int size = 8 * slot_count - RED_ZONE_SIZE;
+    return size > 0 ? size : 0;
+}
+
+// Whether everything reachable from save stays among the blocks it
+// dominates without coming back to save itself
+static bool is_closed_region(CFG* cfg, BasicBlock* save) {
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        if (!dominates(cfg, save, block)) continue;
+        for (int s = 0; s < block->successor_count; s++) {
+            BasicBlock* successor = block->successors[s];
+            if (successor == save || !dominates(cfg, save, successor)) return false;
+        }
+    }
+    return true;
+}
+
+// The nearest block strictly dominating block
+static BasicBlock* immediate_dominator(CFG* cfg, BasicBlock* block) {
+    BasicBlock* parent = NULL;
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* candidate = cfg->blocks[b];
+        if (candidate == block || !dominates(cfg, candidate, block)) continue;
+        if (!parent || cfg->dom_pre[candidate->index] > cfg->dom_pre[parent->index]) {
+            parent = candidate;
+        }
+    }
+    return parent;
+}
+
+// Shrink-wrapping: the block to set up the frame in, given which blocks
+// use it.  It dominates all of them, and no path from it leaves the
+// blocks it dominates or loops back to it, so the frame stays up until
+// one of the exits below it.  NULL when no block uses the frame.
+BasicBlock* find_save_block(CFG* cfg, const bool* needs_frame) {
+    bool any = false;
+    for (int b = 0; b < cfg->block_count; b++) {
+        if (needs_frame[b] && cfg->blocks[b]->is_reachable) any = true;
+    }
+    if (!any) return NULL;
+
+    // The common dominators form a chain; take the deepest
+    BasicBlock* save = NULL;
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* candidate = cfg->blocks[b];
+        if (!candidate->is_reachable) continue;
+        bool covers = true;
+        for (int n = 0; n < cfg->block_count && covers; n++) {
+            if (needs_frame[n] && cfg->blocks[n]->is_reachable) {
+                covers = dominates(cfg, candidate, cfg->blocks[n]);
+            }
+        }
+        if (covers && (!save || cfg->dom_pre[b] > cfg->dom_pre[save->index])) save = candidate;
+    }
+    while (save != cfg->blocks[0] && !is_closed_region(cfg, save)) {
+        save = immediate_dominator(cfg, save);
+    }
+    return save;
+}
+
+void free_stack_objects(StackObject* objects, int count) {
+    for (int i = 0; i < count; i++) {
+        free(objects[i].ranges);
+    }
+    free(objects);
+}
@@ -0,0 +1,31 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "cfg.h"
+#include <stdbool.h>
+
+// Bytes below %rsp that signal handlers leave alone (System V)
+#define RED_ZONE_SIZE 128
+
+// Positions [from, to) over which a stack object must keep its value
+typedef struct {
+    int from;
+    int to;
+} LiveRange;
+
+// A variable or spilled value that needs a stack slot
+typedef struct {
+    LiveRange* ranges;
+    int range_count;
+    int capacity;
+    int slot;               // Set by assign_stack_slots
+} StackObject;
+
+void add_live_range(StackObject* object, int from, int to);
+int assign_stack_slots(StackObject* objects, int count);
+int frame_size(int slot_count, int saved_count);
+int leaf_frame_size(int slot_count);
+BasicBlock* find_save_block(CFG* cfg, const bool* needs_frame);
+void free_stack_objects(StackObject* objects, int count);
+
+#endif
@@ -7,6 +7,8 @@ IRProgram* create_ir_program(void) {
     program->count = 0;
     program->temp_count = 0;
     program->label_count = 0;
+    program->blocks = NULL;
+    program->block_count = 0;
     program->instructions = malloc(sizeof(IRInstr*) * program->capacity);
     return program;
 }
@@ -35,17 +37,260 @@ void add_instruction(IRProgram* program, IRInstr* instr) {
     program->instructions[program->count++] = instr;
 }
 
-static IRInstr* create_instr(IROpcode op, const char* dest, const char* src1, 
-                            const char* src2) {
+IRInstr* create_instr(IROpcode op, const char* dest, const char* src1, 
+                     const char* src2) {
     IRInstr* instr = malloc(sizeof(IRInstr));
     instr->op = op;
     instr->dest = dest ? strdup(dest) : NULL;
     instr->src1 = src1 ? strdup(src1) : NULL;
     instr->src2 = src2 ? strdup(src2) : NULL;
     instr->label = NULL;
+    instr->value = 0;
     return instr;
 }
 
+IRInstr* create_label_instr(const char* name, int number) {
+    IRInstr* instr = create_instr(IR_LABEL, NULL, NULL, NULL);
+    instr->label = malloc(sizeof(IRLabel));
+    instr->label->name = strdup(name);
+    instr->label->number = number;
+    return instr;
+}
+
+IRInstr* create_jump_instr(IROpcode op, const char* cond, const char* target) {
+    IRInstr* instr = create_instr(op, NULL, cond, NULL);
+    instr->label = malloc(sizeof(IRLabel));
+    instr->label->name = strdup(target);
+    instr->label->number = 0;
+    return instr;
+}
+
+IRInstr* copy_instruction(IRInstr* instr) {
+    IRInstr* copy = create_instr(instr->op, instr->dest, instr->src1, instr->src2);
+    copy->value = instr->value;
+    if (instr->label) {
+        copy->label = malloc(sizeof(IRLabel));
+        copy->label->name = strdup(instr->label->name);
+        copy->label->number = instr->label->number;
+    }
+    return copy;
+}
+
+void free_instruction(IRInstr* instr) {
+    if (!instr) return;
+    free(instr->dest);
+    free(instr->src1);
+    free(instr->src2);
+    if (instr->label) {
+        free(instr->label->name);
+        free(instr->label);
+    }
+    free(instr);
+}
+
+// Insert n instructions before position index; the program takes ownership
+void insert_instructions(IRProgram* program, int index, IRInstr** instrs, int n) {
+    if (n <= 0) return;
+    if (program->count + n > program->capacity) {
+        while (program->count + n > program->capacity) {
+            program->capacity *= 2;
+        }
+        program->instructions = realloc(program->instructions,
+                                      sizeof(IRInstr*) * program->capacity);
+    }
+    memmove(&program->instructions[index + n], &program->instructions[index],
+            sizeof(IRInstr*) * (program->count - index));
+    memcpy(&program->instructions[index], instrs, sizeof(IRInstr*) * n);
+    program->count += n;
+}
+
+// Free and remove n instructions starting at position index
+void remove_instructions(IRProgram* program, int index, int n) {
+    if (n <= 0) return;
+    for (int i = index; i < index + n; i++) {
+        free_instruction(program->instructions[i]);
+    }
+    memmove(&program->instructions[index], &program->instructions[index + n],
+            sizeof(IRInstr*) * (program->count - index - n));
+    program->count -= n;
+}
+
+// Remove the instruction at index without freeing it
+IRInstr* detach_instruction(IRProgram* program, int index) {
+    IRInstr* instr = program->instructions[index];
+    memmove(&program->instructions[index], &program->instructions[index + 1],
+            sizeof(IRInstr*) * (program->count - index - 1));
+    program->count--;
+    return instr;
+}
+
+bool is_function_label(IRInstr* instr) {
+    return instr->op == IR_LABEL && instr->label->number == -1;
+}
+
+// Returns one past the last instruction of the function starting at start
+int find_function_end(IRProgram* program, int start) {
+    int i = start + 1;
+    while (i < program->count && !is_function_label(program->instructions[i])) {
+        i++;
+    }
+    return i;
+}
+
+bool is_immediate_operand(const char* operand) {
+    if (!operand) return false;
+    if (*operand == '-') operand++;
+    return isdigit((unsigned char)*operand);
+}
+
+bool is_branch(IRInstr* instr) {
+    return instr->op == IR_JUMP || instr->op == IR_JUMPZ || instr->op == IR_JUMPNZ ||
+           instr->op == IR_JUMP_COMPARE;
+}
+
+// True if control leaves the function after the instruction
+bool is_exit(IRInstr* instr) {
+    return instr->op == IR_RETURN || instr->op == IR_TAIL_CALL;
+}
+
+// True if the instruction assigns a value to its dest operand
+bool writes_dest(IRInstr* instr) {
+    switch (instr->op) {
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV: case IR_SHR:
+        case IR_ASSIGN: case IR_CALL: case IR_COMPARE: case IR_LOAD:
+        case IR_PARAM: case IR_CMOVZ: case IR_CMOVNZ:
+            return instr->dest != NULL;
+        default:
+            return false;
+    }
+}
+
+// True if the instruction does anything besides writing its dest operand
+bool has_side_effects(IRInstr* instr) {
+    switch (instr->op) {
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_SHR:
+        case IR_ASSIGN: case IR_COMPARE:
+            return false;
+        default:
+            // Division can trap, so it is never treated as pure
+            return true;
+    }
+}
+
+// True if name is one of the values the instruction reads
+bool reads_operand(IRInstr* instr, const char* name) {
+    if (instr->src1 && strcmp(instr->src1, name) == 0) return true;
+    if (instr->src2 && strcmp(instr->src2, name) == 0) return true;
+    // A store writes through its dest operand rather than to it, and a
+    // conditional move keeps it when the move is not made
+    return (instr->op == IR_STORE || instr->op == IR_CMOVZ || instr->op == IR_CMOVNZ) &&
+           instr->dest && strcmp(instr->dest, name) == 0;
+}
+
+// Relation that holds for (right, left) when relation holds for (left, right)
+int swap_relation(int relation) {
+    switch (relation) {
+        case TOKEN_LESS: return TOKEN_GREATER;
+        case TOKEN_GREATER: return TOKEN_LESS;
+        case TOKEN_LESS_EQUALS: return TOKEN_GREATER_EQUALS;
+        case TOKEN_GREATER_EQUALS: return TOKEN_LESS_EQUALS;
+        default: return relation;
+    }
+}
+
+int negate_relation(int relation) {
+    switch (relation) {
+        case TOKEN_EQUALS: return TOKEN_NOT_EQUALS;
+        case TOKEN_NOT_EQUALS: return TOKEN_EQUALS;
+        case TOKEN_LESS: return TOKEN_GREATER_EQUALS;
+        case TOKEN_GREATER: return TOKEN_LESS_EQUALS;
+        case TOKEN_LESS_EQUALS: return TOKEN_GREATER;
+        case TOKEN_GREATER_EQUALS: return TOKEN_LESS;
+        default: return relation;
+    }
+}
+
+bool evaluate_relation(int relation, long left, long right) {
+    switch (relation) {
+        case TOKEN_EQUALS: return left == right;
+        case TOKEN_NOT_EQUALS: return left != right;
+        case TOKEN_LESS: return left < right;
+        case TOKEN_GREATER: return left > right;
+        case TOKEN_LESS_EQUALS: return left <= right;
+        case TOKEN_GREATER_EQUALS: return left >= right;
+        default: return false;
+    }
+}
+
+static unsigned int hash_name(const char* key) {
+    unsigned int hash = 2166136261u;
+    while (*key) {
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    }
+    return hash;
+}
+
+NameMap* create_name_map(int initial_capacity) {
+    NameMap* map = malloc(sizeof(NameMap));
+    map->capacity = 16;
+    while (map->capacity < initial_capacity * 2) {
+        map->capacity *= 2;
+    }
+    map->count = 0;
+    map->keys = calloc(map->capacity, sizeof(char*));
+    map->values = malloc(sizeof(int) * map->capacity);
+    return map;
+}
+
+static int name_map_slot(NameMap* map, const char* key) {
+    unsigned int mask = map->capacity - 1;
+    unsigned int slot = hash_name(key) & mask;
+    while (map->keys[slot] && strcmp(map->keys[slot], key) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+int name_map_get(NameMap* map, const char* key) {
+    int slot = name_map_slot(map, key);
+    return map->keys[slot] ? map->values[slot] : -1;
+}
+
+void name_map_put(NameMap* map, const char* key, int value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        char** old_keys = map->keys;
+        int* old_values = map->values;
+        int old_capacity = map->capacity;
+        map->capacity *= 2;
+        map->keys = calloc(map->capacity, sizeof(char*));
+        map->values = malloc(sizeof(int) * map->capacity);
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_keys[i]) {
+                int slot = name_map_slot(map, old_keys[i]);
+                map->keys[slot] = old_keys[i];
+                map->values[slot] = old_values[i];
+            }
+        }
+        free(old_keys);
+        free(old_values);
+    }
+    int slot = name_map_slot(map, key);
+    if (!map->keys[slot]) {
+        map->keys[slot] = strdup(key);
+        map->count++;
+    }
+    map->values[slot] = value;
+}
+
+void free_name_map(NameMap* map) {
+    for (int i = 0; i < map->capacity; i++) {
+        free(map->keys[i]);
+    }
+    free(map->keys);
+    free(map->values);
+    free(map);
+}
+
 static char* generate_expression_ir(IRProgram* program, ASTNode* node) {
     switch (node->type) {
         case NODE_NUMBER: {
@@ -173,11 +418,23 @@ void generate_ir(IRProgram* program, ASTNode* ast) {
     }
 }
 
+static const char* relation_symbol(int relation) {
+    switch (relation) {
+        case TOKEN_EQUALS: return "==";
+        case TOKEN_NOT_EQUALS: return "!=";
+        case TOKEN_LESS: return "<";
+        case TOKEN_GREATER: return ">";
+        case TOKEN_LESS_EQUALS: return "<=";
+        case TOKEN_GREATER_EQUALS: return ">=";
+        default: return "?";
+    }
+}
+
 void print_ir(IRProgram* program) {
     const char* opcode_names[] = {
         "ADD", "SUB", "MUL", "DIV", "ASSIGN", "LABEL", "JUMP",
         "JUMPZ", "JUMPNZ", "CALL", "RETURN", "PARAM", "ARG",
-        "COMPARE", "LOAD", "STORE"
+        "COMPARE", "LOAD", "STORE", "SHR", "TAILCALL", "JUMPCMP", "CMOVZ", "CMOVNZ"
     };
     
     for (int i = 0; i < program->count; i++) {
@@ -194,7 +451,10 @@ void print_ir(IRProgram* program) {
         if (instr->src1) printf("%s ", instr->src1);
         if (instr->src2) printf("%s ", instr->src2);
         if (instr->label) printf("%s ", instr->label->name);
-        if (instr->op == IR_ASSIGN) printf("%d", instr->value);
+        if (instr->op == IR_ASSIGN && !instr->src1) printf("%d", instr->value);
+        if (instr->op == IR_COMPARE || instr->op == IR_JUMP_COMPARE) {
+            printf("(%s)", relation_symbol(instr->value));
+        }
         
         printf("\n");
     }
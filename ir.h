@@ -19,10 +19,14 @@ typedef enum {
     IR_RETURN,
     IR_PARAM,    // Function parameter
     IR_ARG,      // Function argument
-    IR_COMPARE,
+    IR_COMPARE,  // dest = src1 <relation> src2, relation token in value
     IR_LOAD,
     IR_STORE,
-    IR_SHR
+    IR_SHR,
+    IR_TAIL_CALL,   // Call src1 with the pending arguments in place of returning
+    IR_JUMP_COMPARE, // Jump if src1 <relation> src2, relation token in value
+    IR_CMOVZ,       // dest = src2 if src1 is zero, else dest is left as it was
+    IR_CMOVNZ       // dest = src2 if src1 is not zero, else dest is left as it was
 } IROpcode;
 
 typedef struct {
@@ -47,6 +51,12 @@ typedef struct BasicBlock {
     bool is_reachable;      // For dead code elimination
     IRInstr* instructions;  // Assuming IRInstr is defined elsewhere
     int instruction_count;
+    int index;              // Position in the owning CFG's block array
+    struct BasicBlock** predecessors;
+    int predecessor_count;
+    struct BasicBlock* idom;     // Immediate dominator (NULL for the entry)
+    int rpo_number;         // Reverse-postorder number, -1 if unreachable
+    struct Loop* loop;      // Innermost loop containing this block
 } BasicBlock;
 typedef struct {
     IRInstr** instructions;
@@ -58,6 +68,14 @@ typedef struct {
     int block_count;
 } IRProgram;
 
+// Open-addressed map from operand and label names to integer ids
+typedef struct {
+    char** keys;
+    int* values;
+    int capacity;
+    int count;
+} NameMap;
+
 IRProgram* create_ir_program(void);
 void generate_ir(IRProgram* program, ASTNode* ast);
 char* new_temp(IRProgram* program);
@@ -69,11 +87,40 @@ void free_ir_program(IRProgram* program);
 // Optimization functions
 void optimize_ir(IRProgram* program);
 void constant_folding(IRProgram* program);
+void apply_rewrite_rules(IRProgram* program);
 void dead_code_elimination(IRProgram* program);
 void merge_basic_blocks(IRProgram* program);
 
 void free_instruction(IRInstr* instr);
 
+// Instruction helpers shared by the optimization passes
+IRInstr* create_instr(IROpcode op, const char* dest, const char* src1,
+                      const char* src2);
+IRInstr* create_label_instr(const char* name, int number);
+IRInstr* create_jump_instr(IROpcode op, const char* cond, const char* target);
+IRInstr* copy_instruction(IRInstr* instr);
+void insert_instructions(IRProgram* program, int index, IRInstr** instrs, int n);
+void remove_instructions(IRProgram* program, int index, int n);
+IRInstr* detach_instruction(IRProgram* program, int index);
+bool is_function_label(IRInstr* instr);
+int find_function_end(IRProgram* program, int start);
+bool is_immediate_operand(const char* operand);
+bool is_branch(IRInstr* instr);
+bool is_exit(IRInstr* instr);
+bool writes_dest(IRInstr* instr);
+bool has_side_effects(IRInstr* instr);
+bool reads_operand(IRInstr* instr, const char* name);
+
+// Comparison relations are stored as TOKEN_EQUALS ... TOKEN_GREATER_EQUALS
+int swap_relation(int relation);
+int negate_relation(int relation);
+bool evaluate_relation(int relation, long left, long right);
+
+NameMap* create_name_map(int initial_capacity);
+int name_map_get(NameMap* map, const char* key);
+void name_map_put(NameMap* map, const char* key, int value);
+void free_name_map(NameMap* map);
+
 
 
 #endif 
\ No newline at end of file
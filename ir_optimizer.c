@@ -1,195 +1,466 @@
 #include "ir.h"
+#include "cfg.h"
+#include "dataflow.h"
+#include <limits.h>
 #include <stdbool.h>
 
-static int evaluate_constant_expr(IROpcode op, int left, int right) {
-    switch (op) {
-        case IR_ADD: return left + right;
-        case IR_SUB: return left - right;
-        case IR_MUL: return left * right;
-        case IR_DIV: return left / right;
-        default: return 0;
+static bool is_constant(IRInstr* instr) {
+    return instr->op == IR_ASSIGN && instr->src1 == NULL && instr->src2 == NULL;
+}
+
+// Value of operand at the point described by reaching, the set of
+// definitions that reach it: an immediate, or a name whose reaching
+// definitions all assign the same constant
+static bool get_reaching_constant(IRProgram* program, ReachingDefs* defs,
+                                  uint64_t* reaching, const char* operand, long* value) {
+    if (is_immediate_operand(operand)) {
+        *value = atol(operand);
+        return true;
+    }
+    int* bits;
+    int count = find_name_defs(defs, operand, &bits);
+    bool found = false;
+    for (int i = 0; i < count; i++) {
+        if (!bitset_test(reaching, bits[i])) continue;
+        IRInstr* def = program->instructions[defs->def_instrs[bits[i]]];
+        if (!is_constant(def) || (found && def->value != *value)) return false;
+        *value = def->value;
+        found = true;
     }
+    return found;
 }
 
-static bool is_constant(IRInstr* instr) {
-    return instr->op == IR_ASSIGN && instr->src1 == NULL && instr->src2 == NULL;
+// Whether an exact result can be held in IRInstr.value.  The target
+// computes in 64 bits, so a result that does not fit is left for run
+// time rather than wrapped to int.
+static bool fits_ir_value(long value) {
+    return value >= INT_MIN && value <= INT_MAX;
 }
 
-static int get_constant_value(IRProgram* program, const char* temp) {
-    for (int i = 0; i < program->count; i++) {
-        IRInstr* instr = program->instructions[i];
-        if (instr->dest && strcmp(instr->dest, temp) == 0 && is_constant(instr)) {
-            return instr->value;
+static bool evaluate_constant_expr(IRInstr* instr, long left, long right, long* result) {
+    switch (instr->op) {
+        case IR_ADD: *result = left + right; break;
+        case IR_SUB: *result = left - right; break;
+        case IR_MUL: *result = left * right; break;
+        case IR_DIV:
+            // Leave trapping divisions for run time
+            if (right == 0) return false;
+            *result = left / right;
+            break;
+        // sarq uses the low six bits of the count
+        case IR_SHR: *result = left >> (right & 63); break;
+        case IR_COMPARE: *result = evaluate_relation(instr->value, left, right); break;
+        default: return false;
+    }
+    return fits_ir_value(*result);
+}
+
+static bool fold_function_constants(IRProgram* program, CFG* cfg) {
+    ReachingDefs* defs = compute_reaching_defs(program, cfg);
+    uint64_t* reaching = malloc(sizeof(uint64_t) * defs->words);
+    bool folded = false;
+    for (int r = 0; r < cfg->rpo_count; r++) {
+        BasicBlock* block = cfg->rpo[r];
+        reaching_defs_at_entry(defs, block, reaching);
+        for (int i = block->start; i <= block->end; i++) {
+            IRInstr* instr = program->instructions[i];
+            long left, right, result;
+            if (instr->src1 && instr->src2 && instr->dest &&
+                get_reaching_constant(program, defs, reaching, instr->src1, &left) &&
+                get_reaching_constant(program, defs, reaching, instr->src2, &right) &&
+                evaluate_constant_expr(instr, left, right, &result)) {
+                instr->op = IR_ASSIGN;
+                free(instr->src1);
+                free(instr->src2);
+                instr->src1 = NULL;
+                instr->src2 = NULL;
+                instr->value = (int)result;
+                folded = true;
+            }
+            apply_reaching_def(defs, reaching, i);
         }
     }
-    return 0;
+    free(reaching);
+    free_reaching_defs(defs);
+    return folded;
 }
 
+// Folds operations whose operands are constant on every path reaching
+// them.  Folding only turns definitions into constants, so the reaching
+// sets stay valid and are solved once per round.
 void constant_folding(IRProgram* program) {
-    bool changed;
-    do {
-        changed = false;
-        for (int i = 0; i < program->count; i++) {
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+        CFG* cfg = build_cfg(program, start);
+        bool changed;
+        do {
+            changed = fold_function_constants(program, cfg);
+        } while (changed);
+        free_cfg(cfg);
+        start = find_function_end(program, start);
+    }
+}
+
+// Removes code no path from its function's entry reaches
+void dead_code_elimination(IRProgram* program) {
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+        CFG* cfg = build_cfg(program, start);
+        remove_unreachable_blocks(program, cfg);
+        free_cfg(cfg);
+        start = find_function_end(program, start);
+    }
+}
+
+// Rewrite rules
+
+// Operators the generated matcher switches on: the arithmetic opcodes,
+// then one per compare relation in token order
+typedef enum {
+    RULE_NONE = -1,
+    RULE_ADD,
+    RULE_SUB,
+    RULE_MUL,
+    RULE_DIV,
+    RULE_SHR,
+    RULE_EQ,
+    RULE_NE,
+    RULE_LT,
+    RULE_GT,
+    RULE_LE,
+    RULE_GE
+} RuleOp;
+
+// Rewrites of one instruction before moving on; the rules make progress
+// on their own, so this only bounds a badly written rules file
+#define MAX_RULE_REWRITES 8
+
+static RuleOp get_rule_op(IRInstr* instr) {
+    if (!instr->dest || !instr->src1 || !instr->src2) return RULE_NONE;
+    switch (instr->op) {
+        case IR_ADD: return RULE_ADD;
+        case IR_SUB: return RULE_SUB;
+        case IR_MUL: return RULE_MUL;
+        case IR_DIV: return RULE_DIV;
+        case IR_SHR: return RULE_SHR;
+        case IR_COMPARE: return RULE_EQ + (instr->value - TOKEN_EQUALS);
+        default: return RULE_NONE;
+    }
+}
+
+static void rewrite_constant(IRInstr* instr, long value) {
+    free(instr->src1);
+    free(instr->src2);
+    instr->op = IR_ASSIGN;
+    instr->src1 = NULL;
+    instr->src2 = NULL;
+    // The matcher has checked the value fits
+    instr->value = (int)value;
+}
+
+static void rewrite_copy(IRInstr* instr, const char* operand) {
+    if (is_immediate_operand(operand)) {
+        rewrite_constant(instr, atol(operand));
+        return;
+    }
+    char* copy = strdup(operand);
+    free(instr->src1);
+    free(instr->src2);
+    instr->op = IR_ASSIGN;
+    instr->src1 = copy;
+    instr->src2 = NULL;
+}
+
+// Takes ownership of left and right
+static void rewrite_binary(IRInstr* instr, RuleOp op, char* left, char* right) {
+    static const IROpcode opcodes[] = { IR_ADD, IR_SUB, IR_MUL, IR_DIV, IR_SHR };
+    free(instr->src1);
+    free(instr->src2);
+    instr->src1 = left;
+    instr->src2 = right;
+    if (op >= RULE_EQ) {
+        instr->op = IR_COMPARE;
+        instr->value = TOKEN_EQUALS + (op - RULE_EQ);
+    } else {
+        instr->op = opcodes[op];
+    }
+}
+
+static char* rule_immediate(long value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%ld", value);
+    return strdup(buffer);
+}
+
+// match_rewrite_rule, generated from ir.rules by rulegen
+#include "ir_rules.inc"
+
+static void rewrite_function(IRProgram* program, CFG* cfg) {
+    ReachingDefs* defs = compute_reaching_defs(program, cfg);
+    uint64_t* reaching = malloc(sizeof(uint64_t) * defs->words);
+    for (int r = 0; r < cfg->rpo_count; r++) {
+        BasicBlock* block = cfg->rpo[r];
+        reaching_defs_at_entry(defs, block, reaching);
+        for (int i = block->start; i <= block->end; i++) {
             IRInstr* instr = program->instructions[i];
-            
-            // Look for arithmetic operations with constant operands
-            if ((instr->op == IR_ADD || instr->op == IR_SUB || 
-                 instr->op == IR_MUL || instr->op == IR_DIV) &&
-                instr->src1 && instr->src2) {
-                
-                int left_val, right_val;
-                bool left_const = false, right_const = false;
-                
-                // Check if operands are constants
-                for (int j = 0; j < i; j++) {
-                    IRInstr* prev = program->instructions[j];
-                    if (prev->dest) {
-                        if (strcmp(prev->dest, instr->src1) == 0 && is_constant(prev)) {
-                            left_val = prev->value;
-                            left_const = true;
-                        }
-                        if (strcmp(prev->dest, instr->src2) == 0 && is_constant(prev)) {
-                            right_val = prev->value;
-                            right_const = true;
-                        }
-                    }
-                }
-                
-                // If both operands are constants, fold them
-                if (left_const && right_const) {
-                    int result = evaluate_constant_expr(instr->op, left_val, right_val);
-                    instr->op = IR_ASSIGN;
-                    free(instr->src1);
-                    free(instr->src2);
-                    instr->src1 = NULL;
-                    instr->src2 = NULL;
-                    instr->value = result;
-                    changed = true;
+            for (int n = 0; n < MAX_RULE_REWRITES; n++) {
+                RuleOp op = get_rule_op(instr);
+                if (op == RULE_NONE) break;
+                long left = 0, right = 0;
+                bool known_left =
+                    get_reaching_constant(program, defs, reaching, instr->src1, &left);
+                bool known_right =
+                    get_reaching_constant(program, defs, reaching, instr->src2, &right);
+                if (!match_rewrite_rule(instr, op, known_left, left, known_right, right)) {
+                    break;
                 }
             }
+            apply_reaching_def(defs, reaching, i);
         }
-    } while (changed);
+    }
+    free(reaching);
+    free_reaching_defs(defs);
 }
 
-static void find_basic_blocks(IRProgram* program) {
-    // First pass: count basic blocks
-    int block_count = 1;  // Start block
-    for (int i = 0; i < program->count; i++) {
-        IRInstr* instr = program->instructions[i];
-        if (instr->op == IR_LABEL || 
-            instr->op == IR_JUMP || 
-            instr->op == IR_JUMPZ || 
-            instr->op == IR_JUMPNZ) {
-            block_count++;
-        }
-    }
-    
-    // Allocate blocks
-    program->blocks = malloc(sizeof(BasicBlock*) * block_count);
-    program->block_count = 0;
-    
-    // Second pass: create basic blocks
-    int current_start = 0;
-    for (int i = 0; i < program->count; i++) {
+// Applies the rules in ir.rules in one pass over each function, taking
+// operands constant on every path reaching them as constants.  Rewrites
+// keep every definition in place, so the reaching sets stay valid.
+void apply_rewrite_rules(IRProgram* program) {
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+        CFG* cfg = build_cfg(program, start);
+        rewrite_function(program, cfg);
+        free_cfg(cfg);
+        start = find_function_end(program, start);
+    }
+}
+
+// CFG simplification
+
+// Rounds per function; the pass itself is rerun between other passes
+#define MAX_SIMPLIFY_ROUNDS 64
+
+static bool is_conditional_branch(IRInstr* instr) {
+    return instr->op == IR_JUMPZ || instr->op == IR_JUMPNZ;
+}
+
+// Value cond holds at the end of block: an immediate, or a constant
+// assigned in the block and not overwritten since
+static bool get_block_constant(IRProgram* program, BasicBlock* block, const char* cond,
+                               long* value) {
+    if (is_immediate_operand(cond)) {
+        *value = atol(cond);
+        return true;
+    }
+    for (int i = block->end; i >= block->start; i--) {
         IRInstr* instr = program->instructions[i];
-        if (instr->op == IR_LABEL || i == 0) {
-            BasicBlock* block = malloc(sizeof(BasicBlock));
-            block->start = current_start;
-            block->end = i - 1;
-            block->successors = malloc(sizeof(BasicBlock*) * 2);  // Max 2 successors
-            block->successor_count = 0;
-            block->is_reachable = false;
-            
-            if (program->block_count > 0) {
-                program->blocks[program->block_count - 1]->end = i - 1;
-            }
-            
-            program->blocks[program->block_count++] = block;
-            current_start = i;
+        if (writes_dest(instr) && strcmp(instr->dest, cond) == 0) {
+            if (!is_constant(instr)) return false;
+            *value = instr->value;
+            return true;
         }
     }
-    
-    // Set end of last block
-    if (program->block_count > 0) {
-        program->blocks[program->block_count - 1]->end = program->count - 1;
+    return false;
+}
+
+// Whether cond is zero once control leaves pred through branch: 1 if
+// it is, 0 if not, -1 if that is not known
+static int known_zero(IRProgram* program, BasicBlock* pred, IRInstr* branch, const char* cond) {
+    long value;
+    if (get_block_constant(program, pred, cond, &value)) return value == 0;
+    if (is_conditional_branch(branch) && strcmp(branch->src1, cond) == 0) {
+        return branch->op == IR_JUMPZ;
     }
+    return -1;
 }
 
-void dead_code_elimination(IRProgram* program) {
-    find_basic_blocks(program);
-    
-    // Mark reachable blocks starting from entry
-    program->blocks[0]->is_reachable = true;
-    bool changed;
-    do {
-        changed = false;
-        for (int i = 0; i < program->block_count; i++) {
-            BasicBlock* block = program->blocks[i];
-            if (!block->is_reachable) continue;
-            
-            // Find successors
-            IRInstr* last_instr = program->instructions[block->end];
-            if (last_instr->op == IR_JUMP || 
-                last_instr->op == IR_JUMPZ || 
-                last_instr->op == IR_JUMPNZ) {
-                
-                // Find target block
-                for (int j = 0; j < program->block_count; j++) {
-                    BasicBlock* target = program->blocks[j];
-                    IRInstr* first_instr = program->instructions[target->start];
-                    if (first_instr->op == IR_LABEL && 
-                        strcmp(first_instr->label->name, last_instr->label->name) == 0) {
-                        if (!target->is_reachable) {
-                            target->is_reachable = true;
-                            changed = true;
-                        }
-                        break;
-                    }
-                }
-            }
-            
-            // Fall-through case
-            if (i + 1 < program->block_count && !program->blocks[i + 1]->is_reachable) {
-                program->blocks[i + 1]->is_reachable = true;
-                changed = true;
+// Label of the block after block, if control can be sent there by name
+static const char* next_block_label(IRProgram* program, CFG* cfg, BasicBlock* block) {
+    if (block->index + 1 >= cfg->block_count) return NULL;
+    IRInstr* first = program->instructions[cfg->blocks[block->index + 1]->start];
+    return first->op == IR_LABEL ? first->label->name : NULL;
+}
+
+// Jump threading: where branch, ending pred, can go instead of its
+// target when that only leads on elsewhere.  A block holding nothing
+// but its label leads to the next one; with a jump it leads to the
+// jump's target; with a conditional branch it does so once the outcome
+// is known on the way in from pred.  Nothing the blocks passed through
+// do changes the condition, so what pred knows still holds.
+static const char* thread_target(IRProgram* program, CFG* cfg, BasicBlock* pred,
+                                 IRInstr* branch) {
+    const char* target = branch->label->name;
+    for (int steps = 0; steps < cfg->block_count; steps++) {
+        BasicBlock* block = find_block_by_label(cfg, target);
+        if (!block) return target;
+        IRInstr* last = program->instructions[block->end];
+        const char* next = NULL;
+        if (block->start == block->end) {
+            next = next_block_label(program, cfg, block);
+        } else if (block->start + 1 == block->end && last->op == IR_JUMP) {
+            next = last->label->name;
+        } else if (block->start + 1 == block->end && is_conditional_branch(last)) {
+            int zero = known_zero(program, pred, branch, last->src1);
+            if (zero >= 0) {
+                next = zero == (last->op == IR_JUMPZ) ? last->label->name
+                                                      : next_block_label(program, cfg, block);
             }
         }
-    } while (changed);
-    
-    // Remove unreachable blocks
-    int write = 0;
-    for (int read = 0; read < program->count; read++) {
-        IRInstr* instr = program->instructions[read];
-        bool keep = false;
-        
-        // Check if instruction is in a reachable block
-        for (int i = 0; i < program->block_count; i++) {
-            BasicBlock* block = program->blocks[i];
-            if (block->is_reachable && 
-                read >= block->start && 
-                read <= block->end) {
-                keep = true;
-                break;
+        if (!next) return target;
+        target = next;
+    }
+    // Only a cycle of empty blocks gets this far
+    return branch->label->name;
+}
+
+// True if label name directly follows index, possibly among other labels
+static bool is_next_label(IRProgram* program, int index, int end, const char* name) {
+    for (int i = index + 1; i < end && program->instructions[i]->op == IR_LABEL; i++) {
+        if (strcmp(program->instructions[i]->label->name, name) == 0) return true;
+    }
+    return false;
+}
+
+// Folds branches on known conditions, threads jumps and drops those to
+// the next instruction.  Only branches change, so the CFG's indices stay
+// valid until the dropped ones are removed at the end.
+static bool simplify_branches(IRProgram* program, CFG* cfg) {
+    bool* dropped = calloc(cfg->end - cfg->start, sizeof(bool));
+    bool changed = false;
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        IRInstr* last = program->instructions[block->end];
+        long value;
+        if (is_conditional_branch(last) && get_block_constant(program, block, last->src1, &value)) {
+            if ((value == 0) == (last->op == IR_JUMPZ)) {
+                last->op = IR_JUMP;
+                free(last->src1);
+                last->src1 = NULL;
+            } else {
+                dropped[block->end - cfg->start] = true;
             }
+            changed = true;
         }
-        
-        if (keep) {
-            program->instructions[write++] = instr;
-        } else {
-            free(instr->dest);
-            free(instr->src1);
-            free(instr->src2);
-            if (instr->label) {
-                free(instr->label->name);
-                free(instr->label);
-            }
-            free(instr);
+        if (!is_branch(last) || dropped[block->end - cfg->start]) continue;
+        const char* target = thread_target(program, cfg, block, last);
+        if (strcmp(target, last->label->name) != 0) {
+            char* name = strdup(target);
+            free(last->label->name);
+            last->label->name = name;
+            changed = true;
+        }
+        if (last->op != IR_JUMP_COMPARE &&
+            is_next_label(program, block->end, cfg->end, last->label->name)) {
+            dropped[block->end - cfg->start] = true;
+            changed = true;
+        }
+    }
+    for (int i = cfg->end - 1; i > cfg->start; i--) {
+        if (dropped[i - cfg->start]) remove_instructions(program, i, 1);
+    }
+    free(dropped);
+    return changed;
+}
+
+// Labels no branch names only split blocks; without them a block
+// falling into its only successor merges with it
+static bool remove_unused_labels(IRProgram* program, CFG* cfg) {
+    NameMap* used = create_name_map(cfg->block_count);
+    for (int i = cfg->start; i < cfg->end; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (is_branch(instr)) name_map_put(used, instr->label->name, 1);
+    }
+    bool changed = false;
+    for (int i = cfg->end - 1; i > cfg->start; i--) {
+        IRInstr* instr = program->instructions[i];
+        if (instr->op == IR_LABEL && name_map_get(used, instr->label->name) < 0) {
+            remove_instructions(program, i, 1);
+            changed = true;
+        }
+    }
+    free_name_map(used);
+    return changed;
+}
+
+// A block reached only by a jump from elsewhere, and not falling
+// through itself, moves in place of that jump
+static bool merge_jump_target(IRProgram* program, CFG* cfg) {
+    for (int b = 1; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        if (block->predecessor_count != 1) continue;
+        BasicBlock* pred = block->predecessors[0];
+        IRInstr* jump = program->instructions[pred->end];
+        IRInstr* last = program->instructions[block->end];
+        if (pred == block || jump->op != IR_JUMP || (last->op != IR_JUMP && !is_exit(last))) {
+            continue;
+        }
+        int from = block->start + (program->instructions[block->start]->op == IR_LABEL);
+        int count = block->end + 1 - from;
+        IRInstr** moved = malloc(sizeof(IRInstr*) * count);
+        for (int i = 0; i < count; i++) {
+            moved[i] = copy_instruction(program->instructions[from + i]);
+        }
+        // The later position first, so the earlier one stays valid
+        int jump_index = pred->end;
+        if (block->start > jump_index) {
+            remove_instructions(program, block->start, block->end + 1 - block->start);
+        }
+        remove_instructions(program, jump_index, 1);
+        insert_instructions(program, jump_index, moved, count);
+        if (block->start < jump_index) {
+            remove_instructions(program, block->start, block->end + 1 - block->start);
+        }
+        free(moved);
+        return true;
+    }
+    return false;
+}
+
+// One round of simplification, stopping at the first kind of change
+// since each leaves the CFG out of date
+static bool simplify_function_cfg(IRProgram* program, int start) {
+    CFG* cfg = build_cfg(program, start);
+    bool changed = remove_unreachable_blocks(program, cfg) > 0 ||
+                   simplify_branches(program, cfg) ||
+                   remove_unused_labels(program, cfg) ||
+                   merge_jump_target(program, cfg);
+    free_cfg(cfg);
+    return changed;
+}
+
+// Simplifies each function's control flow: jumps are threaded past
+// empty blocks and branches already decided, branches with a known
+// outcome or to the next instruction are folded away, and blocks are
+// merged with their only successor.  Unreachable blocks go as well.
+void merge_basic_blocks(IRProgram* program) {
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+        for (int round = 0; round < MAX_SIMPLIFY_ROUNDS; round++) {
+            if (!simplify_function_cfg(program, start)) break;
         }
+        start = find_function_end(program, start);
     }
-    program->count = write;
 }
 
 void optimize_ir(IRProgram* program) {
     constant_folding(program);
+    apply_rewrite_rules(program);
     dead_code_elimination(program);
+    merge_basic_blocks(program);
 } 
\ No newline at end of file
@@ -0,0 +1,1246 @@
+#include "isel.h"
+#include "dataflow.h"
+#include "frame.h"
+#include <limits.h>
+
+// Instruction selection by bottom-up rewriting.  Each IR instruction
+// becomes a small expression tree whose leaves are the locations the
+// register allocator chose; a value used only by the next instruction
+// is folded into that instruction's tree instead of being computed on
+// its own.  The trees are labelled with the cheapest way to derive each
+// nonterminal from the pattern table below, then reduced to machine
+// instructions from the root down.
+
+#define INFINITE_COST INT_MAX
+#define MAX_FOLD_DEPTH 3        // Keeps trees within the scratch registers
+#define MAX_TREE_NODES 32
+
+typedef enum {
+    SEL_NT,         // Pattern leaf standing for a nonterminal
+    SEL_REG,
+    SEL_MEM,
+    SEL_IMM,
+    SEL_ADD,
+    SEL_SUB,
+    SEL_MUL,
+    SEL_SHR,
+    SEL_LOAD
+} SelOp;
+
+typedef enum {
+    NT_REG,         // Value in a register
+    NT_MEM,         // Value in memory
+    NT_IMM,
+    NT_SCALE,       // Immediate usable as an index scale
+    NT_RM,
+    NT_RMI,
+    NT_INDEX,       // index * scale
+    NT_ADDR,        // Address: base + index * scale + displacement
+    NT_COUNT
+} Nonterminal;
+
+struct Rule;
+
+typedef struct SelNode {
+    SelOp op;
+    MachineOperand leaf;
+    struct SelNode* kids[2];
+    int target;                         // Register the root's value goes to
+    int cost[NT_COUNT];
+    const struct Rule* rule[NT_COUNT];  // Cheapest rule deriving each nonterminal
+} SelNode;
+
+typedef struct Pattern {
+    SelOp op;
+    Nonterminal nt;                     // For SEL_NT leaves
+    const struct Pattern* kids[2];
+} Pattern;
+
+// Edge moves that cannot sit in either block, emitted after the function
+typedef struct {
+    int label;
+    MoveList* moves;
+    const char* target;
+    int block;          // Block the edge leaves
+    int begin;          // Index of the stub's first instruction
+} MoveStub;
+
+// Function being selected.  The prologue pushes the callee-saved
+// registers the allocation uses; spill slots lie below them.  Leaf
+// functions keep no frame pointer and address their slots from %rsp,
+// mostly within the red zone.  The body is selected first and the
+// prologue and epilogues are placed once it is known which blocks use
+// the frame.
+typedef struct {
+    IRProgram* program;
+    CFG* cfg;
+    RegAllocation* alloc;
+    MachineFunction* out;
+    int* label_count;
+    Register saved[REG_COUNT];
+    int saved_count;
+    int frame_size;             // Bytes of spill slots, padded so calls see an aligned %rsp
+    bool leaf;                  // Makes no calls
+    MoveStub* stubs;
+    int stub_count;
+    int* block_begin;           // Per block, index of its first instruction
+    int* frame_points;          // Per block, where a prologue at its top goes
+    int* exits;                 // Indices of returns and tail calls, in order
+    int* exit_blocks;
+    int exit_count;
+    int* pending_args;          // ARGs not yet consumed by a call
+    int pending_count;
+    bool* folded;               // Per instruction, computed within the next one's tree
+    bool* flag_compares;        // Per instruction, a compare answered in the flags only
+    const char* flags_value;    // Compare result or tested value the flags answer for,
+    int flags_relation;         // as value != 0 when flags_relation holds
+    bool busy[REG_COUNT];       // Scratch registers holding parts of the current tree
+    SelNode nodes[MAX_TREE_NODES];
+    int node_count;
+} Selector;
+
+typedef MachineOperand (*ReduceAction)(Selector* sel, SelNode* node, SelNode** kids,
+                                       const Nonterminal* nts, int target);
+
+typedef struct Rule {
+    Nonterminal lhs;
+    const Pattern* pattern;
+    int cost;
+    bool two_address;           // One cheaper when the left operand is already the target
+    bool (*applies)(SelNode* node);
+    ReduceAction reduce;
+} Rule;
+
+// Registers no value is allocated to, free for use within a tree
+static const Register scratch_registers[] = { REG_RAX, REG_R11, REG_RCX, REG_RDX };
+
+#define SCRATCH_COUNT ((int)(sizeof(scratch_registers) / sizeof(scratch_registers[0])))
+
+static MachineOperand reduce(Selector* sel, SelNode* node, Nonterminal nt, int target);
+
+static int take_scratch(Selector* sel) {
+    for (int i = 0; i < SCRATCH_COUNT; i++) {
+        if (!sel->busy[scratch_registers[i]]) {
+            sel->busy[scratch_registers[i]] = true;
+            return scratch_registers[i];
+        }
+    }
+    fprintf(stderr, "Code generation error: expression needs too many registers\n");
+    exit(1);
+}
+
+// Frees the scratch registers an operand was built in once it is used
+static void release_operand(Selector* sel, MachineOperand operand) {
+    if (operand.kind != MOP_REG && operand.kind != MOP_MEM) return;
+    if (operand.reg != NO_REGISTER) sel->busy[operand.reg] = false;
+    if (operand.kind == MOP_MEM && operand.index != NO_REGISTER) sel->busy[operand.index] = false;
+}
+
+static int result_register(Selector* sel, int target) {
+    return target != NO_REGISTER ? target : take_scratch(sel);
+}
+
+static MachineOpcode arithmetic_opcode(SelOp op) {
+    switch (op) {
+        case SEL_ADD: return MI_ADD;
+        case SEL_SUB: return MI_SUB;
+        case SEL_MUL: return MI_IMUL;
+        default: return MI_SAR;
+    }
+}
+
+static bool reads_register(SelNode* node, int reg) {
+    if (node->op == SEL_REG || node->op == SEL_MEM) return operand_reads_register(node->leaf, reg);
+    for (int i = 0; i < 2; i++) {
+        if (node->kids[i] && reads_register(node->kids[i], reg)) return true;
+    }
+    return false;
+}
+
+// Reduce actions, one per shape of rule
+
+static MachineOperand reduce_leaf(Selector* sel, SelNode* node, SelNode** kids,
+                                  const Nonterminal* nts, int target) {
+    (void)sel, (void)kids, (void)nts, (void)target;
+    return node->leaf;
+}
+
+static MachineOperand reduce_chain(Selector* sel, SelNode* node, SelNode** kids,
+                                   const Nonterminal* nts, int target) {
+    (void)node;
+    return reduce(sel, kids[0], nts[0], target);
+}
+
+static MachineOperand reduce_into_register(Selector* sel, SelNode* node, SelNode** kids,
+                                           const Nonterminal* nts, int target) {
+    (void)node;
+    MachineOperand value = reduce(sel, kids[0], nts[0], NO_REGISTER);
+    release_operand(sel, value);
+    int dest = result_register(sel, target);
+    mir_append(sel->out, MI_MOV, 2, value, mir_reg(dest));
+    return mir_reg(dest);
+}
+
+static MachineOperand reduce_lea(Selector* sel, SelNode* node, SelNode** kids,
+                                 const Nonterminal* nts, int target) {
+    (void)node;
+    MachineOperand address = reduce(sel, kids[0], nts[0], NO_REGISTER);
+    release_operand(sel, address);
+    int dest = result_register(sel, target);
+    mir_append(sel->out, MI_LEA, 2, address, mir_reg(dest));
+    return mir_reg(dest);
+}
+
+// A loaded value is used in place as a memory operand
+static MachineOperand reduce_load(Selector* sel, SelNode* node, SelNode** kids,
+                                  const Nonterminal* nts, int target) {
+    (void)node, (void)target;
+    return reduce(sel, kids[0], nts[0], NO_REGISTER);
+}
+
+static MachineOperand reduce_base(Selector* sel, SelNode* node, SelNode** kids,
+                                  const Nonterminal* nts, int target) {
+    (void)node, (void)target;
+    MachineOperand base = reduce(sel, kids[0], nts[0], NO_REGISTER);
+    return mir_mem(base.reg, NO_REGISTER, 1, 0);
+}
+
+static MachineOperand reduce_index(Selector* sel, SelNode* node, SelNode** kids,
+                                   const Nonterminal* nts, int target) {
+    (void)node, (void)target;
+    MachineOperand index = reduce(sel, kids[0], nts[0], NO_REGISTER);
+    MachineOperand scale = reduce(sel, kids[1], nts[1], NO_REGISTER);
+    return mir_mem(NO_REGISTER, index.reg, (int)scale.value, 0);
+}
+
+static MachineOperand reduce_base_index(Selector* sel, SelNode* node, SelNode** kids,
+                                        const Nonterminal* nts, int target) {
+    (void)node, (void)target;
+    MachineOperand base = reduce(sel, kids[0], nts[0], NO_REGISTER);
+    MachineOperand index = reduce(sel, kids[1], nts[1], NO_REGISTER);
+    if (index.kind == MOP_REG) return mir_mem(base.reg, index.reg, 1, 0);
+    index.reg = base.reg;
+    return index;
+}
+
+static MachineOperand reduce_displacement(Selector* sel, SelNode* node, SelNode** kids,
+                                          const Nonterminal* nts, int target) {
+    (void)target;
+    MachineOperand address = reduce(sel, kids[0], nts[0], NO_REGISTER);
+    MachineOperand offset = reduce(sel, kids[1], nts[1], NO_REGISTER);
+    address.value += node->op == SEL_SUB ? -offset.value : offset.value;
+    return address;
+}
+
+// x * 3, 5 or 9 as x + x * 2, 4 or 8
+static MachineOperand reduce_scaled_base(Selector* sel, SelNode* node, SelNode** kids,
+                                         const Nonterminal* nts, int target) {
+    (void)node, (void)target;
+    MachineOperand base = reduce(sel, kids[0], nts[0], NO_REGISTER);
+    MachineOperand factor = reduce(sel, kids[1], nts[1], NO_REGISTER);
+    return mir_mem(base.reg, base.reg, (int)factor.value - 1, 0);
+}
+
+// left op= right, with left brought into the target first unless right
+// still has to read the target
+static MachineOperand reduce_two_address(Selector* sel, SelNode* node, SelNode** kids,
+                                         const Nonterminal* nts, int target) {
+    int dest = target;
+    if (dest == NO_REGISTER || reads_register(kids[1], dest)) dest = take_scratch(sel);
+    MachineOperand left = reduce(sel, kids[0], nts[0], dest);
+    MachineOperand right = reduce(sel, kids[1], nts[1], NO_REGISTER);
+    if (left.kind != MOP_REG || left.reg != dest) {
+        mir_append(sel->out, MI_MOV, 2, left, mir_reg(dest));
+        release_operand(sel, left);
+    }
+    mir_append(sel->out, arithmetic_opcode(node->op), 2, right, mir_reg(dest));
+    release_operand(sel, right);
+    return mir_reg(dest);
+}
+
+static MachineOperand reduce_multiply_immediate(Selector* sel, SelNode* node, SelNode** kids,
+                                                const Nonterminal* nts, int target) {
+    (void)node;
+    MachineOperand source = reduce(sel, kids[0], nts[0], NO_REGISTER);
+    MachineOperand factor = reduce(sel, kids[1], nts[1], NO_REGISTER);
+    release_operand(sel, source);
+    int dest = result_register(sel, target);
+    mir_append(sel->out, MI_IMUL, 3, factor, source, mir_reg(dest));
+    return mir_reg(dest);
+}
+
+static bool is_scale(SelNode* node) {
+    return node->leaf.value == 1 || node->leaf.value == 2 || node->leaf.value == 4 ||
+           node->leaf.value == 8;
+}
+
+static bool is_scale_plus_one(SelNode* node) {
+    long factor = node->kids[1]->leaf.value;
+    return factor == 3 || factor == 5 || factor == 9;
+}
+
+// Displacements stay well inside 32 bits however many get added up
+static bool is_small_displacement(SelNode* node) {
+    long offset = node->kids[1]->leaf.value;
+    return offset > -(1L << 24) && offset < (1L << 24);
+}
+
+#define NONTERMINAL(nt) { SEL_NT, nt, { NULL, NULL } }
+
+static const Pattern reg_nt = NONTERMINAL(NT_REG);
+static const Pattern mem_nt = NONTERMINAL(NT_MEM);
+static const Pattern imm_nt = NONTERMINAL(NT_IMM);
+static const Pattern scale_nt = NONTERMINAL(NT_SCALE);
+static const Pattern rm_nt = NONTERMINAL(NT_RM);
+static const Pattern rmi_nt = NONTERMINAL(NT_RMI);
+static const Pattern index_nt = NONTERMINAL(NT_INDEX);
+static const Pattern addr_nt = NONTERMINAL(NT_ADDR);
+
+static const Pattern reg_leaf = { SEL_REG, NT_REG, { NULL, NULL } };
+static const Pattern mem_leaf = { SEL_MEM, NT_REG, { NULL, NULL } };
+static const Pattern imm_leaf = { SEL_IMM, NT_REG, { NULL, NULL } };
+static const Pattern load_addr = { SEL_LOAD, NT_REG, { &addr_nt, NULL } };
+static const Pattern mul_reg_scale = { SEL_MUL, NT_REG, { &reg_nt, &scale_nt } };
+static const Pattern mul_reg_imm = { SEL_MUL, NT_REG, { &reg_nt, &imm_nt } };
+static const Pattern add_reg_reg = { SEL_ADD, NT_REG, { &reg_nt, &reg_nt } };
+static const Pattern add_reg_index = { SEL_ADD, NT_REG, { &reg_nt, &index_nt } };
+static const Pattern add_addr_imm = { SEL_ADD, NT_REG, { &addr_nt, &imm_nt } };
+static const Pattern sub_addr_imm = { SEL_SUB, NT_REG, { &addr_nt, &imm_nt } };
+static const Pattern add_reg_rmi = { SEL_ADD, NT_REG, { &reg_nt, &rmi_nt } };
+static const Pattern sub_reg_rmi = { SEL_SUB, NT_REG, { &reg_nt, &rmi_nt } };
+static const Pattern shr_reg_imm = { SEL_SHR, NT_REG, { &reg_nt, &imm_nt } };
+static const Pattern mul_reg_rm = { SEL_MUL, NT_REG, { &reg_nt, &rm_nt } };
+static const Pattern mul_rm_imm = { SEL_MUL, NT_REG, { &rm_nt, &imm_nt } };
+
+// Costs are roughly cycles.  Rules whose pattern is a lone nonterminal
+// are chain rules, applied after the others until costs settle.
+static const Rule rules[] = {
+    // Leaves
+    { NT_REG, &reg_leaf, 0, false, NULL, reduce_leaf },
+    { NT_MEM, &mem_leaf, 0, false, NULL, reduce_leaf },
+    { NT_IMM, &imm_leaf, 0, false, NULL, reduce_leaf },
+    { NT_SCALE, &imm_leaf, 0, false, is_scale, reduce_leaf },
+    { NT_MEM, &load_addr, 0, false, NULL, reduce_load },
+
+    // Operand classes
+    { NT_RM, &reg_nt, 0, false, NULL, reduce_chain },
+    { NT_RM, &mem_nt, 0, false, NULL, reduce_chain },
+    { NT_RMI, &rm_nt, 0, false, NULL, reduce_chain },
+    { NT_RMI, &imm_nt, 0, false, NULL, reduce_chain },
+    { NT_REG, &imm_nt, 1, false, NULL, reduce_into_register },
+    { NT_REG, &mem_nt, 1, false, NULL, reduce_into_register },
+    { NT_REG, &addr_nt, 1, false, NULL, reduce_lea },
+
+    // Addressing modes
+    { NT_ADDR, &reg_nt, 0, false, NULL, reduce_base },
+    { NT_ADDR, &index_nt, 0, false, NULL, reduce_chain },
+    { NT_INDEX, &mul_reg_scale, 0, false, NULL, reduce_index },
+    { NT_ADDR, &add_reg_reg, 0, false, NULL, reduce_base_index },
+    { NT_ADDR, &add_reg_index, 0, false, NULL, reduce_base_index },
+    { NT_ADDR, &add_addr_imm, 0, false, is_small_displacement, reduce_displacement },
+    { NT_ADDR, &sub_addr_imm, 0, false, is_small_displacement, reduce_displacement },
+    { NT_ADDR, &mul_reg_imm, 0, false, is_scale_plus_one, reduce_scaled_base },
+
+    // Arithmetic
+    { NT_REG, &add_reg_rmi, 2, true, NULL, reduce_two_address },
+    { NT_REG, &sub_reg_rmi, 2, true, NULL, reduce_two_address },
+    { NT_REG, &shr_reg_imm, 2, true, NULL, reduce_two_address },
+    { NT_REG, &mul_reg_rm, 4, true, NULL, reduce_two_address },
+    { NT_REG, &mul_rm_imm, 3, false, NULL, reduce_multiply_immediate },
+};
+
+#define RULE_COUNT ((int)(sizeof(rules) / sizeof(rules[0])))
+
+static bool match_pattern(const Pattern* pattern, SelNode* node, int* cost) {
+    if (pattern->op == SEL_NT) {
+        if (node->cost[pattern->nt] == INFINITE_COST) return false;
+        *cost += node->cost[pattern->nt];
+        return true;
+    }
+    if (pattern->op != node->op) return false;
+    for (int i = 0; i < 2 && pattern->kids[i]; i++) {
+        if (!match_pattern(pattern->kids[i], node->kids[i], cost)) return false;
+    }
+    return true;
+}
+
+static bool record_rule(SelNode* node, const Rule* rule, int cost) {
+    if (cost >= node->cost[rule->lhs]) return false;
+    node->cost[rule->lhs] = cost;
+    node->rule[rule->lhs] = rule;
+    return true;
+}
+
+static void label_tree(SelNode* node) {
+    for (int i = 0; i < 2; i++) {
+        if (node->kids[i]) label_tree(node->kids[i]);
+    }
+    for (int nt = 0; nt < NT_COUNT; nt++) {
+        node->cost[nt] = INFINITE_COST;
+        node->rule[nt] = NULL;
+    }
+    for (int r = 0; r < RULE_COUNT; r++) {
+        const Rule* rule = &rules[r];
+        int cost = rule->cost;
+        if (rule->pattern->op == SEL_NT || !match_pattern(rule->pattern, node, &cost) ||
+            (rule->applies && !rule->applies(node))) {
+            continue;
+        }
+        if (rule->two_address && node->target != NO_REGISTER &&
+            node->kids[0]->op == SEL_REG && node->kids[0]->leaf.reg == node->target) {
+            cost--;
+        }
+        record_rule(node, rule, cost);
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int r = 0; r < RULE_COUNT; r++) {
+            const Rule* rule = &rules[r];
+            if (rule->pattern->op != SEL_NT || node->cost[rule->pattern->nt] == INFINITE_COST) {
+                continue;
+            }
+            changed |= record_rule(node, rule, node->cost[rule->pattern->nt] + rule->cost);
+        }
+    }
+}
+
+// Gathers the subtrees matched by the pattern's nonterminal leaves
+static int collect_kids(const Pattern* pattern, SelNode* node, SelNode** kids,
+                        Nonterminal* nts, int count) {
+    if (pattern->op == SEL_NT) {
+        kids[count] = node;
+        nts[count] = pattern->nt;
+        return count + 1;
+    }
+    for (int i = 0; i < 2 && pattern->kids[i]; i++) {
+        count = collect_kids(pattern->kids[i], node->kids[i], kids, nts, count);
+    }
+    return count;
+}
+
+// Emits code deriving nt from the labelled node, computing into target
+// when it names a register and the value needs one
+static MachineOperand reduce(Selector* sel, SelNode* node, Nonterminal nt, int target) {
+    const Rule* rule = node->rule[nt];
+    if (!rule) {
+        fprintf(stderr, "Code generation error: no instruction pattern covers expression\n");
+        exit(1);
+    }
+    SelNode* kids[4];
+    Nonterminal nts[4];
+    collect_kids(rule->pattern, node, kids, nts, 0);
+    return rule->reduce(sel, node, kids, nts, target);
+}
+
+static MachineOperand location_operand(Selector* sel, Location location) {
+    switch (location.kind) {
+        case LOC_REG:
+            return mir_reg(location.reg);
+        case LOC_STACK:
+            if (sel->leaf) {
+                return mir_mem(REG_RSP, NO_REGISTER, 1, sel->frame_size - 8 * (location.slot + 1));
+            }
+            return mir_mem(REG_RBP, NO_REGISTER, 1, -8 * (sel->saved_count + location.slot + 1));
+        case LOC_ARG:
+            if (sel->leaf) {
+                return mir_mem(REG_RSP, NO_REGISTER, 1,
+                               sel->frame_size + 8 * (sel->saved_count + location.slot + 1));
+            }
+            return mir_mem(REG_RBP, NO_REGISTER, 1, 16 + 8 * location.slot);
+        case LOC_IMM:
+            return mir_imm(location.imm);
+        default:
+            fprintf(stderr, "Code generation error: operand has no location\n");
+            exit(1);
+    }
+}
+
+static Location register_location(Register reg) {
+    Location location = { LOC_REG, reg, -1, 0 };
+    return location;
+}
+
+static Location immediate_location(int value) {
+    Location location = { LOC_IMM, -1, -1, value };
+    return location;
+}
+
+static void emit_op(Selector* sel, MachineOpcode opcode, Location from, Location to) {
+    mir_append(sel->out, opcode, 2, location_operand(sel, from), location_operand(sel, to));
+}
+
+static void emit_operand_move(Selector* sel, MachineOperand from, MachineOperand to) {
+    if (same_operand(from, to)) return;
+    if (from.kind == MOP_MEM && to.kind == MOP_MEM) {
+        mir_append(sel->out, MI_MOV, 2, from, mir_reg(REG_R11));
+        from = mir_reg(REG_R11);
+    }
+    mir_append(sel->out, MI_MOV, 2, from, to);
+}
+
+static void emit_move(Selector* sel, Location from, Location to) {
+    if (to.kind == LOC_NONE || to.kind == LOC_IMM || from.kind == LOC_NONE) return;
+    emit_operand_move(sel, location_operand(sel, from), location_operand(sel, to));
+}
+
+// Performs the moves as if all at once: a move goes ahead once no other
+// pending move still reads its destination, and each cycle left over is
+// broken by saving one destination in %rax
+static void emit_parallel_move(Selector* sel, MoveList* list) {
+    if (!list || list->count == 0) return;
+    int n = list->count;
+    Move* moves = malloc(sizeof(Move) * n);
+    bool* done = calloc(n, sizeof(bool));
+    memcpy(moves, list->moves, sizeof(Move) * n);
+    int remaining = n;
+
+    while (remaining > 0) {
+        bool progress = false;
+        for (int i = 0; i < n; i++) {
+            if (done[i]) continue;
+            bool blocked = false;
+            for (int j = 0; j < n && !blocked; j++) {
+                blocked = !done[j] && j != i && same_location(moves[j].from, moves[i].to);
+            }
+            if (blocked) continue;
+            emit_move(sel, moves[i].from, moves[i].to);
+            done[i] = true;
+            remaining--;
+            progress = true;
+        }
+        if (progress) continue;
+
+        int first = 0;
+        while (done[first]) first++;
+        Location saved = register_location(REG_RAX);
+        emit_move(sel, moves[first].to, saved);
+        for (int j = 0; j < n; j++) {
+            if (!done[j] && same_location(moves[j].from, moves[first].to)) moves[j].from = saved;
+        }
+    }
+    free(moves);
+    free(done);
+}
+
+static Location operand_location(Selector* sel, const char* operand, int position) {
+    if (is_immediate_operand(operand)) return immediate_location(atoi(operand));
+    return get_location(sel->alloc, operand, position);
+}
+
+// Values computed but never read still need somewhere to go
+static Location dest_location(Selector* sel, IRInstr* instr, int k) {
+    Location location = get_location(sel->alloc, instr->dest, DEF_POSITION(k));
+    return location.kind == LOC_NONE ? register_location(REG_RAX) : location;
+}
+
+static bool has_constant_count(Selector* sel, IRInstr* instr, int k) {
+    return operand_location(sel, instr->src2, USE_POSITION(k)).kind == LOC_IMM;
+}
+
+// Instructions whose result can be computed as part of a larger tree
+static bool is_tree_value(Selector* sel, IRInstr* instr, int k) {
+    if (!instr->dest) return false;
+    switch (instr->op) {
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_LOAD:
+        case IR_ASSIGN:
+            return true;
+        case IR_SHR:
+            return has_constant_count(sel, instr, k);
+        default:
+            return false;
+    }
+}
+
+// Instructions that read all their operands as trees
+static bool is_tree_root(Selector* sel, IRInstr* instr, int k) {
+    switch (instr->op) {
+        case IR_COMPARE:
+        case IR_JUMP_COMPARE:
+        case IR_STORE:
+            return true;
+        case IR_RETURN:
+            return instr->src1 != NULL;
+        default:
+            return is_tree_value(sel, instr, k) && instr->src1;
+    }
+}
+
+static void count_name(NameMap* counts, const char* name) {
+    int count = name_map_get(counts, name);
+    name_map_put(counts, name, count < 0 ? 1 : count + 1);
+}
+
+static bool is_conditional_move(IRInstr* instr) {
+    return instr->op == IR_CMOVZ || instr->op == IR_CMOVNZ;
+}
+
+// Marks the values defined once and read once, by the next instruction
+// of the same block with nothing moved in between.  The leaves of their
+// trees then still hold the same values when that instruction runs.
+// Likewise a compare read only as the condition of the conditional
+// moves right after it leaves its answer in the flags for them.
+static void find_folded_values(Selector* sel) {
+    CFG* cfg = sel->cfg;
+    NameMap* uses = create_name_map(64);
+    NameMap* defs = create_name_map(64);
+    for (int i = cfg->start; i < cfg->end; i++) {
+        IRInstr* instr = sel->program->instructions[i];
+        const char* names[3];
+        int count = read_operands(instr, names);
+        for (int j = 0; j < count; j++) {
+            count_name(uses, names[j]);
+        }
+        if (writes_dest(instr)) count_name(defs, instr->dest);
+    }
+
+    int* depth = calloc(cfg->end - cfg->start, sizeof(int));
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        for (int i = block->start; i < block->end; i++) {
+            IRInstr* instr = sel->program->instructions[i];
+            IRInstr* next = sel->program->instructions[i + 1];
+            int k = i - cfg->start;
+            depth[k] = 1 + (k > 0 && sel->folded[k - 1] ? depth[k - 1] : 0);
+            sel->folded[k] = is_tree_value(sel, instr, k) && depth[k] <= MAX_FOLD_DEPTH &&
+                             name_map_get(uses, instr->dest) == 1 &&
+                             name_map_get(defs, instr->dest) == 1 &&
+                             is_tree_root(sel, next, k + 1) && reads_operand(next, instr->dest) &&
+                             sel->alloc->moves_before[k + 1].count == 0;
+            if (instr->op != IR_COMPARE || name_map_get(defs, instr->dest) != 1) continue;
+            int moves = 0;
+            for (int j = i + 1; j <= block->end; j++) {
+                IRInstr* move = sel->program->instructions[j];
+                if (!is_conditional_move(move) || strcmp(move->src1, instr->dest) != 0 ||
+                    sel->alloc->moves_before[j - cfg->start].count != 0) {
+                    break;
+                }
+                moves++;
+            }
+            sel->flag_compares[k] = moves > 0 && name_map_get(uses, instr->dest) == moves;
+        }
+    }
+    free(depth);
+    free_name_map(uses);
+    free_name_map(defs);
+}
+
+static SelNode* new_node(Selector* sel, SelOp op) {
+    if (sel->node_count == MAX_TREE_NODES) {
+        fprintf(stderr, "Code generation error: expression tree too large\n");
+        exit(1);
+    }
+    SelNode* node = &sel->nodes[sel->node_count++];
+    memset(node, 0, sizeof(SelNode));
+    node->op = op;
+    node->target = NO_REGISTER;
+    return node;
+}
+
+static SelNode* new_leaf(Selector* sel, MachineOperand leaf) {
+    SelNode* node = new_node(sel, leaf.kind == MOP_REG ? SEL_REG
+                                  : leaf.kind == MOP_IMM ? SEL_IMM : SEL_MEM);
+    node->leaf = leaf;
+    return node;
+}
+
+static SelNode* build_value(Selector* sel, int i);
+
+// Tree for operand as instruction i reads it
+static SelNode* build_operand(Selector* sel, const char* operand, int i) {
+    int k = i - sel->cfg->start;
+    if (k > 0 && sel->folded[k - 1] &&
+        strcmp(sel->program->instructions[i - 1]->dest, operand) == 0) {
+        return build_value(sel, i - 1);
+    }
+    return new_leaf(sel, location_operand(sel, operand_location(sel, operand, USE_POSITION(k))));
+}
+
+// Tree for the value instruction i computes
+static SelNode* build_value(Selector* sel, int i) {
+    IRInstr* instr = sel->program->instructions[i];
+    if (instr->op == IR_ASSIGN) {
+        return instr->src1 ? build_operand(sel, instr->src1, i)
+                           : new_leaf(sel, mir_imm(instr->value));
+    }
+    if (instr->op == IR_LOAD) {
+        SelNode* node = new_node(sel, SEL_LOAD);
+        node->kids[0] = build_operand(sel, instr->src1, i);
+        return node;
+    }
+    SelNode* node = new_node(sel, instr->op == IR_ADD ? SEL_ADD : instr->op == IR_SUB ? SEL_SUB
+                                  : instr->op == IR_MUL ? SEL_MUL : SEL_SHR);
+    node->kids[0] = build_operand(sel, instr->src1, i);
+    node->kids[1] = build_operand(sel, instr->src2, i);
+    // Immediates go right, and products right of what they are added to
+    bool commutative = node->op == SEL_ADD || node->op == SEL_MUL;
+    if (commutative && (node->kids[0]->op == SEL_IMM ||
+                        (node->kids[0]->op == SEL_MUL && node->kids[1]->op != SEL_IMM))) {
+        SelNode* swap = node->kids[0];
+        node->kids[0] = node->kids[1];
+        node->kids[1] = swap;
+    }
+    return node;
+}
+
+static void finish_tree(Selector* sel) {
+    sel->node_count = 0;
+    memset(sel->busy, 0, sizeof(sel->busy));
+}
+
+static MachineOperand reduce_register_or_immediate(Selector* sel, SelNode* tree) {
+    label_tree(tree);
+    return reduce(sel, tree, tree->cost[NT_IMM] == 0 ? NT_IMM : NT_REG, NO_REGISTER);
+}
+
+// dest op= value for a destination in memory, when the tree is
+// dest op something
+static bool select_read_modify_write(Selector* sel, SelNode* tree, MachineOperand dest) {
+    if (tree->op != SEL_ADD && tree->op != SEL_SUB && tree->op != SEL_SHR) return false;
+    if (tree->op == SEL_ADD && tree->kids[1]->op == SEL_MEM &&
+        same_operand(tree->kids[1]->leaf, dest)) {
+        SelNode* swap = tree->kids[0];
+        tree->kids[0] = tree->kids[1];
+        tree->kids[1] = swap;
+    }
+    if (tree->kids[0]->op != SEL_MEM || !same_operand(tree->kids[0]->leaf, dest)) return false;
+    MachineOperand value = reduce_register_or_immediate(sel, tree->kids[1]);
+    mir_append(sel->out, arithmetic_opcode(tree->op), 2, value, dest);
+    return true;
+}
+
+// Computes the tree into dest
+static void select_value(Selector* sel, SelNode* tree, Location dest) {
+    if (dest.kind == LOC_NONE || dest.kind == LOC_IMM) return;
+    if (dest.kind == LOC_REG) {
+        bool commutative = tree->op == SEL_ADD || tree->op == SEL_MUL;
+        if (commutative && tree->kids[1]->op == SEL_REG && tree->kids[1]->leaf.reg == dest.reg &&
+            tree->kids[0]->op != SEL_IMM) {
+            SelNode* swap = tree->kids[0];
+            tree->kids[0] = tree->kids[1];
+            tree->kids[1] = swap;
+        }
+        sel->busy[dest.reg] = true;
+        tree->target = dest.reg;
+        label_tree(tree);
+        emit_operand_move(sel, reduce(sel, tree, NT_REG, dest.reg), mir_reg(dest.reg));
+        return;
+    }
+    MachineOperand to = location_operand(sel, dest);
+    if (select_read_modify_write(sel, tree, to)) return;
+    emit_operand_move(sel, reduce_register_or_immediate(sel, tree), to);
+}
+
+static ConditionCode relation_condition(int relation) {
+    switch (relation) {
+        case TOKEN_EQUALS: return COND_E;
+        case TOKEN_NOT_EQUALS: return COND_NE;
+        case TOKEN_LESS: return COND_L;
+        case TOKEN_LESS_EQUALS: return COND_LE;
+        case TOKEN_GREATER: return COND_G;
+        default: return COND_GE;
+    }
+}
+
+static void emit_prologue(Selector* sel) {
+    if (!sel->leaf) {
+        mir_append(sel->out, MI_PUSH, 1, mir_reg(REG_RBP));
+        mir_append(sel->out, MI_MOV, 2, mir_reg(REG_RSP), mir_reg(REG_RBP));
+    }
+    for (int i = 0; i < sel->saved_count; i++) {
+        mir_append(sel->out, MI_PUSH, 1, mir_reg(sel->saved[i]));
+    }
+    if (sel->frame_size > 0) {
+        mir_append(sel->out, MI_SUB, 2, mir_imm(sel->frame_size), mir_reg(REG_RSP));
+    }
+}
+
+static void emit_epilogue(Selector* sel) {
+    if (sel->leaf) {
+        if (sel->frame_size > 0) {
+            mir_append(sel->out, MI_ADD, 2, mir_imm(sel->frame_size), mir_reg(REG_RSP));
+        }
+        for (int i = sel->saved_count - 1; i >= 0; i--) {
+            mir_append(sel->out, MI_POP, 1, mir_reg(sel->saved[i]));
+        }
+        return;
+    }
+    if (sel->saved_count > 0) {
+        if (sel->frame_size > 0) {
+            mir_append(sel->out, MI_LEA, 2, mir_mem(REG_RBP, NO_REGISTER, 1, -8 * sel->saved_count),
+                       mir_reg(REG_RSP));
+        }
+        for (int i = sel->saved_count - 1; i >= 0; i--) {
+            mir_append(sel->out, MI_POP, 1, mir_reg(sel->saved[i]));
+        }
+    } else {
+        mir_append(sel->out, MI_MOV, 2, mir_reg(REG_RBP), mir_reg(REG_RSP));
+    }
+    mir_append(sel->out, MI_POP, 1, mir_reg(REG_RBP));
+}
+
+// Parameters arrive in the argument registers and above the return
+// address, and move to their locations all at once
+static void emit_parameter_moves(Selector* sel) {
+    MoveList moves = {0};
+    int start = sel->cfg->start;
+    for (int i = start + 1, p = 0; i < sel->cfg->end &&
+         sel->program->instructions[i]->op == IR_PARAM; i++, p++) {
+        IRInstr* param = sel->program->instructions[i];
+        if (!param->dest) continue;
+        Location from = { LOC_ARG, -1, p - MAX_REGISTER_ARGS, 0 };
+        if (p < MAX_REGISTER_ARGS) from = register_location(argument_registers[p]);
+        add_move(&moves, from, get_location(sel->alloc, param->dest, DEF_POSITION(0)));
+    }
+    emit_parallel_move(sel, &moves);
+    free(moves.moves);
+}
+
+// Arguments of the call at k, taken off the pending stack.  The first
+// six go to registers together; the rest are pushed right to left.
+static void emit_call_arguments(Selector* sel, IRInstr* call, int k, int* stack_bytes) {
+    int argc = call->value < sel->pending_count ? call->value : sel->pending_count;
+    sel->pending_count -= argc;
+    int* args = sel->pending_args + sel->pending_count;
+    int start = sel->cfg->start;
+    Location* values = malloc(sizeof(Location) * (argc + 1));
+    for (int j = 0; j < argc; j++) {
+        const char* operand = sel->program->instructions[args[j]]->src1;
+        values[j] = operand_location(sel, operand, USE_POSITION(k));
+        if (values[j].kind == LOC_NONE) {
+            values[j] = operand_location(sel, operand, USE_POSITION(args[j] - start));
+        }
+    }
+
+    *stack_bytes = 0;
+    if (argc > MAX_REGISTER_ARGS) {
+        int stack_args = argc - MAX_REGISTER_ARGS;
+        if (stack_args % 2) {
+            mir_append(sel->out, MI_SUB, 2, mir_imm(8), mir_reg(REG_RSP));
+            *stack_bytes += 8;
+        }
+        for (int j = argc - 1; j >= MAX_REGISTER_ARGS; j--) {
+            mir_append(sel->out, MI_PUSH, 1, location_operand(sel, values[j]));
+            *stack_bytes += 8;
+        }
+    }
+
+    MoveList moves = {0};
+    for (int j = 0; j < argc && j < MAX_REGISTER_ARGS; j++) {
+        add_move(&moves, values[j], register_location(argument_registers[j]));
+    }
+    emit_parallel_move(sel, &moves);
+    free(moves.moves);
+    free(values);
+}
+
+// Division and shifts by a variable count need fixed registers
+static void select_fixed_binary(Selector* sel, IRInstr* instr, int k) {
+    Location dest = dest_location(sel, instr, k);
+    Location left = operand_location(sel, instr->src1, USE_POSITION(k));
+    Location right = operand_location(sel, instr->src2, USE_POSITION(k));
+    Location rax = register_location(REG_RAX);
+
+    if (instr->op == IR_DIV) {
+        emit_move(sel, left, rax);
+        mir_append(sel->out, MI_CQTO, 0);
+        if (right.kind == LOC_IMM) {
+            emit_move(sel, right, register_location(REG_R11));
+            right = register_location(REG_R11);
+        }
+        mir_append(sel->out, MI_IDIV, 1, location_operand(sel, right));
+        emit_move(sel, rax, dest);
+        return;
+    }
+
+    Location work = dest;
+    if (dest.kind != LOC_REG || same_location(dest, right)) work = rax;
+    emit_move(sel, left, work);
+    emit_move(sel, right, register_location(REG_RCX));
+    mir_append(sel->out, MI_SAR, 2, mir_reg8(REG_RCX), location_operand(sel, work));
+    emit_move(sel, work, dest);
+}
+
+// Compares the operand trees and returns the relation the flags then
+// answer, swapped if an immediate had to move to the right
+static int emit_comparison(Selector* sel, SelNode* left, SelNode* right, int relation) {
+    if (left->op == SEL_IMM && right->op != SEL_IMM) {
+        SelNode* swap = left;
+        left = right;
+        right = swap;
+        relation = swap_relation(relation);
+    }
+    label_tree(left);
+    label_tree(right);
+    MachineOperand l = reduce(sel, left, NT_RM, NO_REGISTER);
+    MachineOperand r = reduce(sel, right, NT_RMI, NO_REGISTER);
+    if (l.kind == MOP_MEM && r.kind == MOP_MEM) {
+        release_operand(sel, r);
+        int reg = take_scratch(sel);
+        mir_append(sel->out, MI_MOV, 2, r, mir_reg(reg));
+        r = mir_reg(reg);
+    }
+    mir_append(sel->out, MI_CMP, 2, r, l);
+    return relation;
+}
+
+static void select_compare(Selector* sel, IRInstr* instr, int i) {
+    int k = i - sel->cfg->start;
+    Location dest = get_location(sel->alloc, instr->dest, DEF_POSITION(k));
+    if (dest.kind == LOC_NONE || dest.kind == LOC_IMM) return;
+    int relation = emit_comparison(sel, build_operand(sel, instr->src1, i),
+                                   build_operand(sel, instr->src2, i), instr->value);
+    if (sel->flag_compares[k]) {
+        sel->flags_value = instr->dest;
+        sel->flags_relation = relation;
+        return;
+    }
+    mir_append(sel->out, MI_SETCC, 1, mir_reg8(REG_RAX))->cond = relation_condition(relation);
+    MachineOperand to = location_operand(sel, dest);
+    MachineOperand widened = to.kind == MOP_REG ? to : mir_reg(REG_RAX);
+    mir_append(sel->out, MI_MOVZB, 2, mir_reg8(REG_RAX), widened);
+    emit_operand_move(sel, widened, to);
+}
+
+// cmov wants its destination in a register and cannot take an
+// immediate, so those go through %rax and %r11 with movs, which leave
+// the flags as the test or compare set them
+static void select_conditional_move(Selector* sel, IRInstr* instr, int k) {
+    Location dest = get_location(sel->alloc, instr->dest, DEF_POSITION(k));
+    if (dest.kind == LOC_NONE || dest.kind == LOC_IMM) return;
+    Location value = operand_location(sel, instr->src2, USE_POSITION(k));
+    ConditionCode cond;
+    if (sel->flags_value && strcmp(instr->src1, sel->flags_value) == 0) {
+        int relation = sel->flags_relation;
+        cond = relation_condition(instr->op == IR_CMOVZ ? negate_relation(relation) : relation);
+    } else {
+        Location test = operand_location(sel, instr->src1, USE_POSITION(k));
+        if (test.kind == LOC_IMM) {
+            if ((test.imm == 0) == (instr->op == IR_CMOVZ)) emit_move(sel, value, dest);
+            return;
+        }
+        if (test.kind == LOC_REG) {
+            emit_op(sel, MI_TEST, test, test);
+        } else {
+            emit_op(sel, MI_CMP, immediate_location(0), test);
+        }
+        cond = instr->op == IR_CMOVZ ? COND_E : COND_NE;
+        sel->flags_value = instr->src1;
+        sel->flags_relation = TOKEN_NOT_EQUALS;
+    }
+    if (sel->flags_value && strcmp(instr->dest, sel->flags_value) == 0) sel->flags_value = NULL;
+    // The value kept when the move is not made
+    emit_move(sel, get_location(sel->alloc, instr->dest, USE_POSITION(k)), dest);
+    MachineOperand to = location_operand(sel, dest);
+    MachineOperand target = to.kind == MOP_REG ? to : mir_reg(REG_RAX);
+    emit_operand_move(sel, to, target);
+    MachineOperand from = location_operand(sel, value);
+    if (from.kind == MOP_IMM) {
+        mir_append(sel->out, MI_MOV, 2, from, mir_reg(REG_R11));
+        from = mir_reg(REG_R11);
+    }
+    mir_append(sel->out, MI_CMOV, 2, from, target)->cond = cond;
+    emit_operand_move(sel, target, to);
+}
+
+static void select_store(Selector* sel, IRInstr* instr, int i) {
+    MachineOperand value = reduce_register_or_immediate(sel, build_operand(sel, instr->src1, i));
+    SelNode* address = build_operand(sel, instr->dest, i);
+    label_tree(address);
+    mir_append(sel->out, MI_MOV, 2, value, reduce(sel, address, NT_ADDR, NO_REGISTER));
+}
+
+// Jumps to target along the edge from block, through a stub when the
+// edge needs moves the block cannot make itself
+static void emit_branch(Selector* sel, MachineOpcode opcode, ConditionCode cond,
+                        BasicBlock* block, const char* target) {
+    BasicBlock* successor = find_block_by_label(sel->cfg, target);
+    MoveList* moves = successor ? find_edge_moves(sel->alloc, block->index,
+                                                  successor->index) : NULL;
+    if (!moves) {
+        mir_append(sel->out, opcode, 1, mir_label(target))->cond = cond;
+        return;
+    }
+    sel->stubs = realloc(sel->stubs, sizeof(MoveStub) * (sel->stub_count + 1));
+    MoveStub* stub = &sel->stubs[sel->stub_count++];
+    stub->label = (*sel->label_count)++;
+    stub->moves = moves;
+    stub->target = target;
+    stub->block = block->index;
+    char name[32];
+    sprintf(name, "LR%d", stub->label);
+    mir_append(sel->out, opcode, 1, mir_label(name))->cond = cond;
+}
+
+static void emit_fallthrough_moves(Selector* sel, BasicBlock* block) {
+    if (block->index + 1 >= sel->cfg->block_count) return;
+    emit_parallel_move(sel, find_edge_moves(sel->alloc, block->index, block->index + 1));
+}
+
+// The frame is torn down just before the next instruction
+static void mark_exit(Selector* sel, BasicBlock* block) {
+    sel->exits = realloc(sel->exits, sizeof(int) * (sel->exit_count + 1));
+    sel->exit_blocks = realloc(sel->exit_blocks, sizeof(int) * (sel->exit_count + 1));
+    sel->exits[sel->exit_count] = sel->out->count;
+    sel->exit_blocks[sel->exit_count++] = block->index;
+}
+
+// Whether instr relies on the prologue: a call, a callee-saved
+// register it preserves, or memory in the frame
+static bool uses_frame(Selector* sel, MachineInstr* instr) {
+    if (instr->opcode == MI_CALL) return true;
+    for (int j = 0; j < instr->operand_count; j++) {
+        MachineOperand operand = instr->operands[j];
+        if (operand.kind == MOP_MEM && (operand.reg == REG_RBP || operand.reg == REG_RSP)) {
+            return true;
+        }
+        for (int r = 0; r < sel->saved_count; r++) {
+            if (operand_reads_register(operand, sel->saved[r])) return true;
+        }
+    }
+    return false;
+}
+
+static bool range_uses_frame(Selector* sel, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        if (uses_frame(sel, &sel->out->instrs[i])) return true;
+    }
+    return false;
+}
+
+// Shrink-wrapping: the prologue goes at the top of the block
+// find_save_block picks and an epilogue before each exit that block
+// dominates, so early exits that need no frame run without one
+static void place_frame(Selector* sel) {
+    CFG* cfg = sel->cfg;
+    bool* needs_frame = calloc(cfg->block_count, sizeof(bool));
+    for (int b = 0; b < cfg->block_count; b++) {
+        needs_frame[b] = range_uses_frame(sel, sel->block_begin[b], sel->block_begin[b + 1]);
+    }
+    for (int s = 0; s < sel->stub_count; s++) {
+        int end = s + 1 < sel->stub_count ? sel->stubs[s + 1].begin : sel->out->count;
+        if (range_uses_frame(sel, sel->stubs[s].begin, end)) {
+            needs_frame[sel->stubs[s].block] = true;
+        }
+    }
+    BasicBlock* save = find_save_block(cfg, needs_frame);
+    free(needs_frame);
+
+    MachineFunction* body = sel->out;
+    sel->out = create_machine_function(body->name);
+    int next_exit = 0;
+    for (int i = 0; i <= body->count; i++) {
+        if (save && i == sel->frame_points[save->index]) emit_prologue(sel);
+        for (; next_exit < sel->exit_count && sel->exits[next_exit] == i; next_exit++) {
+            if (save && dominates(cfg, save, cfg->blocks[sel->exit_blocks[next_exit]])) {
+                emit_epilogue(sel);
+            }
+        }
+        if (i < body->count) mir_append_instr(sel->out, &body->instrs[i]);
+    }
+    body->count = 0;
+    free_machine_function(body);
+}
+
+// The flags from the cmp feed the jump directly, with no 0/1 value
+static void select_compare_branch(Selector* sel, BasicBlock* block, int i) {
+    IRInstr* instr = sel->program->instructions[i];
+    SelNode* left = build_operand(sel, instr->src1, i);
+    SelNode* right = build_operand(sel, instr->src2, i);
+    if (left->op == SEL_IMM && right->op == SEL_IMM) {
+        if (evaluate_relation(instr->value, left->leaf.value, right->leaf.value)) {
+            emit_branch(sel, MI_JMP, 0, block, instr->label->name);
+        }
+        return;
+    }
+    int relation = emit_comparison(sel, left, right, instr->value);
+    emit_branch(sel, MI_JCC, relation_condition(relation), block, instr->label->name);
+}
+
+static void select_ir_instruction(Selector* sel, BasicBlock* block, int i) {
+    IRInstr* instr = sel->program->instructions[i];
+    int k = i - sel->cfg->start;
+    if (sel->folded[k]) return;
+    if (!is_conditional_move(instr)) sel->flags_value = NULL;
+
+    switch (instr->op) {
+        case IR_LABEL:
+            if (is_function_label(instr)) {
+                mir_append(sel->out, MI_LABEL, 1, mir_symbol(instr->label->name));
+                sel->frame_points[block->index] = sel->out->count;
+                emit_parameter_moves(sel);
+            } else {
+                mir_append(sel->out, MI_LABEL, 1, mir_label(instr->label->name));
+                sel->frame_points[block->index] = sel->out->count;
+            }
+            break;
+
+        case IR_PARAM:
+            break;
+
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_SHR:
+        case IR_LOAD:
+        case IR_ASSIGN:
+            if (instr->op == IR_SHR && !has_constant_count(sel, instr, k)) {
+                select_fixed_binary(sel, instr, k);
+                break;
+            }
+            select_value(sel, build_value(sel, i),
+                         get_location(sel->alloc, instr->dest, DEF_POSITION(k)));
+            break;
+
+        case IR_DIV:
+            select_fixed_binary(sel, instr, k);
+            break;
+
+        case IR_COMPARE:
+            select_compare(sel, instr, i);
+            break;
+
+        case IR_STORE:
+            select_store(sel, instr, i);
+            break;
+
+        case IR_CMOVZ:
+        case IR_CMOVNZ:
+            select_conditional_move(sel, instr, k);
+            break;
+
+        case IR_JUMP:
+            emit_parallel_move(sel, find_edge_moves(sel->alloc, block->index,
+                               find_block_by_label(sel->cfg, instr->label->name)->index));
+            mir_append(sel->out, MI_JMP, 1, mir_label(instr->label->name));
+            break;
+
+        case IR_JUMPZ:
+        case IR_JUMPNZ: {
+            Location cond = operand_location(sel, instr->src1, USE_POSITION(k));
+            if (cond.kind == LOC_IMM) {
+                if ((cond.imm == 0) == (instr->op == IR_JUMPZ)) {
+                    emit_branch(sel, MI_JMP, 0, block, instr->label->name);
+                }
+            } else {
+                if (cond.kind == LOC_REG) {
+                    emit_op(sel, MI_TEST, cond, cond);
+                } else {
+                    emit_op(sel, MI_CMP, immediate_location(0), cond);
+                }
+                emit_branch(sel, MI_JCC, instr->op == IR_JUMPZ ? COND_E : COND_NE, block,
+                            instr->label->name);
+            }
+            break;
+        }
+
+        case IR_JUMP_COMPARE:
+            select_compare_branch(sel, block, i);
+            break;
+
+        case IR_ARG:
+            sel->pending_args[sel->pending_count++] = i;
+            break;
+
+        case IR_CALL: {
+            int stack_bytes;
+            emit_call_arguments(sel, instr, k, &stack_bytes);
+            mir_append(sel->out, MI_CALL, 1, mir_symbol(instr->src1));
+            if (stack_bytes > 0) {
+                mir_append(sel->out, MI_ADD, 2, mir_imm(stack_bytes), mir_reg(REG_RSP));
+            }
+            if (instr->dest) {
+                emit_move(sel, register_location(REG_RAX),
+                          get_location(sel->alloc, instr->dest, DEF_POSITION(k)));
+            }
+            break;
+        }
+
+        case IR_TAIL_CALL: {
+            // Arguments go straight into registers, then the frame is
+            // released so the callee returns to our caller
+            int stack_bytes;
+            emit_call_arguments(sel, instr, k, &stack_bytes);
+            mark_exit(sel, block);
+            mir_append(sel->out, MI_JMP, 1, mir_symbol(instr->src1));
+            break;
+        }
+
+        case IR_RETURN:
+            if (instr->src1) {
+                select_value(sel, build_operand(sel, instr->src1, i),
+                             register_location(REG_RAX));
+            }
+            mark_exit(sel, block);
+            mir_append(sel->out, MI_RET, 0);
+            break;
+    }
+    finish_tree(sel);
+}
+
+MachineFunction* select_instructions(IRProgram* program, CFG* cfg, RegAllocation* alloc,
+                                     int* label_count) {
+    Selector* sel = calloc(1, sizeof(Selector));
+    sel->program = program;
+    sel->cfg = cfg;
+    sel->alloc = alloc;
+    sel->label_count = label_count;
+    sel->out = create_machine_function(program->instructions[cfg->start]->label->name);
+    for (int r = 0; r < REG_COUNT; r++) {
+        if (alloc->used[r] && is_callee_saved(r)) sel->saved[sel->saved_count++] = r;
+    }
+    sel->leaf = true;
+    for (int i = cfg->start; i < cfg->end; i++) {
+        if (program->instructions[i]->op == IR_CALL) sel->leaf = false;
+    }
+    sel->frame_size = sel->leaf ? leaf_frame_size(alloc->slot_count)
+                                : frame_size(alloc->slot_count, sel->saved_count);
+    sel->pending_args = malloc(sizeof(int) * (cfg->end - cfg->start + 1));
+    sel->folded = calloc(cfg->end - cfg->start, sizeof(bool));
+    sel->flag_compares = calloc(cfg->end - cfg->start, sizeof(bool));
+    sel->block_begin = malloc(sizeof(int) * (cfg->block_count + 1));
+    sel->frame_points = malloc(sizeof(int) * cfg->block_count);
+    find_folded_values(sel);
+
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        sel->block_begin[b] = sel->out->count;
+        sel->frame_points[b] = sel->out->count;
+        for (int i = block->start; i <= block->end; i++) {
+            emit_parallel_move(sel, &alloc->moves_before[i - cfg->start]);
+            select_ir_instruction(sel, block, i);
+        }
+        IRInstr* last = program->instructions[block->end];
+        if (last->op != IR_JUMP && !is_exit(last)) {
+            emit_fallthrough_moves(sel, block);
+        }
+    }
+
+    sel->block_begin[cfg->block_count] = sel->out->count;
+
+    for (int s = 0; s < sel->stub_count; s++) {
+        char name[32];
+        sprintf(name, "LR%d", sel->stubs[s].label);
+        sel->stubs[s].begin = sel->out->count;
+        mir_append(sel->out, MI_LABEL, 1, mir_label(name));
+        emit_parallel_move(sel, sel->stubs[s].moves);
+        mir_append(sel->out, MI_JMP, 1, mir_label(sel->stubs[s].target));
+    }
+
+    place_frame(sel);
+
+    MachineFunction* function = sel->out;
+    free(sel->stubs);
+    free(sel->block_begin);
+    free(sel->frame_points);
+    free(sel->exits);
+    free(sel->exit_blocks);
+    free(sel->pending_args);
+    free(sel->folded);
+    free(sel->flag_compares);
+    free(sel);
+    return function;
+}
@@ -0,0 +1,12 @@
+#ifndef ISEL_H
+#define ISEL_H
+
+#include "mir.h"
+
+// Selects machine instructions for the function cfg covers, given
+// where alloc placed its values.  Labels for blocks of edge moves are
+// numbered from *label_count.
+MachineFunction* select_instructions(IRProgram* program, CFG* cfg, RegAllocation* alloc,
+                                     int* label_count);
+
+#endif
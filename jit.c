@@ -0,0 +1,115 @@
+#include "jit.h"
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// jmp *0(%rip) followed by the target's address, padded to 16 bytes
+#define TRAMPOLINE_SIZE 16
+
+static void jit_error(const char* message) {
+    perror(message);
+    exit(1);
+}
+
+// Outside functions may be further than a rel32 call reaches, so each
+// gets an absolute jump after .text for the calls to go through
+static void write_trampoline(unsigned char* at, void* target) {
+    static const unsigned char jump[6] = { 0xff, 0x25, 0, 0, 0, 0 };
+    memset(at, 0xcc, TRAMPOLINE_SIZE);
+    memcpy(at, jump, sizeof(jump));
+    uint64_t address = (uint64_t)(uintptr_t)target;
+    memcpy(at + sizeof(jump), &address, sizeof(address));
+}
+
+JitModule* load_jit_module(ObjectCode* object) {
+    // Give each outside function called a trampoline slot
+    int* slots = malloc(sizeof(int) * (object->symbol_count > 0 ? object->symbol_count : 1));
+    int slot_count = 0;
+    for (int i = 0; i < object->symbol_count; i++) {
+        slots[i] = -1;
+    }
+    for (int i = 0; i < object->relocation_count; i++) {
+        int symbol = object->relocations[i].symbol;
+        if (slots[symbol] == -1) slots[symbol] = slot_count++;
+    }
+
+    size_t text_size = (object->text->length + TRAMPOLINE_SIZE - 1) / TRAMPOLINE_SIZE *
+                       TRAMPOLINE_SIZE;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = text_size + (size_t)slot_count * TRAMPOLINE_SIZE;
+    size = (size + page_size - 1) / page_size * page_size;
+    if (size == 0) size = page_size;
+
+    JitModule* module = malloc(sizeof(JitModule));
+    module->size = size;
+    module->code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (module->code == MAP_FAILED) jit_error("JIT error: mapping code");
+    memset(module->code, 0xcc, size);
+    memcpy(module->code, object->text->data, object->text->length);
+
+    for (int i = 0; i < object->symbol_count; i++) {
+        if (slots[i] == -1) continue;
+        void* target = dlsym(RTLD_DEFAULT, object->symbols[i].name);
+        if (!target) {
+            fprintf(stderr, "JIT error: undefined function '%s'\n", object->symbols[i].name);
+            exit(1);
+        }
+        write_trampoline(module->code + text_size + (size_t)slots[i] * TRAMPOLINE_SIZE, target);
+    }
+    for (int i = 0; i < object->relocation_count; i++) {
+        ObjectRelocation* relocation = &object->relocations[i];
+        long trampoline = (long)text_size + (long)slots[relocation->symbol] * TRAMPOLINE_SIZE;
+        int32_t displacement = (int32_t)(trampoline + relocation->addend - relocation->offset);
+        memcpy(module->code + relocation->offset, &displacement, sizeof(displacement));
+    }
+    free(slots);
+
+    if (mprotect(module->code, size, PROT_READ | PROT_EXEC) != 0) {
+        jit_error("JIT error: making code executable");
+    }
+
+    int capacity = object->symbol_count > 0 ? object->symbol_count : 1;
+    module->symbols = malloc(sizeof(ObjectSymbol) * capacity);
+    module->symbol_count = 0;
+    for (int i = 0; i < object->symbol_count; i++) {
+        if (object->symbols[i].offset == -1) continue;
+        ObjectSymbol* symbol = &module->symbols[module->symbol_count++];
+        *symbol = object->symbols[i];
+        symbol->name = strdup(symbol->name);
+    }
+    return module;
+}
+
+void* get_jit_symbol(JitModule* module, const char* name) {
+    for (int i = 0; i < module->symbol_count; i++) {
+        if (strcmp(module->symbols[i].name, name) == 0) {
+            return module->code + module->symbols[i].offset;
+        }
+    }
+    return NULL;
+}
+
+bool write_perf_map(JitModule* module) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+    for (int i = 0; i < module->symbol_count; i++) {
+        ObjectSymbol* symbol = &module->symbols[i];
+        fprintf(file, "%lx %lx %s\n", (unsigned long)(uintptr_t)(module->code + symbol->offset),
+                (unsigned long)symbol->size, symbol->name);
+    }
+    return fclose(file) == 0;
+}
+
+void free_jit_module(JitModule* module) {
+    munmap(module->code, module->size);
+    for (int i = 0; i < module->symbol_count; i++) {
+        free(module->symbols[i].name);
+    }
+    free(module->symbols);
+    free(module);
+}
@@ -0,0 +1,24 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "encoder.h"
+
+// In-process execution of encoded code.  The code is copied into memory
+// mapped writable, then made executable and no longer writable before
+// anything runs (W^X).
+typedef struct {
+    unsigned char* code;
+    size_t size;            // Bytes mapped, a whole number of pages
+    ObjectSymbol* symbols;  // Functions defined in the module
+    int symbol_count;
+} JitModule;
+
+// object must have been through finish_object_code.  Calls to functions
+// it does not define go to the process's own, looked up with dlsym.
+JitModule* load_jit_module(ObjectCode* object);
+void* get_jit_symbol(JitModule* module, const char* name);
+// Writes /tmp/perf-<pid>.map so perf can name frames in the module
+bool write_perf_map(JitModule* module);
+void free_jit_module(JitModule* module);
+
+#endif
@@ -3,6 +3,8 @@
 #include "ir.h"
 #include "optimizer.h"
 #include "semantic.h"
+#include "superopt.h"
+#include "jit.h"
 
 void print_phase_separator(const char* phase_name) {
     print_n_chars('=', 80);
@@ -68,29 +70,55 @@ void print_optimizations(OptFlags flags) {
     printf("Applied Optimizations:\n");
     printf("--------------------\n");
     printf("✓ Constant Folding:            %s\n", flags.constant_folding ? "Enabled" : "Disabled");
+    printf("✓ Rewrite Rules:               %s\n", flags.rewrite_rules ? "Enabled" : "Disabled");
     printf("✓ Dead Code Elimination:       %s\n", flags.dead_code_elimination ? "Enabled" : "Disabled");
+    printf("✓ CFG Simplification:          %s\n", flags.simplify_cfg ? "Enabled" : "Disabled");
     printf("✓ Common Subexpression Elim:   %s\n", flags.common_subexpression ? "Enabled" : "Disabled");
     printf("✓ Loop Unrolling:             %s\n", flags.loop_unrolling ? "Enabled" : "Disabled");
+    printf("✓ Loop Rotation:              %s\n", flags.loop_rotation ? "Enabled" : "Disabled");
+    printf("✓ If-Conversion:              %s\n", flags.if_conversion ? "Enabled" : "Disabled");
+    printf("✓ Loop-Invariant Code Motion: %s\n", flags.loop_invariant_motion ? "Enabled" : "Disabled");
     printf("✓ Strength Reduction:         %s\n", flags.strength_reduction ? "Enabled" : "Disabled");
+    printf("✓ Superoptimizer Cache:       %s\n", flags.superoptimizer ? "Enabled" : "Disabled");
+    printf("✓ Induction Variables:        %s\n", flags.induction_variables ? "Enabled" : "Disabled");
     printf("✓ Tail Recursion Elimination: %s\n", flags.tail_recursion ? "Enabled" : "Disabled");
     printf("✓ Function Inlining:          %s\n", flags.inline_functions ? "Enabled" : "Disabled");
     printf("\n");
 }
 
-void print_assembly(const char* filename) {
+// Shows the generator's buffer rather than reading the file back
+void print_assembly(CodeGenerator* gen) {
+    if (gen->object) {
+        printf("Generated machine code: %zu bytes\n", gen->object->text->length);
+        return;
+    }
     printf("Generated Assembly:\n");
     printf("------------------\n");
-    FILE* asm_file = fopen(filename, "r");
-    if (asm_file) {
-        char buffer[1024];
-        while (fgets(buffer, sizeof(buffer), asm_file)) {
-            printf("%s", buffer);
-        }
-        fclose(asm_file);
-    }
+    fwrite(gen->buffer->data, 1, gen->buffer->length, stdout);
     printf("\n");
 }
 
+// Runs the program's main in this process and returns its result as the
+// exit status
+int run_program(CodeGenerator* gen, bool perf_map) {
+    JitModule* module = load_jit_module(gen->object);
+    if (perf_map && !write_perf_map(module)) {
+        fprintf(stderr, "Could not write perf map\n");
+    }
+    long (*entry)(void) = (long (*)(void))get_jit_symbol(module, "main");
+    if (!entry) {
+        fprintf(stderr, "No main function to run\n");
+        free_jit_module(module);
+        return 1;
+    }
+    printf("\nRunning main...\n");
+    fflush(stdout);
+    long result = entry();
+    printf("Program returned: %ld\n", result);
+    free_jit_module(module);
+    return (int)result;
+}
+
 void print_n_chars(char c, int n) {
     for (int i = 0; i < n; i++) {
         putchar(c);
@@ -98,15 +126,53 @@ void print_n_chars(char c, int n) {
 }
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input.c> <output.s>\n", argv[0]);
+    // Options may appear anywhere; the remaining arguments are the input
+    // file and, unless the program is run in-process, the output file
+    OptLevel opt_level = OPT_O2;
+    bool time_report = false;
+    bool run = false;
+    bool perf_map = false;
+    const char* superopt_cache = NULL;
+    bool superoptimize = false;
+    const char* files[2];
+    int file_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O0") == 0) {
+            opt_level = OPT_NONE;
+        } else if (strcmp(argv[i], "-O1") == 0) {
+            opt_level = OPT_O1;
+        } else if (strcmp(argv[i], "-O2") == 0) {
+            opt_level = OPT_O2;
+        } else if (strcmp(argv[i], "-O3") == 0) {
+            opt_level = OPT_O3;
+        } else if (strcmp(argv[i], "-ftime-report") == 0) {
+            time_report = true;
+        } else if (strncmp(argv[i], "-fsuperopt-cache=", 17) == 0) {
+            superopt_cache = argv[i] + 17;
+        } else if (strcmp(argv[i], "-fsuperoptimize") == 0) {
+            superoptimize = true;
+        } else if (strcmp(argv[i], "-run") == 0) {
+            run = true;
+        } else if (strcmp(argv[i], "-fperf-map") == 0) {
+            perf_map = true;
+        } else if (argv[i][0] != '-' && file_count < 2) {
+            files[file_count++] = argv[i];
+        } else {
+            file_count = -1;
+            break;
+        }
+    }
+    if (file_count != (run ? 1 : 2)) {
+        fprintf(stderr, "Usage: %s [-O0|-O1|-O2|-O3] [-ftime-report] [-fsuperoptimize] "
+                "[-fsuperopt-cache=<file>] <input.c> <output.s|output.o>\n", argv[0]);
+        fprintf(stderr, "       %s [options] -run [-fperf-map] <input.c>\n", argv[0]);
         return 1;
     }
 
     // Read source file
-    FILE* file = fopen(argv[1], "r");
+    FILE* file = fopen(files[0], "r");
     if (!file) {
-        fprintf(stderr, "Could not open file: %s\n", argv[1]);
+        fprintf(stderr, "Could not open file: %s\n", files[0]);
         return 1;
     }
 
@@ -157,30 +223,50 @@ int main(int argc, char** argv) {
 
     // Phase 5: Code Optimization
     print_phase_separator("5. Code Optimization");
-    OptFlags opt_flags = {
-        .constant_folding = true,
-        .dead_code_elimination = true,
-        .common_subexpression = true,
-        .loop_unrolling = true,
-        .strength_reduction = true,
-        .tail_recursion = true,
-        .inline_functions = true
-    };
-    
+    OptFlags opt_flags = get_level_flags(opt_level);
     print_optimizations(opt_flags);
-    set_optimization_level(OPT_O2);
+    set_optimization_level(opt_level);
+    if (superoptimize && !superopt_cache) {
+        superopt_cache = "superopt.cache";
+    }
+    if (superopt_cache) {
+        load_superopt_cache(superopt_cache);
+    }
     optimize_program(ir, opt_flags);
+    if (superoptimize) {
+        // Offline mode: search what the cache misses and keep the results
+        // for later compiles
+        int improved = superoptimize_program(ir);
+        if (opt_flags.superoptimizer) {
+            apply_superoptimizations(ir);
+        }
+        if (!save_superopt_cache(superopt_cache)) {
+            fprintf(stderr, "Could not write superoptimizer cache: %s\n", superopt_cache);
+        }
+        printf("Superoptimizer: %d new sequences improved\n\n", improved);
+    }
+    if (time_report) {
+        print_pass_statistics(stderr);
+    }
     printf("Optimized IR:\n");
     print_ir_code(ir);
 
     // Phase 6: Code Generation
     print_phase_separator("6. Code Generation");
-    CodeGenerator* gen = create_generator(argv[2]);
+    CodeGenerator* gen = run ? create_jit_generator() : create_generator(files[1]);
+    if (opt_level == OPT_O3) {
+        gen->allocator = REGALLOC_GRAPH_COLORING;
+    }
     generate_code_from_ir(gen, ir);
-    print_assembly(argv[2]);
+    print_assembly(gen);
 
     printf("\nCompilation completed successfully!\n");
-    printf("Output written to: %s\n", argv[2]);
+    int status = 0;
+    if (run) {
+        status = run_program(gen, perf_map);
+    } else {
+        printf("Output written to: %s\n", files[1]);
+    }
 
     // Cleanup
     free_generator(gen);
@@ -192,6 +278,7 @@ int main(int argc, char** argv) {
     free(source_copy);
     free_ir_program(ir);
     free_analyzer(analyzer);
+    free_superopt_cache();
 
-    return 0;
+    return status;
 } 
\ No newline at end of file
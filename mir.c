@@ -0,0 +1,207 @@
+#include "mir.h"
+#include <stdarg.h>
+
+const char* register_names[REG_COUNT] = {
+    "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+    "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15"
+};
+
+static const char* byte_register_names[REG_COUNT] = {
+    "%al", "%cl", "%dl", "%bl", "%spl", "%bpl", "%sil", "%dil",
+    "%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b"
+};
+
+static const char* mnemonics[] = {
+    [MI_LABEL] = "",
+    [MI_MOV] = "movq",
+    [MI_MOVZB] = "movzbq",
+    [MI_LEA] = "leaq",
+    [MI_ADD] = "addq",
+    [MI_SUB] = "subq",
+    [MI_IMUL] = "imulq",
+    [MI_IDIV] = "idivq",
+    [MI_CQTO] = "cqto",
+    [MI_SAR] = "sarq",
+    [MI_CMP] = "cmpq",
+    [MI_TEST] = "testq",
+    [MI_SETCC] = "set",
+    [MI_CMOV] = "cmov",
+    [MI_PUSH] = "pushq",
+    [MI_POP] = "popq",
+    [MI_JMP] = "jmp",
+    [MI_JCC] = "j",
+    [MI_CALL] = "call",
+    [MI_RET] = "ret"
+};
+
+static const char* condition_suffix(ConditionCode cond) {
+    switch (cond) {
+        case COND_E: return "e";
+        case COND_NE: return "ne";
+        case COND_L: return "l";
+        case COND_LE: return "le";
+        case COND_G: return "g";
+        default: return "ge";
+    }
+}
+
+MachineOperand mir_reg(int reg) {
+    MachineOperand operand = { MOP_REG, reg, NO_REGISTER, 1, 0, false, NULL };
+    return operand;
+}
+
+MachineOperand mir_reg8(int reg) {
+    MachineOperand operand = mir_reg(reg);
+    operand.byte = true;
+    return operand;
+}
+
+MachineOperand mir_imm(long value) {
+    MachineOperand operand = { MOP_IMM, NO_REGISTER, NO_REGISTER, 1, value, false, NULL };
+    return operand;
+}
+
+MachineOperand mir_mem(int base, int index, int scale, long displacement) {
+    MachineOperand operand = { MOP_MEM, base, index, scale, displacement, false, NULL };
+    return operand;
+}
+
+MachineOperand mir_label(const char* name) {
+    MachineOperand operand = { MOP_LABEL, NO_REGISTER, NO_REGISTER, 1, 0, false, strdup(name) };
+    return operand;
+}
+
+MachineOperand mir_symbol(const char* name) {
+    MachineOperand operand = mir_label(name);
+    operand.kind = MOP_SYMBOL;
+    return operand;
+}
+
+bool same_operand(MachineOperand a, MachineOperand b) {
+    if (a.kind != b.kind) return false;
+    switch (a.kind) {
+        case MOP_REG: return a.reg == b.reg && a.byte == b.byte;
+        case MOP_IMM: return a.value == b.value;
+        case MOP_MEM:
+            return a.reg == b.reg && a.index == b.index && a.value == b.value &&
+                   (a.index == NO_REGISTER || a.scale == b.scale);
+        case MOP_LABEL:
+        case MOP_SYMBOL: return strcmp(a.name, b.name) == 0;
+        default: return true;
+    }
+}
+
+// Whether using the operand reads reg, directly or to form an address
+bool operand_reads_register(MachineOperand operand, int reg) {
+    if (operand.kind == MOP_REG) return operand.reg == reg;
+    if (operand.kind == MOP_MEM) return operand.reg == reg || operand.index == reg;
+    return false;
+}
+
+MachineFunction* create_machine_function(const char* name) {
+    MachineFunction* function = malloc(sizeof(MachineFunction));
+    function->name = strdup(name);
+    function->capacity = 64;
+    function->count = 0;
+    function->instrs = malloc(sizeof(MachineInstr) * function->capacity);
+    return function;
+}
+
+static MachineInstr* new_instr(MachineFunction* function) {
+    if (function->count == function->capacity) {
+        function->capacity *= 2;
+        function->instrs = realloc(function->instrs, sizeof(MachineInstr) * function->capacity);
+    }
+    return &function->instrs[function->count++];
+}
+
+// Appends an instruction taking operand_count MachineOperands, which
+// it takes ownership of
+MachineInstr* mir_append(MachineFunction* function, MachineOpcode opcode, int operand_count, ...) {
+    MachineInstr* instr = new_instr(function);
+    memset(instr, 0, sizeof(MachineInstr));
+    instr->opcode = opcode;
+    instr->operand_count = operand_count;
+    va_list args;
+    va_start(args, operand_count);
+    for (int i = 0; i < operand_count; i++) {
+        instr->operands[i] = va_arg(args, MachineOperand);
+    }
+    va_end(args);
+    return instr;
+}
+
+// Appends a copy of instr, which takes over its operands
+MachineInstr* mir_append_instr(MachineFunction* function, const MachineInstr* instr) {
+    MachineInstr* copy = new_instr(function);
+    *copy = *instr;
+    return copy;
+}
+
+static void print_operand(EmitBuffer* output, MachineOperand operand) {
+    switch (operand.kind) {
+        case MOP_REG:
+            emit_string(output, operand.byte ? byte_register_names[operand.reg]
+                                             : register_names[operand.reg]);
+            break;
+        case MOP_IMM:
+            emit_char(output, '$');
+            emit_decimal(output, operand.value);
+            break;
+        case MOP_MEM:
+            if (operand.value != 0 || operand.reg == NO_REGISTER) {
+                emit_decimal(output, operand.value);
+            }
+            emit_char(output, '(');
+            if (operand.reg != NO_REGISTER) emit_string(output, register_names[operand.reg]);
+            if (operand.index != NO_REGISTER) {
+                emit_char(output, ',');
+                emit_string(output, register_names[operand.index]);
+                emit_char(output, ',');
+                emit_decimal(output, operand.scale);
+            }
+            emit_char(output, ')');
+            break;
+        case MOP_LABEL:
+            emit_char(output, '.');
+            emit_string(output, operand.name);
+            break;
+        case MOP_SYMBOL:
+            emit_string(output, operand.name);
+            break;
+        default:
+            break;
+    }
+}
+
+void print_machine_function(EmitBuffer* output, MachineFunction* function) {
+    for (int i = 0; i < function->count; i++) {
+        MachineInstr* instr = &function->instrs[i];
+        if (instr->opcode == MI_LABEL) {
+            print_operand(output, instr->operands[0]);
+            emit_string(output, ":\n");
+            continue;
+        }
+        emit_string(output, "    ");
+        emit_string(output, mnemonics[instr->opcode]);
+        if (instr->opcode == MI_JCC || instr->opcode == MI_SETCC || instr->opcode == MI_CMOV) {
+            emit_string(output, condition_suffix(instr->cond));
+        }
+        for (int j = 0; j < instr->operand_count; j++) {
+            emit_string(output, j == 0 ? " " : ", ");
+            print_operand(output, instr->operands[j]);
+        }
+        emit_char(output, '\n');
+    }
+}
+
+void free_machine_function(MachineFunction* function) {
+    for (int i = 0; i < function->count; i++) {
+        for (int j = 0; j < function->instrs[i].operand_count; j++) {
+            free(function->instrs[i].operands[j].name);
+        }
+    }
+    free(function->instrs);
+    free(function->name);
+    free(function);
+}
@@ -0,0 +1,96 @@
+#ifndef MIR_H
+#define MIR_H
+
+#include "regalloc.h"
+#include "emitbuf.h"
+#include <stdio.h>
+
+// Machine IR: x86-64 instructions with their operands resolved to
+// registers, memory and immediates, ready to print or encode
+
+#define NO_REGISTER -1
+
+// Condition codes, numbered by their encodings in jcc, setcc and cmov
+typedef enum {
+    COND_E = 0x4,
+    COND_NE = 0x5,
+    COND_L = 0xc,
+    COND_GE = 0xd,
+    COND_LE = 0xe,
+    COND_G = 0xf
+} ConditionCode;
+
+typedef enum {
+    MOP_NONE,
+    MOP_REG,
+    MOP_IMM,
+    MOP_MEM,        // value(reg, index, scale)
+    MOP_LABEL,      // Local label, printed with a leading '.'
+    MOP_SYMBOL      // Function name
+} MachineOperandKind;
+
+typedef struct {
+    MachineOperandKind kind;
+    int reg;            // Register, or base of a memory operand
+    int index;          // Index of a memory operand
+    int scale;
+    long value;         // Immediate, or displacement of a memory operand
+    bool byte;          // Low byte of the register
+    char* name;         // Label or symbol
+} MachineOperand;
+
+typedef enum {
+    MI_LABEL,
+    MI_MOV,
+    MI_MOVZB,
+    MI_LEA,
+    MI_ADD,
+    MI_SUB,
+    MI_IMUL,        // Two operands, or an immediate, a source and a destination
+    MI_IDIV,
+    MI_CQTO,
+    MI_SAR,
+    MI_CMP,
+    MI_TEST,
+    MI_SETCC,
+    MI_CMOV,        // Source register or memory, destination register
+    MI_PUSH,
+    MI_POP,
+    MI_JMP,
+    MI_JCC,
+    MI_CALL,
+    MI_RET
+} MachineOpcode;
+
+typedef struct {
+    MachineOpcode opcode;
+    ConditionCode cond;             // MI_JCC, MI_SETCC and MI_CMOV
+    MachineOperand operands[3];     // AT&T order, destination last
+    int operand_count;
+} MachineInstr;
+
+typedef struct {
+    char* name;
+    MachineInstr* instrs;
+    int count;
+    int capacity;
+} MachineFunction;
+
+extern const char* register_names[REG_COUNT];
+
+MachineOperand mir_reg(int reg);
+MachineOperand mir_reg8(int reg);
+MachineOperand mir_imm(long value);
+MachineOperand mir_mem(int base, int index, int scale, long displacement);
+MachineOperand mir_label(const char* name);
+MachineOperand mir_symbol(const char* name);
+bool same_operand(MachineOperand a, MachineOperand b);
+bool operand_reads_register(MachineOperand operand, int reg);
+
+MachineFunction* create_machine_function(const char* name);
+MachineInstr* mir_append(MachineFunction* function, MachineOpcode opcode, int operand_count, ...);
+MachineInstr* mir_append_instr(MachineFunction* function, const MachineInstr* instr);
+void print_machine_function(EmitBuffer* output, MachineFunction* function);
+void free_machine_function(MachineFunction* function);
+
+#endif
@@ -1,38 +1,107 @@
 #include "optimizer.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
 #include "ir.h"
+#include "analysis.h"
+#include "superopt.h"
 
 static OptLevel current_level = OPT_NONE;
 
-// Helper function to check if an instruction is a computation
-static bool is_computation(IRInstr* instr) {
-    return instr->op == IR_ADD || instr->op == IR_SUB || 
-           instr->op == IR_MUL || instr->op == IR_DIV;
+// Common subexpression elimination over available expressions: an
+// expression already computed on every path, with no operand written
+// since, is replaced by a copy of a temporary that every computation
+// of it now also writes
+static bool eliminate_function_subexpressions(IRProgram* program, CFG* cfg) {
+    AvailableExprs* exprs = compute_available_exprs(program, cfg);
+    bool* redundant = calloc(cfg->end - cfg->start, sizeof(bool));
+    char** holders = calloc(exprs->expr_count + 1, sizeof(char*));
+    uint64_t* set = malloc(sizeof(uint64_t) * exprs->words);
+    bool found = false;
+    for (int r = 0; r < cfg->rpo_count; r++) {
+        BasicBlock* block = cfg->rpo[r];
+        available_exprs_at_entry(exprs, block, set);
+        for (int i = block->start; i <= block->end; i++) {
+            int bit = exprs->instr_exprs[i - cfg->start];
+            if (bit >= 0 && bitset_test(set, bit)) {
+                redundant[i - cfg->start] = true;
+                if (!holders[bit]) holders[bit] = new_temp(program);
+                found = true;
+            }
+            apply_available_expr(exprs, set, program, i);
+        }
+    }
+
+    // An expression evaluated once more can reuse that evaluation's
+    // dest when nothing else writes it
+    int* sources = calloc(exprs->expr_count + 1, sizeof(int));
+    NameMap* def_counts = create_name_map(64);
+    for (int i = found ? cfg->start : cfg->end; i < cfg->end; i++) {
+        IRInstr* instr = program->instructions[i];
+        int bit = exprs->instr_exprs[i - cfg->start];
+        if (bit >= 0 && holders[bit] && !redundant[i - cfg->start]) {
+            sources[bit] = sources[bit] ? -1 : i;
+        }
+        if (writes_dest(instr)) {
+            int count = name_map_get(def_counts, instr->dest);
+            name_map_put(def_counts, instr->dest, count < 0 ? 1 : count + 1);
+        }
+    }
+    for (int bit = 0; bit < exprs->expr_count; bit++) {
+        if (!holders[bit] || sources[bit] <= 0) continue;
+        IRInstr* source = program->instructions[sources[bit]];
+        if (name_map_get(def_counts, source->dest) == 1 && !reads_operand(source, source->dest)) {
+            free(holders[bit]);
+            holders[bit] = strdup(source->dest);
+        } else {
+            sources[bit] = 0;
+        }
+    }
+    free_name_map(def_counts);
+
+    // Back to front, so inserting after an instruction leaves the
+    // indices still to be visited alone
+    for (int i = found ? cfg->end - 1 : -1; i >= cfg->start; i--) {
+        int bit = exprs->instr_exprs[i - cfg->start];
+        if (bit < 0 || !holders[bit] || i == sources[bit]) continue;
+        IRInstr* instr = program->instructions[i];
+        if (redundant[i - cfg->start]) {
+            instr->op = IR_ASSIGN;
+            free(instr->src1);
+            free(instr->src2);
+            instr->src1 = strdup(holders[bit]);
+            instr->src2 = NULL;
+            instr->value = 0;
+        } else {
+            IRInstr* copy = create_instr(IR_ASSIGN, instr->dest, holders[bit], NULL);
+            free(instr->dest);
+            instr->dest = strdup(holders[bit]);
+            insert_instructions(program, i + 1, &copy, 1);
+        }
+    }
+
+    for (int i = 0; i < exprs->expr_count; i++) {
+        free(holders[i]);
+    }
+    free(holders);
+    free(sources);
+    free(redundant);
+    free(set);
+    free_available_exprs(exprs);
+    return found;
 }
 
-// Common subexpression elimination
-static void eliminate_common_subexpressions(IRProgram* program) {
-    for (int i = 0; i < program->count; i++) {
-        IRInstr* current = program->instructions[i];
-        if (!is_computation(current)) continue;
-        
-        // Look for identical computations
-        for (int j = i + 1; j < program->count; j++) {
-            IRInstr* next = program->instructions[j];
-            if (!is_computation(next)) continue;
-            
-            // Check if operations and operands match
-            if (next->op == current->op &&
-                strcmp(next->src1, current->src1) == 0 &&
-                strcmp(next->src2, current->src2) == 0) {
-                // Replace computation with assignment
-                next->op = IR_ASSIGN;
-                free(next->src2);
-                next->src2 = NULL;
-                free(next->src1);
-                next->src1 = strdup(current->dest);
-            }
+static void eliminate_common_subexpressions(IRProgram* program, AnalysisManager* analyses) {
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+        if (eliminate_function_subexpressions(program, get_cfg(analyses, start))) {
+            invalidate_function(analyses, start, ANALYSIS_NONE);
         }
+        start = find_function_end(program, start);
     }
 }
 
@@ -63,183 +132,2209 @@ static void reduce_strength(IRProgram* program) {
     }
 }
 
-// Loop unrolling
-static void unroll_loops(IRProgram* program) {
-    for (int i = 0; i < program->block_count; i++) {
-        BasicBlock* block = program->blocks[i];
-        IRInstr* last_instr = program->instructions[block->end];
-        
-        // Check if this is a loop block
-        if (last_instr->op == IR_JUMP) {
-            // Find loop condition
-            for (int j = 0; j < program->block_count; j++) {
-                BasicBlock* target = program->blocks[j];
-                if (target->start < block->start && 
-                    strcmp(last_instr->label->name, 
-                           program->instructions[target->start]->label->name) == 0) {
-                    // This is a backward jump - likely a loop
-                    // Unroll the loop if it's small enough
-                    int loop_size = block->end - block->start + 1;
-                    if (loop_size < 10) {  // Only unroll small loops
-                        // Duplicate the loop body
-                        for (int k = block->start; k <= block->end - 1; k++) {
-                            IRInstr* instr = program->instructions[k];
-                            // Create a copy of the instruction
-                            IRInstr* copy = malloc(sizeof(IRInstr));
-                            memcpy(copy, instr, sizeof(IRInstr));
-                            if (copy->dest) copy->dest = strdup(instr->dest);
-                            if (copy->src1) copy->src1 = strdup(instr->src1);
-                            if (copy->src2) copy->src2 = strdup(instr->src2);
-                            // Insert the copy
-                            // Note: Need to implement instruction insertion
-                        }
+// Growable list of instructions built up before splicing into the program
+typedef struct {
+    IRInstr** items;
+    int count;
+    int capacity;
+} InstrList;
+
+static void push_instr(InstrList* list, IRInstr* instr) {
+    if (list->count >= list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->items = realloc(list->items, sizeof(IRInstr*) * list->capacity);
+    }
+    list->items[list->count++] = instr;
+}
+
+// Old name -> fresh name, used when duplicating code
+typedef struct {
+    NameMap* map;
+    char** names;
+    int count;
+} RenameTable;
+
+static RenameTable* create_rename_table(void) {
+    RenameTable* table = malloc(sizeof(RenameTable));
+    table->map = create_name_map(16);
+    table->names = NULL;
+    table->count = 0;
+    return table;
+}
+
+static void add_rename(RenameTable* table, const char* from, char* to) {
+    table->names = realloc(table->names, sizeof(char*) * (table->count + 1));
+    table->names[table->count] = to;
+    name_map_put(table->map, from, table->count++);
+}
+
+static void apply_rename(RenameTable* table, char** name) {
+    if (!*name) return;
+    int index = name_map_get(table->map, *name);
+    if (index >= 0) {
+        free(*name);
+        *name = strdup(table->names[index]);
+    }
+}
+
+static void free_rename_table(RenameTable* table) {
+    for (int i = 0; i < table->count; i++) {
+        free(table->names[i]);
+    }
+    free(table->names);
+    free_name_map(table->map);
+    free(table);
+}
+
+static char* new_label_name(IRProgram* program) {
+    IRLabel* label = new_label(program);
+    char* name = label->name;
+    free(label);
+    return name;
+}
+
+static int count_defs(IRProgram* program, int from, int to, const char* name) {
+    int count = 0;
+    for (int i = from; i < to; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (writes_dest(instr) && strcmp(instr->dest, name) == 0) count++;
+    }
+    return count;
+}
+
+// Index of the only instruction in [from, to) writing name, or -1
+static int find_single_def(IRProgram* program, int from, int to, const char* name) {
+    int found = -1;
+    for (int i = from; i < to; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (writes_dest(instr) && strcmp(instr->dest, name) == 0) {
+            if (found >= 0) return -1;
+            found = i;
+        }
+    }
+    return found;
+}
+
+// Constant value of an operand: an immediate, or a name whose only
+// definition in the function is a constant assignment
+static bool get_operand_constant(IRProgram* program, CFG* cfg, const char* operand,
+                                 long* value) {
+    if (is_immediate_operand(operand)) {
+        *value = atol(operand);
+        return true;
+    }
+    int def = find_single_def(program, cfg->start, cfg->end, operand);
+    if (def >= 0 && program->instructions[def]->op == IR_ASSIGN &&
+        !program->instructions[def]->src1) {
+        *value = program->instructions[def]->value;
+        return true;
+    }
+    return false;
+}
+
+// A name written once and only read later in the same block can be
+// given a fresh name in each copy of the code
+static bool is_block_local(IRProgram* program, CFG* cfg, int def) {
+    IRInstr* instr = program->instructions[def];
+    if (count_defs(program, cfg->start, cfg->end, instr->dest) != 1) return false;
+    BasicBlock* block = find_block_containing(cfg, def);
+    for (int i = cfg->start; i < cfg->end; i++) {
+        if (reads_operand(program->instructions[i], instr->dest) &&
+            (i <= def || i > block->end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Maximum number of instructions an unrolled loop body may grow to
+#define UNROLL_SIZE_BUDGET 64
+#define FULL_UNROLL_MAX_TRIPS 16
+#define PARTIAL_UNROLL_FACTOR 4
+
+// A loop of the form  while (iv REL bound) { ...; iv = iv + step; }
+// laid out as header, body, latch with a single backward jump
+typedef struct {
+    BasicBlock* header;
+    BasicBlock* latch;
+    int body_start;         // First instruction after the exit branch
+    int body_end;           // Index of the backward jump
+    IRInstr* compare;       // Exit test feeding the exit branch
+    IRInstr* exit_branch;
+    const char* iv;
+    long step;
+    int relation;           // Condition to stay in the loop, as iv REL bound
+    bool header_needed;     // Body reads values computed in the header
+    long trip_count;        // -1 if unknown
+} CountedLoop;
+
+// Step of an update of the form iv + c, c + iv or iv - c
+static bool get_iv_step(IRProgram* program, CFG* cfg, IRInstr* update, const char* iv,
+                        long* step) {
+    if (update->op == IR_ADD && strcmp(update->src1, iv) == 0) {
+        return get_operand_constant(program, cfg, update->src2, step);
+    }
+    if (update->op == IR_ADD && strcmp(update->src2, iv) == 0) {
+        return get_operand_constant(program, cfg, update->src1, step);
+    }
+    if (update->op == IR_SUB && strcmp(update->src1, iv) == 0 &&
+        get_operand_constant(program, cfg, update->src2, step)) {
+        *step = -*step;
+        return true;
+    }
+    return false;
+}
+
+static bool analyze_counted_loop(IRProgram* program, CFG* cfg, Loop* loop,
+                                 CountedLoop* counted) {
+    if (loop->child_count > 0 || loop->latch_count != 1) return false;
+    BasicBlock* header = loop->header;
+    BasicBlock* latch = loop->latches[0];
+    if (latch == header) return false;
+
+    IRInstr* back_jump = program->instructions[latch->end];
+    IRInstr* exit_branch = program->instructions[header->end];
+    if (program->instructions[header->start]->op != IR_LABEL ||
+        is_function_label(program->instructions[header->start]) ||
+        back_jump->op != IR_JUMP ||
+        (exit_branch->op != IR_JUMPZ && exit_branch->op != IR_JUMPNZ)) {
+        return false;
+    }
+    BasicBlock* exit_block = find_block_by_label(cfg, exit_branch->label->name);
+    if (!exit_block || loop->contains[exit_block->index]) return false;
+
+    // The loop must be contiguous, header first and latch last, and
+    // may only be left through the header's exit branch
+    if (loop->block_count != latch->index - header->index + 1) return false;
+    for (int i = header->index; i <= latch->index; i++) {
+        BasicBlock* block = cfg->blocks[i];
+        if (!loop->contains[block->index]) return false;
+        if (block == header) continue;
+        if (is_exit(program->instructions[block->end])) return false;
+        for (int j = 0; j < block->successor_count; j++) {
+            if (!loop->contains[block->successors[j]->index]) return false;
+        }
+    }
+    for (int i = header->start + 1; i < header->end; i++) {
+        if (has_side_effects(program->instructions[i])) return false;
+    }
+
+    int loop_start = header->start;
+    int loop_end = latch->end + 1;
+    int cmp_index = find_single_def(program, loop_start, loop_end, exit_branch->src1);
+    if (cmp_index < 0 || cmp_index >= header->end ||
+        program->instructions[cmp_index]->op != IR_COMPARE) {
+        return false;
+    }
+    IRInstr* compare = program->instructions[cmp_index];
+
+    // One compare operand is the induction variable, the other is invariant
+    const char* iv;
+    int relation;
+    bool left_invariant = is_immediate_operand(compare->src1) ||
+                          count_defs(program, loop_start, loop_end, compare->src1) == 0;
+    bool right_invariant = is_immediate_operand(compare->src2) ||
+                           count_defs(program, loop_start, loop_end, compare->src2) == 0;
+    if (!left_invariant && right_invariant) {
+        iv = compare->src1;
+        relation = compare->value;
+    } else if (left_invariant && !right_invariant) {
+        iv = compare->src2;
+        relation = swap_relation(compare->value);
+    } else {
+        return false;
+    }
+    if (exit_branch->op == IR_JUMPNZ) relation = negate_relation(relation);
+    const char* bound = iv == compare->src1 ? compare->src2 : compare->src1;
+
+    // The induction variable is updated exactly once per iteration
+    int def = find_single_def(program, loop_start, loop_end, iv);
+    if (def < 0) return false;
+    BasicBlock* def_block = find_block_containing(cfg, def);
+    if (def_block == header || !dominates(cfg, def_block, latch)) return false;
+
+    IRInstr* update = program->instructions[def];
+    if (update->op == IR_ASSIGN && update->src1) {
+        // iv = t where t = iv +/- step earlier in the same block
+        int step_def = find_single_def(program, loop_start, loop_end, update->src1);
+        if (step_def < def_block->start || step_def > def) return false;
+        update = program->instructions[step_def];
+    }
+    long step;
+    if (!get_iv_step(program, cfg, update, iv, &step) || step == 0) return false;
+
+    counted->header = header;
+    counted->latch = latch;
+    counted->body_start = header->end + 1;
+    counted->body_end = latch->end;
+    counted->compare = compare;
+    counted->exit_branch = exit_branch;
+    counted->iv = iv;
+    counted->step = step;
+    counted->relation = relation;
+    counted->trip_count = -1;
+
+    counted->header_needed = false;
+    for (int i = header->start + 1; i < header->end; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (!writes_dest(instr)) continue;
+        for (int j = counted->body_start; j < counted->body_end; j++) {
+            if (reads_operand(program->instructions[j], instr->dest)) {
+                counted->header_needed = true;
+            }
+        }
+    }
+
+    // Constant trip count needs a constant bound and a constant initial
+    // value assigned in the single block entering the loop
+    long limit, value;
+    BasicBlock* preheader = NULL;
+    for (int i = 0; i < header->predecessor_count; i++) {
+        BasicBlock* pred = header->predecessors[i];
+        if (loop->contains[pred->index]) continue;
+        if (preheader) return true;
+        preheader = pred;
+    }
+    if (!preheader || !get_operand_constant(program, cfg, bound, &limit)) return true;
+    for (int i = preheader->end; i >= preheader->start; i--) {
+        IRInstr* instr = program->instructions[i];
+        if (!writes_dest(instr) || strcmp(instr->dest, iv) != 0) continue;
+        if (instr->op != IR_ASSIGN) return true;
+        if (instr->src1 && !get_operand_constant(program, cfg, instr->src1, &value)) {
+            return true;
+        }
+        if (!instr->src1) value = instr->value;
+
+        long trips = 0;
+        while (evaluate_relation(relation, value, limit) && trips <= FULL_UNROLL_MAX_TRIPS) {
+            value += step;
+            trips++;
+        }
+        if (trips <= FULL_UNROLL_MAX_TRIPS) counted->trip_count = trips;
+        return true;
+    }
+    return true;
+}
+
+// Appends one copy of the loop body, giving its labels and
+// block-local values fresh names
+static void append_body_copy(IRProgram* program, CFG* cfg, CountedLoop* counted,
+                             InstrList* out) {
+    RenameTable* renames = create_rename_table();
+    for (int i = counted->body_start; i < counted->body_end; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (instr->op == IR_LABEL) {
+            add_rename(renames, instr->label->name, new_label_name(program));
+        } else if (writes_dest(instr) && is_block_local(program, cfg, i)) {
+            add_rename(renames, instr->dest, new_temp(program));
+        }
+    }
+
+    if (counted->header_needed) {
+        for (int i = counted->header->start + 1; i < counted->header->end; i++) {
+            push_instr(out, copy_instruction(program->instructions[i]));
+        }
+    }
+    for (int i = counted->body_start; i < counted->body_end; i++) {
+        IRInstr* copy = copy_instruction(program->instructions[i]);
+        apply_rename(renames, &copy->dest);
+        apply_rename(renames, &copy->src1);
+        apply_rename(renames, &copy->src2);
+        if (copy->label) apply_rename(renames, &copy->label->name);
+        push_instr(out, copy);
+    }
+    free_rename_table(renames);
+}
+
+static int unrolled_body_size(CountedLoop* counted) {
+    int size = counted->body_end - counted->body_start;
+    if (counted->header_needed) {
+        size += counted->header->end - counted->header->start - 1;
+    }
+    return size;
+}
+
+// Replaces the loop with trip_count straight-line copies of its body
+static void fully_unroll(IRProgram* program, CFG* cfg, CountedLoop* counted) {
+    InstrList out = {0};
+    BasicBlock* header = counted->header;
+    push_instr(&out, copy_instruction(program->instructions[header->start]));
+    for (long trip = 0; trip < counted->trip_count; trip++) {
+        append_body_copy(program, cfg, counted, &out);
+    }
+
+    // The final, failing exit test still defines the header's values
+    for (int i = header->start + 1; i < header->end; i++) {
+        IRInstr* instr = program->instructions[i];
+        bool used_outside = false;
+        for (int j = cfg->start; j < cfg->end && writes_dest(instr); j++) {
+            if ((j < header->start || j > counted->latch->end) &&
+                reads_operand(program->instructions[j], instr->dest)) {
+                used_outside = true;
+            }
+        }
+        if (used_outside) push_instr(&out, copy_instruction(instr));
+    }
+
+    const char* exit_label = counted->exit_branch->label->name;
+    int after = counted->latch->end + 1;
+    if (after >= program->count || program->instructions[after]->op != IR_LABEL ||
+        strcmp(program->instructions[after]->label->name, exit_label) != 0) {
+        push_instr(&out, create_jump_instr(IR_JUMP, NULL, exit_label));
+    }
+
+    remove_instructions(program, header->start, counted->latch->end - header->start + 1);
+    insert_instructions(program, header->start, out.items, out.count);
+    free(out.items);
+}
+
+// Places an unrolled copy of the loop in front of the original, which
+// is kept to run the remaining iterations.  The unrolled loop only
+// starts a round while the exit test still passes for the last of its
+// factor iterations, which holds because the induction variable moves
+// monotonically towards the bound.
+static char* partially_unroll(IRProgram* program, CFG* cfg, Loop* loop,
+                              CountedLoop* counted, int factor) {
+    InstrList out = {0};
+    BasicBlock* header = counted->header;
+    const char* header_label = program->instructions[header->start]->label->name;
+    char* unrolled_label = new_label_name(program);
+
+    push_instr(&out, create_label_instr(unrolled_label, 0));
+    char* distance = new_temp(program);
+    char* last_iv = new_temp(program);
+    char* guard = new_temp(program);
+    IRInstr* instr = create_instr(IR_ASSIGN, distance, NULL, NULL);
+    instr->value = (int)(counted->step * (factor - 1));
+    push_instr(&out, instr);
+    push_instr(&out, create_instr(IR_ADD, last_iv, counted->iv, distance));
+    instr = copy_instruction(counted->compare);
+    free(instr->dest);
+    instr->dest = strdup(guard);
+    if (strcmp(instr->src1, counted->iv) == 0) {
+        free(instr->src1);
+        instr->src1 = strdup(last_iv);
+    } else {
+        free(instr->src2);
+        instr->src2 = strdup(last_iv);
+    }
+    push_instr(&out, instr);
+    instr = copy_instruction(counted->exit_branch);
+    free(instr->src1);
+    instr->src1 = strdup(guard);
+    free(instr->label->name);
+    instr->label->name = strdup(header_label);
+    push_instr(&out, instr);
+
+    for (int i = 0; i < factor; i++) {
+        append_body_copy(program, cfg, counted, &out);
+    }
+    push_instr(&out, create_jump_instr(IR_JUMP, NULL, unrolled_label));
+
+    // Entry edges now go to the unrolled loop
+    for (int i = 0; i < header->predecessor_count; i++) {
+        BasicBlock* pred = header->predecessors[i];
+        IRInstr* last = program->instructions[pred->end];
+        if (!loop->contains[pred->index] && is_branch(last) &&
+            strcmp(last->label->name, header_label) == 0) {
+            free(last->label->name);
+            last->label->name = strdup(unrolled_label);
+        }
+    }
+
+    insert_instructions(program, header->start, out.items, out.count);
+    free(out.items);
+    free(distance);
+    free(last_iv);
+    free(guard);
+    return unrolled_label;
+}
+
+static bool try_unroll_loop(IRProgram* program, CFG* cfg, Loop* loop, NameMap* done) {
+    CountedLoop counted;
+    if (!analyze_counted_loop(program, cfg, loop, &counted)) return false;
+    int size = unrolled_body_size(&counted);
+
+    if (counted.trip_count >= 0 && counted.trip_count * size <= UNROLL_SIZE_BUDGET) {
+        fully_unroll(program, cfg, &counted);
+        return true;
+    }
+
+    bool increasing = counted.step > 0 &&
+        (counted.relation == TOKEN_LESS || counted.relation == TOKEN_LESS_EQUALS);
+    bool decreasing = counted.step < 0 &&
+        (counted.relation == TOKEN_GREATER || counted.relation == TOKEN_GREATER_EQUALS);
+    if (!increasing && !decreasing) return false;
+
+    for (int factor = PARTIAL_UNROLL_FACTOR; factor >= 2; factor /= 2) {
+        if (factor * size <= UNROLL_SIZE_BUDGET) {
+            char* label = partially_unroll(program, cfg, loop, &counted, factor);
+            name_map_put(done, label, 1);
+            free(label);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Loop unrolling: counted innermost loops with a small constant trip
+// count are unrolled completely, others by a fixed factor with the
+// original loop left behind for the remainder
+static void unroll_loops(IRProgram* program, AnalysisManager* analyses) {
+    NameMap* done = create_name_map(16);
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+
+        // Every transformation invalidates the CFG, so rebuild and retry
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            CFG* cfg = get_cfg(analyses, start);
+            LoopForest* forest = get_loops(analyses, start);
+            for (int i = 0; i < forest->loop_count && !changed; i++) {
+                Loop* loop = forest->loops[i];
+                IRInstr* first = program->instructions[loop->header->start];
+                if (first->op != IR_LABEL ||
+                    name_map_get(done, first->label->name) >= 0) {
+                    continue;
+                }
+                name_map_put(done, first->label->name, 1);
+                changed = try_unroll_loop(program, cfg, loop, done);
+            }
+            if (changed) invalidate_function(analyses, start, ANALYSIS_NONE);
+        }
+        start = find_function_end(program, start);
+    }
+    free_name_map(done);
+}
+
+// Loop rotation
+
+// Largest loop test duplicated at the latch
+#define ROTATE_HEADER_MAX 8
+
+// Turns a loop tested at the top,
+//     Lh: test; jz t Lexit; body; jump Lh
+// into a guarded do-while,
+//     Lh: test; jz t Lexit; Lb: body; test'; jnz t' Lb; jump Lexit
+// so an iteration takes one conditional branch instead of a branch and
+// a jump.  The guard keeps Lh for any other entry.  The test runs at
+// exactly the same points as before, so it is copied as it stands,
+// values used only within it renamed.  The final jump is left out when
+// the exit follows the latch.  Returns the body label, or NULL.
+static char* rotate_loop(IRProgram* program, CFG* cfg, Loop* loop) {
+    if (loop->latch_count != 1) return NULL;
+    BasicBlock* header = loop->header;
+    BasicBlock* latch = loop->latches[0];
+    IRInstr* first = program->instructions[header->start];
+    IRInstr* exit_branch = program->instructions[header->end];
+    IRInstr* back_jump = program->instructions[latch->end];
+    if (latch == header || first->op != IR_LABEL || is_function_label(first) ||
+        (exit_branch->op != IR_JUMPZ && exit_branch->op != IR_JUMPNZ) ||
+        back_jump->op != IR_JUMP || strcmp(back_jump->label->name, first->label->name) != 0 ||
+        header->end - header->start - 1 > ROTATE_HEADER_MAX ||
+        header->index + 1 >= cfg->block_count || !loop->contains[header->index + 1]) {
+        return NULL;
+    }
+    BasicBlock* exit_block = find_block_by_label(cfg, exit_branch->label->name);
+    if (!exit_block || loop->contains[exit_block->index]) return NULL;
+    for (int i = header->start + 1; i < header->end; i++) {
+        IROpcode op = program->instructions[i]->op;
+        if (op == IR_ARG || op == IR_CALL) return NULL;
+    }
+
+    IRInstr* body_first = program->instructions[header->end + 1];
+    bool body_labelled = body_first->op == IR_LABEL;
+    char* body_label = body_labelled ? strdup(body_first->label->name)
+                                     : new_label_name(program);
+
+    RenameTable* renames = create_rename_table();
+    for (int i = header->start + 1; i < header->end; i++) {
+        if (writes_dest(program->instructions[i]) && is_block_local(program, cfg, i)) {
+            add_rename(renames, program->instructions[i]->dest, new_temp(program));
+        }
+    }
+    InstrList test = {0};
+    for (int i = header->start + 1; i < header->end; i++) {
+        IRInstr* copy = copy_instruction(program->instructions[i]);
+        apply_rename(renames, &copy->dest);
+        apply_rename(renames, &copy->src1);
+        apply_rename(renames, &copy->src2);
+        push_instr(&test, copy);
+    }
+    IRInstr* back_branch = create_jump_instr(exit_branch->op == IR_JUMPZ ? IR_JUMPNZ : IR_JUMPZ,
+                                             exit_branch->src1, body_label);
+    apply_rename(renames, &back_branch->src1);
+    push_instr(&test, back_branch);
+    IRInstr* after = latch->end + 1 < cfg->end ? program->instructions[latch->end + 1] : NULL;
+    if (!after || after->op != IR_LABEL ||
+        strcmp(after->label->name, exit_branch->label->name) != 0) {
+        push_instr(&test, create_jump_instr(IR_JUMP, NULL, exit_branch->label->name));
+    }
+    free_rename_table(renames);
+
+    // Edit the later position first so the earlier one stays valid
+    int latch_end = latch->end;
+    int body_start = header->end + 1;
+    if (latch_end > body_start) {
+        free_instruction(detach_instruction(program, latch_end));
+        insert_instructions(program, latch_end, test.items, test.count);
+    }
+    if (!body_labelled) {
+        IRInstr* label = create_label_instr(body_label, 0);
+        insert_instructions(program, body_start, &label, 1);
+    }
+    if (latch_end < body_start) {
+        free_instruction(detach_instruction(program, latch_end));
+        insert_instructions(program, latch_end, test.items, test.count);
+    }
+    free(test.items);
+    return body_label;
+}
+
+// Loop rotation over every loop, outermost ones too.  It runs after
+// the loop passes, which match the top-tested shape.
+static void rotate_loops(IRProgram* program, AnalysisManager* analyses) {
+    NameMap* done = create_name_map(16);
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            CFG* cfg = get_cfg(analyses, start);
+            LoopForest* forest = get_loops(analyses, start);
+            for (int i = 0; i < forest->loop_count && !changed; i++) {
+                IRInstr* first = program->instructions[forest->loops[i]->header->start];
+                if (first->op != IR_LABEL || name_map_get(done, first->label->name) >= 0) {
+                    continue;
+                }
+                name_map_put(done, first->label->name, 1);
+                char* body_label = rotate_loop(program, cfg, forest->loops[i]);
+                if (body_label) {
+                    name_map_put(done, body_label, 1);
+                    free(body_label);
+                    changed = true;
+                }
+            }
+            if (changed) invalidate_function(analyses, start, ANALYSIS_NONE);
+        }
+        start = find_function_end(program, start);
+    }
+    free_name_map(done);
+}
+
+// If-conversion
+
+// Instructions an if may turn into, both arms and the conditional moves
+// together: a mispredicted branch costs about as much as running this
+// many unconditionally
+#define IF_CONVERSION_BUDGET 8
+
+// One side of an if, copied to run whichever way the branch goes
+typedef struct {
+    BasicBlock* block;      // NULL for the empty side of a triangle
+    int from;               // Its code, without label and trailing jump
+    int to;
+    RenameTable* renames;   // Names seen after the if -> their value on this side
+} IfArm;
+
+// An arm is a block entered only from head and left only for join,
+// doing nothing that would be unsafe to do when it is not taken
+static bool find_arm_code(IRProgram* program, IfArm* arm, BasicBlock* head,
+                          BasicBlock* join) {
+    BasicBlock* block = arm->block;
+    if (block->predecessor_count != 1 || block->predecessors[0] != head ||
+        block->successor_count != 1 || block->successors[0] != join) {
+        return false;
+    }
+    arm->from = block->start;
+    arm->to = block->end + 1;
+    if (program->instructions[arm->from]->op == IR_LABEL) arm->from++;
+    if (arm->to > arm->from && program->instructions[arm->to - 1]->op == IR_JUMP) arm->to--;
+    for (int i = arm->from; i < arm->to; i++) {
+        if (has_side_effects(program->instructions[i])) return false;
+    }
+    return true;
+}
+
+static int count_reads(IRProgram* program, CFG* cfg, const char* name) {
+    int count = 0;
+    for (int i = cfg->start; i < cfg->end; i++) {
+        if (reads_operand(program->instructions[i], name)) count++;
+    }
+    return count;
+}
+
+// Constant a name written in the speculated code holds, if any
+static bool find_arm_constant(InstrList* code, const char* name, long* value) {
+    for (int i = code->count - 1; i >= 0; i--) {
+        IRInstr* instr = code->items[i];
+        if (strcmp(instr->dest, name) != 0) continue;
+        if (instr->op != IR_ASSIGN || instr->src1) return false;
+        *value = instr->value;
+        return true;
+    }
+    return false;
+}
+
+static char* find_rename(RenameTable* table, const char* name) {
+    if (!table) return NULL;
+    int index = name_map_get(table->map, name);
+    return index >= 0 ? table->names[index] : NULL;
+}
+
+// Turns the diamond or triangle branching at the end of head into
+// straight-line code: both arms run, writing fresh names, and then the
+// names they write take the value from the arm the branch would have
+// chosen, through conditional moves or, for 0/1 results, the compare
+// itself.  The compare feeding the branch is moved down to the moves
+// when it has no other use, so its flags can steer them directly.
+static bool convert_if(IRProgram* program, CFG* cfg, BasicBlock* head) {
+    IRInstr* branch = program->instructions[head->end];
+    if ((branch->op != IR_JUMPZ && branch->op != IR_JUMPNZ) ||
+        is_immediate_operand(branch->src1) || head->successor_count != 2 ||
+        head->index + 1 >= cfg->block_count) {
+        return false;
+    }
+    BasicBlock* fall = cfg->blocks[head->index + 1];
+    BasicBlock* taken = find_block_by_label(cfg, branch->label->name);
+    if (!taken || taken == fall) return false;
+
+    // arms[0] runs when the branch falls through, arms[1] when it is taken
+    IfArm arms[2] = { { fall, 0, 0, NULL }, { taken, 0, 0, NULL } };
+    BasicBlock* join;
+    if (fall->successor_count == 1 && fall->successors[0] == taken) {
+        join = taken;
+        arms[1].block = NULL;
+    } else if (taken->successor_count == 1 && taken->successors[0] == fall) {
+        join = fall;
+        arms[0].block = NULL;
+    } else if (fall->successor_count == 1) {
+        join = fall->successors[0];
+    } else {
+        return false;
+    }
+    int arm_size = 0;
+    for (int a = 0; a < 2; a++) {
+        if (arms[a].block && !find_arm_code(program, &arms[a], head, join)) return false;
+        arm_size += arms[a].to - arms[a].from;
+    }
+
+    // Control now runs from head straight into join, unless something
+    // else still lies between them
+    int next = head->index + 1;
+    while (next < cfg->block_count &&
+           (cfg->blocks[next] == arms[0].block || cfg->blocks[next] == arms[1].block)) {
+        next++;
+    }
+    bool needs_jump = next >= cfg->block_count || cfg->blocks[next] != join;
+    IRInstr* join_label = program->instructions[join->start];
+    if (needs_jump && join_label->op != IR_LABEL) return false;
+
+    const char* cond = branch->src1;
+    IRInstr* compare = head->end > head->start ? program->instructions[head->end - 1] : NULL;
+    if (compare && (compare->op != IR_COMPARE || strcmp(compare->dest, cond) != 0)) {
+        compare = NULL;
+    }
+    bool move_compare = compare && count_defs(program, cfg->start, cfg->end, cond) == 1 &&
+                        count_reads(program, cfg, cond) == 1;
+
+    // Speculate both arms; names only the arm itself reads keep theirs
+    InstrList code = {0};
+    NameMap* seen = create_name_map(16);
+    char** written = NULL;
+    int written_count = 0;
+    bool writes_cond = false;
+    for (int a = 0; a < 2; a++) {
+        arms[a].renames = create_rename_table();
+        for (int i = arms[a].from; i < arms[a].to; i++) {
+            IRInstr* copy = copy_instruction(program->instructions[i]);
+            apply_rename(arms[a].renames, &copy->src1);
+            apply_rename(arms[a].renames, &copy->src2);
+            if (!is_block_local(program, cfg, i)) {
+                if (name_map_get(seen, copy->dest) < 0) {
+                    name_map_put(seen, copy->dest, written_count);
+                    written = realloc(written, sizeof(char*) * (written_count + 1));
+                    written[written_count++] = strdup(copy->dest);
+                    writes_cond = writes_cond || strcmp(copy->dest, cond) == 0;
+                }
+                char* fresh = new_temp(program);
+                add_rename(arms[a].renames, copy->dest, fresh);
+                free(copy->dest);
+                copy->dest = strdup(fresh);
+            }
+            push_instr(&code, copy);
+        }
+    }
+
+    // Copies go ahead of a moved compare unless it reads what they write
+    IROpcode when_taken = branch->op == IR_JUMPZ ? IR_CMOVZ : IR_CMOVNZ;
+    IROpcode when_fall = branch->op == IR_JUMPZ ? IR_CMOVNZ : IR_CMOVZ;
+    InstrList copies = {0};
+    InstrList moves = {0};
+    InstrList results = {0};
+    for (int v = 0; v < written_count; v++) {
+        const char* name = written[v];
+        char* values[2] = { find_rename(arms[0].renames, name),
+                            find_rename(arms[1].renames, name) };
+        long constants[2];
+        if (values[0] && values[1] && find_arm_constant(&code, values[0], &constants[0]) &&
+            find_arm_constant(&code, values[1], &constants[1]) &&
+            (constants[0] == 0 || constants[0] == 1) && constants[0] + constants[1] == 1) {
+            // 1 on exactly one side: the condition itself, as 0 or 1
+            bool when_nonzero = (constants[0] == 1) == (branch->op == IR_JUMPZ);
+            IRInstr* result;
+            if (when_nonzero && compare) {
+                result = create_instr(IR_ASSIGN, name, cond, NULL);
+            } else {
+                result = create_instr(IR_COMPARE, name, cond, "0");
+                result->value = when_nonzero ? TOKEN_NOT_EQUALS : TOKEN_EQUALS;
+            }
+            push_instr(&results, result);
+        } else if (values[0] && values[1]) {
+            if (move_compare && reads_operand(compare, name)) {
+                push_instr(&moves, create_instr(when_fall, name, cond, values[0]));
+            } else {
+                push_instr(&copies, create_instr(IR_ASSIGN, name, values[0], NULL));
+            }
+            push_instr(&moves, create_instr(when_taken, name, cond, values[1]));
+        } else if (values[0]) {
+            push_instr(&moves, create_instr(when_fall, name, cond, values[0]));
+        } else {
+            push_instr(&moves, create_instr(when_taken, name, cond, values[1]));
+        }
+    }
+    // Arm code only feeding values the moves no longer need is dropped;
+    // none of it is seen after the if
+    for (int j = code.count - 1; j >= 0; j--) {
+        IRInstr* instr = code.items[j];
+        bool read = false;
+        for (int l = j + 1; l < code.count && !read; l++) {
+            read = code.items[l] && reads_operand(code.items[l], instr->dest);
+        }
+        InstrList* tails[3] = { &copies, &moves, &results };
+        for (int t = 0; t < 3 && !read; t++) {
+            for (int l = 0; l < tails[t]->count && !read; l++) {
+                read = reads_operand(tails[t]->items[l], instr->dest);
+            }
+        }
+        if (!read) {
+            free_instruction(instr);
+            code.items[j] = NULL;
+        }
+    }
+    int compacted = 0;
+    for (int j = 0; j < code.count; j++) {
+        if (code.items[j]) code.items[compacted++] = code.items[j];
+    }
+    code.count = compacted;
+    int size = code.count + copies.count + moves.count + results.count;
+    bool convert = !writes_cond && size <= IF_CONVERSION_BUDGET;
+
+    InstrList out = code;
+    if (convert) {
+        for (int j = 0; j < copies.count; j++) push_instr(&out, copies.items[j]);
+        if (move_compare) push_instr(&out, copy_instruction(compare));
+        for (int j = 0; j < moves.count; j++) push_instr(&out, moves.items[j]);
+        for (int j = 0; j < results.count; j++) push_instr(&out, results.items[j]);
+        if (needs_jump) push_instr(&out, create_jump_instr(IR_JUMP, NULL, join_label->label->name));
+    } else {
+        for (int j = 0; j < out.count; j++) free_instruction(out.items[j]);
+        for (int j = 0; j < copies.count; j++) free_instruction(copies.items[j]);
+        for (int j = 0; j < moves.count; j++) free_instruction(moves.items[j]);
+        for (int j = 0; j < results.count; j++) free_instruction(results.items[j]);
+    }
+    free(copies.items);
+    free(moves.items);
+    free(results.items);
+    for (int a = 0; a < 2; a++) free_rename_table(arms[a].renames);
+    for (int v = 0; v < written_count; v++) free(written[v]);
+    free(written);
+    free_name_map(seen);
+    if (!convert) {
+        free(out.items);
+        return false;
+    }
+
+    // Remove the arms and the branch, the later positions first so the
+    // earlier ones stay valid
+    int head_from = move_compare ? head->end - 1 : head->end;
+    int starts[3] = { head_from, -1, -1 };
+    int ends[3] = { head->end + 1, -1, -1 };
+    for (int a = 0; a < 2; a++) {
+        if (!arms[a].block) continue;
+        starts[a + 1] = arms[a].block->start;
+        ends[a + 1] = arms[a].block->end + 1;
+    }
+    for (int done = 0; done < 3; done++) {
+        int last = 0;
+        for (int r = 1; r < 3; r++) {
+            if (starts[r] > starts[last]) last = r;
+        }
+        if (starts[last] < 0) break;
+        remove_instructions(program, starts[last], ends[last] - starts[last]);
+        if (last == 0) insert_instructions(program, starts[0], out.items, out.count);
+        starts[last] = -1;
+    }
+    free(out.items);
+    return true;
+}
+
+// If-conversion over every branch; a converted if can leave an
+// enclosing one with straight-line arms, so it goes round again
+static void convert_ifs(IRProgram* program, AnalysisManager* analyses) {
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            CFG* cfg = get_cfg(analyses, start);
+            for (int b = 0; b < cfg->block_count && !changed; b++) {
+                changed = convert_if(program, cfg, cfg->blocks[b]);
+            }
+            if (changed) invalidate_function(analyses, start, ANALYSIS_NONE);
+        }
+        start = find_function_end(program, start);
+    }
+}
+
+// Loop-invariant code motion
+
+// Returns the block loop-invariant code should be placed at the end of,
+// creating a dedicated preheader in front of the header if the loop is
+// not entered from exactly one block that only leads to the header.
+// Sets *changed when new instructions were inserted.
+static int find_or_insert_preheader(IRProgram* program, CFG* cfg, Loop* loop,
+                                    bool* changed) {
+    BasicBlock* header = loop->header;
+    BasicBlock* entry = NULL;
+    int entry_count = 0;
+    for (int i = 0; i < header->predecessor_count; i++) {
+        if (!loop->contains[header->predecessors[i]->index]) {
+            entry = header->predecessors[i];
+            entry_count++;
+        }
+    }
+    *changed = false;
+    if (entry_count == 1 && entry->successor_count == 1) {
+        // Insert before a trailing jump, or at the very end on fall-through
+        IRInstr* last = program->instructions[entry->end];
+        if (last->op == IR_JUMP) return entry->end;
+        if (!is_branch(last)) return entry->end + 1;
+    }
+
+    const char* header_label = program->instructions[header->start]->label->name;
+    char* preheader_label = new_label_name(program);
+    for (int i = 0; i < header->predecessor_count; i++) {
+        BasicBlock* pred = header->predecessors[i];
+        IRInstr* last = program->instructions[pred->end];
+        if (!loop->contains[pred->index] && is_branch(last) &&
+            strcmp(last->label->name, header_label) == 0) {
+            free(last->label->name);
+            last->label->name = strdup(preheader_label);
+        }
+    }
+
+    // A loop block falling through into the header must now jump over
+    // the preheader
+    int position = header->start;
+    if (header->index > 0) {
+        BasicBlock* before = cfg->blocks[header->index - 1];
+        IRInstr* last = program->instructions[before->end];
+        if (loop->contains[before->index] && last->op != IR_JUMP &&
+            !is_exit(last)) {
+            IRInstr* jump = create_jump_instr(IR_JUMP, NULL, header_label);
+            insert_instructions(program, position++, &jump, 1);
+        }
+    }
+    IRInstr* label = create_label_instr(preheader_label, 0);
+    insert_instructions(program, position, &label, 1);
+    free(preheader_label);
+    *changed = true;
+    return -1;
+}
+
+// True if control can leave the loop from the end of block
+static bool is_exiting_block(IRProgram* program, Loop* loop, BasicBlock* block) {
+    if (is_exit(program->instructions[block->end])) return true;
+    for (int i = 0; i < block->successor_count; i++) {
+        if (!loop->contains[block->successors[i]->index]) return true;
+    }
+    return false;
+}
+
+static bool dominates_loop_exits(IRProgram* program, CFG* cfg, Loop* loop,
+                                 BasicBlock* block) {
+    for (int i = 0; i < loop->block_count; i++) {
+        BasicBlock* other = loop->blocks[i];
+        if (is_exiting_block(program, loop, other) && !dominates(cfg, block, other)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Division is only hoisted when it cannot trap: a constant divisor
+// other than 0 and -1, or a position where it runs before any exit
+static bool is_safe_division(IRProgram* program, CFG* cfg, Loop* loop, int index) {
+    IRInstr* instr = program->instructions[index];
+    long divisor;
+    if (get_operand_constant(program, cfg, instr->src2, &divisor)) {
+        return divisor != 0 && divisor != -1;
+    }
+    return dominates_loop_exits(program, cfg, loop, find_block_containing(cfg, index));
+}
+
+// Marks invariant instructions that can be moved to the preheader and
+// returns them in an order that respects dominance
+static int find_hoistable(IRProgram* program, CFG* cfg, Loop* loop, int* hoisted) {
+    NameMap* def_counts = create_name_map(64);
+    NameMap* def_index = create_name_map(64);
+    for (int i = 0; i < loop->block_count; i++) {
+        BasicBlock* block = loop->blocks[i];
+        for (int k = block->start; k <= block->end; k++) {
+            IRInstr* instr = program->instructions[k];
+            if (!writes_dest(instr)) continue;
+            int count = name_map_get(def_counts, instr->dest);
+            name_map_put(def_counts, instr->dest, count < 0 ? 1 : count + 1);
+            name_map_put(def_index, instr->dest, k);
+        }
+    }
+
+    // Loop blocks in reverse postorder so definitions come before uses
+    BasicBlock** order = malloc(sizeof(BasicBlock*) * loop->block_count);
+    int order_count = 0;
+    for (int i = 0; i < cfg->rpo_count; i++) {
+        if (loop->contains[cfg->rpo[i]->index]) order[order_count++] = cfg->rpo[i];
+    }
+
+    int count = 0;
+    bool* invariant = calloc(cfg->end - cfg->start, sizeof(bool));
+    bool changed;
+    do {
+        changed = false;
+        for (int b = 0; b < order_count; b++) {
+            BasicBlock* block = order[b];
+            for (int k = block->start; k <= block->end; k++) {
+                IRInstr* instr = program->instructions[k];
+                if (invariant[k - cfg->start] || !writes_dest(instr) ||
+                    instr->op == IR_PARAM) {
+                    continue;
+                }
+                if (has_side_effects(instr) &&
+                    !(instr->op == IR_DIV && is_safe_division(program, cfg, loop, k))) {
+                    continue;
+                }
+                if (name_map_get(def_counts, instr->dest) != 1) continue;
+
+                // Every operand is constant, defined outside the loop, or
+                // defined by an instruction already found invariant
+                bool operands_invariant = true;
+                const char* operands[2] = { instr->src1, instr->src2 };
+                for (int j = 0; j < 2; j++) {
+                    if (!operands[j] || is_immediate_operand(operands[j])) continue;
+                    int defs = name_map_get(def_counts, operands[j]);
+                    if (defs > 1 || (defs == 1 &&
+                        !invariant[name_map_get(def_index, operands[j]) - cfg->start])) {
+                        operands_invariant = false;
+                    }
+                }
+                if (!operands_invariant) continue;
+
+                // Uses must all see this definition, and values read
+                // after the loop must have been computed on every path
+                bool movable = true;
+                bool dominates_exits = dominates_loop_exits(program, cfg, loop, block);
+                for (int j = cfg->start; j < cfg->end && movable; j++) {
+                    if (!reads_operand(program->instructions[j], instr->dest)) continue;
+                    BasicBlock* use_block = find_block_containing(cfg, j);
+                    if (!loop->contains[use_block->index]) {
+                        movable = dominates_exits;
+                    } else if (!dominates(cfg, block, use_block) ||
+                               (use_block == block && j <= k)) {
+                        movable = false;
                     }
-                    break;
                 }
+                if (!movable) continue;
+
+                invariant[k - cfg->start] = true;
+                changed = true;
             }
         }
+    } while (changed);
+
+    for (int b = 0; b < order_count; b++) {
+        for (int k = order[b]->start; k <= order[b]->end; k++) {
+            if (invariant[k - cfg->start]) hoisted[count++] = k;
+        }
     }
+
+    free(invariant);
+    free(order);
+    free_name_map(def_counts);
+    free_name_map(def_index);
+    return count;
 }
 
-// Tail recursion elimination
-static void eliminate_tail_recursion(IRProgram* program) {
-    char* current_function = NULL;
-    
-    for (int i = 0; i < program->count; i++) {
-        IRInstr* instr = program->instructions[i];
-        
-        if (instr->op == IR_LABEL && instr->label->number == -1) {
-            // This is a function label
-            current_function = strdup(instr->label->name);
+static int compare_index_descending(const void* a, const void* b) {
+    return *(const int*)b - *(const int*)a;
+}
+
+static void hoist_loop_invariants(IRProgram* program, AnalysisManager* analyses) {
+    NameMap* done = create_name_map(16);
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
         }
-        
-        if (instr->op == IR_CALL && 
-            strcmp(instr->src1, current_function) == 0) {
-            // Found a recursive call
-            // Check if it's followed by a return
-            if (i + 1 < program->count && 
-                program->instructions[i + 1]->op == IR_RETURN) {
-                // This is tail recursion - replace with jump
-                instr->op = IR_JUMP;
-                IRLabel* label = malloc(sizeof(IRLabel));
-                label->name = strdup(current_function);
-                label->number = -1;
-                instr->label = label;
-                
-                // Remove the return instruction
-                free_instruction(program->instructions[i + 1]);
-                // Shift remaining instructions
-                for (int j = i + 1; j < program->count - 1; j++) {
-                    program->instructions[j] = program->instructions[j + 1];
+
+        // Inner loops first, so their invariants can move on outwards
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            CFG* cfg = get_cfg(analyses, start);
+            LoopForest* forest = get_loops(analyses, start);
+            for (int i = 0; i < forest->loop_count && !changed; i++) {
+                Loop* loop = forest->loops[i];
+                IRInstr* first = program->instructions[loop->header->start];
+                if (first->op != IR_LABEL || is_function_label(first) ||
+                    name_map_get(done, first->label->name) >= 0) {
+                    continue;
+                }
+
+                int* hoisted = malloc(sizeof(int) * (cfg->end - cfg->start));
+                int count = find_hoistable(program, cfg, loop, hoisted);
+                if (count == 0) {
+                    name_map_put(done, first->label->name, 1);
+                    free(hoisted);
+                    continue;
+                }
+
+                // Creating a preheader shifts instructions; redo the
+                // analysis on the next round
+                int position = find_or_insert_preheader(program, cfg, loop, &changed);
+                if (changed) {
+                    free(hoisted);
+                    continue;
+                }
+                name_map_put(done, first->label->name, 1);
+
+                IRInstr** moved = malloc(sizeof(IRInstr*) * count);
+                for (int j = 0; j < count; j++) {
+                    moved[j] = program->instructions[hoisted[j]];
+                }
+                // Detach back to front so earlier indices stay valid
+                qsort(hoisted, count, sizeof(int), compare_index_descending);
+                for (int j = 0; j < count; j++) {
+                    detach_instruction(program, hoisted[j]);
+                    if (hoisted[j] < position) position--;
+                }
+                insert_instructions(program, position, moved, count);
+                free(moved);
+                free(hoisted);
+                changed = true;
+            }
+            if (changed) invalidate_function(analyses, start, ANALYSIS_NONE);
+        }
+        start = find_function_end(program, start);
+    }
+    free_name_map(done);
+}
+
+// Induction variable strength reduction
+
+// Basic induction variable: the only definition in the loop is iv = iv + step,
+// possibly computed into a temporary first and copied back
+typedef struct {
+    const char* name;
+    int update;             // Instruction writing the variable
+    int step_def;           // Temporary holding iv + step, or -1
+    long step;
+} BasicIV;
+
+// Derived induction variable: dest = base * factor with an invariant factor
+typedef struct {
+    int def;                // The multiply
+    int base;               // Index into the basic IV table
+    const char* factor;
+    char* reduced;          // Variable that tracks the product additively
+} DerivedIV;
+
+static int count_loop_defs(IRProgram* program, Loop* loop, const char* name) {
+    int count = 0;
+    for (int i = 0; i < loop->block_count; i++) {
+        BasicBlock* block = loop->blocks[i];
+        count += count_defs(program, block->start, block->end + 1, name);
+    }
+    return count;
+}
+
+static int find_loop_def(IRProgram* program, Loop* loop, const char* name) {
+    for (int i = 0; i < loop->block_count; i++) {
+        BasicBlock* block = loop->blocks[i];
+        for (int k = block->start; k <= block->end; k++) {
+            IRInstr* instr = program->instructions[k];
+            if (writes_dest(instr) && strcmp(instr->dest, name) == 0) return k;
+        }
+    }
+    return -1;
+}
+
+static bool is_loop_invariant(IRProgram* program, Loop* loop, const char* operand) {
+    return is_immediate_operand(operand) || count_loop_defs(program, loop, operand) == 0;
+}
+
+static int find_basic_ivs(IRProgram* program, CFG* cfg, Loop* loop, BasicIV* ivs) {
+    int count = 0;
+    for (int i = 0; i < loop->block_count; i++) {
+        BasicBlock* block = loop->blocks[i];
+        for (int k = block->start; k <= block->end; k++) {
+            IRInstr* instr = program->instructions[k];
+            if (!writes_dest(instr) || instr->op == IR_PARAM ||
+                count_loop_defs(program, loop, instr->dest) != 1) {
+                continue;
+            }
+            IRInstr* update = instr;
+            int step_def = -1;
+            if (instr->op == IR_ASSIGN && instr->src1) {
+                step_def = find_loop_def(program, loop, instr->src1);
+                if (step_def < block->start || step_def > k ||
+                    count_loop_defs(program, loop, instr->src1) != 1) {
+                    continue;
+                }
+                update = program->instructions[step_def];
+            }
+            long step;
+            if (!get_iv_step(program, cfg, update, instr->dest, &step) || step == 0) {
+                continue;
+            }
+            ivs[count].name = instr->dest;
+            ivs[count].update = k;
+            ivs[count].step_def = step_def;
+            ivs[count].step = step;
+            count++;
+        }
+    }
+    return count;
+}
+
+static int find_basic_iv(BasicIV* ivs, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(ivs[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int find_derived_ivs(IRProgram* program, Loop* loop, BasicIV* ivs, int iv_count,
+                            DerivedIV* derived) {
+    int count = 0;
+    for (int i = 0; i < loop->block_count; i++) {
+        BasicBlock* block = loop->blocks[i];
+        for (int k = block->start; k <= block->end; k++) {
+            IRInstr* instr = program->instructions[k];
+            if (instr->op != IR_MUL) continue;
+            int base = find_basic_iv(ivs, iv_count, instr->src1);
+            const char* factor = instr->src2;
+            if (base < 0) {
+                base = find_basic_iv(ivs, iv_count, instr->src2);
+                factor = instr->src1;
+            }
+            if (base < 0 || !is_loop_invariant(program, loop, factor)) continue;
+            derived[count].def = k;
+            derived[count].base = base;
+            derived[count].factor = factor;
+            derived[count].reduced = NULL;
+            count++;
+        }
+    }
+    return count;
+}
+
+static IRInstr* create_constant_instr(const char* dest, long value) {
+    IRInstr* instr = create_instr(IR_ASSIGN, dest, NULL, NULL);
+    instr->value = (int)value;
+    return instr;
+}
+
+// Linear-function test replacement: rewrite an exit test on the basic
+// IV in terms of a reduced product with a constant factor, so the basic
+// IV itself may become dead
+static bool replace_iv_test(IRProgram* program, CFG* cfg, Loop* loop, BasicIV* iv,
+                            DerivedIV* derived, InstrList* preheader) {
+    long factor;
+    if (!get_operand_constant(program, cfg, derived->factor, &factor) || factor == 0) {
+        return false;
+    }
+    bool replaced = false;
+    for (int i = 0; i < loop->block_count; i++) {
+        BasicBlock* block = loop->blocks[i];
+        for (int k = block->start; k <= block->end; k++) {
+            IRInstr* instr = program->instructions[k];
+            if (instr->op != IR_COMPARE) continue;
+            bool left = strcmp(instr->src1, iv->name) == 0;
+            bool right = strcmp(instr->src2, iv->name) == 0;
+            if (left == right) continue;
+            const char* bound = left ? instr->src2 : instr->src1;
+            if (!is_loop_invariant(program, loop, bound)) continue;
+
+            char* scaled = new_temp(program);
+            char* factor_temp = new_temp(program);
+            push_instr(preheader, create_constant_instr(factor_temp, factor));
+            push_instr(preheader, create_instr(IR_MUL, scaled, bound, factor_temp));
+            char** iv_operand = left ? &instr->src1 : &instr->src2;
+            char** bound_operand = left ? &instr->src2 : &instr->src1;
+            free(*iv_operand);
+            *iv_operand = strdup(derived->reduced);
+            free(*bound_operand);
+            *bound_operand = scaled;
+            if (factor < 0) instr->value = swap_relation(instr->value);
+            free(factor_temp);
+            replaced = true;
+        }
+    }
+    return replaced;
+}
+
+// Removes basic IVs that nothing reads but their own update, neither
+// inside the loop nor after it.  Returns true after the first removal
+// since instruction indices have shifted.
+static bool remove_dead_ivs(IRProgram* program, CFG* cfg, Loop* loop, Liveness* liveness) {
+    BasicIV* ivs = malloc(sizeof(BasicIV) * (cfg->end - cfg->start));
+    int iv_count = find_basic_ivs(program, cfg, loop, ivs);
+    for (int v = 0; v < iv_count; v++) {
+        BasicIV* iv = &ivs[v];
+        const char* step_temp = iv->step_def >= 0 ?
+            program->instructions[iv->step_def]->dest : NULL;
+        bool live = false;
+        for (int i = 0; i < loop->block_count && !live; i++) {
+            BasicBlock* block = loop->blocks[i];
+            for (int k = block->start; k <= block->end && !live; k++) {
+                if (k == iv->update || k == iv->step_def) continue;
+                IRInstr* instr = program->instructions[k];
+                live = reads_operand(instr, iv->name) ||
+                       (step_temp && reads_operand(instr, step_temp));
+            }
+            for (int j = 0; j < block->successor_count && !live; j++) {
+                BasicBlock* succ = block->successors[j];
+                live = !loop->contains[succ->index] &&
+                       (is_live_in_block(liveness, succ, iv->name) ||
+                        (step_temp && is_live_in_block(liveness, succ, step_temp)));
+            }
+        }
+        if (live) continue;
+
+        remove_instructions(program, iv->update, 1);
+        if (iv->step_def >= 0) remove_instructions(program, iv->step_def, 1);
+        free(ivs);
+        return true;
+    }
+    free(ivs);
+    return false;
+}
+
+static bool reduce_loop_ivs(IRProgram* program, CFG* cfg, Loop* loop, bool* retry) {
+    *retry = false;
+    int capacity = cfg->end - cfg->start;
+    BasicIV* ivs = malloc(sizeof(BasicIV) * capacity);
+    DerivedIV* derived = malloc(sizeof(DerivedIV) * capacity);
+    int iv_count = find_basic_ivs(program, cfg, loop, ivs);
+    int derived_count = find_derived_ivs(program, loop, ivs, iv_count, derived);
+    if (derived_count == 0) {
+        free(ivs);
+        free(derived);
+        return false;
+    }
+
+    int position = find_or_insert_preheader(program, cfg, loop, retry);
+    if (*retry) {
+        free(ivs);
+        free(derived);
+        return true;
+    }
+
+    // Each product gets a variable initialised in the preheader and
+    // bumped by step * factor right after its basic IV is updated
+    InstrList preheader = {0};
+    InstrList* updates = calloc(capacity, sizeof(InstrList));
+    bool* deleted = calloc(capacity, sizeof(bool));
+    for (int i = 0; i < derived_count; i++) {
+        DerivedIV* d = &derived[i];
+        BasicIV* iv = &ivs[d->base];
+        IRInstr* mul = program->instructions[d->def];
+
+        // A product only read later in its own block can be maintained
+        // in place, unless the basic IV changes before those reads
+        BasicBlock* block = find_block_containing(cfg, d->def);
+        bool in_place = is_block_local(program, cfg, d->def);
+        for (int k = d->def + 1; k <= block->end && in_place; k++) {
+            if (k == iv->update) {
+                for (int j = k + 1; j <= block->end; j++) {
+                    if (reads_operand(program->instructions[j], mul->dest)) in_place = false;
+                }
+            }
+        }
+        if (in_place) {
+            d->reduced = strdup(mul->dest);
+            deleted[d->def - cfg->start] = true;
+        } else {
+            d->reduced = new_temp(program);
+        }
+        char* increment = new_temp(program);
+        char* step = new_temp(program);
+        push_instr(&preheader, create_instr(IR_MUL, d->reduced, iv->name, d->factor));
+        push_instr(&preheader, create_constant_instr(step, iv->step));
+        push_instr(&preheader, create_instr(IR_MUL, increment, step, d->factor));
+        push_instr(&updates[iv->update - cfg->start],
+                   create_instr(IR_ADD, d->reduced, d->reduced, increment));
+        free(increment);
+        free(step);
+    }
+
+    // Rewrite exit tests before the multiplies, which the IV names point into
+    for (int i = 0; i < iv_count; i++) {
+        for (int j = 0; j < derived_count; j++) {
+            if (derived[j].base == i &&
+                replace_iv_test(program, cfg, loop, &ivs[i], &derived[j], &preheader)) {
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < derived_count; i++) {
+        IRInstr* mul = program->instructions[derived[i].def];
+        if (deleted[derived[i].def - cfg->start]) continue;
+        mul->op = IR_ASSIGN;
+        free(mul->src1);
+        free(mul->src2);
+        mul->src1 = strdup(derived[i].reduced);
+        mul->src2 = NULL;
+    }
+
+    // Splice the updates in back to front, then the preheader code
+    for (int k = cfg->end - 1; k >= cfg->start; k--) {
+        InstrList* list = &updates[k - cfg->start];
+        if (list->count > 0) {
+            insert_instructions(program, k + 1, list->items, list->count);
+            if (k + 1 <= position) position += list->count;
+            free(list->items);
+        }
+        if (deleted[k - cfg->start]) {
+            remove_instructions(program, k, 1);
+            if (k < position) position--;
+        }
+    }
+    insert_instructions(program, position, preheader.items, preheader.count);
+    free(preheader.items);
+    free(updates);
+    free(deleted);
+    for (int i = 0; i < derived_count; i++) {
+        free(derived[i].reduced);
+    }
+    free(derived);
+    free(ivs);
+    return true;
+}
+
+// Replaces multiplies of induction variables by additive updates, then
+// rewrites exit tests so the original counters can be deleted
+static void reduce_induction_variables(IRProgram* program, AnalysisManager* analyses) {
+    NameMap* reduced = create_name_map(16);
+    NameMap* cleaned = create_name_map(16);
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            CFG* cfg = get_cfg(analyses, start);
+            LoopForest* forest = get_loops(analyses, start);
+            for (int i = 0; i < forest->loop_count && !changed; i++) {
+                Loop* loop = forest->loops[i];
+                IRInstr* first = program->instructions[loop->header->start];
+                if (first->op != IR_LABEL || is_function_label(first)) continue;
+                const char* name = first->label->name;
+
+                if (name_map_get(reduced, name) < 0) {
+                    bool retry;
+                    changed = reduce_loop_ivs(program, cfg, loop, &retry);
+                    if (!retry) name_map_put(reduced, name, 1);
+                    if (changed) break;
+                }
+                if (name_map_get(cleaned, name) < 0) {
+                    Liveness* liveness = get_liveness(analyses, start);
+                    changed = remove_dead_ivs(program, cfg, loop, liveness);
+                    if (!changed) name_map_put(cleaned, name, 1);
                 }
-                program->count--;
             }
+            if (changed) invalidate_function(analyses, start, ANALYSIS_NONE);
         }
+        start = find_function_end(program, start);
     }
-    
-    free(current_function);
+    free_name_map(reduced);
+    free_name_map(cleaned);
 }
 
 // Function inlining
-static void inline_functions(IRProgram* program) {
-    // First pass: collect small functions
-    struct {
-        char* name;
-        int start;
-        int end;
-        int instruction_count;
-    } functions[100];
-    int function_count = 0;
-    
-    int current_start = 0;
+
+// Instructions saved by not calling: call, ret and the move of the
+// result out of %rax.  Each argument costs a move into its register at
+// the call and another out of it in the callee.  A callee that itself
+// calls also sets up and tears down %rbp, three instructions the caller,
+// which calls too, already has.
+#define INLINE_CALL_OVERHEAD 3
+#define INLINE_ARG_OVERHEAD 2
+#define INLINE_FRAME_OVERHEAD 3
+#define INLINE_CONSTANT_ARG_BONUS 5     // Folding a constant argument
+#define INLINE_SINGLE_SITE_BONUS 40     // The out-of-line copy can be deleted
+#define INLINE_MAX_CALLER_SIZE 2000
+
+typedef struct {
+    const char* name;
+    int start;              // Function label
+    int end;                // One past the last instruction
+    int body_start;         // First instruction after the parameters
+    int call_sites;
+    bool inlinable;
+    bool leaf;              // Makes no calls, so keeps no frame pointer
+} FunctionInfo;
+
+static int collect_functions(IRProgram* program, FunctionInfo** out) {
+    int count = 0;
     for (int i = 0; i < program->count; i++) {
-        IRInstr* instr = program->instructions[i];
-        if (instr->op == IR_LABEL && instr->label->number == -1) {
-            current_start = i;
-        } else if (instr->op == IR_RETURN) {
-            int size = i - current_start + 1;
-            if (size < 20) {  // Only inline small functions
-                functions[function_count].name = 
-                    strdup(program->instructions[current_start]->label->name);
-                functions[function_count].start = current_start;
-                functions[function_count].end = i;
-                functions[function_count].instruction_count = size;
-                function_count++;
-            }
-        }
-    }
-    
-    // Second pass: replace calls with inlined code
+        if (is_function_label(program->instructions[i])) count++;
+    }
+    FunctionInfo* functions = calloc(count + 1, sizeof(FunctionInfo));
+    count = 0;
     for (int i = 0; i < program->count; i++) {
+        if (!is_function_label(program->instructions[i])) continue;
+        FunctionInfo* f = &functions[count++];
+        f->name = program->instructions[i]->label->name;
+        f->start = i;
+        f->end = find_function_end(program, i);
+        f->body_start = i + 1;
+        while (f->body_start < f->end &&
+               program->instructions[f->body_start]->op == IR_PARAM) {
+            f->body_start++;
+        }
+    }
+
+    // Count call sites; a function that jumps outside its own body
+    // cannot be copied
+    bool* calls = calloc((count + 1) * (count + 1), sizeof(bool));
+    for (int k = 0; k < count; k++) {
+        FunctionInfo* f = &functions[k];
+        NameMap* labels = create_name_map(16);
+        for (int i = f->start + 1; i < f->end; i++) {
+            IRInstr* instr = program->instructions[i];
+            if (instr->op == IR_LABEL) name_map_put(labels, instr->label->name, i);
+        }
+        f->inlinable = true;
+        f->leaf = true;
+        for (int i = f->start + 1; i < f->end; i++) {
+            IRInstr* instr = program->instructions[i];
+            if (is_branch(instr) && name_map_get(labels, instr->label->name) < 0) {
+                f->inlinable = false;
+            }
+            if (instr->op == IR_TAIL_CALL) f->inlinable = false;
+            if (instr->op == IR_CALL) f->leaf = false;
+            if (instr->op != IR_CALL && instr->op != IR_TAIL_CALL) continue;
+            for (int j = 0; j < count; j++) {
+                if (strcmp(functions[j].name, instr->src1) == 0) {
+                    functions[j].call_sites++;
+                    calls[k * count + j] = true;
+                }
+            }
+        }
+        free_name_map(labels);
+    }
+
+    // Recursive functions, directly or through others, are never inlined
+    int* stack = malloc(sizeof(int) * (count + 1));
+    bool* seen = malloc(sizeof(bool) * (count + 1));
+    for (int k = 0; k < count; k++) {
+        memset(seen, 0, sizeof(bool) * count);
+        int top = 0;
+        stack[top++] = k;
+        while (top > 0 && functions[k].inlinable) {
+            int current = stack[--top];
+            for (int j = 0; j < count; j++) {
+                if (!calls[current * count + j]) continue;
+                if (j == k) functions[k].inlinable = false;
+                if (!seen[j]) {
+                    seen[j] = true;
+                    stack[top++] = j;
+                }
+            }
+        }
+    }
+    free(stack);
+    free(seen);
+    free(calls);
+    *out = functions;
+    return count;
+}
+
+static FunctionInfo* find_function(FunctionInfo* functions, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(functions[i].name, name) == 0) return &functions[i];
+    }
+    return NULL;
+}
+
+// Finds the ARG instructions belonging to the call at index call by
+// replaying the argument stack.  Every expression pushes and pops its
+// arguments in straight-line order, and inlined bodies are balanced, so
+// this can run linearly from the function start.
+static bool find_call_args(IRProgram* program, int function_start, int call, int* args) {
+    int* stack = malloc(sizeof(int) * (call - function_start + 1));
+    int depth = 0;
+    for (int i = function_start + 1; i < call; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (instr->op == IR_ARG) {
+            stack[depth++] = i;
+        } else if (instr->op == IR_CALL || instr->op == IR_TAIL_CALL) {
+            depth -= instr->value;
+            if (depth < 0) depth = 0;
+        }
+    }
+    int argc = program->instructions[call]->value;
+    bool found = depth >= argc;
+    for (int i = 0; i < argc && found; i++) {
+        args[i] = stack[depth - argc + i];
+    }
+    free(stack);
+    return found;
+}
+
+static bool is_constant_operand(IRProgram* program, int function_start, const char* operand) {
+    if (is_immediate_operand(operand)) return true;
+    int end = find_function_end(program, function_start);
+    int def = find_single_def(program, function_start, end, operand);
+    return def >= 0 && program->instructions[def]->op == IR_ASSIGN &&
+           !program->instructions[def]->src1;
+}
+
+static bool should_inline(IRProgram* program, FunctionInfo* caller, FunctionInfo* callee,
+                          int call, int* args) {
+    if (!callee->inlinable) return false;
+    int size = callee->end - callee->body_start;
+    if ((caller->end - caller->start) + size > INLINE_MAX_CALLER_SIZE) return false;
+
+    int argc = program->instructions[call]->value;
+    int constant_args = 0;
+    for (int i = 0; i < argc; i++) {
+        IRInstr* arg = program->instructions[args[i]];
+        if (is_constant_operand(program, caller->start, arg->src1)) constant_args++;
+    }
+    int benefit = INLINE_CALL_OVERHEAD + INLINE_ARG_OVERHEAD * argc +
+                  INLINE_CONSTANT_ARG_BONUS * constant_args;
+    if (!callee->leaf) benefit += INLINE_FRAME_OVERHEAD;
+    if (callee->call_sites == 1 && strcmp(callee->name, "main") != 0) {
+        benefit += INLINE_SINGLE_SITE_BONUS;
+    }
+    return size <= benefit;
+}
+
+static void inline_call(IRProgram* program, FunctionInfo* callee, int call, int* args) {
+    IRInstr* call_instr = program->instructions[call];
+    int argc = call_instr->value;
+    RenameTable* renames = create_rename_table();
+
+    // Every name and label in the callee gets a fresh counterpart
+    for (int i = callee->start + 1; i < callee->end; i++) {
         IRInstr* instr = program->instructions[i];
-        if (instr->op == IR_CALL) {
-            // Check if this function should be inlined
-            for (int j = 0; j < function_count; j++) {
-                if (strcmp(instr->src1, functions[j].name) == 0) {
-                    // Inline the function
-                    // Note: Need to implement instruction insertion and
-                    // handle parameter passing
+        char* names[3] = { instr->dest, instr->src1, instr->src2 };
+        for (int j = 0; j < 3; j++) {
+            if (!names[j] || is_immediate_operand(names[j])) continue;
+            if (j == 1 && instr->op == IR_CALL) continue;
+            if (name_map_get(renames->map, names[j]) < 0) {
+                add_rename(renames, names[j], new_temp(program));
+            }
+        }
+        if (instr->op == IR_LABEL) {
+            add_rename(renames, instr->label->name, new_label_name(program));
+        }
+    }
+
+    char** params = malloc(sizeof(char*) * (argc + 1));
+    for (int i = 0; i < argc; i++) {
+        params[i] = strdup(program->instructions[callee->start + 1 + i]->dest);
+        apply_rename(renames, &params[i]);
+    }
+
+    InstrList body = {0};
+    char* end_label = new_label_name(program);
+    bool end_label_used = false;
+    for (int i = callee->body_start; i < callee->end; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (instr->op == IR_RETURN) {
+            if (instr->src1 && call_instr->dest) {
+                IRInstr* result = create_instr(IR_ASSIGN, call_instr->dest, instr->src1, NULL);
+                apply_rename(renames, &result->src1);
+                push_instr(&body, result);
+            }
+            if (i + 1 < callee->end) {
+                push_instr(&body, create_jump_instr(IR_JUMP, NULL, end_label));
+                end_label_used = true;
+            }
+            continue;
+        }
+        IRInstr* copy = copy_instruction(instr);
+        apply_rename(renames, &copy->dest);
+        if (copy->op != IR_CALL) apply_rename(renames, &copy->src1);
+        apply_rename(renames, &copy->src2);
+        if (copy->label) apply_rename(renames, &copy->label->name);
+        push_instr(&body, copy);
+    }
+    if (end_label_used) push_instr(&body, create_label_instr(end_label, 0));
+    free(end_label);
+
+    // The call is replaced by the body, each argument by an assignment
+    // to the matching renamed parameter
+    remove_instructions(program, call, 1);
+    insert_instructions(program, call, body.items, body.count);
+    free(body.items);
+    for (int i = 0; i < argc; i++) {
+        IRInstr* arg = program->instructions[args[i]];
+        arg->op = IR_ASSIGN;
+        arg->dest = params[i];
+    }
+    free(params);
+    free_rename_table(renames);
+}
+
+// Removes functions other than main that are no longer called
+static void remove_unused_functions(IRProgram* program) {
+    FunctionInfo* functions;
+    int count = collect_functions(program, &functions);
+    for (int i = count - 1; i >= 0; i--) {
+        if (functions[i].call_sites == 0 && strcmp(functions[i].name, "main") != 0) {
+            remove_instructions(program, functions[i].start,
+                                functions[i].end - functions[i].start);
+        }
+    }
+    free(functions);
+}
+
+static void inline_functions(IRProgram* program) {
+    bool inlined_any = false;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        FunctionInfo* functions;
+        int count = collect_functions(program, &functions);
+        for (int f = 0; f < count && !changed; f++) {
+            FunctionInfo* caller = &functions[f];
+            for (int i = caller->body_start; i < caller->end && !changed; i++) {
+                IRInstr* instr = program->instructions[i];
+                if (instr->op != IR_CALL) continue;
+                FunctionInfo* callee = find_function(functions, count, instr->src1);
+                if (!callee) continue;
+                int* args = malloc(sizeof(int) * (instr->value + 1));
+                if (find_call_args(program, caller->start, i, args) &&
+                    should_inline(program, caller, callee, i, args)) {
+                    inline_call(program, callee, i, args);
+                    changed = true;
+                    inlined_any = true;
+                }
+                free(args);
+            }
+        }
+        free(functions);
+    }
+    if (inlined_any) remove_unused_functions(program);
+}
+
+// Tail call elimination
+
+// Calls with more arguments than this pass some on the stack, in space
+// that belongs to the caller's frame
+#define MAX_REGISTER_ARGS 6
+
+// True if the value of the call at index call is returned unchanged:
+// only labels, jumps and copies of the result may lie on the way
+static bool is_tail_call(IRProgram* program, FunctionInfo* function, int call) {
+    IRInstr* instr = program->instructions[call];
+    if (!instr->dest) return false;
+    NameMap* aliases = create_name_map(8);
+    name_map_put(aliases, instr->dest, 1);
+
+    // Jumps are followed at most once each, which bounds the walk
+    NameMap* visited = create_name_map(8);
+    bool tail = false;
+    int i = call + 1;
+    while (i < function->end) {
+        IRInstr* next = program->instructions[i];
+        bool copies_alias = next->src1 && name_map_get(aliases, next->src1) >= 0;
+        if (next->op == IR_LABEL) {
+            i++;
+        } else if (next->op == IR_JUMP && name_map_get(visited, next->label->name) < 0) {
+            name_map_put(visited, next->label->name, 1);
+            i = function->start + 1;
+            while (i < function->end &&
+                   !(program->instructions[i]->op == IR_LABEL &&
+                     strcmp(program->instructions[i]->label->name, next->label->name) == 0)) {
+                i++;
+            }
+        } else if (next->op == IR_ASSIGN && copies_alias) {
+            name_map_put(aliases, next->dest, 1);
+            i++;
+        } else {
+            tail = next->op == IR_RETURN && copies_alias;
+            break;
+        }
+    }
+    free_name_map(aliases);
+    free_name_map(visited);
+    return tail;
+}
+
+// Orders the simultaneous assignments dests[i] = srcs[i] into a sequence
+// of copies, saving a value in a fresh temporary to break each cycle
+static void sequentialize_moves(IRProgram* program, char** dests, char** srcs, int n,
+                                InstrList* out) {
+    bool* done = calloc(n + 1, sizeof(bool));
+    char** sources = malloc(sizeof(char*) * (n + 1));
+    int remaining = 0;
+    for (int i = 0; i < n; i++) {
+        sources[i] = strdup(srcs[i]);
+        done[i] = strcmp(dests[i], srcs[i]) == 0;
+        if (!done[i]) remaining++;
+    }
+
+    while (remaining > 0) {
+        // A move can go ahead once no other pending move reads its dest
+        bool progress = false;
+        for (int i = 0; i < n; i++) {
+            if (done[i]) continue;
+            bool blocked = false;
+            for (int j = 0; j < n && !blocked; j++) {
+                blocked = !done[j] && j != i && strcmp(sources[j], dests[i]) == 0;
+            }
+            if (blocked) continue;
+            push_instr(out, create_instr(IR_ASSIGN, dests[i], sources[i], NULL));
+            done[i] = true;
+            remaining--;
+            progress = true;
+        }
+        if (progress) continue;
+
+        // Everything left is on a cycle: save one dest and redirect its readers
+        int first = 0;
+        while (done[first]) first++;
+        char* saved = new_temp(program);
+        push_instr(out, create_instr(IR_ASSIGN, saved, dests[first], NULL));
+        for (int j = 0; j < n; j++) {
+            if (!done[j] && strcmp(sources[j], dests[first]) == 0) {
+                free(sources[j]);
+                sources[j] = strdup(saved);
+            }
+        }
+        free(saved);
+    }
+
+    for (int i = 0; i < n; i++) {
+        free(sources[i]);
+    }
+    free(sources);
+    free(done);
+}
+
+// Replaces a self tail call by assignments of the arguments to the
+// parameters and a jump back to header
+static void eliminate_self_call(IRProgram* program, FunctionInfo* function, int call,
+                                int* args, const char* header) {
+    int argc = program->instructions[call]->value;
+    char** params = malloc(sizeof(char*) * (argc + 1));
+    char** values = malloc(sizeof(char*) * (argc + 1));
+    for (int i = 0; i < argc; i++) {
+        IRInstr* arg = program->instructions[args[i]];
+        params[i] = program->instructions[function->start + 1 + i]->dest;
+        values[i] = strdup(arg->src1);
+
+        // An argument whose source changes before the call is captured
+        // where it was passed; the others are read directly by the moves
+        bool overwritten = false;
+        for (int k = args[i] + 1; k < call && !overwritten; k++) {
+            IRInstr* instr = program->instructions[k];
+            overwritten = writes_dest(instr) && strcmp(instr->dest, arg->src1) == 0;
+        }
+        if (overwritten) {
+            free(values[i]);
+            values[i] = new_temp(program);
+            arg->op = IR_ASSIGN;
+            arg->dest = strdup(values[i]);
+        }
+    }
+
+    InstrList moves = {0};
+    sequentialize_moves(program, params, values, argc, &moves);
+    push_instr(&moves, create_jump_instr(IR_JUMP, NULL, header));
+    remove_instructions(program, call, 1);
+    insert_instructions(program, call, moves.items, moves.count);
+    free(moves.items);
+
+    // Drop the remaining ARGs back to front so earlier indices stay valid
+    for (int i = argc - 1; i >= 0; i--) {
+        if (program->instructions[args[i]]->op == IR_ARG) {
+            remove_instructions(program, args[i], 1);
+        }
+    }
+    for (int i = 0; i < argc; i++) {
+        free(values[i]);
+    }
+    free(params);
+    free(values);
+}
+
+// Self tail calls become jumps to a loop header placed after the
+// parameters.  Tail calls to other functions become IR_TAIL_CALL, which
+// the backend emits as a jump once the frame has been torn down.
+static void eliminate_tail_recursion(IRProgram* program) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        FunctionInfo* functions;
+        int count = collect_functions(program, &functions);
+        for (int f = 0; f < count && !changed; f++) {
+            FunctionInfo* function = &functions[f];
+            for (int i = function->body_start; i < function->end && !changed; i++) {
+                IRInstr* instr = program->instructions[i];
+                if (instr->op != IR_CALL || !is_tail_call(program, function, i)) continue;
+                int argc = instr->value;
+                int* args = malloc(sizeof(int) * (argc + 1));
+                if (!find_call_args(program, function->start, i, args)) {
+                    free(args);
+                    continue;
+                }
+
+                if (strcmp(instr->src1, function->name) == 0 &&
+                    argc == function->body_start - function->start - 1) {
+                    // Any label already at the top of the body will do
+                    IRInstr* first = program->instructions[function->body_start];
+                    char* header;
+                    if (first->op == IR_LABEL) {
+                        header = strdup(first->label->name);
+                    } else {
+                        header = new_label_name(program);
+                        IRInstr* label = create_label_instr(header, 0);
+                        insert_instructions(program, function->body_start, &label, 1);
+                        i++;
+                        for (int j = 0; j < argc; j++) {
+                            args[j]++;
+                        }
+                    }
+                    eliminate_self_call(program, function, i, args, header);
+                    free(header);
+                    changed = true;
+                } else if (argc <= MAX_REGISTER_ARGS) {
+                    instr->op = IR_TAIL_CALL;
+                    free(instr->dest);
+                    instr->dest = NULL;
                 }
+                free(args);
+            }
+        }
+        free(functions);
+    }
+}
+
+// Unreachable code removal on the cached CFGs
+static void remove_dead_code(IRProgram* program, AnalysisManager* analyses) {
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+        if (remove_unreachable_blocks(program, get_cfg(analyses, start)) > 0) {
+            invalidate_function(analyses, start, ANALYSIS_NONE);
+        }
+        start = find_function_end(program, start);
+    }
+}
+
+// Pass manager
+
+typedef enum {
+    PASS_CONSTANT_FOLDING,
+    PASS_REWRITE_RULES,
+    PASS_DEAD_CODE,
+    PASS_SIMPLIFY_CFG,
+    PASS_COMMON_SUBEXPRESSION,
+    PASS_STRENGTH_REDUCTION,
+    PASS_SUPEROPTIMIZER,
+    PASS_INLINE,
+    PASS_LOOP_INVARIANT_MOTION,
+    PASS_INDUCTION_VARIABLES,
+    PASS_LOOP_UNROLLING,
+    PASS_LOOP_ROTATION,
+    PASS_IF_CONVERSION,
+    PASS_TAIL_RECURSION,
+    PASS_COUNT
+} PassId;
+
+// A pass either ignores analyses, in which case preserved lists what its
+// changes leave valid, or takes the manager and invalidates what it
+// changes itself
+typedef struct {
+    const char* name;
+    void (*run)(IRProgram* program);
+    void (*run_with_analyses)(IRProgram* program, AnalysisManager* analyses);
+    unsigned preserved;
+    size_t flag;            // Offset of the enabling field in OptFlags
+} Pass;
+
+// In-place rewrites of straight-line code keep the block structure
+#define PRESERVES_SHAPE (ANALYSIS_CFG | ANALYSIS_LOOPS)
+
+static const Pass passes[PASS_COUNT] = {
+    { "constant-folding", constant_folding, NULL, PRESERVES_SHAPE,
+      offsetof(OptFlags, constant_folding) },
+    { "rewrite-rules", apply_rewrite_rules, NULL, PRESERVES_SHAPE,
+      offsetof(OptFlags, rewrite_rules) },
+    { "dead-code", NULL, remove_dead_code, ANALYSIS_ALL,
+      offsetof(OptFlags, dead_code_elimination) },
+    { "simplify-cfg", merge_basic_blocks, NULL, ANALYSIS_NONE,
+      offsetof(OptFlags, simplify_cfg) },
+    { "cse", NULL, eliminate_common_subexpressions, ANALYSIS_ALL,
+      offsetof(OptFlags, common_subexpression) },
+    { "strength-reduction", reduce_strength, NULL, PRESERVES_SHAPE,
+      offsetof(OptFlags, strength_reduction) },
+    { "superopt", apply_superoptimizations, NULL, ANALYSIS_NONE,
+      offsetof(OptFlags, superoptimizer) },
+    { "inline", inline_functions, NULL, ANALYSIS_NONE,
+      offsetof(OptFlags, inline_functions) },
+    { "licm", NULL, hoist_loop_invariants, ANALYSIS_ALL,
+      offsetof(OptFlags, loop_invariant_motion) },
+    { "induction-variables", NULL, reduce_induction_variables, ANALYSIS_ALL,
+      offsetof(OptFlags, induction_variables) },
+    { "loop-unroll", NULL, unroll_loops, ANALYSIS_ALL,
+      offsetof(OptFlags, loop_unrolling) },
+    { "loop-rotate", NULL, rotate_loops, ANALYSIS_ALL,
+      offsetof(OptFlags, loop_rotation) },
+    { "if-convert", NULL, convert_ifs, ANALYSIS_ALL,
+      offsetof(OptFlags, if_conversion) },
+    { "tail-calls", eliminate_tail_recursion, NULL, ANALYSIS_NONE,
+      offsetof(OptFlags, tail_recursion) },
+};
+
+// Passes run in order; a group with max_iterations > 1 is repeated
+// until a full round leaves the program unchanged
+typedef struct {
+    const PassId* passes;
+    int count;
+    int max_iterations;
+} PassGroup;
+
+#define GROUP(list, iterations) { list, sizeof(list) / sizeof(list[0]), iterations }
+#define MAX_CLEANUP_ITERATIONS 4
+
+static const PassId local_passes[] = {
+    PASS_CONSTANT_FOLDING, PASS_REWRITE_RULES, PASS_DEAD_CODE, PASS_SIMPLIFY_CFG,
+    PASS_STRENGTH_REDUCTION
+};
+static const PassId scalar_passes[] = {
+    PASS_CONSTANT_FOLDING, PASS_REWRITE_RULES, PASS_DEAD_CODE, PASS_SIMPLIFY_CFG,
+    PASS_COMMON_SUBEXPRESSION, PASS_STRENGTH_REDUCTION, PASS_SUPEROPTIMIZER
+};
+static const PassId inline_passes[] = { PASS_INLINE };
+static const PassId loop_passes[] = {
+    PASS_LOOP_INVARIANT_MOTION, PASS_INDUCTION_VARIABLES
+};
+static const PassId unroll_passes[] = { PASS_LOOP_UNROLLING };
+// After the loop passes, which expect the test at the top
+static const PassId rotate_passes[] = { PASS_LOOP_ROTATION };
+// After everything that expects ifs as branches; merging the joins left
+// behind gives enclosing ifs straight-line arms to convert in turn
+static const PassId if_passes[] = { PASS_IF_CONVERSION, PASS_SIMPLIFY_CFG };
+// Last, since the inliner does not copy IR_TAIL_CALL
+static const PassId tail_passes[] = { PASS_TAIL_RECURSION };
+
+static const PassGroup o1_pipeline[] = {
+    GROUP(local_passes, 1),
+};
+static const PassGroup o2_pipeline[] = {
+    GROUP(scalar_passes, MAX_CLEANUP_ITERATIONS),
+    GROUP(inline_passes, 1),
+    GROUP(scalar_passes, MAX_CLEANUP_ITERATIONS),
+    GROUP(loop_passes, 1),
+    GROUP(rotate_passes, 1),
+    GROUP(if_passes, MAX_CLEANUP_ITERATIONS),
+    GROUP(tail_passes, 1),
+};
+static const PassGroup o3_pipeline[] = {
+    GROUP(scalar_passes, MAX_CLEANUP_ITERATIONS),
+    GROUP(inline_passes, 1),
+    GROUP(scalar_passes, MAX_CLEANUP_ITERATIONS),
+    GROUP(loop_passes, 1),
+    GROUP(unroll_passes, 1),
+    GROUP(scalar_passes, MAX_CLEANUP_ITERATIONS),
+    GROUP(rotate_passes, 1),
+    GROUP(if_passes, MAX_CLEANUP_ITERATIONS),
+    GROUP(tail_passes, 1),
+};
+
+static const PassGroup* get_pipeline(OptLevel level, int* count) {
+    switch (level) {
+        case OPT_O1:
+            *count = sizeof(o1_pipeline) / sizeof(o1_pipeline[0]);
+            return o1_pipeline;
+        case OPT_O2:
+            *count = sizeof(o2_pipeline) / sizeof(o2_pipeline[0]);
+            return o2_pipeline;
+        case OPT_O3:
+            *count = sizeof(o3_pipeline) / sizeof(o3_pipeline[0]);
+            return o3_pipeline;
+        default:
+            *count = 0;
+            return NULL;
+    }
+}
+
+typedef struct {
+    int runs;
+    int changed_runs;
+    int removed;            // Instructions deleted, net per run
+    int added;
+    double seconds;
+} PassStats;
+
+static PassStats pass_stats[PASS_COUNT];
+static int analyses_computed;
+static int analyses_reused;
+
+static bool is_pass_enabled(OptFlags* flags, PassId pass) {
+    return *(bool*)((char*)flags + passes[pass].flag);
+}
+
+// Cheap summary of the program used to tell whether a pass changed it
+static unsigned int program_fingerprint(IRProgram* program) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < program->count; i++) {
+        IRInstr* instr = program->instructions[i];
+        const char* parts[4] = { instr->dest, instr->src1, instr->src2,
+                                 instr->label ? instr->label->name : NULL };
+        hash = (hash ^ (unsigned int)instr->op) * 16777619u;
+        hash = (hash ^ (unsigned int)instr->value) * 16777619u;
+        for (int j = 0; j < 4; j++) {
+            for (const char* c = parts[j]; c && *c; c++) {
+                hash = (hash ^ (unsigned char)*c) * 16777619u;
             }
+            hash = (hash ^ 0xff) * 16777619u;
         }
     }
+    return hash;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool run_pass(IRProgram* program, AnalysisManager* analyses, PassId pass) {
+    PassStats* stats = &pass_stats[pass];
+    int before_count = program->count;
+    unsigned int before = program_fingerprint(program);
+    double start = now_seconds();
+    if (passes[pass].run_with_analyses) {
+        passes[pass].run_with_analyses(program, analyses);
+    } else {
+        passes[pass].run(program);
+    }
+    stats->seconds += now_seconds() - start;
+    stats->runs++;
+
+    bool changed = program->count != before_count || program_fingerprint(program) != before;
+    if (changed) {
+        stats->changed_runs++;
+        invalidate_analyses(analyses, passes[pass].preserved);
+    }
+    if (program->count < before_count) stats->removed += before_count - program->count;
+    if (program->count > before_count) stats->added += program->count - before_count;
+    return changed;
 }
 
 void set_optimization_level(OptLevel level) {
     current_level = level;
 }
 
+// Passes the pipeline for level contains
+OptFlags get_level_flags(OptLevel level) {
+    OptFlags flags;
+    memset(&flags, 0, sizeof(flags));
+    int count;
+    const PassGroup* pipeline = get_pipeline(level, &count);
+    for (int g = 0; g < count; g++) {
+        for (int i = 0; i < pipeline[g].count; i++) {
+            *(bool*)((char*)&flags + passes[pipeline[g].passes[i]].flag) = true;
+        }
+    }
+    return flags;
+}
+
+// Runs the pipeline for the current optimization level, skipping
+// passes whose flag is off
 void optimize_program(IRProgram* program, OptFlags flags) {
-    if (flags.constant_folding) {
-        constant_folding(program);
-    }
-    
-    if (flags.dead_code_elimination) {
-        dead_code_elimination(program);
-    }
-    
-    if (flags.common_subexpression) {
-        eliminate_common_subexpressions(program);
-    }
-    
-    if (flags.strength_reduction) {
-        reduce_strength(program);
-    }
-    
-    if (flags.loop_unrolling) {
-        unroll_loops(program);
-    }
-    
-    if (flags.tail_recursion) {
-        eliminate_tail_recursion(program);
-    }
-    
-    if (flags.inline_functions) {
-        inline_functions(program);
-    }
-}
-
-// Peephole optimization for assembly code
-void peephole_optimize(char* assembly) {
-    (void)assembly; // Prevent unused parameter warning
-    // Common x86_64 peephole optimizations
-    
-    // 1. Remove redundant moves
-    // mov %rax, %rbx
-    // mov %rbx, %rax  -> remove second move
-    
-    // 2. Simplify arithmetic
-    // add $0, %rax    -> remove
-    // mul $1, %rax    -> remove
-    // sub $0, %rax    -> remove
-    
-    // 3. Optimize jumps
-    // jmp L1
-    // L1:             -> remove jump
-    
-    // 4. Merge load/store
-    // mov %rax, (%rsp)
-    // mov (%rsp), %rax  -> remove second move
-    
-    // Implementation would involve pattern matching on assembly strings
-} 
\ No newline at end of file
+    memset(pass_stats, 0, sizeof(pass_stats));
+    AnalysisManager* analyses = create_analysis_manager(program);
+    int count;
+    const PassGroup* pipeline = get_pipeline(current_level, &count);
+    for (int g = 0; g < count; g++) {
+        const PassGroup* group = &pipeline[g];
+        bool changed = true;
+        for (int round = 0; round < group->max_iterations && changed; round++) {
+            changed = false;
+            for (int i = 0; i < group->count; i++) {
+                if (is_pass_enabled(&flags, group->passes[i]) &&
+                    run_pass(program, analyses, group->passes[i])) {
+                    changed = true;
+                }
+            }
+        }
+    }
+    analyses_computed = analyses->computed;
+    analyses_reused = analyses->reused;
+    free_analysis_manager(analyses);
+}
+
+// Timing and statistics for the passes run by the last optimize_program
+void print_pass_statistics(FILE* out) {
+    double total = 0;
+    for (int i = 0; i < PASS_COUNT; i++) {
+        total += pass_stats[i].seconds;
+    }
+    fprintf(out, "Pass execution timing report:\n");
+    fprintf(out, "%-22s %6s %8s %8s %8s %12s %7s\n",
+            "Pass", "Runs", "Changed", "Removed", "Added", "Time (ms)", "%");
+    for (int i = 0; i < PASS_COUNT; i++) {
+        PassStats* stats = &pass_stats[i];
+        if (stats->runs == 0) continue;
+        fprintf(out, "%-22s %6d %8d %8d %8d %12.3f %6.1f%%\n",
+                passes[i].name, stats->runs, stats->changed_runs, stats->removed,
+                stats->added, stats->seconds * 1000,
+                total > 0 ? stats->seconds * 100 / total : 0.0);
+    }
+    fprintf(out, "%-22s %6s %8s %8s %8s %12.3f\n", "Total", "", "", "", "", total * 1000);
+    fprintf(out, "Analyses: %d computed, %d reused from cache\n",
+            analyses_computed, analyses_reused);
+}
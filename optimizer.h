@@ -15,17 +15,25 @@ typedef enum {
 // Optimization flags
 typedef struct {
     bool constant_folding;
+    bool rewrite_rules;
     bool dead_code_elimination;
+    bool simplify_cfg;
     bool common_subexpression;
     bool loop_unrolling;
+    bool loop_rotation;
+    bool if_conversion;
+    bool loop_invariant_motion;
+    bool induction_variables;
     bool strength_reduction;
+    bool superoptimizer;
     bool tail_recursion;
     bool inline_functions;
 } OptFlags;
 
 // Function declarations
 void set_optimization_level(OptLevel level);
+OptFlags get_level_flags(OptLevel level);
 void optimize_program(IRProgram* program, OptFlags flags);
-void peephole_optimize(char* assembly_code);
+void print_pass_statistics(FILE* out);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,110 @@
+#include "peephole.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Peephole optimization over machine instructions.  Labels are
+// instructions too, so a window never spans a jump target.  The
+// selector only reads condition codes straight after a cmp or test,
+// which lets arithmetic that changes nothing go although it would have
+// set the flags.
+
+static void remove_instr(MachineFunction* function, int index) {
+    MachineInstr* instr = &function->instrs[index];
+    for (int j = 0; j < instr->operand_count; j++) {
+        free(instr->operands[j].name);
+    }
+    memmove(instr, instr + 1, sizeof(MachineInstr) * (function->count - index - 1));
+    function->count--;
+}
+
+static bool is_immediate(MachineOperand operand, long value) {
+    return operand.kind == MOP_IMM && operand.value == value;
+}
+
+// mov to itself, adding or subtracting zero, shifting by zero,
+// multiplying by one
+static bool does_nothing(MachineInstr* instr) {
+    switch (instr->opcode) {
+        case MI_MOV:
+            return same_operand(instr->operands[0], instr->operands[1]);
+        case MI_ADD:
+        case MI_SUB:
+        case MI_SAR:
+            return is_immediate(instr->operands[0], 0);
+        case MI_IMUL:
+            return instr->operand_count == 2 && is_immediate(instr->operands[0], 1);
+        case MI_LEA: {
+            MachineOperand address = instr->operands[0];
+            return address.index == NO_REGISTER && address.value == 0 &&
+                   address.reg == instr->operands[1].reg;
+        }
+        default:
+            return false;
+    }
+}
+
+// A jump to one of the labels right after it
+static bool jumps_to_next(MachineFunction* function, int index) {
+    MachineInstr* jump = &function->instrs[index];
+    if ((jump->opcode != MI_JMP && jump->opcode != MI_JCC) ||
+        jump->operands[0].kind != MOP_LABEL) {
+        return false;
+    }
+    for (int i = index + 1; i < function->count && function->instrs[i].opcode == MI_LABEL; i++) {
+        if (same_operand(function->instrs[i].operands[0], jump->operands[0])) return true;
+    }
+    return false;
+}
+
+// Two movs in a row, the first from -> to, the second from its source
+// into its destination
+static bool simplify_move_pair(MachineFunction* function, int index) {
+    MachineInstr* first = &function->instrs[index];
+    MachineInstr* second = &function->instrs[index + 1];
+    MachineOperand from = first->operands[0];
+    MachineOperand to = first->operands[1];
+
+    // Moving the value back where it came from, unless the first move
+    // changed the address it came from
+    if (same_operand(second->operands[0], to) && same_operand(second->operands[1], from) &&
+        !(to.kind == MOP_REG && operand_reads_register(from, to.reg))) {
+        remove_instr(function, index + 1);
+        return true;
+    }
+    // Store then reload: the value is still at hand
+    if (to.kind == MOP_MEM && (from.kind == MOP_REG || from.kind == MOP_IMM) &&
+        same_operand(second->operands[0], to)) {
+        second->operands[0] = from;
+        return true;
+    }
+    // The first result is overwritten before anything reads it
+    if (to.kind == MOP_REG && same_operand(second->operands[1], to) &&
+        !operand_reads_register(second->operands[0], to.reg)) {
+        remove_instr(function, index);
+        return true;
+    }
+    return false;
+}
+
+static bool simplify_window(MachineFunction* function, int index) {
+    MachineInstr* instr = &function->instrs[index];
+    if (does_nothing(instr) || jumps_to_next(function, index)) {
+        remove_instr(function, index);
+        return true;
+    }
+    if (index + 1 < function->count && instr->opcode == MI_MOV &&
+        function->instrs[index + 1].opcode == MI_MOV) {
+        return simplify_move_pair(function, index);
+    }
+    return false;
+}
+
+void peephole_optimize(MachineFunction* function) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < function->count; i++) {
+            if (simplify_window(function, i)) changed = true;
+        }
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "mir.h"
+
+// Rewrites a function's selected instructions through a window of two
+// adjacent ones, sweeping until a pass over it changes nothing
+void peephole_optimize(MachineFunction* function);
+
+#endif
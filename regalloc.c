@@ -0,0 +1,865 @@
+#include "regalloc.h"
+#include "frame.h"
+#include <limits.h>
+
+const Register argument_registers[MAX_REGISTER_ARGS] = {
+    REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9
+};
+
+// Caller-saved registers come first so that values not live across a
+// call leave the callee-saved ones, which cost a save, alone.  %rax,
+// %rcx, %rdx and %r11 are kept back as scratch for division, shifts
+// and instructions with two memory operands.
+const Register allocatable_registers[ALLOCATABLE_COUNT] = {
+    REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10,
+    REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+bool is_callee_saved(int reg) {
+    return reg == REG_RBX || reg == REG_RBP || (reg >= REG_R12 && reg <= REG_R15);
+}
+
+typedef struct {
+    int from;
+    int to;
+} Range;
+
+// Live interval of one value, or of the part of it left after a split.
+// Ranges may leave holes where the value is dead.
+typedef struct Interval {
+    int value;                  // Index into the allocation's values
+    Range* ranges;              // Sorted and disjoint once built
+    int range_count;
+    int range_capacity;
+    int* uses;                  // Positions read or written, sorted once built
+    int* use_weights;           // 10^loop depth of each use
+    int use_count;
+    int use_capacity;
+    int hint_reg;               // Register the value would like, or -1
+    struct Interval* hint;      // Copy source whose register it would like
+    int reg;                    // Assigned register, -1 when spilled
+    struct Interval* split_child;
+} Interval;
+
+typedef struct {
+    IRProgram* program;
+    CFG* cfg;
+    RegAllocation* alloc;
+    Interval** roots;           // Value -> interval before any split
+    int* def_counts;            // Value -> number of definitions
+    int* remat;                 // Value -> instruction of its constant, or -1
+    int* slots;                 // Value -> spill slot, or -1
+    Interval** intervals;       // Every interval, split parts included
+    int interval_count;
+    int interval_capacity;
+    Range* fixed[REG_COUNT];    // Positions where a register is clobbered
+    int fixed_count[REG_COUNT];
+    Interval** unhandled;       // Sorted by decreasing start
+    int unhandled_count;
+    Interval** active;          // Assigned and live at the current position
+    int active_count;
+    Interval** inactive;        // Assigned but in a hole at the current position
+    int inactive_count;
+    int list_capacity;          // Of each of the three lists
+} Allocator;
+
+static int interval_start(Interval* interval) {
+    return interval->ranges[0].from;
+}
+
+static int interval_end(Interval* interval) {
+    return interval->ranges[interval->range_count - 1].to;
+}
+
+static bool covers(Interval* interval, int position) {
+    for (int i = 0; i < interval->range_count; i++) {
+        if (position < interval->ranges[i].from) return false;
+        if (position < interval->ranges[i].to) return true;
+    }
+    return false;
+}
+
+// First position covered by both range lists, or INT_MAX
+static int intersect_ranges(Range* a, int a_count, Range* b, int b_count) {
+    int i = 0, j = 0;
+    while (i < a_count && j < b_count) {
+        if (a[i].to <= b[j].from) {
+            i++;
+        } else if (b[j].to <= a[i].from) {
+            j++;
+        } else {
+            return a[i].from > b[j].from ? a[i].from : b[j].from;
+        }
+    }
+    return INT_MAX;
+}
+
+static int next_intersection(Interval* a, Interval* b) {
+    return intersect_ranges(a->ranges, a->range_count, b->ranges, b->range_count);
+}
+
+static Interval* new_interval(Allocator* allocator, int value) {
+    Interval* interval = calloc(1, sizeof(Interval));
+    interval->value = value;
+    interval->hint_reg = -1;
+    interval->reg = -1;
+    if (allocator->interval_count == allocator->interval_capacity) {
+        allocator->interval_capacity = allocator->interval_capacity * 2 + 16;
+        allocator->intervals = realloc(allocator->intervals,
+                                       sizeof(Interval*) * allocator->interval_capacity);
+    }
+    allocator->intervals[allocator->interval_count++] = interval;
+    return interval;
+}
+
+static void push_range(Interval* interval, int from, int to) {
+    if (interval->range_count == interval->range_capacity) {
+        interval->range_capacity = interval->range_capacity * 2 + 4;
+        interval->ranges = realloc(interval->ranges, sizeof(Range) * interval->range_capacity);
+    }
+    interval->ranges[interval->range_count].from = from;
+    interval->ranges[interval->range_count].to = to;
+    interval->range_count++;
+}
+
+static void push_use(Interval* interval, int position, int weight) {
+    if (interval->use_count == interval->use_capacity) {
+        interval->use_capacity = interval->use_capacity * 2 + 4;
+        interval->uses = realloc(interval->uses, sizeof(int) * interval->use_capacity);
+        interval->use_weights = realloc(interval->use_weights,
+                                        sizeof(int) * interval->use_capacity);
+    }
+    interval->uses[interval->use_count] = position;
+    interval->use_weights[interval->use_count] = weight;
+    interval->use_count++;
+}
+
+// Intervals are built walking backwards, so ranges arrive in decreasing
+// order and the last one stored is the earliest
+static void add_range(Interval* interval, int from, int to) {
+    if (interval->range_count > 0) {
+        Range* first = &interval->ranges[interval->range_count - 1];
+        if (to >= first->from) {
+            if (from < first->from) first->from = from;
+            if (to > first->to) first->to = to;
+            return;
+        }
+    }
+    push_range(interval, from, to);
+}
+
+static void add_def(Interval* interval, int position, int weight) {
+    if (interval->range_count > 0) {
+        Range* first = &interval->ranges[interval->range_count - 1];
+        if (first->from <= position && position < first->to) {
+            first->from = position;
+            push_use(interval, position, weight);
+            return;
+        }
+    }
+    // Never read afterwards
+    push_range(interval, position, position + 1);
+    push_use(interval, position, weight);
+}
+
+RegAllocation* create_reg_allocation(CFG* cfg) {
+    RegAllocation* alloc = calloc(1, sizeof(RegAllocation));
+    alloc->start = cfg->start;
+    alloc->names = create_name_map(64);
+    alloc->instr_count = cfg->end - cfg->start;
+    alloc->moves_before = calloc(alloc->instr_count + 1, sizeof(MoveList));
+    return alloc;
+}
+
+int add_allocated_value(RegAllocation* alloc, const char* name) {
+    int index = name_map_get(alloc->names, name);
+    if (index >= 0) return index;
+    index = alloc->value_count++;
+    name_map_put(alloc->names, name, index);
+    alloc->values = realloc(alloc->values, sizeof(ValueAllocation) * alloc->value_count);
+    alloc->values[index].name = strdup(name);
+    alloc->values[index].ranges = NULL;
+    alloc->values[index].range_count = 0;
+    return index;
+}
+
+static int value_index(Allocator* allocator, const char* name) {
+    RegAllocation* alloc = allocator->alloc;
+    int count = alloc->value_count;
+    int index = add_allocated_value(alloc, name);
+    if (index < count) return index;
+    allocator->roots = realloc(allocator->roots, sizeof(Interval*) * alloc->value_count);
+    allocator->def_counts = realloc(allocator->def_counts, sizeof(int) * alloc->value_count);
+    allocator->remat = realloc(allocator->remat, sizeof(int) * alloc->value_count);
+    allocator->slots = realloc(allocator->slots, sizeof(int) * alloc->value_count);
+    allocator->roots[index] = new_interval(allocator, index);
+    allocator->def_counts[index] = 0;
+    allocator->remat[index] = -1;
+    allocator->slots[index] = -1;
+    return index;
+}
+
+static Interval* root_interval(Allocator* allocator, const char* name) {
+    int index = value_index(allocator, name);
+    return allocator->roots[index];
+}
+
+static void reverse_ranges_and_uses(Interval* interval) {
+    for (int i = 0, j = interval->range_count - 1; i < j; i++, j--) {
+        Range range = interval->ranges[i];
+        interval->ranges[i] = interval->ranges[j];
+        interval->ranges[j] = range;
+    }
+    for (int i = 0, j = interval->use_count - 1; i < j; i++, j--) {
+        int use = interval->uses[i];
+        interval->uses[i] = interval->uses[j];
+        interval->uses[j] = use;
+        int weight = interval->use_weights[i];
+        interval->use_weights[i] = interval->use_weights[j];
+        interval->use_weights[j] = weight;
+    }
+}
+
+// Index of the call each ARG belongs to, relative to the function
+// label, found by replaying the argument stack; -1 for other instructions
+int* match_call_arguments(IRProgram* program, CFG* cfg) {
+    int length = cfg->end - cfg->start;
+    int* calls = malloc(sizeof(int) * (length + 1));
+    int* pending = malloc(sizeof(int) * (length + 1));
+    int pending_count = 0;
+    for (int k = 0; k < length; k++) {
+        IRInstr* instr = program->instructions[cfg->start + k];
+        calls[k] = -1;
+        if (instr->op == IR_ARG) {
+            pending[pending_count++] = k;
+        } else if (instr->op == IR_CALL || instr->op == IR_TAIL_CALL) {
+            for (int j = 0; j < instr->value && pending_count > 0; j++) {
+                calls[pending[--pending_count]] = k;
+            }
+        }
+    }
+    free(pending);
+    return calls;
+}
+
+int block_use_weight(BasicBlock* block) {
+    int depth = block->loop ? block->loop->depth : 0;
+    int weight = 1;
+    for (int i = 0; i < depth && i < 6; i++) {
+        weight *= 10;
+    }
+    return weight;
+}
+
+// Builds the intervals block by block from the last, extending each
+// value live out of a block over all of it and cutting ranges short at
+// definitions
+static void build_intervals(Allocator* allocator, Liveness* liveness) {
+    IRProgram* program = allocator->program;
+    CFG* cfg = allocator->cfg;
+    int start = cfg->start;
+    int* calls = match_call_arguments(program, cfg);
+    NameMap* live_names = liveness->names;
+
+    for (int b = cfg->block_count - 1; b >= 0; b--) {
+        BasicBlock* block = cfg->blocks[b];
+        int block_from = USE_POSITION(block->start - start);
+        int block_to = USE_POSITION(block->end - start + 1);
+        int weight = block_use_weight(block);
+
+        uint64_t* out = dataflow_set(liveness->problem, liveness->problem->out, block);
+        for (int s = 0; s < live_names->capacity; s++) {
+            if (live_names->keys[s] && bitset_test(out, live_names->values[s])) {
+                add_range(root_interval(allocator, live_names->keys[s]), block_from, block_to);
+            }
+        }
+
+        for (int i = block->end; i >= block->start; i--) {
+            IRInstr* instr = program->instructions[i];
+            int k = i - start;
+            if (writes_dest(instr)) {
+                int index = value_index(allocator, instr->dest);
+                Interval* interval = allocator->roots[index];
+                int position = instr->op == IR_PARAM ? DEF_POSITION(0) : DEF_POSITION(k);
+                add_def(interval, position, weight);
+                allocator->def_counts[index]++;
+                if (instr->op == IR_ASSIGN && !instr->src1) {
+                    allocator->remat[index] = i;
+                }
+                if (instr->op == IR_ASSIGN && instr->src1 && !is_immediate_operand(instr->src1)) {
+                    interval->hint = root_interval(allocator, instr->src1);
+                }
+            }
+
+            // Arguments stay where they are until the call moves them
+            int position = USE_POSITION(k);
+            if (instr->op == IR_ARG && calls[k] >= 0 && calls[k] + start <= block->end) {
+                position = USE_POSITION(calls[k]);
+            }
+            const char* names[4];
+            int count = read_operands(instr, names);
+            for (int j = 0; j < count; j++) {
+                Interval* interval = root_interval(allocator, names[j]);
+                add_range(interval, block_from, position + 1);
+                push_use(interval, position, weight);
+            }
+        }
+    }
+
+    // Parameters arrive in the argument registers
+    for (int i = start + 1, p = 0; i < cfg->end && program->instructions[i]->op == IR_PARAM;
+         i++, p++) {
+        IRInstr* param = program->instructions[i];
+        if (param->dest && p < MAX_REGISTER_ARGS) {
+            root_interval(allocator, param->dest)->hint_reg = argument_registers[p];
+        }
+    }
+
+    for (int v = 0; v < allocator->alloc->value_count; v++) {
+        reverse_ranges_and_uses(allocator->roots[v]);
+        // Only a single constant definition can be repeated at each use
+        if (allocator->def_counts[v] != 1) allocator->remat[v] = -1;
+    }
+
+    // Calls clobber every caller-saved register
+    for (int k = 0; k < cfg->end - start; k++) {
+        if (program->instructions[start + k]->op != IR_CALL) continue;
+        for (int r = 0; r < ALLOCATABLE_COUNT; r++) {
+            Register reg = allocatable_registers[r];
+            if (is_callee_saved(reg)) continue;
+            allocator->fixed[reg] = realloc(allocator->fixed[reg],
+                                            sizeof(Range) * (allocator->fixed_count[reg] + 1));
+            Range* range = &allocator->fixed[reg][allocator->fixed_count[reg]++];
+            range->from = CLOBBER_POSITION(k);
+            range->to = CLOBBER_POSITION(k) + 1;
+        }
+    }
+    free(calls);
+}
+
+// Uses per instruction covered, weighted by loop depth, so long
+// intervals that are rarely read are the first to go to memory.
+// Constants are cheaper still, since spilling them costs no store.
+static double spill_weight(Allocator* allocator, Interval* interval) {
+    double uses = 0;
+    for (int i = 0; i < interval->use_count; i++) {
+        uses += interval->use_weights[i];
+    }
+    double length = (interval_end(interval) - interval_start(interval)) / 4 + 1;
+    double weight = uses / length;
+    return allocator->remat[interval->value] >= 0 ? weight / 2 : weight;
+}
+
+// Moves everything from position onwards into a new interval
+static Interval* split_interval(Allocator* allocator, Interval* interval, int position) {
+    Interval* child = new_interval(allocator, interval->value);
+    child->hint_reg = interval->hint_reg;
+    int kept = 0;
+    for (int i = 0; i < interval->range_count; i++) {
+        Range range = interval->ranges[i];
+        if (range.to <= position) {
+            interval->ranges[kept++] = range;
+        } else if (range.from >= position) {
+            push_range(child, range.from, range.to);
+        } else {
+            interval->ranges[kept].from = range.from;
+            interval->ranges[kept++].to = position;
+            push_range(child, position, range.to);
+        }
+    }
+    interval->range_count = kept;
+
+    int kept_uses = 0;
+    for (int i = 0; i < interval->use_count; i++) {
+        if (interval->uses[i] < position) {
+            interval->uses[kept_uses] = interval->uses[i];
+            interval->use_weights[kept_uses++] = interval->use_weights[i];
+        } else {
+            push_use(child, interval->uses[i], interval->use_weights[i]);
+        }
+    }
+    interval->use_count = kept_uses;
+
+    child->split_child = interval->split_child;
+    interval->split_child = child;
+    return child;
+}
+
+// Every interval is on at most one list at a time, so lists as long as
+// the interval array never overflow
+static void reserve_lists(Allocator* allocator) {
+    if (allocator->list_capacity >= allocator->interval_count) return;
+    allocator->list_capacity = allocator->interval_count * 2;
+    allocator->unhandled = realloc(allocator->unhandled,
+                                   sizeof(Interval*) * allocator->list_capacity);
+    allocator->active = realloc(allocator->active, sizeof(Interval*) * allocator->list_capacity);
+    allocator->inactive = realloc(allocator->inactive,
+                                  sizeof(Interval*) * allocator->list_capacity);
+}
+
+static void add_unhandled(Allocator* allocator, Interval* interval) {
+    reserve_lists(allocator);
+    int start = interval_start(interval);
+    int i = allocator->unhandled_count++;
+    while (i > 0 && interval_start(allocator->unhandled[i - 1]) < start) {
+        allocator->unhandled[i] = allocator->unhandled[i - 1];
+        i--;
+    }
+    allocator->unhandled[i] = interval;
+}
+
+static void spill(Interval* interval) {
+    interval->reg = -1;
+}
+
+// The part of interval covering position, following its splits
+static Interval* find_split_part(Interval* interval, int position) {
+    for (; interval; interval = interval->split_child) {
+        if (covers(interval, position)) return interval;
+    }
+    return NULL;
+}
+
+static int preferred_register(Interval* current) {
+    if (current->hint_reg >= 0) return current->hint_reg;
+    if (!current->hint) return -1;
+    Interval* source = find_split_part(current->hint, interval_start(current) - 2);
+    return source ? source->reg : -1;
+}
+
+static int fixed_free_until(Allocator* allocator, Register reg, Interval* current) {
+    return intersect_ranges(allocator->fixed[reg], allocator->fixed_count[reg],
+                            current->ranges, current->range_count);
+}
+
+// Whether a parameter should stay in its argument register until that
+// is next needed, outside any loop, rather than take a register free
+// for longer.  A callee-saved one taken from the entry would have to be
+// saved on every path, even those that return before any call.
+static bool keeps_argument_register(Allocator* allocator, Interval* current, int free_until) {
+    if (current->hint_reg < 0 || current != allocator->roots[current->value]) return false;
+    int split = free_until & ~3;
+    if (split <= interval_start(current)) return false;
+    return !find_block_containing(allocator->cfg, allocator->cfg->start + split / 4)->loop;
+}
+
+// Takes the register free for longest, splitting current where that
+// register is next needed if it is not free to the end
+static bool try_allocate_free_register(Allocator* allocator, Interval* current) {
+    int free_until[REG_COUNT];
+    for (int r = 0; r < REG_COUNT; r++) {
+        free_until[r] = -1;
+    }
+    for (int r = 0; r < ALLOCATABLE_COUNT; r++) {
+        Register reg = allocatable_registers[r];
+        free_until[reg] = fixed_free_until(allocator, reg, current);
+    }
+    for (int i = 0; i < allocator->active_count; i++) {
+        free_until[allocator->active[i]->reg] = 0;
+    }
+    for (int i = 0; i < allocator->inactive_count; i++) {
+        Interval* interval = allocator->inactive[i];
+        int position = next_intersection(interval, current);
+        if (position < free_until[interval->reg]) free_until[interval->reg] = position;
+    }
+
+    int end = interval_end(current);
+    int hint = preferred_register(current);
+    int reg = -1;
+    if (hint >= 0 && (free_until[hint] >= end ||
+                      keeps_argument_register(allocator, current, free_until[hint]))) {
+        reg = hint;
+    } else {
+        for (int r = 0; r < ALLOCATABLE_COUNT; r++) {
+            Register candidate = allocatable_registers[r];
+            if (reg < 0 || free_until[candidate] > free_until[reg]) reg = candidate;
+        }
+    }
+
+    if (free_until[reg] >= end) {
+        current->reg = reg;
+        return true;
+    }
+    int split = free_until[reg] & ~3;
+    if (split <= interval_start(current)) return false;
+    add_unhandled(allocator, split_interval(allocator, current, split));
+    current->reg = reg;
+    return true;
+}
+
+// Sends interval to memory from position on.  It competes for a
+// register again from its next use, if that comes after current starts.
+static void evict(Allocator* allocator, Interval* interval, int position, Interval* current) {
+    if (position <= interval_start(interval)) {
+        spill(interval);
+        return;
+    }
+    Interval* rest = split_interval(allocator, interval, position);
+    spill(rest);
+    for (int i = 0; i < rest->use_count; i++) {
+        int reload = rest->uses[i] & ~3;
+        if (reload <= position) continue;
+        if (reload > interval_start(current) && reload > interval_start(rest)) {
+            add_unhandled(allocator, split_interval(allocator, rest, reload));
+        }
+        break;
+    }
+}
+
+static void remove_spilled(Interval** list, int* count) {
+    int kept = 0;
+    for (int i = 0; i < *count; i++) {
+        if (list[i]->reg >= 0) list[kept++] = list[i];
+    }
+    *count = kept;
+}
+
+// No register is free: take the one whose occupants are cheapest to
+// spill, unless current is cheaper still
+static void allocate_blocked_register(Allocator* allocator, Interval* current) {
+    double cost[REG_COUNT] = {0};
+    for (int i = 0; i < allocator->active_count; i++) {
+        cost[allocator->active[i]->reg] += spill_weight(allocator, allocator->active[i]);
+    }
+    for (int i = 0; i < allocator->inactive_count; i++) {
+        Interval* interval = allocator->inactive[i];
+        if (next_intersection(interval, current) != INT_MAX) {
+            cost[interval->reg] += spill_weight(allocator, interval);
+        }
+    }
+
+    int start = interval_start(current);
+    int reg = -1;
+    for (int r = 0; r < ALLOCATABLE_COUNT; r++) {
+        Register candidate = allocatable_registers[r];
+        if ((fixed_free_until(allocator, candidate, current) & ~3) <= start) continue;
+        if (reg < 0 || cost[candidate] < cost[reg]) reg = candidate;
+    }
+    if (reg < 0 || cost[reg] >= spill_weight(allocator, current)) {
+        spill(current);
+        return;
+    }
+
+    for (int i = 0; i < allocator->active_count; i++) {
+        if (allocator->active[i]->reg == reg) {
+            evict(allocator, allocator->active[i], start & ~3, current);
+        }
+    }
+    for (int i = 0; i < allocator->inactive_count; i++) {
+        Interval* interval = allocator->inactive[i];
+        int position = next_intersection(interval, current);
+        if (interval->reg == reg && position != INT_MAX) {
+            evict(allocator, interval, position & ~3, current);
+        }
+    }
+    remove_spilled(allocator->active, &allocator->active_count);
+    remove_spilled(allocator->inactive, &allocator->inactive_count);
+
+    current->reg = reg;
+    int fixed = fixed_free_until(allocator, reg, current);
+    if (fixed < interval_end(current)) {
+        add_unhandled(allocator, split_interval(allocator, current, fixed & ~3));
+    }
+}
+
+static void linear_scan(Allocator* allocator) {
+    for (int v = 0; v < allocator->alloc->value_count; v++) {
+        if (allocator->roots[v]->range_count > 0) add_unhandled(allocator, allocator->roots[v]);
+    }
+
+    while (allocator->unhandled_count > 0) {
+        Interval* current = allocator->unhandled[--allocator->unhandled_count];
+        int position = interval_start(current);
+
+        int active_count = 0;
+        for (int i = 0; i < allocator->active_count; i++) {
+            Interval* interval = allocator->active[i];
+            if (interval_end(interval) <= position) continue;
+            if (covers(interval, position)) {
+                allocator->active[active_count++] = interval;
+            } else {
+                allocator->inactive[allocator->inactive_count++] = interval;
+            }
+        }
+        allocator->active_count = active_count;
+        int inactive_count = 0;
+        for (int i = 0; i < allocator->inactive_count; i++) {
+            Interval* interval = allocator->inactive[i];
+            if (interval_end(interval) <= position) continue;
+            if (covers(interval, position)) {
+                allocator->active[allocator->active_count++] = interval;
+            } else {
+                allocator->inactive[inactive_count++] = interval;
+            }
+        }
+        allocator->inactive_count = inactive_count;
+
+        if (!try_allocate_free_register(allocator, current)) {
+            allocate_blocked_register(allocator, current);
+        }
+        reserve_lists(allocator);
+        if (current->reg >= 0) allocator->active[allocator->active_count++] = current;
+    }
+}
+
+static Location interval_location(Allocator* allocator, Interval* interval) {
+    Location location = { LOC_REG, interval->reg, -1, 0 };
+    if (interval->reg >= 0) return location;
+    int def = allocator->remat[interval->value];
+    if (def >= 0) {
+        location.kind = LOC_IMM;
+        location.reg = -1;
+        location.imm = allocator->program->instructions[def]->value;
+        return location;
+    }
+    if (allocator->slots[interval->value] < 0) {
+        allocator->slots[interval->value] = allocator->alloc->slot_count++;
+    }
+    location.kind = LOC_STACK;
+    location.reg = -1;
+    location.slot = allocator->slots[interval->value];
+    return location;
+}
+
+bool same_location(Location a, Location b) {
+    if (a.kind != b.kind) return false;
+    switch (a.kind) {
+        case LOC_REG: return a.reg == b.reg;
+        case LOC_STACK: case LOC_ARG: return a.slot == b.slot;
+        case LOC_IMM: return a.imm == b.imm;
+        default: return true;
+    }
+}
+
+static int compare_ranges(const void* a, const void* b) {
+    return ((const AllocRange*)a)->from - ((const AllocRange*)b)->from;
+}
+
+// Gathers the pieces of every value into sorted ranges, joining
+// neighbours that ended up in the same place
+static void record_locations(Allocator* allocator) {
+    RegAllocation* alloc = allocator->alloc;
+    for (int i = 0; i < allocator->interval_count; i++) {
+        Interval* interval = allocator->intervals[i];
+        if (interval->range_count == 0) continue;
+        Location location = interval_location(allocator, interval);
+        if (location.kind == LOC_REG) alloc->used[location.reg] = true;
+        ValueAllocation* value = &alloc->values[interval->value];
+        value->ranges = realloc(value->ranges, sizeof(AllocRange) *
+                                (value->range_count + interval->range_count));
+        for (int j = 0; j < interval->range_count; j++) {
+            AllocRange* range = &value->ranges[value->range_count++];
+            range->from = interval->ranges[j].from;
+            range->to = interval->ranges[j].to;
+            range->location = location;
+        }
+    }
+
+    for (int v = 0; v < alloc->value_count; v++) {
+        ValueAllocation* value = &alloc->values[v];
+        qsort(value->ranges, value->range_count, sizeof(AllocRange), compare_ranges);
+        int kept = 0;
+        for (int i = 0; i < value->range_count; i++) {
+            AllocRange* last = kept > 0 ? &value->ranges[kept - 1] : NULL;
+            if (last && last->to == value->ranges[i].from &&
+                same_location(last->location, value->ranges[i].location)) {
+                last->to = value->ranges[i].to;
+            } else {
+                value->ranges[kept++] = value->ranges[i];
+            }
+        }
+        value->range_count = kept;
+    }
+}
+
+void add_move(MoveList* list, Location from, Location to) {
+    // Constants are never stored, and nothing needs moving to itself
+    if (to.kind == LOC_IMM || to.kind == LOC_NONE || from.kind == LOC_NONE ||
+        same_location(from, to)) {
+        return;
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity * 2 + 4;
+        list->moves = realloc(list->moves, sizeof(Move) * list->capacity);
+    }
+    list->moves[list->count].from = from;
+    list->moves[list->count].to = to;
+    list->count++;
+}
+
+// Inserts moves where a value changes location: inside a block before
+// the instruction at the split, and on the edges into a block where the
+// value arrives somewhere other than where a predecessor left it
+static void resolve_moves(Allocator* allocator, Liveness* liveness) {
+    RegAllocation* alloc = allocator->alloc;
+    CFG* cfg = allocator->cfg;
+    int start = cfg->start;
+
+    for (int v = 0; v < alloc->value_count; v++) {
+        ValueAllocation* value = &alloc->values[v];
+        for (int i = 1; i < value->range_count; i++) {
+            AllocRange* before = &value->ranges[i - 1];
+            AllocRange* after = &value->ranges[i];
+            if (before->to != after->from || after->from % 4 != 0) continue;
+            int k = after->from / 4;
+            if (find_block_containing(cfg, start + k)->start == start + k) continue;
+            add_move(&alloc->moves_before[k], before->location, after->location);
+        }
+    }
+
+    NameMap* live_names = liveness->names;
+    for (int b = 0; b < cfg->block_count; b++) {
+        BasicBlock* block = cfg->blocks[b];
+        if (block->rpo_number < 0) continue;
+        int block_last = USE_POSITION(block->end - start) + 3;
+        for (int s = 0; s < block->successor_count; s++) {
+            BasicBlock* successor = block->successors[s];
+            int successor_first = USE_POSITION(successor->start - start);
+            uint64_t* in = dataflow_set(liveness->problem, liveness->problem->in, successor);
+            MoveList moves = {0};
+            for (int n = 0; n < live_names->capacity; n++) {
+                if (!live_names->keys[n] || !bitset_test(in, live_names->values[n])) continue;
+                add_move(&moves, get_location(alloc, live_names->keys[n], block_last),
+                         get_location(alloc, live_names->keys[n], successor_first));
+            }
+            if (moves.count == 0) {
+                free(moves.moves);
+                continue;
+            }
+            alloc->edge_moves = realloc(alloc->edge_moves,
+                                        sizeof(EdgeMoves) * (alloc->edge_count + 1));
+            EdgeMoves* edge = &alloc->edge_moves[alloc->edge_count++];
+            edge->from_block = block->index;
+            edge->to_block = successor->index;
+            edge->moves = moves;
+        }
+    }
+}
+
+static void renumber_slot(Location* location, StackObject* objects) {
+    if (location->kind == LOC_STACK) location->slot = objects[location->slot].slot;
+}
+
+static void renumber_move_slots(MoveList* list, StackObject* objects) {
+    for (int i = 0; i < list->count; i++) {
+        renumber_slot(&list->moves[i].from, objects);
+        renumber_slot(&list->moves[i].to, objects);
+    }
+}
+
+// Each spilled value was given a slot of its own; values whose stack
+// ranges never overlap now share one
+static void compact_spill_slots(RegAllocation* alloc) {
+    if (alloc->slot_count < 2) return;
+    StackObject* objects = calloc(alloc->slot_count, sizeof(StackObject));
+    for (int v = 0; v < alloc->value_count; v++) {
+        ValueAllocation* value = &alloc->values[v];
+        for (int i = 0; i < value->range_count; i++) {
+            Location location = value->ranges[i].location;
+            if (location.kind != LOC_STACK) continue;
+            add_live_range(&objects[location.slot], value->ranges[i].from, value->ranges[i].to);
+        }
+    }
+    int slot_count = assign_stack_slots(objects, alloc->slot_count);
+
+    for (int v = 0; v < alloc->value_count; v++) {
+        for (int i = 0; i < alloc->values[v].range_count; i++) {
+            renumber_slot(&alloc->values[v].ranges[i].location, objects);
+        }
+    }
+    for (int i = 0; i <= alloc->instr_count; i++) {
+        renumber_move_slots(&alloc->moves_before[i], objects);
+    }
+    for (int i = 0; i < alloc->edge_count; i++) {
+        renumber_move_slots(&alloc->edge_moves[i].moves, objects);
+    }
+    free_stack_objects(objects, alloc->slot_count);
+    alloc->slot_count = slot_count;
+}
+
+static void free_allocator(Allocator* allocator) {
+    for (int i = 0; i < allocator->interval_count; i++) {
+        free(allocator->intervals[i]->ranges);
+        free(allocator->intervals[i]->uses);
+        free(allocator->intervals[i]->use_weights);
+        free(allocator->intervals[i]);
+    }
+    for (int r = 0; r < REG_COUNT; r++) {
+        free(allocator->fixed[r]);
+    }
+    free(allocator->intervals);
+    free(allocator->roots);
+    free(allocator->def_counts);
+    free(allocator->remat);
+    free(allocator->slots);
+    free(allocator->unhandled);
+    free(allocator->active);
+    free(allocator->inactive);
+}
+
+// Linear scan over live intervals with interval splitting, after Wimmer
+// and Mössenböck.  Positions follow instruction order, so every value
+// gets a location at each point of the function's code as emitted.
+// Spill weights use the loop depth of each block, so the function's
+// loops must have been found first.
+RegAllocation* allocate_registers_linear_scan(IRProgram* program, CFG* cfg, Liveness* liveness) {
+    RegAllocation* alloc = create_reg_allocation(cfg);
+    Allocator allocator = {0};
+    allocator.program = program;
+    allocator.cfg = cfg;
+    allocator.alloc = alloc;
+    build_intervals(&allocator, liveness);
+    linear_scan(&allocator);
+    record_locations(&allocator);
+    resolve_moves(&allocator, liveness);
+    compact_spill_slots(alloc);
+    free_allocator(&allocator);
+    return alloc;
+}
+
+Location get_location(RegAllocation* alloc, const char* name, int position) {
+    Location none = { LOC_NONE, -1, -1, 0 };
+    int index = name_map_get(alloc->names, name);
+    if (index < 0) return none;
+    ValueAllocation* value = &alloc->values[index];
+    int low = 0, high = value->range_count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (position < value->ranges[mid].from) {
+            high = mid - 1;
+        } else if (position >= value->ranges[mid].to) {
+            low = mid + 1;
+        } else {
+            return value->ranges[mid].location;
+        }
+    }
+    return none;
+}
+
+MoveList* find_edge_moves(RegAllocation* alloc, int from_block, int to_block) {
+    for (int i = 0; i < alloc->edge_count; i++) {
+        if (alloc->edge_moves[i].from_block == from_block &&
+            alloc->edge_moves[i].to_block == to_block) {
+            return &alloc->edge_moves[i].moves;
+        }
+    }
+    return NULL;
+}
+
+void free_reg_allocation(RegAllocation* alloc) {
+    for (int v = 0; v < alloc->value_count; v++) {
+        free(alloc->values[v].name);
+        free(alloc->values[v].ranges);
+    }
+    for (int i = 0; i <= alloc->instr_count; i++) {
+        free(alloc->moves_before[i].moves);
+    }
+    for (int i = 0; i < alloc->edge_count; i++) {
+        free(alloc->edge_moves[i].moves.moves);
+    }
+    free(alloc->values);
+    free(alloc->moves_before);
+    free(alloc->edge_moves);
+    free_name_map(alloc->names);
+    free(alloc);
+}
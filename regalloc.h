@@ -0,0 +1,105 @@
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include "analysis.h"
+#include <stdbool.h>
+
+// x86-64 general-purpose registers, numbered by their encodings
+typedef enum {
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+    REG_COUNT
+} Register;
+
+#define MAX_REGISTER_ARGS 6
+
+extern const Register argument_registers[MAX_REGISTER_ARGS];
+
+typedef enum {
+    LOC_NONE,       // Not live here
+    LOC_REG,
+    LOC_STACK,      // Spill slot
+    LOC_IMM,        // Constant rematerialised at each use
+    LOC_ARG         // Incoming stack argument, slot is its index
+} LocationKind;
+
+typedef struct {
+    LocationKind kind;
+    int reg;
+    int slot;
+    int imm;
+} Location;
+
+// Instruction k of a function, counted from its label, reads its
+// operands at 4k, clobbers the caller-saved registers at 4k + 1 if it
+// is a call and writes its result at 4k + 2.  Parameters are all
+// written at the label and arguments are read at their call.
+#define USE_POSITION(k) (4 * (k))
+#define CLOBBER_POSITION(k) (4 * (k) + 1)
+#define DEF_POSITION(k) (4 * (k) + 2)
+
+// One value's location over positions [from, to)
+typedef struct {
+    int from;
+    int to;
+    Location location;
+} AllocRange;
+
+typedef struct {
+    char* name;
+    AllocRange* ranges;     // Sorted and disjoint
+    int range_count;
+} ValueAllocation;
+
+typedef struct {
+    Location from;
+    Location to;
+} Move;
+
+// Moves that happen at once, before an instruction or along an edge
+typedef struct {
+    Move* moves;
+    int count;
+    int capacity;
+} MoveList;
+
+typedef struct {
+    int from_block;         // Block indices in the function's CFG
+    int to_block;
+    MoveList moves;
+} EdgeMoves;
+
+typedef struct {
+    int start;              // Function label index
+    NameMap* names;         // Name -> index into values
+    ValueAllocation* values;
+    int value_count;
+    int slot_count;         // Spill slots, 8 bytes each
+    bool used[REG_COUNT];   // Registers holding some value
+    MoveList* moves_before; // Per instruction, where a value changes location
+    int instr_count;
+    EdgeMoves* edge_moves;  // Where locations differ across a CFG edge
+    int edge_count;
+} RegAllocation;
+
+// Registers values may be given, caller-saved first
+#define ALLOCATABLE_COUNT 10
+
+extern const Register allocatable_registers[ALLOCATABLE_COUNT];
+
+RegAllocation* allocate_registers_linear_scan(IRProgram* program, CFG* cfg, Liveness* liveness);
+RegAllocation* allocate_registers_graph_coloring(IRProgram* program, CFG* cfg, Liveness* liveness);
+
+// Shared by the allocators
+RegAllocation* create_reg_allocation(CFG* cfg);
+int add_allocated_value(RegAllocation* alloc, const char* name);
+int* match_call_arguments(IRProgram* program, CFG* cfg);
+int block_use_weight(BasicBlock* block);
+Location get_location(RegAllocation* alloc, const char* name, int position);
+MoveList* find_edge_moves(RegAllocation* alloc, int from_block, int to_block);
+void add_move(MoveList* list, Location from, Location to);
+bool same_location(Location a, Location b);
+bool is_callee_saved(int reg);
+void free_reg_allocation(RegAllocation* alloc);
+
+#endif
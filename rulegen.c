@@ -0,0 +1,501 @@
+// Compiles the IR rewrite rules in ir.rules into the C matcher
+// ir_optimizer.c includes.  Run at build time:
+//
+//   rulegen ir.rules build/ir_rules.inc
+//
+// The matcher is a decision tree: a switch on the operator, then a
+// branch on which operands are constant.  Each leaf holds only the rules
+// that can match there, in file order, with the remaining tests on
+// literal values, repeated operands and guards.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+#define MAX_RULES 256
+#define MAX_TOKEN 1024
+
+typedef enum {
+    TERM_VAR,       // Any operand, bound to name
+    TERM_LITERAL,   // The constant value
+    TERM_CONST,     // Any constant, bound to name
+    TERM_CODE       // Result constant computed by a C expression
+} TermKind;
+
+typedef struct {
+    TermKind kind;
+    char* text;     // Name or C expression
+    long value;
+} Term;
+
+typedef struct {
+    int line;
+    int op;
+    Term operands[2];
+    char* guard;            // NULL when the rule has none
+    bool result_is_instr;
+    int result_op;
+    Term result[2];         // Only result[0] unless result_is_instr
+} Rule;
+
+// Same order as RuleOp in ir_optimizer.c
+static const char* op_names[] = {
+    "ADD", "SUB", "MUL", "DIV", "SHR", "EQ", "NE", "LT", "GT", "LE", "GE"
+};
+#define OP_COUNT (int)(sizeof(op_names) / sizeof(op_names[0]))
+
+typedef enum {
+    TOK_OPEN,
+    TOK_CLOSE,
+    TOK_ARROW,
+    TOK_CODE,
+    TOK_WORD,
+    TOK_EOF
+} TokenKind;
+
+typedef struct {
+    FILE* input;
+    const char* filename;
+    int line;
+    TokenKind kind;
+    char text[MAX_TOKEN];
+} Lexer;
+
+static const char* rules_file;
+static Rule rules[MAX_RULES];
+static int rule_count = 0;
+
+static void error(Lexer* lex, const char* message, const char* detail) {
+    fprintf(stderr, "%s:%d: %s%s%s\n", lex->filename, lex->line, message,
+            detail ? ": " : "", detail ? detail : "");
+    exit(1);
+}
+
+static void append_char(Lexer* lex, int* length, int c) {
+    if (*length >= MAX_TOKEN - 1) error(lex, "token too long", NULL);
+    lex->text[(*length)++] = (char)c;
+    lex->text[*length] = '\0';
+}
+
+static bool is_word_char(int c) {
+    return isalnum(c) || c == '_';
+}
+
+static void next_token(Lexer* lex) {
+    int c = fgetc(lex->input);
+    while (c != EOF && (isspace(c) || c == '#')) {
+        if (c == '#') {
+            while (c != EOF && c != '\n') c = fgetc(lex->input);
+        }
+        if (c == '\n') lex->line++;
+        if (c != EOF) c = fgetc(lex->input);
+    }
+    int length = 0;
+    lex->text[0] = '\0';
+    if (c == EOF) {
+        lex->kind = TOK_EOF;
+    } else if (c == '(') {
+        lex->kind = TOK_OPEN;
+    } else if (c == ')') {
+        lex->kind = TOK_CLOSE;
+    } else if (c == '{') {
+        // C code up to the matching brace
+        int depth = 1;
+        lex->kind = TOK_CODE;
+        while ((c = fgetc(lex->input)) != EOF) {
+            if (c == '{') depth++;
+            if (c == '}' && --depth == 0) break;
+            if (c == '\n') lex->line++;
+            append_char(lex, &length, c);
+        }
+        if (c == EOF) error(lex, "unterminated {", NULL);
+    } else if (c == '-' || is_word_char(c)) {
+        if (c == '-') {
+            c = fgetc(lex->input);
+            if (c == '>') {
+                lex->kind = TOK_ARROW;
+                return;
+            }
+            append_char(lex, &length, '-');
+        }
+        lex->kind = TOK_WORD;
+        while (c != EOF && is_word_char(c)) {
+            append_char(lex, &length, c);
+            c = fgetc(lex->input);
+        }
+        if (c != EOF) ungetc(c, lex->input);
+    } else {
+        char bad[2] = { (char)c, '\0' };
+        error(lex, "unexpected character", bad);
+    }
+}
+
+static void expect(Lexer* lex, TokenKind kind, const char* what) {
+    if (lex->kind != kind) error(lex, "expected", what);
+    next_token(lex);
+}
+
+static bool is_number(const char* text) {
+    if (*text == '-') text++;
+    if (!*text) return false;
+    for (; *text; text++) {
+        if (!isdigit((unsigned char)*text)) return false;
+    }
+    return true;
+}
+
+static bool is_name(const char* text) {
+    return isalpha((unsigned char)*text) || *text == '_';
+}
+
+static bool is_keyword(Lexer* lex, const char* keyword) {
+    return lex->kind == TOK_WORD && strcmp(lex->text, keyword) == 0;
+}
+
+static int parse_op(Lexer* lex) {
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (is_keyword(lex, op_names[i])) {
+            next_token(lex);
+            return i;
+        }
+    }
+    error(lex, "unknown operator", lex->text);
+    return -1;
+}
+
+// The rest of (CONST n), (CONST name) or, in results, (CONST {expr})
+// once "(CONST" has been read
+static Term parse_const(Lexer* lex, bool allow_code) {
+    Term term = { TERM_LITERAL, NULL, 0 };
+    if (lex->kind == TOK_CODE && allow_code) {
+        term.kind = TERM_CODE;
+        term.text = strdup(lex->text);
+    } else if (lex->kind == TOK_WORD && is_number(lex->text)) {
+        term.value = atol(lex->text);
+    } else if (lex->kind == TOK_WORD && is_name(lex->text)) {
+        term.kind = TERM_CONST;
+        term.text = strdup(lex->text);
+    } else {
+        error(lex, "expected a constant", lex->text);
+    }
+    next_token(lex);
+    expect(lex, TOK_CLOSE, ")");
+    return term;
+}
+
+static Term parse_term(Lexer* lex, bool allow_code) {
+    if (lex->kind == TOK_WORD) {
+        if (!is_name(lex->text)) error(lex, "expected a name", lex->text);
+        Term term = { TERM_VAR, strdup(lex->text), 0 };
+        next_token(lex);
+        return term;
+    }
+    expect(lex, TOK_OPEN, "(");
+    if (!is_keyword(lex, "CONST")) error(lex, "expected CONST", lex->text);
+    next_token(lex);
+    return parse_const(lex, allow_code);
+}
+
+// Pattern position binding name, or -1
+static int find_binding(Rule* rule, const char* name) {
+    for (int p = 0; p < 2; p++) {
+        Term* term = &rule->operands[p];
+        if ((term->kind == TERM_VAR || term->kind == TERM_CONST) &&
+            strcmp(term->text, name) == 0) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+// Result names must be bound by the pattern, and constants only to
+// constants; a bare name bound to a constant stands for its value
+static void check_result_term(Lexer* lex, Rule* rule, Term* term) {
+    if (term->kind != TERM_VAR && term->kind != TERM_CONST) return;
+    int p = find_binding(rule, term->text);
+    if (p < 0) error(lex, "unbound name", term->text);
+    if (rule->operands[p].kind == TERM_CONST) {
+        term->kind = TERM_CONST;
+    } else if (term->kind == TERM_CONST) {
+        error(lex, "not bound to a constant", term->text);
+    }
+}
+
+static void parse_rule(Lexer* lex, Rule* rule) {
+    rule->line = lex->line;
+    expect(lex, TOK_OPEN, "(");
+    rule->op = parse_op(lex);
+    for (int p = 0; p < 2; p++) {
+        rule->operands[p] = parse_term(lex, false);
+    }
+    expect(lex, TOK_CLOSE, ")");
+    Term* left = &rule->operands[0];
+    Term* right = &rule->operands[1];
+    if (left->text && right->text && strcmp(left->text, right->text) == 0 &&
+        left->kind != right->kind) {
+        error(lex, "name bound both as an operand and a constant", left->text);
+    }
+
+    rule->guard = NULL;
+    if (is_keyword(lex, "if")) {
+        next_token(lex);
+        if (lex->kind != TOK_CODE) error(lex, "expected {guard}", NULL);
+        rule->guard = strdup(lex->text);
+        next_token(lex);
+    }
+    expect(lex, TOK_ARROW, "->");
+
+    rule->result_is_instr = false;
+    if (lex->kind != TOK_OPEN) {
+        rule->result[0] = parse_term(lex, false);
+    } else {
+        next_token(lex);
+        if (is_keyword(lex, "CONST")) {
+            next_token(lex);
+            rule->result[0] = parse_const(lex, true);
+        } else {
+            rule->result_is_instr = true;
+            rule->result_op = parse_op(lex);
+            for (int p = 0; p < 2; p++) {
+                rule->result[p] = parse_term(lex, true);
+                check_result_term(lex, rule, &rule->result[p]);
+            }
+            expect(lex, TOK_CLOSE, ")");
+            return;
+        }
+    }
+    check_result_term(lex, rule, &rule->result[0]);
+}
+
+static void parse_rules(const char* filename) {
+    Lexer lex;
+    lex.input = fopen(filename, "r");
+    if (!lex.input) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        exit(1);
+    }
+    lex.filename = filename;
+    lex.line = 1;
+    next_token(&lex);
+    while (lex.kind != TOK_EOF) {
+        if (rule_count >= MAX_RULES) error(&lex, "too many rules", NULL);
+        parse_rule(&lex, &rules[rule_count++]);
+    }
+    fclose(lex.input);
+}
+
+// Code generation
+
+// Which operands are constant in the decision-tree leaf being emitted
+typedef struct {
+    bool known[2];
+} Leaf;
+
+// Copies code with each name bound to a constant replaced by the
+// matcher's variable for that operand
+static void emit_code(FILE* out, Rule* rule, const char* code, bool parenthesize) {
+    if (parenthesize) fputc('(', out);
+    const char* p = code;
+    while (*p) {
+        if (isalpha((unsigned char)*p) || *p == '_') {
+            const char* start = p;
+            while (is_word_char((unsigned char)*p)) p++;
+            char name[MAX_TOKEN];
+            snprintf(name, sizeof(name), "%.*s", (int)(p - start), start);
+            int pos = find_binding(rule, name);
+            if (pos >= 0 && rule->operands[pos].kind == TERM_CONST) {
+                fprintf(out, "c%d", pos + 1);
+            } else {
+                fputs(name, out);
+            }
+        } else {
+            fputc(*p++, out);
+        }
+    }
+    if (parenthesize) fputc(')', out);
+}
+
+// Constant value of a result term
+static void emit_value(FILE* out, Rule* rule, Term* term) {
+    switch (term->kind) {
+        case TERM_LITERAL: fprintf(out, "%ld", term->value); break;
+        case TERM_CODE: emit_code(out, rule, term->text, true); break;
+        default: fprintf(out, "c%d", find_binding(rule, term->text) + 1); break;
+    }
+}
+
+// A newly allocated operand string for a result term
+static void emit_operand(FILE* out, Rule* rule, Leaf* leaf, Term* term) {
+    if (term->kind == TERM_VAR) {
+        int pos = find_binding(rule, term->text);
+        if (leaf->known[pos]) {
+            fprintf(out, "rule_immediate(c%d)", pos + 1);
+        } else {
+            fprintf(out, "strdup(instr->src%d)", pos + 1);
+        }
+        return;
+    }
+    fprintf(out, "rule_immediate(");
+    emit_value(out, rule, term);
+    fprintf(out, ")");
+}
+
+static void emit_result(FILE* out, Rule* rule, Leaf* leaf, const char* indent) {
+    Term* result = &rule->result[0];
+    fputs(indent, out);
+    if (rule->result_is_instr) {
+        fprintf(out, "rewrite_binary(instr, RULE_%s, ", op_names[rule->result_op]);
+        emit_operand(out, rule, leaf, &rule->result[0]);
+        fprintf(out, ", ");
+        emit_operand(out, rule, leaf, &rule->result[1]);
+        fprintf(out, ");\n");
+    } else if (result->kind == TERM_VAR && !leaf->known[find_binding(rule, result->text)]) {
+        fprintf(out, "rewrite_copy(instr, instr->src%d);\n",
+                find_binding(rule, result->text) + 1);
+    } else {
+        fprintf(out, "rewrite_constant(instr, ");
+        if (result->kind == TERM_VAR) {
+            fprintf(out, "c%d", find_binding(rule, result->text) + 1);
+        } else {
+            emit_value(out, rule, result);
+        }
+        fprintf(out, ");\n");
+    }
+    fprintf(out, "%sreturn true;\n", indent);
+}
+
+static bool is_repeated(Rule* rule) {
+    Term* left = &rule->operands[0];
+    Term* right = &rule->operands[1];
+    return left->text && right->text && strcmp(left->text, right->text) == 0;
+}
+
+// Whether rule can match in leaf: constant patterns need constants, and
+// a constant never equals an operand that is not one
+static bool rule_fits_leaf(Rule* rule, Leaf* leaf) {
+    for (int p = 0; p < 2; p++) {
+        if (rule->operands[p].kind != TERM_VAR && !leaf->known[p]) return false;
+    }
+    return !is_repeated(rule) || leaf->known[0] == leaf->known[1];
+}
+
+static int result_term_count(Rule* rule) {
+    return rule->result_is_instr ? 2 : 1;
+}
+
+static bool computes_result(Rule* rule) {
+    for (int t = 0; t < result_term_count(rule); t++) {
+        if (rule->result[t].kind == TERM_CODE) return true;
+    }
+    return false;
+}
+
+// Whether anything beyond the leaf's constness decides a match
+static bool has_conditions(Rule* rule) {
+    return rule->operands[0].kind == TERM_LITERAL || rule->operands[1].kind == TERM_LITERAL ||
+           rule->guard || is_repeated(rule) || computes_result(rule);
+}
+
+// Those tests, joined with &&
+static void emit_conditions(FILE* out, Rule* rule, Leaf* leaf) {
+    const char* separator = "";
+    for (int p = 0; p < 2; p++) {
+        if (rule->operands[p].kind == TERM_LITERAL) {
+            fprintf(out, "%sc%d == %ld", separator, p + 1, rule->operands[p].value);
+            separator = " && ";
+        }
+    }
+    if (is_repeated(rule)) {
+        if (leaf->known[0]) {
+            fprintf(out, "%sc1 == c2", separator);
+        } else {
+            fprintf(out, "%sstrcmp(instr->src1, instr->src2) == 0", separator);
+        }
+        separator = " && ";
+    }
+    if (rule->guard) {
+        fputs(separator, out);
+        emit_code(out, rule, rule->guard, *separator != '\0');
+        separator = " && ";
+    }
+    // Computed constants are exact in long; one that does not fit an IR
+    // value stops the rule, as it stops constant folding.  This comes
+    // after the guard, which may be what makes the computation safe.
+    for (int t = 0; t < result_term_count(rule); t++) {
+        if (rule->result[t].kind != TERM_CODE) continue;
+        fprintf(out, "%sfits_ir_value", separator);
+        emit_code(out, rule, rule->result[t].text, true);
+        separator = " && ";
+    }
+}
+
+static void emit_leaf(FILE* out, int op, Leaf* leaf) {
+    bool any = false;
+    for (int r = 0; r < rule_count; r++) {
+        if (rules[r].op == op && rule_fits_leaf(&rules[r], leaf)) any = true;
+    }
+    if (!any) return;
+
+    fprintf(out, "        if (%sknown1 && %sknown2) {\n",
+            leaf->known[0] ? "" : "!", leaf->known[1] ? "" : "!");
+    for (int r = 0; r < rule_count; r++) {
+        Rule* rule = &rules[r];
+        if (rule->op != op || !rule_fits_leaf(rule, leaf)) continue;
+        fprintf(out, "            // %s:%d\n", rules_file, rule->line);
+        if (!has_conditions(rule)) {
+            // Later rules in this leaf can never run
+            emit_result(out, rule, leaf, "            ");
+            break;
+        }
+        fprintf(out, "            if (");
+        emit_conditions(out, rule, leaf);
+        fprintf(out, ") {\n");
+        emit_result(out, rule, leaf, "                ");
+        fprintf(out, "            }\n");
+    }
+    fprintf(out, "        }\n");
+}
+
+static void emit_matcher(FILE* out) {
+    fprintf(out, "// Generated by rulegen from %s; do not edit\n\n", rules_file);
+    fprintf(out, "static bool match_rewrite_rule(IRInstr* instr, RuleOp op, bool known1, "
+                 "long c1,\n");
+    fprintf(out, "                               bool known2, long c2) {\n");
+    fprintf(out, "    switch (op) {\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        bool used = false;
+        for (int r = 0; r < rule_count; r++) {
+            if (rules[r].op == op) used = true;
+        }
+        if (!used) continue;
+        fprintf(out, "    case RULE_%s:\n", op_names[op]);
+        for (int k = 3; k >= 0; k--) {
+            Leaf leaf = { { (k & 2) != 0, (k & 1) != 0 } };
+            emit_leaf(out, op, &leaf);
+        }
+        fprintf(out, "        return false;\n");
+    }
+    fprintf(out, "    default:\n");
+    fprintf(out, "        return false;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <rules> <output>\n", argv[0]);
+        return 1;
+    }
+    rules_file = argv[1];
+    parse_rules(argv[1]);
+    FILE* out = fopen(argv[2], "w");
+    if (!out) {
+        fprintf(stderr, "Cannot open %s\n", argv[2]);
+        return 1;
+    }
+    emit_matcher(out);
+    fclose(out);
+    return 0;
+}
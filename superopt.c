@@ -0,0 +1,742 @@
+#include "superopt.h"
+#include <stdint.h>
+#include <limits.h>
+
+// Chains are at most MAX_CHAIN instructions and candidates at most
+// MAX_SEARCH_LENGTH, which keeps a search to about a second
+#define MAX_CHAIN 4
+#define MAX_SEARCH_LENGTH 3
+#define MAX_CONSTANTS 8
+#define MAX_DEGREE 16
+#define SAMPLE_COUNT 16
+#define EXHAUSTIVE_BITS 8
+
+typedef enum {
+    SEQ_ADD,
+    SEQ_SUB,
+    SEQ_MUL,
+    SEQ_OP_COUNT
+} SeqOp;
+
+static const char* seq_op_names[] = { "ADD", "SUB", "MUL" };
+static const int seq_op_costs[] = { 1, 1, 3 };     // Latency on x86-64
+
+typedef enum {
+    SEQ_INPUT,
+    SEQ_RESULT,     // Result of an earlier instruction, by index
+    SEQ_CONST
+} SeqOperandKind;
+
+typedef struct {
+    SeqOperandKind kind;
+    long value;
+} SeqOperand;
+
+typedef struct {
+    SeqOp op;
+    SeqOperand a;
+    SeqOperand b;
+} SeqInstr;
+
+// Straight-line code over one input.  Its value is the last
+// instruction's, or result when there are none.
+typedef struct {
+    SeqInstr instrs[MAX_CHAIN];
+    int count;
+    SeqOperand result;
+} Sequence;
+
+// Sequences are evaluated in 64-bit registers like the generated code,
+// where ADD, SUB and MUL wrap modulo 2^64
+static uint64_t operand_value(SeqOperand* operand, uint64_t x, uint64_t* results) {
+    switch (operand->kind) {
+        case SEQ_INPUT: return x;
+        case SEQ_RESULT: return results[operand->value];
+        default: return (uint64_t)operand->value;
+    }
+}
+
+static uint64_t evaluate_sequence(Sequence* seq, uint64_t x) {
+    if (seq->count == 0) return operand_value(&seq->result, x, NULL);
+    uint64_t results[MAX_CHAIN];
+    for (int i = 0; i < seq->count; i++) {
+        SeqInstr* instr = &seq->instrs[i];
+        uint64_t a = operand_value(&instr->a, x, results);
+        uint64_t b = operand_value(&instr->b, x, results);
+        switch (instr->op) {
+            case SEQ_ADD: results[i] = a + b; break;
+            case SEQ_SUB: results[i] = a - b; break;
+            default: results[i] = a * b; break;
+        }
+    }
+    return results[seq->count - 1];
+}
+
+static int sequence_cost(Sequence* seq) {
+    int cost = 0;
+    for (int i = 0; i < seq->count; i++) {
+        cost += seq_op_costs[seq->instrs[i].op];
+    }
+    return cost;
+}
+
+// Polynomials in the input with coefficients modulo 2^64.  Sequences
+// with equal polynomials compute the same function, which is the proof
+// behind every cached result.
+typedef struct {
+    uint64_t coefficients[MAX_DEGREE + 1];
+} Polynomial;
+
+static void operand_polynomial(SeqOperand* operand, Polynomial* results, Polynomial* out) {
+    if (operand->kind == SEQ_RESULT) {
+        *out = results[operand->value];
+        return;
+    }
+    memset(out, 0, sizeof(*out));
+    if (operand->kind == SEQ_INPUT) {
+        out->coefficients[1] = 1;
+    } else {
+        out->coefficients[0] = (uint64_t)operand->value;
+    }
+}
+
+// False if the degree grows past MAX_DEGREE
+static bool sequence_polynomial(Sequence* seq, Polynomial* out) {
+    if (seq->count == 0) {
+        operand_polynomial(&seq->result, NULL, out);
+        return true;
+    }
+    Polynomial results[MAX_CHAIN];
+    for (int i = 0; i < seq->count; i++) {
+        SeqInstr* instr = &seq->instrs[i];
+        Polynomial a, b;
+        operand_polynomial(&instr->a, results, &a);
+        operand_polynomial(&instr->b, results, &b);
+        Polynomial* r = &results[i];
+        memset(r, 0, sizeof(*r));
+        for (int d = 0; d <= MAX_DEGREE; d++) {
+            if (instr->op == SEQ_ADD) {
+                r->coefficients[d] = a.coefficients[d] + b.coefficients[d];
+            } else if (instr->op == SEQ_SUB) {
+                r->coefficients[d] = a.coefficients[d] - b.coefficients[d];
+            } else {
+                for (int e = 0; e <= MAX_DEGREE; e++) {
+                    if (!a.coefficients[d] || !b.coefficients[e]) continue;
+                    if (d + e > MAX_DEGREE) return false;
+                    r->coefficients[d + e] += a.coefficients[d] * b.coefficients[e];
+                }
+            }
+        }
+    }
+    *out = results[seq->count - 1];
+    return true;
+}
+
+// Text form, used as the cache key: "MUL x 3; ADD r0 x", or a lone
+// operand for a sequence with no instructions
+
+static void format_operand(SeqOperand* operand, char* out, size_t size) {
+    switch (operand->kind) {
+        case SEQ_INPUT: snprintf(out, size, "x"); break;
+        case SEQ_RESULT: snprintf(out, size, "r%ld", operand->value); break;
+        default: snprintf(out, size, "%ld", operand->value); break;
+    }
+}
+
+static char* format_sequence(Sequence* seq) {
+    char buffer[256];
+    char a[32], b[32];
+    if (seq->count == 0) {
+        format_operand(&seq->result, buffer, sizeof(buffer));
+        return strdup(buffer);
+    }
+    int length = 0;
+    for (int i = 0; i < seq->count; i++) {
+        SeqInstr* instr = &seq->instrs[i];
+        format_operand(&instr->a, a, sizeof(a));
+        format_operand(&instr->b, b, sizeof(b));
+        length += snprintf(buffer + length, sizeof(buffer) - length, "%s%s %s %s",
+                           i ? "; " : "", seq_op_names[instr->op], a, b);
+    }
+    return strdup(buffer);
+}
+
+static bool parse_operand(const char* text, int results, SeqOperand* operand) {
+    if (strcmp(text, "x") == 0) {
+        operand->kind = SEQ_INPUT;
+    } else if (text[0] == 'r' && is_immediate_operand(text + 1) && atol(text + 1) >= 0 &&
+               atol(text + 1) < results) {
+        operand->kind = SEQ_RESULT;
+        operand->value = atol(text + 1);
+    } else if (is_immediate_operand(text)) {
+        operand->kind = SEQ_CONST;
+        operand->value = atol(text);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_sequence(const char* text, Sequence* seq) {
+    if (!*text) return false;
+    char* copy = strdup(text);
+    char* save = NULL;
+    bool ok = true;
+    seq->count = 0;
+    for (char* part = strtok_r(copy, ";", &save); part && ok;
+         part = strtok_r(NULL, ";", &save)) {
+        char op[16], a[32], b[32], extra[2];
+        int fields = sscanf(part, "%15s %31s %31s %1s", op, a, b, extra);
+        if (fields == 1 && !strchr(text, ';')) {
+            ok = parse_operand(op, 0, &seq->result);
+            continue;
+        }
+        ok = fields == 3 && seq->count < MAX_CHAIN;
+        if (!ok) break;
+        SeqInstr* instr = &seq->instrs[seq->count];
+        int op_index = 0;
+        while (op_index < SEQ_OP_COUNT && strcmp(op, seq_op_names[op_index]) != 0) {
+            op_index++;
+        }
+        instr->op = (SeqOp)op_index;
+        ok = op_index < SEQ_OP_COUNT && parse_operand(a, seq->count, &instr->a) &&
+             parse_operand(b, seq->count, &instr->b);
+        seq->count++;
+    }
+    free(copy);
+    return ok;
+}
+
+// Cache
+
+typedef struct {
+    char* key;
+    char* replacement;      // NULL when the search found nothing cheaper
+} CacheEntry;
+
+static struct {
+    CacheEntry* entries;
+    int count;
+    int capacity;
+    NameMap* index;         // Key -> entry
+} cache;
+
+static void add_cache_entry(const char* key, const char* replacement) {
+    if (!cache.index) cache.index = create_name_map(64);
+    if (cache.count >= cache.capacity) {
+        cache.capacity = cache.capacity ? cache.capacity * 2 : 64;
+        cache.entries = realloc(cache.entries, sizeof(CacheEntry) * cache.capacity);
+    }
+    CacheEntry* entry = &cache.entries[cache.count];
+    entry->key = strdup(key);
+    entry->replacement = replacement ? strdup(replacement) : NULL;
+    name_map_put(cache.index, key, cache.count++);
+}
+
+static CacheEntry* find_cache_entry(const char* key) {
+    int index = cache.index ? name_map_get(cache.index, key) : -1;
+    return index >= 0 ? &cache.entries[index] : NULL;
+}
+
+// Whether replacement is a cheaper sequence computing the same as key
+static bool check_cache_entry(const char* key, const char* replacement) {
+    Sequence from, to;
+    Polynomial p, q;
+    if (!parse_sequence(key, &from)) return false;
+    if (!replacement) return true;
+    return parse_sequence(replacement, &to) && sequence_cost(&to) < sequence_cost(&from) &&
+           sequence_polynomial(&from, &p) && sequence_polynomial(&to, &q) &&
+           memcmp(&p, &q, sizeof(p)) == 0;
+}
+
+// One entry per line, "sequence -> replacement", with "-" for none
+void load_superopt_cache(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return;
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') continue;
+        char* arrow = strstr(line, " -> ");
+        if (arrow) {
+            *arrow = '\0';
+            const char* replacement = arrow + 4;
+            if (strcmp(replacement, "-") == 0) replacement = NULL;
+            if (check_cache_entry(line, replacement)) {
+                if (!find_cache_entry(line)) add_cache_entry(line, replacement);
+                continue;
+            }
+        }
+        fprintf(stderr, "%s:%d: ignoring invalid superoptimizer entry\n", path, line_number);
+    }
+    fclose(file);
+}
+
+bool save_superopt_cache(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "# Superoptimizer results: sequence -> cheapest equivalent, or -\n");
+    for (int i = 0; i < cache.count; i++) {
+        CacheEntry* entry = &cache.entries[i];
+        fprintf(file, "%s -> %s\n", entry->key, entry->replacement ? entry->replacement : "-");
+    }
+    return fclose(file) == 0;
+}
+
+void free_superopt_cache(void) {
+    for (int i = 0; i < cache.count; i++) {
+        free(cache.entries[i].key);
+        free(cache.entries[i].replacement);
+    }
+    free(cache.entries);
+    if (cache.index) free_name_map(cache.index);
+    memset(&cache, 0, sizeof(cache));
+}
+
+// Search
+
+typedef struct {
+    Sequence target;
+    Polynomial polynomial;
+    uint64_t samples[SAMPLE_COUNT];
+    uint64_t exhaustive[1 << EXHAUSTIVE_BITS];
+    long constants[MAX_CONSTANTS];
+    int constant_count;
+    Sequence candidate;
+    Sequence best;
+    int best_cost;
+} Search;
+
+static uint64_t sample_inputs[SAMPLE_COUNT];
+
+static void init_sample_inputs(void) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    sample_inputs[0] = 0;
+    sample_inputs[1] = 1;
+    sample_inputs[2] = (uint64_t)-1;
+    for (int i = 3; i < SAMPLE_COUNT; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        sample_inputs[i] = state;
+    }
+}
+
+static void add_constant(Search* search, uint64_t value) {
+    long constant = (long)value;
+    if (constant < INT_MIN || constant > INT_MAX || search->constant_count >= MAX_CONSTANTS) {
+        return;
+    }
+    for (int i = 0; i < search->constant_count; i++) {
+        if (search->constants[i] == constant) return;
+    }
+    search->constants[search->constant_count++] = constant;
+}
+
+// Random inputs reject most candidates, every input with the low
+// EXHAUSTIVE_BITS bits of the range most of the rest, and the
+// polynomials decide
+static bool is_equivalent(Search* search, Sequence* seq) {
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        if (evaluate_sequence(seq, sample_inputs[i]) != search->samples[i]) return false;
+    }
+    for (int x = 0; x < 1 << EXHAUSTIVE_BITS; x++) {
+        if (evaluate_sequence(seq, (uint64_t)x) != search->exhaustive[x]) return false;
+    }
+    Polynomial polynomial;
+    return sequence_polynomial(seq, &polynomial) &&
+           memcmp(&polynomial, &search->polynomial, sizeof(polynomial)) == 0;
+}
+
+// Operand choice at position: the input, earlier results, then constants
+static SeqOperand get_choice(Search* search, int position, int choice) {
+    SeqOperand operand;
+    if (choice == 0) {
+        operand.kind = SEQ_INPUT;
+        operand.value = 0;
+    } else if (choice <= position) {
+        operand.kind = SEQ_RESULT;
+        operand.value = choice - 1;
+    } else {
+        operand.kind = SEQ_CONST;
+        operand.value = search->constants[choice - position - 1];
+    }
+    return operand;
+}
+
+static bool uses_all_results(Sequence* seq) {
+    for (int r = 0; r < seq->count - 1; r++) {
+        bool used = false;
+        for (int i = r + 1; i < seq->count && !used; i++) {
+            SeqInstr* instr = &seq->instrs[i];
+            used = (instr->a.kind == SEQ_RESULT && instr->a.value == r) ||
+                   (instr->b.kind == SEQ_RESULT && instr->b.value == r);
+        }
+        if (!used) return false;
+    }
+    return true;
+}
+
+// Fills candidate from position on with length instructions in all,
+// keeping only sequences cheaper than the best so far
+static void search_from(Search* search, int length, int position, int cost) {
+    Sequence* seq = &search->candidate;
+    if (position == length) {
+        seq->count = length;
+        if (uses_all_results(seq) && is_equivalent(search, seq)) {
+            search->best = *seq;
+            search->best_cost = cost;
+        }
+        return;
+    }
+    int choices = 1 + position + search->constant_count;
+    int remaining = length - position - 1;
+    for (int op = 0; op < SEQ_OP_COUNT; op++) {
+        int next_cost = cost + seq_op_costs[op];
+        if (next_cost + remaining >= search->best_cost) continue;
+        for (int a = 0; a < choices; a++) {
+            // ADD and MUL commute, so take their operands in one order
+            for (int b = op == SEQ_SUB ? 0 : a; b < choices; b++) {
+                if (a > position && b > position) continue;
+                SeqInstr* instr = &seq->instrs[position];
+                instr->op = (SeqOp)op;
+                instr->a = get_choice(search, position, a);
+                instr->b = get_choice(search, position, b);
+                search_from(search, length, position + 1, next_cost);
+            }
+        }
+    }
+}
+
+// Cheapest sequence equivalent to target, or NULL if none beats it
+static char* search_sequence(Sequence* target) {
+    static Search search;
+    if (!sequence_polynomial(target, &search.polynomial)) return NULL;
+    if (sample_inputs[1] == 0) init_sample_inputs();
+    search.target = *target;
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        search.samples[i] = evaluate_sequence(target, sample_inputs[i]);
+    }
+    for (int x = 0; x < 1 << EXHAUSTIVE_BITS; x++) {
+        search.exhaustive[x] = evaluate_sequence(target, (uint64_t)x);
+    }
+
+    // Constants the target uses, then its coefficients and their negations
+    search.constant_count = 0;
+    for (int i = 0; i < target->count; i++) {
+        SeqInstr* instr = &target->instrs[i];
+        if (instr->a.kind == SEQ_CONST) add_constant(&search, instr->a.value);
+        if (instr->b.kind == SEQ_CONST) add_constant(&search, instr->b.value);
+    }
+    for (int d = 0; d <= MAX_DEGREE; d++) {
+        uint64_t coefficient = search.polynomial.coefficients[d];
+        if (coefficient) {
+            add_constant(&search, coefficient);
+            add_constant(&search, -coefficient);
+        }
+    }
+
+    search.best_cost = sequence_cost(target);
+    search.best.count = -1;
+    // The input or a constant on its own costs nothing
+    Sequence* seq = &search.candidate;
+    seq->count = 0;
+    for (int choice = 0; choice <= search.constant_count; choice++) {
+        seq->result = get_choice(&search, 0, choice);
+        if (is_equivalent(&search, seq)) return format_sequence(seq);
+    }
+    for (int length = 1; length <= MAX_SEARCH_LENGTH && length <= target->count; length++) {
+        search_from(&search, length, 0, 0);
+    }
+    return search.best.count >= 0 ? format_sequence(&search.best) : NULL;
+}
+
+// Chains
+
+// Instructions computing one value from one variable and constants,
+// each but the last read only by a later one
+typedef struct {
+    int members[MAX_CHAIN];     // Program indices in order; the last is the root
+    int count;
+    const char* input;
+    Sequence seq;
+} Chain;
+
+static bool is_chain_op(IRInstr* instr) {
+    return (instr->op == IR_ADD || instr->op == IR_SUB || instr->op == IR_MUL) &&
+           instr->dest && instr->src1 && instr->src2;
+}
+
+static void count_name(NameMap* map, const char* name) {
+    if (!name || is_immediate_operand(name)) return;
+    int count = name_map_get(map, name);
+    name_map_put(map, name, count < 0 ? 1 : count + 1);
+}
+
+// Definitions of each name in [start, end), and instructions reading it
+static void count_names(IRProgram* program, int start, int end, NameMap* defs,
+                        NameMap* readers) {
+    for (int i = start; i < end; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (writes_dest(instr)) count_name(defs, instr->dest);
+        count_name(readers, instr->src1);
+        if (instr->src2 && (!instr->src1 || strcmp(instr->src1, instr->src2) != 0)) {
+            count_name(readers, instr->src2);
+        }
+        // Stores and conditional moves also read dest
+        if (instr->dest && reads_operand(instr, instr->dest) &&
+            (!instr->src1 || strcmp(instr->src1, instr->dest) != 0) &&
+            (!instr->src2 || strcmp(instr->src2, instr->dest) != 0)) {
+            count_name(readers, instr->dest);
+        }
+    }
+}
+
+// Index of the chain instruction in reader's block defining operand for
+// reader alone, or -1
+static int find_member_def(IRProgram* program, int start, int reader, const char* operand,
+                           NameMap* defs, NameMap* readers, bool* used) {
+    if (is_immediate_operand(operand) || name_map_get(defs, operand) != 1 ||
+        name_map_get(readers, operand) != 1) {
+        return -1;
+    }
+    for (int j = reader - 1; j > start; j--) {
+        IRInstr* instr = program->instructions[j];
+        if (instr->op == IR_LABEL || is_branch(instr) || is_exit(instr)) return -1;
+        if (writes_dest(instr) && strcmp(instr->dest, operand) == 0) {
+            return is_chain_op(instr) && !used[j] ? j : -1;
+        }
+    }
+    return -1;
+}
+
+static int find_member(Chain* chain, IRProgram* program, const char* name) {
+    for (int k = 0; k < chain->count; k++) {
+        if (strcmp(program->instructions[chain->members[k]]->dest, name) == 0) return k;
+    }
+    return -1;
+}
+
+static bool encode_operand(Chain* chain, IRProgram* program, const char* name,
+                           SeqOperand* operand) {
+    int member = find_member(chain, program, name);
+    if (member >= 0) {
+        operand->kind = SEQ_RESULT;
+        operand->value = member;
+    } else if (is_immediate_operand(name)) {
+        operand->kind = SEQ_CONST;
+        operand->value = atol(name);
+    } else {
+        // A second variable makes it a function of two inputs
+        if (chain->input && strcmp(chain->input, name) != 0) return false;
+        chain->input = name;
+        operand->kind = SEQ_INPUT;
+        operand->value = 0;
+    }
+    return true;
+}
+
+static bool find_chain(IRProgram* program, int start, int root, NameMap* defs,
+                       NameMap* readers, bool* used, Chain* chain) {
+    chain->members[0] = root;
+    chain->count = 1;
+    for (int k = 0; k < chain->count; k++) {
+        IRInstr* instr = program->instructions[chain->members[k]];
+        const char* operands[] = { instr->src1, instr->src2 };
+        for (int o = 0; o < 2 && chain->count < MAX_CHAIN; o++) {
+            int def = find_member_def(program, start, chain->members[k], operands[o],
+                                      defs, readers, used);
+            bool known = false;
+            for (int m = 0; m < chain->count; m++) {
+                known = known || chain->members[m] == def;
+            }
+            if (def >= 0 && !known) chain->members[chain->count++] = def;
+        }
+    }
+    if (chain->count < 2) return false;
+    // Program order, so results are defined before they are read
+    for (int k = 1; k < chain->count; k++) {
+        for (int m = k; m > 0 && chain->members[m - 1] > chain->members[m]; m--) {
+            int swap = chain->members[m];
+            chain->members[m] = chain->members[m - 1];
+            chain->members[m - 1] = swap;
+        }
+    }
+
+    chain->input = NULL;
+    chain->seq.count = chain->count;
+    for (int k = 0; k < chain->count; k++) {
+        IRInstr* instr = program->instructions[chain->members[k]];
+        SeqInstr* seq_instr = &chain->seq.instrs[k];
+        seq_instr->op = instr->op == IR_ADD ? SEQ_ADD : instr->op == IR_SUB ? SEQ_SUB : SEQ_MUL;
+        if (!encode_operand(chain, program, instr->src1, &seq_instr->a) ||
+            !encode_operand(chain, program, instr->src2, &seq_instr->b)) {
+            return false;
+        }
+    }
+    // All constant is constant folding's business
+    if (!chain->input || find_member(chain, program, chain->input) >= 0) return false;
+
+    // The replacement reads the input at the root, so nothing between
+    // may change it
+    for (int i = chain->members[0] + 1; i < root; i++) {
+        IRInstr* instr = program->instructions[i];
+        if (has_side_effects(instr) ||
+            (writes_dest(instr) && strcmp(instr->dest, chain->input) == 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Disjoint chains of program, taking the longest from each root
+// working up from the end of each function
+static Chain* find_chains(IRProgram* program, int* count) {
+    Chain* chains = NULL;
+    int capacity = 0;
+    *count = 0;
+    bool* used = calloc(program->count + 1, sizeof(bool));
+    int start = 0;
+    while (start < program->count) {
+        if (!is_function_label(program->instructions[start])) {
+            start++;
+            continue;
+        }
+        int end = find_function_end(program, start);
+        NameMap* defs = create_name_map(64);
+        NameMap* readers = create_name_map(64);
+        count_names(program, start, end, defs, readers);
+        for (int root = end - 1; root > start; root--) {
+            if (used[root] || !is_chain_op(program->instructions[root])) continue;
+            Chain chain;
+            if (!find_chain(program, start, root, defs, readers, used, &chain)) continue;
+            for (int k = 0; k < chain.count; k++) {
+                used[chain.members[k]] = true;
+            }
+            if (*count >= capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                chains = realloc(chains, sizeof(Chain) * capacity);
+            }
+            chains[(*count)++] = chain;
+        }
+        free_name_map(defs);
+        free_name_map(readers);
+        start = end;
+    }
+    free(used);
+    return chains;
+}
+
+int superoptimize_program(IRProgram* program) {
+    int count;
+    int improved = 0;
+    Chain* chains = find_chains(program, &count);
+    for (int c = 0; c < count; c++) {
+        char* key = format_sequence(&chains[c].seq);
+        if (!find_cache_entry(key)) {
+            char* replacement = search_sequence(&chains[c].seq);
+            add_cache_entry(key, replacement);
+            if (replacement) improved++;
+            free(replacement);
+        }
+        free(key);
+    }
+    free(chains);
+    return improved;
+}
+
+static char* operand_text(SeqOperand* operand, Chain* chain, char** names) {
+    char buffer[32];
+    switch (operand->kind) {
+        case SEQ_INPUT: return strdup(chain->input);
+        case SEQ_RESULT: return strdup(names[operand->value]);
+        default:
+            snprintf(buffer, sizeof(buffer), "%ld", operand->value);
+            return strdup(buffer);
+    }
+}
+
+// Instructions computing seq into the chain root's dest, with fresh
+// temporaries in between
+static int build_replacement(IRProgram* program, Chain* chain, Sequence* seq,
+                             IRInstr** out) {
+    const char* dest = program->instructions[chain->members[chain->count - 1]]->dest;
+    if (seq->count == 0) {
+        if (seq->result.kind == SEQ_INPUT) {
+            out[0] = create_instr(IR_ASSIGN, dest, chain->input, NULL);
+        } else {
+            out[0] = create_instr(IR_ASSIGN, dest, NULL, NULL);
+            out[0]->value = (int)seq->result.value;
+        }
+        return 1;
+    }
+    char* names[MAX_CHAIN];
+    for (int i = 0; i < seq->count; i++) {
+        names[i] = i == seq->count - 1 ? strdup(dest) : new_temp(program);
+    }
+    static const IROpcode opcodes[] = { IR_ADD, IR_SUB, IR_MUL };
+    for (int i = 0; i < seq->count; i++) {
+        char* a = operand_text(&seq->instrs[i].a, chain, names);
+        char* b = operand_text(&seq->instrs[i].b, chain, names);
+        out[i] = create_instr(opcodes[seq->instrs[i].op], names[i], a, b);
+        free(a);
+        free(b);
+    }
+    for (int i = 0; i < seq->count; i++) {
+        free(names[i]);
+    }
+    return seq->count;
+}
+
+void apply_superoptimizations(IRProgram* program) {
+    if (cache.count == 0) return;
+    int count;
+    Chain* chains = find_chains(program, &count);
+    // Per instruction: 0 to keep, -1 to drop, or 1 + the chain it roots
+    int* actions = calloc(program->count + 1, sizeof(int));
+    Sequence* replacements = malloc(sizeof(Sequence) * (count + 1));
+    int extra = 0;
+    for (int c = 0; c < count; c++) {
+        char* key = format_sequence(&chains[c].seq);
+        CacheEntry* entry = find_cache_entry(key);
+        free(key);
+        if (!entry || !entry->replacement ||
+            !parse_sequence(entry->replacement, &replacements[c])) {
+            continue;
+        }
+        Chain* chain = &chains[c];
+        for (int k = 0; k < chain->count - 1; k++) {
+            actions[chain->members[k]] = -1;
+        }
+        actions[chain->members[chain->count - 1]] = c + 1;
+        extra += MAX_CHAIN;
+    }
+
+    if (extra > 0) {
+        // Chains name their input by pointing into their members, so the
+        // old instructions are freed once every replacement is built
+        IRInstr** instructions = malloc(sizeof(IRInstr*) * (program->count + extra));
+        int n = 0;
+        for (int i = 0; i < program->count; i++) {
+            if (actions[i] == 0) {
+                instructions[n++] = program->instructions[i];
+            } else if (actions[i] > 0) {
+                int c = actions[i] - 1;
+                n += build_replacement(program, &chains[c], &replacements[c],
+                                       instructions + n);
+            }
+        }
+        for (int i = 0; i < program->count; i++) {
+            if (actions[i] != 0) free_instruction(program->instructions[i]);
+        }
+        free(program->instructions);
+        program->instructions = instructions;
+        program->capacity = program->count + extra;
+        program->count = n;
+    }
+    free(actions);
+    free(replacements);
+    free(chains);
+}
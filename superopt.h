@@ -0,0 +1,24 @@
+#ifndef SUPEROPT_H
+#define SUPEROPT_H
+
+#include "ir.h"
+
+// Superoptimizer for short chains of ADD/SUB/MUL computing a function of
+// one operand.  Searching is done offline by superoptimize_program; its
+// winners go in a cache file that ordinary compiles only look up.
+
+// A missing file leaves the cache empty; entries that fail to parse or
+// to prove equivalent are dropped
+void load_superopt_cache(const char* path);
+bool save_superopt_cache(const char* path);
+void free_superopt_cache(void);
+
+// Searches every chain in program the cache has no entry for, recording
+// the cheapest equivalent found or that there is none.  Returns how many
+// searches found something cheaper.
+int superoptimize_program(IRProgram* program);
+
+// Replaces chains the cache has a cheaper equivalent for
+void apply_superoptimizations(IRProgram* program);
+
+#endif
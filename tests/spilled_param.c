@@ -0,0 +1,128 @@
+// Regression test: a parameter that is also assigned a constant on one
+// path must not be rematerialised as that constant when it is spilled.
+//
+// Builds the IR of
+//
+//     int f(int a, int c) {
+//         if (c) { a = 17; abs(c); }
+//         ... 16 values live across a loop, forcing spills ...
+//         return a + sum;
+//     }
+//
+// compiles it with both register allocators and runs it in-process.
+// Link against the compiler's objects other than main.o:
+//
+//     gcc -I. -Ibuild tests/spilled_param.c $(ls build/*.o | grep -v main.o) -ldl
+
+#include "codegen.h"
+#include "jit.h"
+
+#define VALUES 16
+#define LOOP_TRIPS 3
+
+static void add(IRProgram* program, IRInstr* instr) {
+    add_instruction(program, instr);
+}
+
+static char* value_name(char* buffer, size_t size, int k) {
+    snprintf(buffer, size, "v%d", k);
+    return buffer;
+}
+
+static IRProgram* build_program(void) {
+    IRProgram* program = create_ir_program();
+    char name[16], immediate[16];
+
+    add(program, create_label_instr("f", -1));
+    add(program, create_instr(IR_PARAM, "a", NULL, NULL));
+    add(program, create_instr(IR_PARAM, "c", NULL, NULL));
+    add(program, create_jump_instr(IR_JUMPZ, "c", "skip"));
+    IRInstr* constant = create_instr(IR_ASSIGN, "a", NULL, NULL);
+    constant->value = 17;
+    add(program, constant);
+    add(program, create_instr(IR_ARG, NULL, "c", NULL));
+    IRInstr* call = create_instr(IR_CALL, "ignored", "abs", NULL);
+    call->value = 1;
+    add(program, call);
+    add(program, create_label_instr("skip", 0));
+
+    for (int k = 0; k < VALUES; k++) {
+        snprintf(immediate, sizeof(immediate), "%d", k + 1);
+        add(program, create_instr(IR_ADD, value_name(name, sizeof(name), k), "c", immediate));
+    }
+    IRInstr* zero = create_instr(IR_ASSIGN, "i", NULL, NULL);
+    zero->value = 0;
+    add(program, zero);
+    zero = create_instr(IR_ASSIGN, "sum", NULL, NULL);
+    zero->value = 0;
+    add(program, zero);
+    add(program, create_label_instr("loop", 0));
+    snprintf(immediate, sizeof(immediate), "%d", LOOP_TRIPS);
+    IRInstr* compare = create_instr(IR_COMPARE, "more", "i", immediate);
+    compare->value = TOKEN_LESS;
+    add(program, compare);
+    add(program, create_jump_instr(IR_JUMPZ, "more", "done"));
+    for (int k = 0; k < VALUES; k++) {
+        value_name(name, sizeof(name), k);
+        add(program, create_instr(IR_ADD, "sum", "sum", name));
+        add(program, create_instr(IR_ADD, name, name, "i"));
+    }
+    add(program, create_instr(IR_ADD, "i", "i", "1"));
+    add(program, create_jump_instr(IR_JUMP, NULL, "loop"));
+    add(program, create_label_instr("done", 0));
+    for (int k = 0; k < VALUES; k++) {
+        add(program, create_instr(IR_ADD, "sum", "sum", value_name(name, sizeof(name), k)));
+    }
+    add(program, create_instr(IR_ADD, "result", "a", "sum"));
+    add(program, create_instr(IR_RETURN, NULL, "result", NULL));
+    return program;
+}
+
+// f evaluated directly
+static long expected_f(long a, long c) {
+    long values[VALUES];
+    long sum = 0;
+    if (c) a = 17;
+    for (int k = 0; k < VALUES; k++) values[k] = c + k + 1;
+    for (int i = 0; i < LOOP_TRIPS; i++) {
+        for (int k = 0; k < VALUES; k++) {
+            sum += values[k];
+            values[k] += i;
+        }
+    }
+    for (int k = 0; k < VALUES; k++) sum += values[k];
+    return a + sum;
+}
+
+static int run(RegisterAllocator allocator, const char* allocator_name) {
+    IRProgram* program = build_program();
+    CodeGenerator* gen = create_jit_generator();
+    gen->allocator = allocator;
+    generate_code_from_ir(gen, program);
+    JitModule* module = load_jit_module(gen->object);
+    long (*f)(long, long) = (long (*)(long, long))get_jit_symbol(module, "f");
+
+    int failures = 0;
+    long cases[][2] = { { 5, 0 }, { 6, 1 }, { -3, 0 }, { 0, 7 } };
+    for (size_t n = 0; n < sizeof(cases) / sizeof(cases[0]); n++) {
+        long got = f(cases[n][0], cases[n][1]);
+        long want = expected_f(cases[n][0], cases[n][1]);
+        if (got != want) {
+            printf("FAIL %s: f(%ld, %ld) = %ld, expected %ld\n", allocator_name,
+                   cases[n][0], cases[n][1], got, want);
+            failures++;
+        }
+    }
+
+    free_jit_module(module);
+    free_generator(gen);
+    free_ir_program(program);
+    return failures;
+}
+
+int main(void) {
+    int failures = run(REGALLOC_LINEAR_SCAN, "linear scan") +
+                   run(REGALLOC_GRAPH_COLORING, "graph coloring");
+    printf(failures ? "spilled_param: FAILED\n" : "spilled_param: passed\n");
+    return failures != 0;
+}